@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEPTH 24
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void remove_tree(const char *top, int depth) {
+  char path[PATH_MAX];
+  for (int d = depth; d >= 0; d--) {
+    size_t pos = (size_t)snprintf(path, sizeof(path), "%s", top);
+    for (int i = 0; i < d; i++) {
+      pos += (size_t)snprintf(path + pos, sizeof(path) - pos, "/level%02d", i);
+    }
+    char file[PATH_MAX];
+    if (snprintf(file, sizeof(file), "%s/file.txt", path) < (int)sizeof(file)) {
+      unlink(file);
+    }
+    rmdir(path);
+  }
+}
+
+/* Absolute-path syscalls against the same calls relative to a held dirfd. */
+int main(void) {
+  char top[] = "/tmp/csap-at-bench-XXXXXX";
+  if (!mkdtemp(top)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  char deep[PATH_MAX];
+  size_t pos = (size_t)snprintf(deep, sizeof(deep), "%s", top);
+  for (int i = 0; i < DEPTH; i++) {
+    pos += (size_t)snprintf(deep + pos, sizeof(deep) - pos, "/level%02d", i);
+    if (mkdir(deep, 0700) != 0) {
+      perror("mkdir");
+      remove_tree(top, i);
+      return 1;
+    }
+  }
+  char file[PATH_MAX];
+  if (snprintf(file, sizeof(file), "%s/file.txt", deep) >= (int)sizeof(file)) {
+    remove_tree(top, DEPTH);
+    return 1;
+  }
+  int fd = open(file, O_WRONLY | O_CREAT, 0600);
+  if (fd < 0) {
+    perror("open");
+    remove_tree(top, DEPTH);
+    return 1;
+  }
+  close(fd);
+  int dirfd = open(deep, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0) {
+    perror("open dir");
+    remove_tree(top, DEPTH);
+    return 1;
+  }
+
+  const int iters = 200000;
+  volatile long sink = 0;
+  struct stat st;
+  printf("%-12s %12s %12s\n", "op", "abs ns/op", "at ns/op");
+
+  double t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    sink += stat(file, &st);
+  }
+  double t1 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    sink += fstatat(dirfd, "file.txt", &st, 0);
+  }
+  double t2 = now_sec();
+  printf("%-12s %12.1f %12.1f\n", "stat", (t1 - t0) * 1e9 / iters, (t2 - t1) * 1e9 / iters);
+
+  t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    int f = open(file, O_RDONLY);
+    sink += f;
+    close(f);
+  }
+  t1 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    int f = openat(dirfd, "file.txt", O_RDONLY);
+    sink += f;
+    close(f);
+  }
+  t2 = now_sec();
+  printf("%-12s %12.1f %12.1f\n", "open+close", (t1 - t0) * 1e9 / iters,
+         (t2 - t1) * 1e9 / iters);
+
+  close(dirfd);
+  remove_tree(top, DEPTH);
+  return sink == 42 ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#include "common/path_sandbox.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* The strtok-based resolver this replaced, kept here as the baseline. */
+static int legacy_normalize(const char *in, char *out, size_t cap) {
+  if (!in || in[0] != '/') {
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  size_t len = strlen(in);
+  if (len >= sizeof(tmp)) {
+    return -1;
+  }
+  memcpy(tmp, in, len + 1);
+  char *segments[PATH_MAX / 2];
+  size_t segs = 0;
+  char *save = NULL;
+  for (char *tok = strtok_r(tmp, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+    if (strcmp(tok, ".") == 0 || strcmp(tok, "") == 0) {
+      continue;
+    }
+    if (strcmp(tok, "..") == 0) {
+      if (segs > 0) {
+        segs--;
+      }
+      continue;
+    }
+    segments[segs++] = tok;
+  }
+  size_t pos = 0;
+  out[pos++] = '/';
+  for (size_t i = 0; i < segs; i++) {
+    size_t slen = strlen(segments[i]);
+    if (pos + slen + 1 >= cap) {
+      return -1;
+    }
+    memcpy(out + pos, segments[i], slen);
+    pos += slen;
+    if (i + 1 < segs) {
+      out[pos++] = '/';
+    }
+  }
+  out[pos] = '\0';
+  return 0;
+}
+
+static int legacy_resolve(const char *root, const char *base, const char *input, char *out,
+                          size_t cap) {
+  char merged[PATH_MAX];
+  if (input[0] == '/') {
+    if (snprintf(merged, sizeof(merged), "%s%s", root, input) >= (int)sizeof(merged)) {
+      return -1;
+    }
+  } else if (snprintf(merged, sizeof(merged), "%s/%s", base, input) >= (int)sizeof(merged)) {
+    return -1;
+  }
+  if (legacy_normalize(merged, out, cap) != 0) {
+    return -1;
+  }
+  char root_norm[PATH_MAX];
+  if (legacy_normalize(root, root_norm, sizeof(root_norm)) != 0) {
+    return -1;
+  }
+  return path_is_within(root_norm, out) ? 0 : -1;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+struct bench_case {
+  const char *name;
+  const char *input;
+};
+
+int main(void) {
+  const char *root = "/srv/csap/root";
+  const char *cwd = "/srv/csap/root/alice/projects/2026/reports";
+  static char adversarial[2048];
+  size_t pos = 0;
+  for (int i = 0; i < 200 && pos + 8 < sizeof(adversarial); i++) {
+    memcpy(adversarial + pos, i % 2 ? "../" : "a/./", i % 2 ? 3 : 4);
+    pos += i % 2 ? 3 : 4;
+  }
+  adversarial[pos] = '\0';
+
+  const struct bench_case cases[] = {
+      {"typical-relative", "q3/summary.csv"},
+      {"typical-absolute", "/alice/projects/2026/reports/q3/summary.csv"},
+      {"dotdot-short", "../../2025/./reports/../notes.txt"},
+      {"dotdot-escape", "../../../../../../../../etc/passwd"},
+      {"dotdot-heavy", adversarial},
+  };
+  const int iters = 500000;
+
+  struct path_resolver r;
+  if (path_resolver_init(&r, root) != 0) {
+    fprintf(stderr, "resolver init failed\n");
+    return 1;
+  }
+  size_t cwd_len = strlen(cwd);
+  char out[PATH_MAX];
+  volatile int sink = 0;
+
+  printf("%-18s %12s %12s\n", "case", "legacy ns/op", "resolver ns/op");
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    double t0 = now_sec();
+    for (int i = 0; i < iters; i++) {
+      sink += legacy_resolve(root, cwd, cases[c].input, out, sizeof(out));
+    }
+    double t1 = now_sec();
+    for (int i = 0; i < iters; i++) {
+      sink += path_resolve(&r, cwd, cwd_len, cases[c].input, out, sizeof(out));
+    }
+    double t2 = now_sec();
+    printf("%-18s %12.1f %12.1f\n", cases[c].name, (t1 - t0) * 1e9 / iters,
+           (t2 - t1) * 1e9 / iters);
+  }
+  return sink == 42 ? 1 : 0;
+}
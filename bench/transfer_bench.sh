@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+# Times upload -j N and download -j N of one file for growing N, over a
+# server of its own on a temporary root. Usage: transfer_bench.sh [size_mb]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BIN_DIR="$SCRIPT_DIR/.."
+SIZE_MB="${1:-256}"
+PORT="$((RANDOM % 20000 + 20000))"
+ROOT="$(mktemp -d /tmp/csap-transfer-bench-XXXXXX)"
+LOCAL="$ROOT/local.bin"
+
+"$BIN_DIR/Server" "$ROOT/srv" 127.0.0.1 "$PORT" >/dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill "$SERVER_PID" >/dev/null 2>&1 || true; rm -rf "$ROOT"' EXIT
+sleep 0.3
+
+printf "create_user bench 0700\n" | "$BIN_DIR/Client" 127.0.0.1 "$PORT" >/dev/null 2>&1
+head -c "$((SIZE_MB << 20))" /dev/urandom >"$LOCAL"
+
+now_ms() {
+  date +%s%3N
+}
+
+run() {
+  local t0 t1
+  t0="$(now_ms)"
+  printf "login bench\n%s\n" "$2" | "$BIN_DIR/Client" 127.0.0.1 "$PORT" -proto="$1" >/dev/null 2>&1
+  t1="$(now_ms)"
+  echo "$((t1 - t0))"
+}
+
+printf "%-6s %-6s %12s %12s\n" "proto" "jobs" "up MB/s" "down MB/s"
+for proto in 1 2; do
+  for jobs in 1 2 4 8; do
+    up_ms="$(run "$proto" "upload -j $jobs $LOCAL up.bin")"
+    down_ms="$(run "$proto" "download -j $jobs up.bin $ROOT/down.bin")"
+    if ! cmp -s "$LOCAL" "$ROOT/down.bin"; then
+      echo "transfer_bench: download with -j $jobs differs"
+      exit 1
+    fi
+    printf "%-6s %-6s %12d %12d\n" "v$proto" "$jobs" \
+      "$((SIZE_MB * 1000 / (up_ms > 0 ? up_ms : 1)))" "$((SIZE_MB * 1000 / (down_ms > 0 ? down_ms : 1)))"
+  done
+done
@@ -3,9 +3,29 @@
 
 #include "client/client.h"
 
-int bg_jobs_init(void);
+#include <stddef.h>
+#include <stdio.h>
+
+#define BG_JOBS_DEFAULT_RUNNING 4
+
+int bg_jobs_init(size_t max_running);
 int bg_jobs_pending(void);
-int bg_start_upload(const struct client_state *state, const char *local_path, const char *remote_path);
-int bg_start_download(const struct client_state *state, const char *remote_path, const char *local_path);
+/* Queue a job and return its id, or -1. Higher priorities run first. */
+int bg_start_upload(const struct client_state *state, const char *local_path,
+                    const char *remote_path, int priority);
+int bg_start_download(const struct client_state *state, const char *remote_path,
+                      const char *local_path, int priority);
+void bg_jobs_list(FILE *out);
+int bg_jobs_cancel(int id);
+void bg_jobs_cancel_all(void);
+void bg_jobs_wait(void);
+
+/*
+ * A logged-in connection beside the interactive one: a stream of it when it
+ * is multiplexed, else a pooled or new connection. -1 if it cannot be
+ * opened, -2 if the login fails. bg_conn_put pools it again if reusable.
+ */
+int bg_conn_get(const struct client_state *state, struct conn *c);
+void bg_conn_put(const struct client_state *state, struct conn *c, int reusable);
 
 #endif
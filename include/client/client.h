@@ -2,11 +2,13 @@
 #define CSAP_CLIENT_H
 
 #include "client/config.h"
+#include "client/conn.h"
 
 struct client_state {
   struct client_config cfg;
-  int fd;
+  struct conn conn;
   char user[64];
+  char token[64];
   int logged_in;
 };
 
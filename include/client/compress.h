@@ -0,0 +1,32 @@
+#ifndef CSAP_CLIENT_COMPRESS_H
+#define CSAP_CLIENT_COMPRESS_H
+
+#include "client/conn.h"
+#include "common/lz.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Client half of compressed payloads (Z_FLAG_ARG, common/lz.h). Bytes
+ * written to a zsend are cut into blocks, each compressed and sent as soon
+ * as it is full, so reading the file and sending overlap.
+ */
+struct zsend;
+
+struct zsend *zsend_open(struct conn *c);
+int zsend_write(struct zsend *z, const void *data, size_t len);
+/* Sends what is pending and the end block, then frees z; its counts go to *st if set. */
+int zsend_close(struct zsend *z, struct lz_stats *st);
+
+/*
+ * Receives a compressed payload of size raw bytes into out, adding them to
+ * *crc when crc is set. -1 if the connection failed or a block is malformed.
+ */
+int zrecv_payload(struct conn *c, uint64_t size, FILE *out, uint32_t *crc, struct lz_stats *st);
+
+/* "Compressed: <raw> bytes as <wire> (<ratio>x)" */
+void compress_report(const struct lz_stats *st);
+
+#endif
@@ -1,9 +1,23 @@
 #ifndef CSAP_CLIENT_CONFIG_H
 #define CSAP_CLIENT_CONFIG_H
 
+#include <stddef.h>
+
 struct client_config {
   char ip[64];
   int port;
+  int proto;
+  size_t max_jobs;
+  size_t pool_size;
+  int pool_idle_sec;
+  /* Send a CRC-32C with every payload and check downloads against the server's. */
+  int crc;
+  /* Offer each upload's SHA-256 first; the server may already store its content. */
+  int dedup;
+  /* Compress the payloads of read, download, write and upload (-z). */
+  int compress;
+  /* Ask downloads for extents (-sparse) and keep the file's holes unallocated. */
+  int sparse;
 };
 
 int client_config_parse(struct client_config *cfg, int argc, char **argv);
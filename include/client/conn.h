@@ -0,0 +1,36 @@
+#ifndef CSAP_CONN_H
+#define CSAP_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mux;
+
+/*
+ * A server connection in either protocol. Callers see the v1 view in both:
+ * text lines (a v2 REPLY is rendered as its status text, tagged "#<tag> " when
+ * the request was, ITEM and NOTICE as their text, END as "END") and payload
+ * bytes; v2 framing is added and stripped here.
+ *
+ * A v2 connection is multiplexed: fd is then the read end of the stream's
+ * pipe, and conn_open_stream opens a further stream over the same socket
+ * that is used exactly like a connection of its own.
+ */
+struct conn {
+  int fd;
+  int proto;
+  size_t data_left;
+  struct mux *mux;
+  uint32_t stream;
+};
+
+int conn_open(struct conn *c, const char *ip, int port, int proto);
+int conn_open_stream(const struct conn *parent, struct conn *c);
+void conn_close(struct conn *c);
+int conn_send_line(struct conn *c, const char *line);
+int conn_sendf_line(struct conn *c, const char *fmt, ...);
+int conn_recv_line(struct conn *c, char *buf, size_t cap);
+int conn_send_blob(struct conn *c, const void *data, size_t len);
+int conn_recv_blob(struct conn *c, void *data, size_t len);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CSAP_CONN_POOL_H
+#define CSAP_CONN_POOL_H
+
+#include "client/conn.h"
+
+#include <stddef.h>
+
+#define CONN_POOL_DEFAULT_SIZE 2
+#define CONN_POOL_DEFAULT_IDLE_SEC 30
+
+/*
+ * Idle background connections, still logged in, kept for the next job of
+ * the same user so it skips connect and login. At most size are kept; one
+ * that sat idle for idle_sec or longer, or that the server has closed, is
+ * dropped instead of handed out. size == 0 disables pooling.
+ */
+void conn_pool_init(size_t size, int idle_sec);
+int conn_pool_get(const char *user, struct conn *c);
+void conn_pool_put(const char *user, struct conn *c);
+void conn_pool_clear(void);
+
+#endif
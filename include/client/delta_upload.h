@@ -0,0 +1,19 @@
+#ifndef CSAP_DELTA_UPLOAD_H
+#define CSAP_DELTA_UPLOAD_H
+
+#include "client/conn.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sends the size bytes of fd to remote as a delta against the server's
+ * current copy (see common/delta.h): blocks found in both are sent as
+ * references, everything else as literal bytes, counted in *literal.
+ * 0 with the server's answer in resp; 1 if the server has no copy to work
+ * from, its answer in resp; -1 if the connection failed.
+ */
+int delta_upload(struct conn *c, int fd, uint64_t size, const char *remote, uint64_t *literal,
+                 char *resp, size_t cap);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef CSAP_PARALLEL_H
+#define CSAP_PARALLEL_H
+
+#include "client/client.h"
+
+#include <stdint.h>
+
+#define PARALLEL_MAX_JOBS 16
+#define PARALLEL_MIN_RANGE (1u << 20)
+
+/*
+ * One file moved as up to n ranges at once, each on its own connection from
+ * bg_conn_get (streams of the interactive one with -proto=2). Files smaller
+ * than n * PARALLEL_MIN_RANGE use fewer ranges. Both return 0 only when
+ * every range made it; the failures are printed.
+ *
+ * parallel_put sends [0, size) of fd as "upload_range <id> <offset> <len>"
+ * of an upload opened by the caller, who commits it afterwards.
+ * parallel_get fills fd, already size bytes long, with ranged reads of remote.
+ */
+int parallel_put(const struct client_state *state, int fd, const char *id, uint64_t size,
+                 int n);
+int parallel_get(const struct client_state *state, const char *remote, int fd, uint64_t size,
+                 int n);
+
+#endif
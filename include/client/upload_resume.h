@@ -0,0 +1,45 @@
+#ifndef CSAP_UPLOAD_RESUME_H
+#define CSAP_UPLOAD_RESUME_H
+
+#include "client/conn.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Client half of resumable uploads: "upload_open <path> <size>" answers
+ * "OK <id>", "upload_status <id>" answers "OK <committed> <size> <crc32c>",
+ * and "upload_data <id> <committed> <n>" carries the rest. Before continuing,
+ * the client checks that its file still starts with what the server has.
+ */
+struct upload_status {
+  uint64_t committed;
+  uint64_t size;
+  uint32_t crc;
+};
+
+int upload_status_parse(const char *line, struct upload_status *st);
+/* CRC-32C of the first len bytes of in; in is then positioned after them. */
+int file_crc32c(FILE *in, uint64_t len, uint32_t *out);
+/* 0 when in starts with the committed prefix; in is then positioned after it. */
+int upload_prefix_matches(FILE *in, const struct upload_status *st);
+
+/*
+ * "upload_hash <remote_path> <size> <sha256>" with the SHA-256 of the size
+ * bytes of in: 0 when the server had the content and put it in place, with
+ * its answer in resp; 1 when the file still has to be sent; -1 if the
+ * connection failed.
+ */
+int upload_by_hash(struct conn *c, FILE *in, uint64_t size, const char *remote_path, char *resp,
+                   size_t cap);
+
+/*
+ * Compares crc, that of a downloaded copy, with "checksum <remote_path>"
+ * from the server. 0 when equal, 1 with the reason in msg when not (or when
+ * the server refused), -1 if the connection failed.
+ */
+int download_verify(struct conn *c, const char *remote_path, uint32_t crc, char *msg,
+                    size_t cap);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef CSAP_BUFREADER_H
+#define CSAP_BUFREADER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BUFREADER_CAP 65536
+
+/*
+ * Read-ahead over a socket: one read(2) pulls in as many pipelined lines and
+ * payload bytes as are available, and lines are then cut out of memory.
+ * Once a reader is attached, all input on that fd must go through it.
+ */
+struct bufreader {
+  int fd;
+  size_t start;
+  size_t end;
+  char data[BUFREADER_CAP];
+};
+
+void bufreader_init(struct bufreader *r, int fd);
+int bufreader_preload(struct bufreader *r, const void *data, size_t len);
+size_t bufreader_buffered(const struct bufreader *r);
+int bufreader_has_line(const struct bufreader *r);
+const void *bufreader_peek(const struct bufreader *r, size_t len);
+ssize_t bufreader_read_line(struct bufreader *r, char *out, size_t cap);
+int bufreader_read(struct bufreader *r, void *out, size_t len);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef CSAP_CRC32C_H
+#define CSAP_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli). Start from 0 and feed the data in any number of
+ * pieces: crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+/* crc32c(crc, zeros, len) without the zeros, in O(log len): how holes are summed. */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len);
+/* 1 when crc32c runs on the CPU's CRC32C instruction, 0 on tables. */
+int crc32c_hardware(void);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef CSAP_DELTA_H
+#define CSAP_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Delta uploads, after rsync. "signature <path>" describes the server's copy
+ * as one entry per block: a weak rolling checksum and a strong 64-bit hash,
+ * u32 and u64 big-endian (DELTA_SIG_SIZE bytes). The last block may be short.
+ *
+ * "delta <path> <block> <size> <crc32c>" then rebuilds the file from a
+ * stream of instructions, each a tag byte and its fields:
+ *
+ *   C u32 index u32 count   copy count blocks of the old copy from index
+ *   L u32 len, len bytes    literal bytes, len <= DELTA_LITERAL_MAX
+ *   E                       end
+ *
+ * size and crc32c are those of the new file; the server checks them before
+ * the file replaces the old one.
+ */
+#define DELTA_BLOCK_MIN 1024u
+#define DELTA_BLOCK_MAX (128u << 10)
+#define DELTA_MAX_BLOCKS (1u << 24)
+#define DELTA_LITERAL_MAX (64u << 10)
+#define DELTA_SIG_SIZE 12
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_END 'E'
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_HEADER_SIZE 5
+
+/* About the square root of size, so signature and literal overhead balance. */
+uint32_t delta_block_size(uint64_t size);
+
+/* The weak checksum of a block, and the same window moved on by one byte. */
+uint32_t delta_weak(const unsigned char *data, size_t len);
+uint32_t delta_roll(uint32_t weak, unsigned char out, unsigned char in, size_t len);
+uint64_t delta_strong(const unsigned char *data, size_t len);
+
+void delta_sig_pack(uint32_t weak, uint64_t strong, unsigned char out[DELTA_SIG_SIZE]);
+void delta_sig_unpack(const unsigned char in[DELTA_SIG_SIZE], uint32_t *weak, uint64_t *strong);
+void delta_copy_pack(uint32_t index, uint32_t count, unsigned char out[DELTA_COPY_SIZE]);
+void delta_literal_pack(uint32_t len, unsigned char out[DELTA_LITERAL_HEADER_SIZE]);
+/* The u32 after a tag byte. */
+uint32_t delta_u32(const unsigned char in[4]);
+
+#endif
@@ -10,7 +10,8 @@ enum err_code {
   ERR_BUSY = 5,
   ERR_IO = 6,
   ERR_UNSUPPORTED = 7,
-  ERR_INTERNAL = 8
+  ERR_INTERNAL = 8,
+  ERR_CHECKSUM = 9
 };
 
 const char *err_str(enum err_code code);
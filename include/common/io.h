@@ -3,9 +3,12 @@
 
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 ssize_t read_full(int fd, void *buf, size_t len);
 ssize_t write_full(int fd, const void *buf, size_t len);
+/* Writes every iov in order, in as few writev calls as the kernel allows; iov is consumed. */
+ssize_t writev_full(int fd, struct iovec *iov, int count);
 ssize_t read_line(int fd, char *buf, size_t cap);
 
 #endif
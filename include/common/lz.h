@@ -0,0 +1,59 @@
+#ifndef CSAP_LZ_H
+#define CSAP_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed payloads (Z_FLAG_ARG in common/protocol.h). The bytes travel as
+ * blocks of at most LZ_BLOCK_MAX, each behind a header of two u32 big-endian
+ * lengths: raw, then stored. stored < raw means the block is LZ compressed;
+ * stored == raw means it is sent as is, which is what happens to blocks that
+ * would not shrink. A block of raw length 0 ends the payload. Blocks are
+ * independent, so each is compressed, sent and written as soon as it is read.
+ *
+ * The codec is byte-oriented LZ77 in the LZ4 block layout: a token (high
+ * nibble literal count, low nibble match length - 4, 15 meaning more length
+ * bytes follow), the literals, a u16 little-endian match offset and the
+ * extra match length bytes. The last sequence is literals only.
+ */
+#define LZ_BLOCK_MAX 65536
+#define LZ_HEADER_SIZE 8
+#define LZ_FRAME_MAX (LZ_HEADER_SIZE + LZ_BLOCK_MAX)
+
+struct lz_stats {
+  uint64_t raw;
+  uint64_t wire;
+  uint64_t blocks;
+  uint64_t stored_blocks;
+};
+
+/*
+ * Sender state: after a run of blocks that would not shrink, the next few
+ * are sent stored without trying, so incompressible data costs little CPU.
+ */
+struct lz_encoder {
+  unsigned misses;
+  unsigned skip;
+  struct lz_stats stats;
+};
+
+/* Compressed src into dst, or 0 if that would not fit in cap. */
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap);
+/* 0 when src decodes to exactly raw bytes at dst; -1 for anything malformed. */
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t raw);
+
+/*
+ * Frames len (at most LZ_BLOCK_MAX) bytes of src into out, which holds
+ * LZ_FRAME_MAX, and returns the frame length; len 0 frames the end block.
+ */
+size_t lz_encode_block(struct lz_encoder *e, const void *src, size_t len, unsigned char *out);
+/* 0 with the lengths of a well-formed header, -1 otherwise. */
+int lz_header_unpack(const unsigned char in[LZ_HEADER_SIZE], uint32_t *raw, uint32_t *stored);
+/* Restores a block body of stored bytes to its raw bytes at out. */
+int lz_decode_block(const unsigned char *body, uint32_t stored, unsigned char *out, uint32_t raw);
+void lz_stats_add(struct lz_stats *s, uint32_t raw, uint32_t stored);
+/* raw / wire, 1 with nothing sent. */
+double lz_stats_ratio(const struct lz_stats *s);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CSAP_MUX_H
+#define CSAP_MUX_H
+
+#include "common/protocol.h"
+#include "common/strbuf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MUX_WINDOW (256 * 1024)
+#define MUX_MIN_WINDOW (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+#define MUX_MAX_STREAMS 64
+
+/*
+ * Stream multiplexing for a v2 connection. A reader thread owns the socket's
+ * input and copies each frame into the pipe of the stream it names, so every
+ * stream is consumed like its own connection: through a plain fd that can be
+ * polled and read with a bufreader. Output from any stream goes straight to
+ * the socket under a write lock, one whole frame at a time, so bulk data is
+ * interleaved with other streams' replies at frame boundaries.
+ *
+ * Each stream has a window in each direction: a sender may have only as many
+ * bytes of frames (header included) not yet consumed by the receiving stream
+ * as the receiver has granted, and the receiver returns credit with WINDOW
+ * frames as it consumes. Every stream starts with MUX_MIN_WINDOW, one whole
+ * frame; the receiver grants the rest of its window, up to MUX_WINDOW, with
+ * a WINDOW frame. A window is as large as the stream's pipe can surely hold,
+ * so the reader never blocks on a slow stream and one stream cannot stall
+ * the others. A stream whose pipe cannot hold MUX_MIN_WINDOW is refused with
+ * FIN. FIN closes a stream in one direction; its receiver then sees EOF.
+ * Closing the last stream on either side ends the connection.
+ */
+struct mux;
+
+/* Called by the reader for the first frame of a peer-opened stream. */
+typedef int (*mux_accept_fn)(struct mux *m, uint32_t stream, int rfd, void *ctx);
+
+struct mux *mux_create(int fd, const void *pending, size_t pending_len, mux_accept_fn accept,
+                       void *ctx, int *stream0_fd);
+void mux_start(struct mux *m);
+void mux_cancel(struct mux *m);
+int mux_open(struct mux *m, uint32_t *stream);
+int mux_begin(struct mux *m, uint32_t stream, size_t len);
+void mux_end(struct mux *m);
+int mux_send(struct mux *m, uint32_t stream, const void *data, size_t len);
+void mux_consumed(struct mux *m, uint32_t stream, size_t len);
+void mux_close(struct mux *m, uint32_t stream);
+void mux_retain(struct mux *m);
+void mux_release(struct mux *m);
+void mux_stats_append(struct strbuf *sb);
+
+#endif
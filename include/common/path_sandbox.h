@@ -1,10 +1,22 @@
 #ifndef CSAP_PATH_SANDBOX_H
 #define CSAP_PATH_SANDBOX_H
 
+#include <limits.h>
 #include <stddef.h>
 
-int resolve_path_in_root(const char *root, const char *base_abs,
-                         const char *input, char *out, size_t cap);
+/*
+ * Immutable per-server resolver. The root is normalized once at init; each
+ * resolution is then a single in-place pass over the input appended to an
+ * already-normalized base, refusing any ".." that would climb above root.
+ */
+struct path_resolver {
+  char root[PATH_MAX];
+  size_t root_len;
+};
+
+int path_resolver_init(struct path_resolver *r, const char *root);
+int path_resolve(const struct path_resolver *r, const char *base_abs, size_t base_len,
+                 const char *input, char *out, size_t cap);
 int path_is_within(const char *parent, const char *child);
 
 #endif
@@ -2,6 +2,7 @@
 #define CSAP_PROTOCOL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 int send_line(int fd, const char *line);
 int sendf_line(int fd, const char *fmt, ...);
@@ -9,4 +10,155 @@ int recv_line(int fd, char *buf, size_t cap);
 int send_blob(int fd, const void *data, size_t len);
 int recv_blob(int fd, void *data, size_t len);
 
+/*
+ * A command whose size argument is "chunked" (write, upload, pwrite) takes a
+ * payload of unknown length instead: chunks of u32 big-endian length followed
+ * by that many bytes, ended by a chunk of length 0. The chunks travel like any
+ * payload, raw in v1 and inside DATA frames in v2.
+ */
+#define CHUNK_HEADER_SIZE 4
+#define CHUNKED_SIZE_ARG "chunked"
+
+void chunk_header_pack(uint32_t len, unsigned char out[CHUNK_HEADER_SIZE]);
+uint32_t chunk_header_unpack(const unsigned char in[CHUNK_HEADER_SIZE]);
+
+/*
+ * "-crc" right after the command name (write, upload, pwrite, upload_data,
+ * upload_range) adds a trailer after the payload, sized or chunked: the u32
+ * big-endian CRC-32C of the payload bytes. The server checks it against what
+ * it wrote and answers ERR CHECKSUM when they differ.
+ */
+#define CRC_FLAG_ARG "-crc"
+#define CRC_TRAILER_SIZE 4
+
+void crc_trailer_pack(uint32_t crc, unsigned char out[CRC_TRAILER_SIZE]);
+uint32_t crc_trailer_unpack(const unsigned char in[CRC_TRAILER_SIZE]);
+
+/*
+ * "-z" right after the command name, alone or with "-crc" in either order,
+ * compresses the command's payload: the bytes a write, upload, pwrite,
+ * upload_data or upload_range sends, or those a read, download, readv range
+ * or pread answers with. Sizes and offsets still count raw bytes; the payload
+ * itself travels as the blocks of common/lz.h up to their end block, and a
+ * CRC trailer, if any, follows that and covers the raw bytes.
+ */
+#define Z_FLAG_ARG "-z"
+
+/*
+ * "-sparse" right after read or download (with "-z" too if wanted) answers
+ * with the file's extents instead of its bytes: each a header of one kind
+ * byte and a u64 big-endian length, followed for data by that many bytes
+ * (compressed as above under "-z") and for a hole by nothing. A hole reads
+ * as zeros; the lengths add up to the size in the OK line.
+ */
+#define SPARSE_FLAG_ARG "-sparse"
+#define SPARSE_HEADER_SIZE 9
+#define SPARSE_DATA 'D'
+#define SPARSE_HOLE 'H'
+
+void sparse_header_pack(int kind, uint64_t len, unsigned char out[SPARSE_HEADER_SIZE]);
+/* 0 with the kind and length of a well-formed header, -1 otherwise. */
+int sparse_header_unpack(const unsigned char in[SPARSE_HEADER_SIZE], int *kind, uint64_t *len);
+
+/*
+ * Protocol v2, entered with "hello v2" on a text connection. Every message is
+ * a frame: a fixed big-endian header followed by len payload bytes.
+ *
+ *   u32 len | u16 opcode | u16 flags | u32 tag | u32 stream
+ *
+ * Requests use the command opcodes and carry their arguments as typed fields
+ * (u8 type, u32 length, value). Replies echo the request tag: one REPLY
+ * (U64 status, STR text), then any ITEM lines, DATA bytes and a closing END
+ * as the command defines. NOTICE frames are untagged. Payload a command
+ * consumes (write, upload, pwrite) follows the request as DATA frames.
+ * A frame payload is at most FRAME_MAX_PAYLOAD bytes; longer data is sent
+ * as several DATA frames.
+ * The stream field names an independent command stream on the connection;
+ * WINDOW (U64 credit) and FIN manage streams, see common/mux.h.
+ */
+#define FRAME_HEADER_SIZE 16
+#define FRAME_MAX_PAYLOAD 65536
+#define FRAME_F_ERROR 0x1
+
+enum frame_op {
+  OP_NONE = 0,
+  OP_HELLO,
+  OP_EXIT,
+  OP_CREATE_USER,
+  OP_LOGIN,
+  OP_LOGOUT,
+  OP_WHOAMI,
+  OP_STATS,
+  OP_CREATE,
+  OP_CHMOD,
+  OP_MOVE,
+  OP_DELETE,
+  OP_CD,
+  OP_LIST,
+  OP_READ,
+  OP_READV,
+  OP_WRITE,
+  OP_UPLOAD,
+  OP_DOWNLOAD,
+  OP_OPEN,
+  OP_PREAD,
+  OP_PWRITE,
+  OP_CLOSE,
+  OP_TRANSFER_REQUEST,
+  OP_ACCEPT,
+  OP_ACCEPT_ALL,
+  OP_REJECT,
+  OP_TOKEN,
+  OP_RESUME,
+  OP_WATCH,
+  OP_UNWATCH,
+  OP_UPLOAD_OPEN,
+  OP_UPLOAD_STATUS,
+  OP_UPLOAD_DATA,
+  OP_UPLOAD_RANGE,
+  OP_UPLOAD_COMMIT,
+  OP_CHECKSUM,
+  OP_SIGNATURE,
+  OP_DELTA,
+  OP_UPLOAD_HASH,
+  OP_UPLOAD_ABORT,
+  OP_COMMAND_COUNT,
+  OP_REPLY = 0x100,
+  OP_ITEM,
+  OP_END,
+  OP_DATA,
+  OP_NOTICE,
+  OP_WINDOW,
+  OP_FIN,
+};
+
+enum field_type {
+  FIELD_STR = 1,
+  FIELD_U64 = 2,
+};
+
+struct frame_header {
+  uint32_t len;
+  uint16_t opcode;
+  uint16_t flags;
+  uint32_t tag;
+  uint32_t stream;
+};
+
+struct field {
+  int type;
+  const char *str;
+  size_t len;
+  uint64_t u64;
+};
+
+int frame_opcode(const char *name);
+const char *frame_opname(int opcode);
+void frame_header_pack(const struct frame_header *h, unsigned char out[FRAME_HEADER_SIZE]);
+void frame_header_unpack(const unsigned char in[FRAME_HEADER_SIZE], struct frame_header *h);
+size_t field_put_str(unsigned char *out, size_t cap, size_t pos, const char *s, size_t len);
+size_t field_put_u64(unsigned char *out, size_t cap, size_t pos, uint64_t v);
+int field_next(const unsigned char *buf, size_t len, size_t *pos, struct field *out);
+int send_frame(int fd, const struct frame_header *h, const void *payload);
+
 #endif
@@ -0,0 +1,24 @@
+#ifndef CSAP_SHA256_H
+#define CSAP_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+#define SHA256_HEX_LEN (2 * SHA256_SIZE)
+
+/* SHA-256 (FIPS 180-4): init, any number of updates, final. */
+struct sha256 {
+  uint32_t h[8];
+  uint64_t len;
+  unsigned char buf[64];
+  size_t used;
+};
+
+void sha256_init(struct sha256 *s);
+void sha256_update(struct sha256 *s, const void *data, size_t len);
+void sha256_final(struct sha256 *s, unsigned char out[SHA256_SIZE]);
+/* Lower-case hex of a digest, NUL terminated. */
+void sha256_hex(const unsigned char digest[SHA256_SIZE], char out[SHA256_HEX_LEN + 1]);
+
+#endif
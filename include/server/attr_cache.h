@@ -0,0 +1,37 @@
+#ifndef CSAP_ATTR_CACHE_H
+#define CSAP_ATTR_CACHE_H
+
+#include "common/strbuf.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define ATTR_CACHE_DEFAULT_ENTRIES 16384
+#define ATTR_CACHE_STAT_TTL_MS 1000
+
+struct attr_info {
+  dev_t dev;
+  ino_t ino;
+  mode_t mode;
+  off_t size;
+  struct timespec mtime;
+};
+
+/*
+ * Bounded, sharded cache of absolute path -> stat attributes and .csap_meta
+ * owner/perm. The meta half is kept exact by meta.c; the stat half is dropped
+ * by the server's own mutations and, without a watcher, expires after
+ * ATTR_CACHE_STAT_TTL_MS so out-of-band edits are picked up. With watch set,
+ * inotify invalidates it instead and cached stats never expire.
+ * max_entries == 0 disables caching; every call then goes to the filesystem.
+ */
+int attr_cache_init(size_t max_entries, int watch);
+int attr_cache_stat(int dirfd, const char *rel, const char *full, struct attr_info *out);
+int attr_cache_get_meta(const char *path, char *owner, size_t owner_cap, int *perm);
+void attr_cache_put_meta(const char *path, const char *owner, int perm);
+void attr_cache_invalidate(const char *path);
+void attr_cache_invalidate_tree(const char *path);
+void attr_cache_stats_append(struct strbuf *sb);
+
+#endif
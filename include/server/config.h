@@ -1,12 +1,28 @@
 #ifndef CSAP_SERVER_CONFIG_H
 #define CSAP_SERVER_CONFIG_H
 
+#include "common/path_sandbox.h"
+
 #include <limits.h>
+#include <stddef.h>
+
+/* Nothing, the file's data before the rename, or that and the directory after it. */
+#define SYNC_NONE 0
+#define SYNC_DATA 1
+#define SYNC_FULL 2
 
 struct server_config {
   char root[PATH_MAX];
   char ip[64];
   int port;
+  struct path_resolver resolver;
+  int root_fd;
+  size_t attr_cache_entries;
+  size_t file_cache_mb;
+  int attr_watch;
+  int dedup;
+  /* What an upload syncs before it replaces its target (SYNC_*). */
+  int sync;
 };
 
 int server_config_parse(struct server_config *cfg, int argc, char **argv);
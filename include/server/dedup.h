@@ -0,0 +1,45 @@
+#ifndef CSAP_DEDUP_H
+#define CSAP_DEDUP_H
+
+#include "common/strbuf.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Optional content-addressed store (-dedup=1). Committed uploads are filed
+ * under <root>/.csap_blobs/<sha256> and the user's path becomes a hard link
+ * to that blob, so identical files share one inode and one copy on disk.
+ * A blob's reference count is its link count: writes, chmod and pwrite
+ * handles already unshare a file before changing it, so a blob never
+ * changes. An index from inode to blob lets the drop of the last reference
+ * remove the blob; a sweep at start catches any that were missed.
+ *
+ * Knowing a hash is not proof of holding the content, so a link by hash is
+ * only given to a user who has uploaded that content since the server
+ * started; anyone else uploads it whole and the ingest merges it after.
+ */
+int dedup_init(const char *root, int enabled);
+int dedup_enabled(void);
+/*
+ * Files the part, size bytes, that user uploaded under its hash: it becomes
+ * the blob, or is replaced by a link to the blob already there.
+ */
+int dedup_ingest(const char *part, uint64_t size, const char *user);
+/*
+ * A new link to the blob with this hash and size at a temporary path under
+ * the store, for the caller to rename into place. -1 if there is none or
+ * user has never uploaded it.
+ */
+int dedup_link(const char *user, const char *hex, uint64_t size, char *tmp, size_t cap);
+/* A dedup_link landed: size bytes the client did not have to send. */
+void dedup_note_skipped(uint64_t size);
+/* Links dst to the blob src shares its inode with; -1 if src is not in the store. */
+int dedup_link_copy(const char *src, const char *dst);
+/* st is a file that has just lost a link: its blob goes if nothing else links it. */
+void dedup_unref(const struct stat *st);
+void dedup_sweep(void);
+void dedup_stats_append(struct strbuf *sb);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CSAP_SERVER_DELTA_H
+#define CSAP_SERVER_DELTA_H
+
+#include "common/strbuf.h"
+#include "server/session.h"
+
+#include <stdint.h>
+
+/*
+ * The server's half of delta uploads (see common/delta.h): the signature of
+ * a file, and the instruction stream that rebuilds a new version from it.
+ */
+struct delta_result {
+  uint64_t literal;
+  uint64_t copied;
+  /* A copy named a block past the old file. */
+  int bad;
+  /* errno of a failed write to the new file. */
+  int failed;
+};
+
+/* Sends the signature entries of the first size bytes of fd. */
+int delta_send_signature(struct client_session *sess, int fd, uint64_t size, uint32_t block);
+/*
+ * Reads instructions up to the end one, appending what they describe to
+ * out_fd from base_fd (base_size bytes, in blocks of block). With out_fd -1
+ * they are only read, so the session stays in step after a refusal; after a
+ * bad copy or a failed write the rest is read the same way. -1 only if the
+ * client went away.
+ */
+int delta_apply(struct client_session *sess, int base_fd, uint64_t base_size, uint32_t block,
+                int out_fd, struct delta_result *res);
+void delta_stats_append(struct strbuf *sb);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef CSAP_FILE_CACHE_H
+#define CSAP_FILE_CACHE_H
+
+#include "common/strbuf.h"
+#include "server/attr_cache.h"
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_DEFAULT_MB 64
+#define FILE_CACHE_MAX_FILE (64u << 10)
+
+/*
+ * Contents of small files that are read often, shared by all sessions and
+ * bounded by size. Entries are keyed by device, inode, size and mtime, so a
+ * file replaced or changed behind the server's back is simply a miss; the
+ * server's own in-place writes drop their entry at once. Shards of CLOCK
+ * rings evict: a hit sets an entry's reference bit, and the hand takes the
+ * first entry it finds without one. max_mb == 0 disables caching.
+ */
+struct file_cache_entry;
+
+int file_cache_init(size_t max_mb);
+/* The cached contents of the file info describes, held until released; NULL on a miss. */
+struct file_cache_entry *file_cache_get(const struct attr_info *info);
+/*
+ * Reads the file open at fd, st being its fstat, into a new entry and returns
+ * it held, or NULL when it is too large or changed while being read.
+ */
+struct file_cache_entry *file_cache_fill(int fd, const struct stat *st);
+const unsigned char *file_cache_data(const struct file_cache_entry *e, size_t *len);
+void file_cache_release(struct file_cache_entry *e);
+/* The inode's contents changed, or it is gone: its entry goes, and any fill under way is dropped. */
+void file_cache_invalidate(dev_t dev, ino_t ino);
+void file_cache_stats_append(struct strbuf *sb);
+
+#endif
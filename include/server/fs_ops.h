@@ -2,6 +2,11 @@
 #define CSAP_FS_OPS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define READV_MAX_RANGES 256
+/* Size of a write, upload or pwrite payload sent in chunks, see common/protocol.h. */
+#define FS_PAYLOAD_CHUNKED SIZE_MAX
 
 struct client_session;
 
@@ -11,9 +16,34 @@ int fs_cmd_move(struct client_session *sess, const char *src, const char *dst);
 int fs_cmd_delete(struct client_session *sess, const char *path);
 int fs_cmd_cd(struct client_session *sess, const char *path);
 int fs_cmd_list(struct client_session *sess, const char *path);
-int fs_cmd_read(struct client_session *sess, const char *path, long offset);
+int fs_cmd_read(struct client_session *sess, const char *path, long offset, long length);
+int fs_cmd_checksum(struct client_session *sess, const char *path);
+int fs_cmd_readv(struct client_session *sess, const char *path, const char *spec);
 int fs_cmd_write(struct client_session *sess, const char *path, long offset, size_t size);
 int fs_cmd_upload(struct client_session *sess, const char *path, size_t size);
+int fs_cmd_upload_open(struct client_session *sess, const char *path, size_t size);
+int fs_cmd_upload_status(struct client_session *sess, const char *id);
+int fs_cmd_upload_data(struct client_session *sess, const char *id, long offset, size_t len);
+int fs_cmd_upload_range(struct client_session *sess, const char *id, long offset, size_t len);
+int fs_cmd_upload_commit(struct client_session *sess, const char *id);
+int fs_cmd_upload_abort(struct client_session *sess, const char *id);
+int fs_cmd_signature(struct client_session *sess, const char *path);
+int fs_cmd_delta(struct client_session *sess, const char *path, uint32_t block, uint64_t size,
+                 uint32_t crc);
+/*
+ * Puts the stored blob with this SHA-256 and size at path without its bytes
+ * crossing the wire (see server/dedup.h): OK <size>, or ERR NOT_FOUND when the
+ * store has no such content and the client should upload it.
+ */
+int fs_cmd_upload_hash(struct client_session *sess, const char *path, uint64_t size,
+                       const char *hash);
 int fs_cmd_download(struct client_session *sess, const char *path);
+int fs_cmd_open(struct client_session *sess, const char *path, const char *mode);
+int fs_cmd_pread(struct client_session *sess, int handle, long offset, size_t len);
+int fs_cmd_pwrite(struct client_session *sess, int handle, long offset, size_t len);
+int fs_cmd_close(struct client_session *sess, int handle);
+int fs_cmd_watch(struct client_session *sess, const char *path);
+int fs_cmd_unwatch(struct client_session *sess, const char *path);
+void fs_close_handles(struct client_session *sess);
 
 #endif
@@ -0,0 +1,34 @@
+#ifndef CSAP_FSUTIL_H
+#define CSAP_FSUTIL_H
+
+#include "common/strbuf.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum fsutil_clone_kind {
+  FSUTIL_CLONE_REFLINK = 0,
+  FSUTIL_CLONE_HARDLINK = 1,
+  FSUTIL_CLONE_COPY = 2
+};
+
+int fsutil_openat_beneath(int dirfd, const char *rel, int flags, int mode);
+int fsutil_open_dir(int dirfd, const char *rel);
+int fsutil_send_range(int sock, int fd, off_t off, size_t len);
+int fsutil_copy_range(int in_fd, off_t off, int out_fd, size_t len);
+/*
+ * The extent of fd that starts at off, cut at end: *len bytes that are all
+ * hole (*hole = 1) or all data, as SEEK_DATA and SEEK_HOLE tell. Where the
+ * filesystem cannot, the rest of the range is data.
+ */
+void fsutil_extent(int fd, off_t off, off_t end, int *hole, off_t *len);
+/* Copies src to a new dst, leaving src's holes unallocated. */
+int fsutil_copy_file(const char *src, const char *dst);
+int fsutil_clone_file(const char *src, const char *dst, int allow_hardlink);
+int fsutil_preallocate(int fd, off_t len);
+int fsutil_break_link(const char *path);
+int fsutil_remove_tree(const char *path);
+int fsutil_mkdir_p(const char *path, int mode);
+void fsutil_stats_append(struct strbuf *sb);
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef CSAP_LOCKS_H
 #define CSAP_LOCKS_H
 
+#include <stdint.h>
+
 int locks_init(void);
 int locks_rdlock(const char *path);
 int locks_wrlock(const char *path);
 int locks_wrlock_pair(const char *path1, const char *path2);
 void locks_unlock(const char *path);
 void locks_unlock_pair(const char *path1, const char *path2);
+int locks_range_lock(const char *path, uint64_t offset, uint64_t len);
+void locks_range_unlock(const char *path, uint64_t offset, uint64_t len);
 
 #endif
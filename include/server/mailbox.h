@@ -0,0 +1,48 @@
+#ifndef CSAP_MAILBOX_H
+#define CSAP_MAILBOX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/strbuf.h"
+
+#define MAILBOX_DEFAULT_CAP 64
+
+struct mailbox_slot {
+  atomic_size_t seq;
+  char *msg;
+  uint64_t enq_ns;
+};
+
+/*
+ * Bounded multi-producer / single-consumer queue of outbound lines.
+ * Any thread may post; only the owning session drains it onto its socket,
+ * so notices never interleave with an in-flight response. When full, new
+ * messages are dropped and counted; the owner reports the loss on the next
+ * drain with a NOTICE DROPPED line.
+ */
+struct mailbox {
+  struct mailbox_slot *slots;
+  size_t mask;
+  atomic_size_t head;
+  atomic_size_t tail;
+  int efd;
+  atomic_uint_fast64_t enqueued;
+  atomic_uint_fast64_t delivered;
+  atomic_uint_fast64_t dropped;
+  uint64_t dropped_reported;
+};
+
+/* Receives each drained line; the owner decides how it goes on the wire. */
+typedef int (*mailbox_emit_fn)(void *ctx, const char *line);
+
+int mailbox_init(struct mailbox *mb, size_t cap);
+void mailbox_destroy(struct mailbox *mb);
+int mailbox_post(struct mailbox *mb, const char *line);
+int mailbox_postf(struct mailbox *mb, const char *fmt, ...);
+int mailbox_wait_fd(const struct mailbox *mb);
+int mailbox_drain(struct mailbox *mb, mailbox_emit_fn emit, void *ctx);
+void mailbox_stats_append(struct strbuf *sb);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef CSAP_RESUME_H
+#define CSAP_RESUME_H
+
+#include "common/strbuf.h"
+
+#include <stddef.h>
+
+#define RESUME_TOKEN_LEN 32
+#define RESUME_MAX_TOKENS 1024
+#define RESUME_TTL_SEC 3600
+
+/*
+ * Resume tokens let another connection of a logged-in user take over the
+ * login without repeating it. An entry keeps the user's home directory open,
+ * so "resume" only checks the token and duplicates that fd: no lookup of the
+ * home and no .csap_meta access. Tokens are 128 random bits in hex, expire
+ * RESUME_TTL_SEC after their last use and are revoked by the logout of the
+ * session that issued them. When the table is full the entry closest to
+ * expiry is evicted.
+ */
+int resume_issue(const char *user, int home_fd, char *token, size_t cap);
+int resume_claim(const char *token, char *user, size_t user_cap, int *home_fd);
+void resume_revoke(const char *token);
+void resume_stats_append(struct strbuf *sb);
+
+#endif
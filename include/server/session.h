@@ -1,19 +1,96 @@
 #ifndef CSAP_SESSION_H
 #define CSAP_SESSION_H
 
+#include "common/bufreader.h"
+#include "common/error.h"
 #include "server/config.h"
+#include "server/mailbox.h"
+#include "server/resume.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SESSION_MAX_HANDLES 32
+#define SESSION_OUT_CAP 65536
+#define SESSION_TAG_MAX 32
+
+struct mux;
+
+/* An open file kept by the session; id 0 marks a free slot. */
+struct session_handle {
+  int id;
+  int fd;
+  int readable;
+  int writable;
+  char *path;
+};
 
 struct client_session {
   int fd;
   char user[64];
   char home[4096];
   char cwd[4096];
+  size_t cwd_len;
+  int home_fd;
+  int cwd_fd;
   int logged_in;
+  int interactive;
+  char resume_token[RESUME_TOKEN_LEN + 1];
   const struct server_config *cfg;
+  struct mailbox mailbox;
+  struct session_handle handles[SESSION_MAX_HANDLES];
+  int next_handle_id;
+  int proto;
+  struct mux *mux;
+  uint32_t stream;
+  char tag[SESSION_TAG_MAX + 1];
+  uint32_t frame_tag;
+  size_t data_left;
+  /* The current command was given CRC_FLAG_ARG: its payload has a trailer. */
+  int payload_crc;
+  /* ... and Z_FLAG_ARG: its payload, either way, is compressed. */
+  int payload_z;
+  /* ... and SPARSE_FLAG_ARG: a read answers with extents, holes left out. */
+  int payload_sparse;
+  /* Raw and wire halves of a block, allocated on the first -z command. */
+  unsigned char *zbuf;
+  struct bufreader in;
+  size_t out_len;
+  char out[SESSION_OUT_CAP];
 };
 
-void session_init(struct client_session *sess, int fd, const struct server_config *cfg);
+int session_init(struct client_session *sess, int fd, const struct server_config *cfg);
 void session_run(struct client_session *sess);
 void session_close(struct client_session *sess);
 
+/*
+ * All socket I/O of a command goes through these, so handlers are the same
+ * for both protocols. Status lines (OK, ERR, WAITING) carry the command's
+ * tag; continuation lines and payloads do not. In v2 a status line becomes
+ * a REPLY frame, a continuation line an ITEM, END an END frame and payload
+ * bytes DATA frames. Output is buffered and flushed once no further
+ * pipelined command is already waiting in the input buffer.
+ */
+int session_reply(struct client_session *sess, const char *fmt, ...);
+int session_err(struct client_session *sess, enum err_code code, const char *fmt, ...);
+int session_line(struct client_session *sess, const char *fmt, ...);
+int session_end(struct client_session *sess);
+int session_send_blob(struct client_session *sess, const void *data, size_t len);
+int session_send_file(struct client_session *sess, int fd, off_t off, size_t len);
+/* Bytes from memory; in v1 one writev takes them with whatever is buffered ahead. */
+int session_send_bytes(struct client_session *sess, const void *data, size_t len);
+/* The same bytes as extents (SPARSE_FLAG_ARG), each data one sent as above. */
+int session_send_sparse(struct client_session *sess, int fd, off_t off, size_t len);
+int session_recv_blob(struct client_session *sess, void *data, size_t len);
+/*
+ * The next block of a compressed payload, raw, at *data (valid until the next
+ * call); *len 0 at the end block. -1 if the client went away or sent a block
+ * that does not decode.
+ */
+int session_recv_block(struct client_session *sess, const unsigned char **data, size_t *len);
+int session_flush(struct client_session *sess);
+/* Writes out the notices queued so far, ahead of whatever comes next. */
+int session_drain_notices(struct client_session *sess);
+
 #endif
@@ -3,9 +3,10 @@
 
 struct client_session;
 
-int transfer_init(void);
-int transfer_request_create(struct client_session *sess, const char *file, const char *dest_user);
+int transfer_init(const char *root);
+int transfer_request_create(struct client_session *sess, const char *files, const char *dest_users);
 int transfer_accept(struct client_session *sess, const char *dir, int id);
+int transfer_accept_all(struct client_session *sess, const char *dir);
 int transfer_reject(struct client_session *sess, int id);
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef CSAP_UPLOADS_H
+#define CSAP_UPLOADS_H
+
+#include "common/strbuf.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPLOAD_ID_LEN 16
+#define UPLOAD_CHECKPOINT_BYTES (4u << 20)
+#define UPLOAD_RANGE_BUF (64u << 10)
+#define UPLOAD_TTL_SEC (24 * 3600)
+#define UPLOAD_SWEEP_SEC 600
+#define UPLOAD_MAX_PER_USER 64
+
+/*
+ * Resumable uploads. Each one has a random id, a part file that receives the
+ * bytes and a record of how many of them are committed: synced to disk, with
+ * the CRC-32C of that prefix. Both live under <root>/.csap_uploads, so an
+ * upload survives the connection and the server. Bytes past the committed
+ * offset may be lost in a crash and are cut off before the upload continues.
+ * An upload whose record has not changed for UPLOAD_TTL_SEC is abandoned:
+ * it goes at the next start, or at the first upload_create once
+ * UPLOAD_SWEEP_SEC have passed since the last sweep.
+ */
+struct upload_record {
+  char id[UPLOAD_ID_LEN + 1];
+  char user[64];
+  char target[PATH_MAX];
+  uint64_t size;
+  uint64_t committed;
+  uint32_t crc;
+};
+
+int uploads_init(const char *root);
+/* Fills rec->id and stores rec with an empty part file. */
+int upload_create(struct upload_record *rec);
+int upload_load(const char *id, struct upload_record *rec);
+int upload_save(const struct upload_record *rec);
+int upload_part_path(const char *id, char *out, size_t cap);
+void upload_remove(const char *id);
+/* Open uploads of user; upload_open allows at most UPLOAD_MAX_PER_USER. */
+size_t upload_count(const char *user);
+/*
+ * A plain upload is received into a staging file beside the part files, with
+ * size bytes reserved up front, and only renamed over its target once whole.
+ * Returns the open fd and the path in out; staging files left by a crash go
+ * at the next start.
+ */
+int upload_stage_create(uint64_t size, int mode, char *out, size_t cap);
+
+/*
+ * Parallel uploads send disjoint ranges over several connections instead of
+ * appending at the committed offset. What has arrived is tracked here, in
+ * memory only, beside each record and for as long as it exists: a ranged
+ * upload cut off by a restart starts over. -1 once the record is gone. A len
+ * of 0 only checks that. *covered is the number of distinct bytes received
+ * so far.
+ */
+int upload_range_add(const char *id, uint64_t offset, uint64_t len, uint64_t *covered);
+uint64_t upload_range_covered(const char *id);
+void uploads_stats_append(struct strbuf *sb);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef CSAP_WATCH_H
+#define CSAP_WATCH_H
+
+#include "common/strbuf.h"
+
+struct mailbox;
+
+#define WATCH_MAX_PER_SESSION 64
+
+/*
+ * Change subscriptions. A session watching a path gets "NOTICE CREATED <p>"
+ * or "NOTICE CHANGED <p>" posted to its mailbox whenever one of the server's
+ * own mutations touches that path, or an entry directly inside it; <p> is
+ * the path as the watcher spelled it, with the entry name appended in the
+ * second case. Removals and moves away count as CHANGED. Changes made to the
+ * tree behind the server's back are not seen.
+ */
+int watch_add(struct mailbox *mb, const char *full, const char *arg);
+int watch_remove(struct mailbox *mb, const char *full);
+void watch_remove_all(struct mailbox *mb);
+void watch_notify(const char *full, int created);
+void watch_stats_append(struct strbuf *sb);
+
+#endif
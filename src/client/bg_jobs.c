@@ -1,215 +1,605 @@
 #include "client/bg_jobs.h"
 
-#include "client/net_client.h"
-#include "common/protocol.h"
-#include "common/io.h"
+#include "client/conn.h"
+#include "client/conn_pool.h"
+#include "client/upload_resume.h"
+#include "common/crc32c.h"
 #include "common/error.h"
+#include "common/protocol.h"
 
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
-#include <unistd.h>
 
-struct bg_job_args {
+#define BG_JOBS_KEEP_FINISHED 32
+#define BG_READY_WAIT_MS 5000
+#define BG_CANCEL_CHECK_MS 100
+#define BG_CONNECT_ATTEMPTS 3
+
+enum bg_state { BG_QUEUED, BG_RUNNING, BG_DONE, BG_FAILED, BG_CANCELLED };
+
+static const char *const g_state_names[] = {
+    [BG_QUEUED] = "queued",
+    [BG_RUNNING] = "running",
+    [BG_DONE] = "done",
+    [BG_FAILED] = "failed",
+    [BG_CANCELLED] = "cancelled",
+};
+
+struct bg_job {
+  int id;
+  int priority;
+  enum bg_state status;
+  int is_upload;
+  atomic_int cancel;
+  atomic_llong done;
+  atomic_llong total;
   struct client_state state;
   char path1[1024];
   char path2[1024];
-  int is_upload;
+  char upload_id[64];
+  int lost;
+  struct bg_job *next;
 };
 
+/*
+ * Jobs sit in one list in submission order. At most g_max_running run at a
+ * time, on worker threads started on demand that exit once nothing is
+ * queued; a worker takes the queued job with the highest priority, oldest
+ * first among equals. Anything waiting on jobs (wait, exit) sleeps on g_cv.
+ * Finished jobs stay listed
+ * until more than BG_JOBS_KEEP_FINISHED of them pile up.
+ */
 static pthread_mutex_t g_mu = PTHREAD_MUTEX_INITIALIZER;
-static int g_pending = 0;
+static pthread_cond_t g_cv = PTHREAD_COND_INITIALIZER;
+static struct bg_job *g_jobs = NULL;
+static int g_next_id = 1;
+static int g_unfinished = 0;
+static size_t g_workers = 0;
+static size_t g_max_running = BG_JOBS_DEFAULT_RUNNING;
 
-int bg_jobs_init(void) {
-  g_pending = 0;
+int bg_jobs_init(size_t max_running) {
+  g_max_running = max_running > 0 ? max_running : 1;
   return 0;
 }
 
 int bg_jobs_pending(void) {
   pthread_mutex_lock(&g_mu);
-  int n = g_pending;
+  int n = g_unfinished;
   pthread_mutex_unlock(&g_mu);
   return n;
 }
 
-static void pending_inc(void) {
-  pthread_mutex_lock(&g_mu);
-  g_pending++;
-  pthread_mutex_unlock(&g_mu);
+static int send_auth(struct conn *c, const char *fmt, const char *arg) {
+  if (conn_sendf_line(c, fmt, arg) != 0) {
+    return -1;
+  }
+  char line[256];
+  if (conn_recv_line(c, line, sizeof(line)) <= 0) {
+    return -1;
+  }
+  return (strncmp(line, "OK", 2) == 0) ? 0 : -1;
 }
 
-static void pending_dec(void) {
-  pthread_mutex_lock(&g_mu);
-  if (g_pending > 0) {
-    g_pending--;
+/* Resumes the interactive login when there is a token, else logs in again. */
+static int send_login(struct conn *c, const struct client_state *state) {
+  if (state->token[0] && send_auth(c, "resume %s -b", state->token) == 0) {
+    return 0;
   }
-  pthread_mutex_unlock(&g_mu);
+  return send_auth(c, "login %s -b", state->user);
 }
 
-static int send_login(int fd, const char *user) {
-  if (sendf_line(fd, "login %s", user) != 0) {
-    return -1;
+/* Reads the next status line, passing over notices from a watch. */
+static int recv_reply(struct conn *c, char *line, size_t cap) {
+  int n;
+  while ((n = conn_recv_line(c, line, cap)) > 0 && strncmp(line, "NOTICE ", 7) == 0) {
   }
-  char line[256];
-  if (recv_line(fd, line, sizeof(line)) <= 0) {
+  return n;
+}
+
+/*
+ * A job whose file is not ready yet (missing, locked, not permitted) waits
+ * for the server to report a change instead of asking again on a timer. The
+ * first failure only subscribes and retries at once, so a change between
+ * that failure and the subscription is not missed; later ones sleep until a
+ * notice arrives. Either way the job gives up BG_READY_WAIT_MS after it
+ * started waiting.
+ */
+struct ready_wait {
+  const char *path;
+  int watching;
+  struct timespec deadline;
+};
+
+static long ms_until(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long)(deadline->tv_sec - now.tv_sec) * 1000 +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+}
+
+/* 0 to try again, -1 to give up; *cancelled tells the two apart. */
+static int wait_ready(struct bg_job *job, struct conn *c, struct ready_wait *w, int *cancelled) {
+  char line[1024];
+  if (!w->watching) {
+    clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+    w->deadline.tv_sec += BG_READY_WAIT_MS / 1000;
+    if (conn_sendf_line(c, "watch %s", w->path) != 0 ||
+        recv_reply(c, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) {
+      return -1;
+    }
+    w->watching = 1;
+    return 0;
+  }
+  long left;
+  while ((left = ms_until(&w->deadline)) > 0) {
+    if (atomic_load(&job->cancel)) {
+      *cancelled = 1;
+      return -1;
+    }
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+    int rc = poll(&pfd, 1, left < BG_CANCEL_CHECK_MS ? (int)left : BG_CANCEL_CHECK_MS);
+    if (rc > 0) {
+      return conn_recv_line(c, line, sizeof(line)) > 0 && strncmp(line, "NOTICE ", 7) == 0
+                 ? 0
+                 : -1;
+    }
+  }
+  return -1;
+}
+
+/* A pooled connection must not carry a subscription into the next job. */
+static int end_wait(struct conn *c, const struct ready_wait *w) {
+  char line[1024];
+  if (!w->watching) {
+    return 0;
+  }
+  if (conn_sendf_line(c, "unwatch %s", w->path) != 0 ||
+      recv_reply(c, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) {
     return -1;
   }
-  return (strncmp(line, "OK", 2) == 0) ? 0 : -1;
+  return 0;
 }
 
-static void *bg_thread(void *arg) {
-  struct bg_job_args *job = (struct bg_job_args *)arg;
+/* The remote directory holding path: uploads wait for it to accept the file. */
+static void remote_parent(const char *path, char *out, size_t cap) {
+  const char *slash = strrchr(path, '/');
+  if (!slash) {
+    snprintf(out, cap, ".");
+  } else if (slash == path) {
+    snprintf(out, cap, "/");
+  } else {
+    snprintf(out, cap, "%.*s", (int)(slash - path), path);
+  }
+}
 
-  int fd = connect_to_server(job->state.cfg.ip, job->state.cfg.port);
-  if (fd < 0) {
-    fprintf(stdout, "[Background] Command failed: connection\n");
-    fflush(stdout);
-    pending_dec();
-    free(job);
-    return NULL;
+/* Whether an error reply means "not ready yet" rather than "never". */
+static int retryable(const char *line, int is_upload) {
+  int code = -1;
+  if (sscanf(line, "ERR %d", &code) != 1) {
+    return 0;
+  }
+  if (code == ERR_NOT_FOUND || code == ERR_PERM) {
+    return 1;
   }
+  return is_upload && (code == ERR_BUSY || code == ERR_IO);
+}
 
-  if (send_login(fd, job->state.user) != 0) {
-    fprintf(stdout, "[Background] Command failed: login\n");
-    fflush(stdout);
-    close(fd);
-    pending_dec();
-    free(job);
-    return NULL;
-  }
-
-  if (job->is_upload) {
-    int attempts = 5;
-    int ok = 0;
-    char line[256];
-    while (attempts-- > 0) {
-      FILE *in = fopen(job->path1, "rb");
-      if (!in) {
+/*
+ * Sets *reusable when the connection is left between commands, and
+ * job->lost when it broke mid-transfer. The upload is resumable, so a retry
+ * on a new connection continues from what the server committed.
+ */
+static enum bg_state run_upload(struct bg_job *job, struct conn *c, int *reusable) {
+  char line[256];
+  char parent[1024];
+  remote_parent(job->path2, parent, sizeof(parent));
+  struct ready_wait w = {.path = parent};
+  int cancelled = 0;
+  enum bg_state result = BG_FAILED;
+  FILE *in = fopen(job->path1, "rb");
+  if (!in) {
+    return BG_FAILED;
+  }
+  struct stat st;
+  if (fstat(fileno(in), &st) != 0) {
+    fclose(in);
+    return BG_FAILED;
+  }
+  atomic_store(&job->total, (long long)st.st_size);
+  while (1) {
+    uint64_t offset = 0;
+    if (job->upload_id[0]) {
+      struct upload_status us;
+      if (conn_sendf_line(c, "upload_status %s", job->upload_id) != 0 ||
+          recv_reply(c, line, sizeof(line)) <= 0) {
+        job->lost = 1;
         break;
       }
-      fseek(in, 0, SEEK_END);
-      long size = ftell(in);
-      fseek(in, 0, SEEK_SET);
-
-      sendf_line(fd, "upload %s %ld", job->path2, size);
-      char buf[4096];
-      long remaining = size;
-      while (remaining > 0) {
-        size_t n = fread(buf, 1, sizeof(buf), in);
-        if (n == 0) {
-          break;
-        }
-        send_blob(fd, buf, n);
-        remaining -= (long)n;
+      if (upload_status_parse(line, &us) != 0 || us.size != (uint64_t)st.st_size ||
+          upload_prefix_matches(in, &us) != 0) {
+        /* Gone, or the local file changed under it: start over. */
+        job->upload_id[0] = '\0';
+        continue;
       }
-      fclose(in);
-      if (recv_line(fd, line, sizeof(line)) > 0 && strncmp(line, "OK", 2) == 0) {
-        ok = 1;
+      offset = us.committed;
+    } else {
+      if (conn_sendf_line(c, "upload_open %s %lld", job->path2, (long long)st.st_size) != 0 ||
+          recv_reply(c, line, sizeof(line)) <= 0) {
+        job->lost = 1;
         break;
       }
-      int code = -1;
-      if (sscanf(line, "ERR %d", &code) == 1 &&
-          (code == ERR_PERM || code == ERR_BUSY || code == ERR_NOT_FOUND || code == ERR_IO)) {
-        struct timespec req = {.tv_sec = 0, .tv_nsec = 100000000};
-        nanosleep(&req, NULL);
-        continue;
+      if (sscanf(line, "OK %63s", job->upload_id) != 1) {
+        job->upload_id[0] = '\0';
+        if (retryable(line, 1) && wait_ready(job, c, &w, &cancelled) == 0) {
+          continue;
+        }
+        break;
       }
-      break;
     }
-    if (ok) {
-      fprintf(stdout, "[Background] Command: upload %s %s concluded\n", job->path2, job->path1);
-      fflush(stdout);
-    } else {
-      fprintf(stdout, "[Background] Command failed: upload\n");
-      fflush(stdout);
+
+    atomic_store(&job->done, (long long)offset);
+    uint64_t remaining = (uint64_t)st.st_size - offset;
+    int crc = job->state.cfg.crc;
+    if (conn_sendf_line(c, "upload_data%s %s %llu %llu", crc ? " " CRC_FLAG_ARG : "",
+                        job->upload_id, (unsigned long long)offset,
+                        (unsigned long long)remaining) != 0 ||
+        fseeko(in, (off_t)offset, SEEK_SET) != 0) {
+      job->lost = 1;
+      break;
     }
-  } else {
-    char line[256];
-    int attempts = 40;
-    int ok = 0;
-    while (attempts-- > 0) {
-      sendf_line(fd, "download %s", job->path1);
-      if (recv_line(fd, line, sizeof(line)) <= 0) {
-        break;
+    char buf[4096];
+    uint32_t sum = 0;
+    while (remaining > 0) {
+      if (atomic_load(&job->cancel)) {
+        fclose(in);
+        return BG_CANCELLED;
       }
-      if (strncmp(line, "OK", 2) == 0) {
-        ok = 1;
+      size_t n = fread(buf, 1, remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf), in);
+      if (n == 0) {
         break;
       }
-      int code = -1;
-      if (sscanf(line, "ERR %d", &code) == 1 &&
-          (code == ERR_NOT_FOUND || code == ERR_PERM)) {
-        struct timespec req = {.tv_sec = 0, .tv_nsec = 100000000};
-        nanosleep(&req, NULL);
-        continue;
+      if (crc) {
+        sum = crc32c(sum, buf, n);
       }
+      if (conn_send_blob(c, buf, n) != 0) {
+        job->lost = 1;
+        break;
+      }
+      remaining -= n;
+      atomic_fetch_add(&job->done, (long long)n);
+    }
+    if (!job->lost && crc) {
+      unsigned char trailer[CRC_TRAILER_SIZE];
+      crc_trailer_pack(sum, trailer);
+      job->lost = conn_send_blob(c, trailer, sizeof(trailer)) != 0;
+    }
+    if (job->lost || recv_reply(c, line, sizeof(line)) <= 0) {
+      job->lost = 1;
       break;
     }
-    if (ok) {
-      long size = 0;
-      sscanf(line, "OK %ld", &size);
-      FILE *out = fopen(job->path2, "wb");
-      if (out) {
-        char buf[4096];
-        long remaining = size;
-        while (remaining > 0) {
-          size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
-          if (recv_blob(fd, buf, chunk) != 0) {
-            break;
-          }
-          fwrite(buf, 1, chunk, out);
-          remaining -= (long)chunk;
-        }
-        fclose(out);
-        fprintf(stdout, "[Background] Command: download %s %s concluded\n", job->path1, job->path2);
-        fflush(stdout);
-      } else {
-        fprintf(stdout, "[Background] Command failed: download\n");
-        fflush(stdout);
-      }
-    } else {
-      fprintf(stdout, "[Background] Command failed: download\n");
+    if (strncmp(line, "OK", 2) == 0) {
+      result = BG_DONE;
+      break;
+    }
+    if (!retryable(line, 1) || wait_ready(job, c, &w, &cancelled) != 0) {
+      break;
+    }
+  }
+  fclose(in);
+  if (cancelled) {
+    return BG_CANCELLED;
+  }
+  *reusable = !job->lost && end_wait(c, &w) == 0;
+  return result;
+}
+
+/* Hashes the finished copy, which may have come in over several connections. */
+static int verify_download(struct bg_job *job, struct conn *c) {
+  FILE *in = fopen(job->path2, "rb");
+  uint32_t sum = 0;
+  int rc = in && file_crc32c(in, (uint64_t)atomic_load(&job->total), &sum) == 0 ? 0 : 1;
+  if (in) {
+    fclose(in);
+  }
+  char msg[256];
+  if (rc == 0 && (rc = download_verify(c, job->path1, sum, msg, sizeof(msg))) > 0) {
+    fprintf(stdout, "[Background] Job %d: %s\n", job->id, msg);
+    fflush(stdout);
+  }
+  return rc;
+}
+
+/* A retry after a broken connection asks only for the bytes not yet saved. */
+static enum bg_state run_download(struct bg_job *job, struct conn *c, int *reusable) {
+  char line[256];
+  struct ready_wait w = {.path = job->path1};
+  int cancelled = 0;
+  int ok = 0;
+  long long offset = atomic_load(&job->done);
+  while (1) {
+    int sent = offset > 0 ? conn_sendf_line(c, "read -offset=%lld %s", offset, job->path1)
+                          : conn_sendf_line(c, "download %s", job->path1);
+    if (sent != 0 || recv_reply(c, line, sizeof(line)) <= 0) {
+      job->lost = 1;
+      return BG_FAILED;
+    }
+    if (strncmp(line, "OK", 2) == 0) {
+      ok = 1;
+      break;
+    }
+    if (!retryable(line, 0) || wait_ready(job, c, &w, &cancelled) != 0) {
+      break;
+    }
+  }
+  if (cancelled) {
+    return BG_CANCELLED;
+  }
+  if (!ok) {
+    *reusable = end_wait(c, &w) == 0;
+    return BG_FAILED;
+  }
+  long size = 0;
+  sscanf(line, "OK %ld", &size);
+  atomic_store(&job->total, offset + size);
+  FILE *out = fopen(job->path2, offset > 0 ? "ab" : "wb");
+  if (!out) {
+    return BG_FAILED;
+  }
+  char buf[4096];
+  long remaining = size;
+  while (remaining > 0) {
+    if (atomic_load(&job->cancel)) {
+      fclose(out);
+      return BG_CANCELLED;
+    }
+    size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
+    if (conn_recv_blob(c, buf, chunk) != 0) {
+      job->lost = 1;
+      break;
+    }
+    fwrite(buf, 1, chunk, out);
+    remaining -= (long)chunk;
+    atomic_fetch_add(&job->done, (long long)chunk);
+  }
+  if (fclose(out) != 0) {
+    return BG_FAILED;
+  }
+  if (remaining > 0) {
+    return BG_FAILED;
+  }
+  *reusable = end_wait(c, &w) == 0;
+  if (*reusable && job->state.cfg.crc && verify_download(job, c) != 0) {
+    return BG_FAILED;
+  }
+  return BG_DONE;
+}
+
+int bg_conn_get(const struct client_state *state, struct conn *c) {
+  *c = (struct conn){.fd = -1};
+  if (state->conn.mux) {
+    if (conn_open_stream(&state->conn, c) != 0) {
+      return -1;
+    }
+  } else if (conn_pool_get(state->user, c) == 0) {
+    return 0;
+  } else if (conn_open(c, state->cfg.ip, state->cfg.port, state->cfg.proto) != 0) {
+    return -1;
+  }
+  if (send_login(c, state) != 0) {
+    conn_close(c);
+    return -2;
+  }
+  return 0;
+}
+
+void bg_conn_put(const struct client_state *state, struct conn *c, int reusable) {
+  if (reusable) {
+    conn_pool_put(state->user, c);
+  } else {
+    conn_close(c);
+  }
+}
+
+static enum bg_state run_job(struct bg_job *job) {
+  const char *op = job->is_upload ? "upload" : "download";
+  enum bg_state result = BG_FAILED;
+  for (int attempt = 0; attempt < BG_CONNECT_ATTEMPTS; attempt++) {
+    struct conn c;
+    int got = bg_conn_get(&job->state, &c);
+    if (got != 0) {
+      fprintf(stdout, "[Background] Command failed: %s\n", got == -2 ? "login" : "connection");
       fflush(stdout);
+      return BG_FAILED;
+    }
+    /* Only a connection left between commands can go back to the pool. */
+    int reusable = 0;
+    job->lost = 0;
+    result = job->is_upload ? run_upload(job, &c, &reusable) : run_download(job, &c, &reusable);
+    bg_conn_put(&job->state, &c, reusable);
+    if (result != BG_FAILED || !job->lost || atomic_load(&job->cancel)) {
+      break;
+    }
+  }
+
+  if (result == BG_DONE && job->is_upload) {
+    fprintf(stdout, "[Background] Command: upload %s %s concluded\n", job->path2, job->path1);
+  } else if (result == BG_DONE) {
+    fprintf(stdout, "[Background] Command: download %s %s concluded\n", job->path1, job->path2);
+  } else if (result == BG_CANCELLED) {
+    fprintf(stdout, "[Background] Job %d cancelled: %s\n", job->id, op);
+  } else {
+    fprintf(stdout, "[Background] Command failed: %s\n", op);
+  }
+  fflush(stdout);
+  return result;
+}
+
+static struct bg_job *next_queued_locked(void) {
+  struct bg_job *best = NULL;
+  for (struct bg_job *j = g_jobs; j; j = j->next) {
+    if (j->status == BG_QUEUED && (!best || j->priority > best->priority)) {
+      best = j;
+    }
+  }
+  return best;
+}
+
+static void prune_finished_locked(void) {
+  size_t finished = 0;
+  for (struct bg_job *j = g_jobs; j; j = j->next) {
+    finished += j->status > BG_RUNNING;
+  }
+  for (struct bg_job **pp = &g_jobs; *pp && finished > BG_JOBS_KEEP_FINISHED;) {
+    struct bg_job *j = *pp;
+    if (j->status > BG_RUNNING) {
+      *pp = j->next;
+      free(j);
+      finished--;
+    } else {
+      pp = &j->next;
     }
   }
+}
+
+static void finish_locked(struct bg_job *job, enum bg_state status) {
+  job->status = status;
+  g_unfinished--;
+  prune_finished_locked();
+  pthread_cond_broadcast(&g_cv);
+}
 
-  close(fd);
-  pending_dec();
-  free(job);
+static void *bg_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_mu);
+  struct bg_job *job;
+  while ((job = next_queued_locked()) != NULL) {
+    job->status = BG_RUNNING;
+    pthread_mutex_unlock(&g_mu);
+    enum bg_state result = run_job(job);
+    pthread_mutex_lock(&g_mu);
+    finish_locked(job, result);
+  }
+  g_workers--;
+  pthread_cond_broadcast(&g_cv);
+  pthread_mutex_unlock(&g_mu);
   return NULL;
 }
 
-static int start_job(const struct client_state *state, const char *p1, const char *p2, int is_upload) {
+static int start_job(const struct client_state *state, const char *p1, const char *p2,
+                     int is_upload, int priority) {
   if (!state || !state->logged_in) {
     return -1;
   }
-  struct bg_job_args *job = malloc(sizeof(*job));
+  struct bg_job *job = calloc(1, sizeof(*job));
   if (!job) {
     return -1;
   }
-  memset(job, 0, sizeof(*job));
   job->state = *state;
   snprintf(job->path1, sizeof(job->path1), "%s", p1);
   snprintf(job->path2, sizeof(job->path2), "%s", p2);
   job->is_upload = is_upload;
+  job->priority = priority;
+  job->status = BG_QUEUED;
 
-  pthread_t tid;
-  pending_inc();
-  if (pthread_create(&tid, NULL, bg_thread, job) != 0) {
-    pending_dec();
-    free(job);
-    return -1;
+  pthread_mutex_lock(&g_mu);
+  job->id = g_next_id++;
+  struct bg_job **tail = &g_jobs;
+  while (*tail) {
+    tail = &(*tail)->next;
   }
-  pthread_detach(tid);
-  return 0;
+  *tail = job;
+  g_unfinished++;
+  if (g_workers < g_max_running) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, bg_worker, NULL) == 0) {
+      pthread_detach(tid);
+      g_workers++;
+    } else if (g_workers == 0) {
+      /* Nothing would ever run it. */
+      finish_locked(job, BG_FAILED);
+      pthread_mutex_unlock(&g_mu);
+      return -1;
+    }
+  }
+  int id = job->id;
+  pthread_mutex_unlock(&g_mu);
+  return id;
+}
+
+int bg_start_upload(const struct client_state *state, const char *local_path,
+                    const char *remote_path, int priority) {
+  return start_job(state, local_path, remote_path, 1, priority);
 }
 
-int bg_start_upload(const struct client_state *state, const char *local_path, const char *remote_path) {
-  return start_job(state, local_path, remote_path, 1);
+int bg_start_download(const struct client_state *state, const char *remote_path,
+                      const char *local_path, int priority) {
+  return start_job(state, remote_path, local_path, 0, priority);
 }
 
-int bg_start_download(const struct client_state *state, const char *remote_path, const char *local_path) {
-  return start_job(state, remote_path, local_path, 0);
+void bg_jobs_list(FILE *out) {
+  pthread_mutex_lock(&g_mu);
+  if (!g_jobs) {
+    fprintf(out, "no jobs\n");
+  }
+  for (struct bg_job *j = g_jobs; j; j = j->next) {
+    fprintf(out, "%d %s %s %s -> %s %lld/%lld\n", j->id, g_state_names[j->status],
+            j->is_upload ? "upload" : "download", j->path1, j->path2,
+            (long long)atomic_load(&j->done), (long long)atomic_load(&j->total));
+  }
+  pthread_mutex_unlock(&g_mu);
+}
+
+/*
+ * A queued job is dropped at once; a running one stops at its next chunk or
+ * retry and closes its connection, since the transfer is left unfinished.
+ */
+int bg_jobs_cancel(int id) {
+  int rc = -1;
+  pthread_mutex_lock(&g_mu);
+  for (struct bg_job *j = g_jobs; j; j = j->next) {
+    if (j->id != id || j->status > BG_RUNNING) {
+      continue;
+    }
+    atomic_store(&j->cancel, 1);
+    if (j->status == BG_QUEUED) {
+      finish_locked(j, BG_CANCELLED);
+    } else {
+      pthread_cond_broadcast(&g_cv);
+    }
+    rc = 0;
+    break;
+  }
+  pthread_mutex_unlock(&g_mu);
+  return rc;
+}
+
+void bg_jobs_cancel_all(void) {
+  pthread_mutex_lock(&g_mu);
+  for (struct bg_job *j = g_jobs; j; j = j->next) {
+    if (j->status <= BG_RUNNING) {
+      atomic_store(&j->cancel, 1);
+    }
+    if (j->status == BG_QUEUED) {
+      j->status = BG_CANCELLED;
+      g_unfinished--;
+    }
+  }
+  prune_finished_locked();
+  pthread_cond_broadcast(&g_cv);
+  pthread_mutex_unlock(&g_mu);
+}
+
+/* Returns once every job has finished and every worker has exited. */
+void bg_jobs_wait(void) {
+  pthread_mutex_lock(&g_mu);
+  while (g_unfinished > 0 || g_workers > 0) {
+    pthread_cond_wait(&g_cv, &g_mu);
+  }
+  pthread_mutex_unlock(&g_mu);
 }
@@ -1,16 +1,25 @@
 #include "client/cli.h"
 
 #include "client/bg_jobs.h"
-#include "client/net_client.h"
-#include "common/io.h"
+#include "client/compress.h"
+#include "client/conn.h"
+#include "client/conn_pool.h"
+#include "client/delta_upload.h"
+#include "client/parallel.h"
+#include "client/upload_resume.h"
+#include "common/crc32c.h"
 #include "common/protocol.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
-#include <time.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* A chunk and its header fill one v2 DATA frame. */
+#define CLI_CHUNK_MAX (FRAME_MAX_PAYLOAD - CHUNK_HEADER_SIZE)
+
 static void print_server_line(const char *line) {
   if (line && line[0]) {
     printf("%s\n", line);
@@ -39,6 +48,7 @@ static void print_help(int logged_in) {
   fprintf(stderr, "  login <username>\n");
   fprintf(stderr, "  logout\n");
   fprintf(stderr, "  whoami\n");
+  fprintf(stderr, "  stats\n");
   fprintf(stderr, "\nCommands (login required):\n");
   fprintf(stderr, "  create [-d] <path> <perm_octal>\n");
   fprintf(stderr, "  chmod <path> <perm_octal>\n");
@@ -46,12 +56,24 @@ static void print_help(int logged_in) {
   fprintf(stderr, "  delete <path>\n");
   fprintf(stderr, "  cd <path>\n");
   fprintf(stderr, "  list [path]\n");
-  fprintf(stderr, "  read [-o set=N|-offset=N] <path>\n");
+  fprintf(stderr, "  read [-o set=N|-offset=N] <path> [length]\n");
+  fprintf(stderr, "  readv <path> <off>:<len>[,<off>:<len>...]\n");
   fprintf(stderr, "  write [-o set=N|-offset=N] <path>\n");
-  fprintf(stderr, "  upload [-b] <client_path> <server_path>\n");
-  fprintf(stderr, "  download [-b] <server_path> <client_path>\n");
-  fprintf(stderr, "  transfer_request <file> <dest_user>\n");
+  fprintf(stderr, "  open <path> <r|w|rw>\n");
+  fprintf(stderr, "  pread <handle> <offset> <length>\n");
+  fprintf(stderr, "  pwrite <handle> <offset>\n");
+  fprintf(stderr, "  close <handle>\n");
+  fprintf(stderr, "  watch <path>\n");
+  fprintf(stderr, "  unwatch <path>\n");
+  fprintf(stderr, "  batch <file>\n");
+  fprintf(stderr, "  upload [-b[=prio]|-resume=<id>|-j N|-delta] <client_path> <server_path>\n");
+  fprintf(stderr, "  download [-b[=prio]|-resume|-j N] <server_path> <client_path>\n");
+  fprintf(stderr, "  jobs\n");
+  fprintf(stderr, "  cancel <job_id>\n");
+  fprintf(stderr, "  wait\n");
+  fprintf(stderr, "  transfer_request <file>[,<file>...] <dest_user>[,<dest_user>...]\n");
   fprintf(stderr, "  accept <dest_dir> <id>\n");
+  fprintf(stderr, "  accept_all <dest_dir>\n");
   fprintf(stderr, "  reject <id>\n");
   if (!logged_in) {
     fprintf(stderr, "\nTip: login first to use file commands.\n");
@@ -66,9 +88,9 @@ static void print_help(int logged_in) {
   fprintf(stderr, "  download remote.txt /tmp/local.txt\n");
 }
 
-static int recv_status_line(int fd, char *buf, size_t cap) {
+static int recv_status_line(struct conn *c, char *buf, size_t cap) {
   while (1) {
-    int n = recv_line(fd, buf, cap);
+    int n = conn_recv_line(c, buf, cap);
     if (n <= 0) {
       return -1;
     }
@@ -80,24 +102,58 @@ static int recv_status_line(int fd, char *buf, size_t cap) {
   }
 }
 
-static int handle_simple(int fd, const char *line) {
-  if (send_line(fd, line) != 0) {
+static int handle_simple(struct conn *c, const char *line) {
+  if (conn_send_line(c, line) != 0) {
     return -1;
   }
   char resp[1024];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   print_server_line(resp);
   return 0;
 }
 
-static int handle_list(int fd, const char *line) {
-  if (send_line(fd, line) != 0) {
+/* "-b" or "-b=<prio>": 1 if present, 0 if not, -1 if malformed. */
+static int parse_background_opt(const char *opt, int *priority) {
+  if (!opt || strncmp(opt, "-b", 2) != 0) {
+    return 0;
+  }
+  if (opt[2] == '\0') {
+    return 1;
+  }
+  char *end = NULL;
+  long v = opt[2] == '=' ? strtol(opt + 3, &end, 10) : 0;
+  if (!end || end == opt + 3 || *end != '\0' || v < -100 || v > 100) {
+    return -1;
+  }
+  *priority = (int)v;
+  return 1;
+}
+
+/*
+ * Asks for a resume token right after login so background jobs can attach
+ * to this login instead of logging in again. A server without tokens (or a
+ * failed login) leaves it empty and jobs fall back to login.
+ */
+static void fetch_token(struct client_state *state) {
+  char resp[256];
+  state->token[0] = '\0';
+  if (conn_send_line(&state->conn, "token") != 0 ||
+      recv_status_line(&state->conn, resp, sizeof(resp)) != 0) {
+    return;
+  }
+  if (strncmp(resp, "OK ", 3) == 0) {
+    snprintf(state->token, sizeof(state->token), "%s", resp + 3);
+  }
+}
+
+static int handle_list(struct conn *c, const char *line) {
+  if (conn_send_line(c, line) != 0) {
     return -1;
   }
   char resp[1024];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   print_server_line(resp);
@@ -105,7 +161,7 @@ static int handle_list(int fd, const char *line) {
     return 0;
   }
   while (1) {
-    if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+    if (recv_status_line(c, resp, sizeof(resp)) != 0) {
       return -1;
     }
     if (strcmp(resp, "END") == 0) {
@@ -116,12 +172,17 @@ static int handle_list(int fd, const char *line) {
   return 0;
 }
 
-static int handle_read(int fd, const char *line) {
-  if (send_line(fd, line) != 0) {
+/* With z the command goes out with Z_FLAG_ARG and the bytes come back compressed. */
+static int handle_read(struct conn *c, const char *line, int z) {
+  const char *args = strchr(line, ' ');
+  z = z && args;
+  int sent = z ? conn_sendf_line(c, "%.*s %s%s", (int)(args - line), line, Z_FLAG_ARG, args)
+               : conn_send_line(c, line);
+  if (sent != 0) {
     return -1;
   }
   char resp[256];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   if (strncmp(resp, "OK", 2) != 0) {
@@ -130,11 +191,15 @@ static int handle_read(int fd, const char *line) {
   }
   long size = 0;
   sscanf(resp, "OK %ld", &size);
+  struct lz_stats st = {0};
+  if (z && zrecv_payload(c, (uint64_t)size, stdout, NULL, &st) != 0) {
+    return -1;
+  }
   char buf[4096];
-  long remaining = size;
+  long remaining = z ? 0 : size;
   while (remaining > 0) {
     size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
-    if (recv_blob(fd, buf, chunk) != 0) {
+    if (conn_recv_blob(c, buf, chunk) != 0) {
       return -1;
     }
     fwrite(buf, 1, chunk, stdout);
@@ -146,74 +211,291 @@ static int handle_read(int fd, const char *line) {
   return 0;
 }
 
-static int read_stdin_all(unsigned char **out, size_t *out_size) {
-  unsigned char *buf = NULL;
-  size_t cap = 0;
-  size_t len = 0;
-
-  unsigned char chunk[4096];
-  size_t n;
-  while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
-    if (len + n > cap) {
-      size_t new_cap = cap ? cap * 2 : 8192;
-      while (new_cap < len + n) {
-        new_cap *= 2;
-      }
-      unsigned char *next = realloc(buf, new_cap);
-      if (!next) {
-        free(buf);
+static int handle_readv(struct conn *c, const char *line) {
+  if (conn_send_line(c, line) != 0) {
+    return -1;
+  }
+  char resp[256];
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
+    return -1;
+  }
+  print_server_line(resp);
+  if (strncmp(resp, "OK", 2) != 0) {
+    return 0;
+  }
+  long count = 0;
+  sscanf(resp, "OK %ld", &count);
+  char buf[4096];
+  for (long i = 0; i < count; i++) {
+    if (recv_status_line(c, resp, sizeof(resp)) != 0) {
+      return -1;
+    }
+    print_server_line(resp);
+    long offset = 0;
+    long remaining = 0;
+    if (sscanf(resp, "RANGE %ld %ld", &offset, &remaining) != 2) {
+      return -1;
+    }
+    while (remaining > 0) {
+      size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
+      if (conn_recv_blob(c, buf, chunk) != 0) {
         return -1;
       }
-      buf = next;
-      cap = new_cap;
+      fwrite(buf, 1, chunk, stdout);
+      remaining -= (long)chunk;
     }
-    memcpy(buf + len, chunk, n);
-    len += n;
+    printf("\n");
   }
+  fflush(stdout);
+  return 0;
+}
+
+#define BATCH_WINDOW 64
+#define BATCH_MAX 4096
+
+enum batch_kind { BATCH_SIMPLE, BATCH_LIST, BATCH_READ };
 
-  *out = buf;
-  *out_size = len;
+static int batch_kind_for(const char *cmd, enum batch_kind *kind) {
+  static const char *const rejected[] = {"write", "pwrite", "upload", "download", "readv",
+                                         "login", "logout", "exit",   "batch"};
+  for (size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++) {
+    if (strcmp(cmd, rejected[i]) == 0) {
+      return -1;
+    }
+  }
+  if (strcmp(cmd, "list") == 0 || strcmp(cmd, "stats") == 0) {
+    *kind = BATCH_LIST;
+  } else if (strcmp(cmd, "read") == 0 || strcmp(cmd, "pread") == 0) {
+    *kind = BATCH_READ;
+  } else {
+    *kind = BATCH_SIMPLE;
+  }
   return 0;
 }
 
-static int read_stdin_write_payload(unsigned char **out, size_t *out_size) {
-  if (isatty(STDIN_FILENO)) {
-    unsigned char *buf = NULL;
-    size_t cap = 0;
-    size_t len = 0;
-    char line[4096];
-    int empty_streak = 0;
-    while (fgets(line, sizeof(line), stdin)) {
-      size_t n = strlen(line);
-      if (n == 1 && line[0] == '\n') {
-        empty_streak++;
-      } else {
-        empty_streak = 0;
+/* Reads the tagged reply for batch entry tag and prints it untagged. */
+static int batch_recv(struct conn *c, int tag, enum batch_kind kind) {
+  char resp[1024];
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
+    return -1;
+  }
+  char prefix[32];
+  int plen = snprintf(prefix, sizeof(prefix), "#%d ", tag);
+  if (strncmp(resp, prefix, (size_t)plen) != 0) {
+    fprintf(stderr, "batch: out of order reply: %s\n", resp);
+    return -1;
+  }
+  const char *status = resp + plen;
+  print_server_line(status);
+  if (strncmp(status, "OK", 2) != 0) {
+    return 0;
+  }
+  if (kind == BATCH_LIST) {
+    while (1) {
+      if (recv_status_line(c, resp, sizeof(resp)) != 0) {
+        return -1;
       }
-      if (empty_streak >= 2) {
-        break;
+      if (strcmp(resp, "END") == 0) {
+        return 0;
       }
-      if (len + n > cap) {
-        size_t new_cap = cap ? cap * 2 : 8192;
-        while (new_cap < len + n) {
-          new_cap *= 2;
-        }
-        unsigned char *next = realloc(buf, new_cap);
-        if (!next) {
-          free(buf);
-          return -1;
-        }
-        buf = next;
-        cap = new_cap;
+      print_server_line(resp);
+    }
+  }
+  if (kind == BATCH_READ) {
+    long remaining = 0;
+    sscanf(status, "OK %ld", &remaining);
+    char buf[4096];
+    while (remaining > 0) {
+      size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
+      if (conn_recv_blob(c, buf, chunk) != 0) {
+        return -1;
       }
-      memcpy(buf + len, line, n);
-      len += n;
+      fwrite(buf, 1, chunk, stdout);
+      remaining -= (long)chunk;
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/*
+ * Runs every command in a file with up to BATCH_WINDOW requests in flight.
+ * The server executes them in order, so replies come back in tag order and
+ * the window only hides the round trips. Commands that carry a payload or
+ * change the login state are refused up front, before anything is sent.
+ */
+static int handle_batch(struct conn *c, const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    printf("batch: cannot open %s\n", file);
+    return 0;
+  }
+  static char lines[BATCH_MAX][1024];
+  enum batch_kind kinds[BATCH_MAX];
+  size_t count = 0;
+  char buf[1024];
+  int rc = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (buf[0] == '\0' || buf[0] == '#') {
+      continue;
+    }
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s", buf);
+    char *cmd = strtok(copy, " ");
+    if (!cmd) {
+      continue;
+    }
+    if (count == BATCH_MAX) {
+      printf("batch: more than %d commands\n", BATCH_MAX);
+      rc = -1;
+      break;
+    }
+    if (batch_kind_for(cmd, &kinds[count]) != 0) {
+      printf("batch: %s not allowed in a batch\n", cmd);
+      rc = -1;
+      break;
     }
-    *out = buf;
-    *out_size = len;
+    snprintf(lines[count++], sizeof(lines[0]), "%s", buf);
+  }
+  fclose(f);
+  if (rc != 0) {
     return 0;
   }
-  return read_stdin_all(out, out_size);
+
+  size_t sent = 0;
+  size_t done = 0;
+  while (done < count) {
+    while (sent < count && sent - done < BATCH_WINDOW) {
+      char tagged[1100];
+      snprintf(tagged, sizeof(tagged), "#%zu %s", sent + 1, lines[sent]);
+      if (conn_send_line(c, tagged) != 0) {
+        return -1;
+      }
+      sent++;
+    }
+    if (batch_recv(c, (int)(done + 1), kinds[done]) != 0) {
+      return -1;
+    }
+    done++;
+  }
+  return 0;
+}
+
+/*
+ * Sends one chunk of a chunked payload from buf + CHUNK_HEADER_SIZE; the
+ * header goes in front of it so both leave in one write. len 0 ends it.
+ */
+static int send_chunk(struct conn *c, unsigned char *buf, size_t len) {
+  chunk_header_pack((uint32_t)len, buf);
+  return conn_send_blob(c, buf, CHUNK_HEADER_SIZE + len);
+}
+
+/* Ends a payload sent with CRC_FLAG_ARG: the CRC-32C of its bytes. */
+static int send_crc_trailer(struct conn *c, uint32_t crc) {
+  unsigned char trailer[CRC_TRAILER_SIZE];
+  crc_trailer_pack(crc, trailer);
+  return conn_send_blob(c, trailer, sizeof(trailer));
+}
+
+/*
+ * Streams in as chunks of up to CLI_CHUNK_MAX bytes, whatever its length.
+ * With crc set, the CRC-32C of what was sent follows the last chunk.
+ */
+static int send_file_chunks(struct conn *c, FILE *in, int crc) {
+  static unsigned char buf[CHUNK_HEADER_SIZE + CLI_CHUNK_MAX];
+  uint32_t sum = 0;
+  size_t n;
+  while ((n = fread(buf + CHUNK_HEADER_SIZE, 1, CLI_CHUNK_MAX, in)) > 0) {
+    if (crc) {
+      sum = crc32c(sum, buf + CHUNK_HEADER_SIZE, n);
+    }
+    if (send_chunk(c, buf, n) != 0) {
+      return -1;
+    }
+  }
+  if (send_chunk(c, buf, 0) != 0) {
+    return -1;
+  }
+  return crc ? send_crc_trailer(c, sum) : 0;
+}
+
+/*
+ * The compressed form of a payload: up to len bytes of in as blocks, then the
+ * end block and, with crc set, the trailer. Prints what compression saved.
+ */
+static int send_file_z(struct conn *c, FILE *in, uint64_t len, int crc) {
+  static unsigned char buf[LZ_BLOCK_MAX];
+  struct zsend *z = zsend_open(c);
+  uint32_t sum = 0;
+  int rc = z ? 0 : -1;
+  while (rc == 0 && len > 0) {
+    size_t n = fread(buf, 1, len < sizeof(buf) ? (size_t)len : sizeof(buf), in);
+    if (n == 0) {
+      break;
+    }
+    if (crc) {
+      sum = crc32c(sum, buf, n);
+    }
+    rc = zsend_write(z, buf, n);
+    len -= n;
+  }
+  struct lz_stats st;
+  if (z && zsend_close(z, &st) != 0) {
+    rc = -1;
+  }
+  if (rc == 0 && crc) {
+    rc = send_crc_trailer(c, sum);
+  }
+  if (rc == 0) {
+    compress_report(&st);
+  }
+  return rc;
+}
+
+/*
+ * Typed input is sent a line at a time until two empty lines in a row;
+ * compressed, the lines are gathered into blocks.
+ */
+static int send_typed_chunks(struct conn *c, int crc, int compress) {
+  static unsigned char buf[CHUNK_HEADER_SIZE + 4096];
+  char *line = (char *)buf + CHUNK_HEADER_SIZE;
+  struct zsend *z = compress ? zsend_open(c) : NULL;
+  uint32_t sum = 0;
+  int empty_streak = 0;
+  if (compress && !z) {
+    return -1;
+  }
+  while (fgets(line, 4096, stdin)) {
+    size_t n = strlen(line);
+    empty_streak = (n == 1 && line[0] == '\n') ? empty_streak + 1 : 0;
+    if (empty_streak >= 2) {
+      break;
+    }
+    if (crc) {
+      sum = crc32c(sum, line, n);
+    }
+    if (z ? zsend_write(z, line, n) != 0 : send_chunk(c, buf, n) != 0) {
+      zsend_close(z, NULL);
+      return -1;
+    }
+  }
+  struct lz_stats st;
+  if (z ? zsend_close(z, &st) != 0 : send_chunk(c, buf, 0) != 0) {
+    return -1;
+  }
+  if (z) {
+    compress_report(&st);
+  }
+  return crc ? send_crc_trailer(c, sum) : 0;
+}
+
+/* The flags that follow a payload command's name. */
+static const char *payload_flags(const struct client_config *cfg) {
+  if (cfg->crc && cfg->compress) {
+    return " " CRC_FLAG_ARG " " Z_FLAG_ARG;
+  }
+  return cfg->crc ? " " CRC_FLAG_ARG : cfg->compress ? " " Z_FLAG_ARG : "";
 }
 
 static int parse_offset_tokens(char *arg1, char *arg2, char **out_path, long *out_offset) {
@@ -235,85 +517,278 @@ static int parse_offset_tokens(char *arg1, char *arg2, char **out_path, long *ou
   return 0;
 }
 
-static int handle_write(int fd, const char *path, long offset) {
-  unsigned char *payload = NULL;
-  size_t size = 0;
-  if (read_stdin_write_payload(&payload, &size) != 0) {
+/*
+ * Sends "<cmd> <args> chunked" and streams stdin behind it as it is read, so
+ * input of any length needs no more memory than one chunk.
+ */
+static int send_stdin_payload(struct conn *c, const char *cmd, const char *args,
+                              const struct client_config *cfg) {
+  char line[2048];
+  snprintf(line, sizeof(line), "%s%s %s %s", cmd, payload_flags(cfg), args, CHUNKED_SIZE_ARG);
+  if (conn_send_line(c, line) != 0) {
     return -1;
   }
-
-  char line[2048];
-  if (offset > 0) {
-    snprintf(line, sizeof(line), "write -offset=%ld %s %zu", offset, path, size);
+  int rc;
+  if (isatty(STDIN_FILENO)) {
+    rc = send_typed_chunks(c, cfg->crc, cfg->compress);
   } else {
-    snprintf(line, sizeof(line), "write %s %zu", path, size);
+    rc = cfg->compress ? send_file_z(c, stdin, UINT64_MAX, cfg->crc)
+                       : send_file_chunks(c, stdin, cfg->crc);
   }
-  if (send_line(fd, line) != 0) {
-    free(payload);
+  if (rc != 0) {
     return -1;
   }
-  if (size > 0 && send_blob(fd, payload, size) != 0) {
-    free(payload);
-    return -1;
-  }
-  free(payload);
 
   char resp[256];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   print_server_line(resp);
   return 0;
 }
 
-static int handle_upload(int fd, const char *local_path, const char *remote_path) {
+static int handle_write(struct conn *c, const char *path, long offset,
+                        const struct client_config *cfg) {
+  char args[2048];
+  if (offset > 0) {
+    snprintf(args, sizeof(args), "-offset=%ld %s", offset, path);
+  } else {
+    snprintf(args, sizeof(args), "%s", path);
+  }
+  return send_stdin_payload(c, "write", args, cfg);
+}
+
+/* Sends a command and reads its status line: 0 on OK, 1 (printed) on anything else. */
+static int send_expect_ok(struct conn *c, const char *line, char *resp, size_t cap) {
+  if (conn_send_line(c, line) != 0 || recv_status_line(c, resp, cap) != 0) {
+    return -1;
+  }
+  if (strncmp(resp, "OK", 2) != 0) {
+    print_server_line(resp);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Regular files go up as a resumable upload: the server hands out an id,
+ * printed so an interrupted upload can be continued with -resume=<id>, and
+ * keeps what it received. Resuming sends only what the server is missing,
+ * once the local file is found to still start with the part already there.
+ * With dedup the file's hash goes first, and nothing more if the server
+ * already stores that content.
+ */
+static int handle_upload(struct conn *c, const char *local_path, const char *remote_path,
+                         const char *resume_id, const struct client_config *cfg) {
   FILE *in = fopen(local_path, "rb");
   if (!in) {
     fprintf(stderr, "upload: cannot open %s\n", local_path);
     return -1;
   }
-  fseek(in, 0, SEEK_END);
-  long size = ftell(in);
-  fseek(in, 0, SEEK_SET);
-
   char line[2048];
-  snprintf(line, sizeof(line), "upload %s %ld", remote_path, size);
-  if (send_line(fd, line) != 0) {
+  char resp[256];
+  /* Pipes, devices and the like have no size to announce: stream them. */
+  struct stat st;
+  if (fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (resume_id) {
+      fprintf(stderr, "upload: %s cannot be resumed\n", local_path);
+      fclose(in);
+      return -1;
+    }
+    snprintf(line, sizeof(line), "upload%s %s %s", payload_flags(cfg), remote_path,
+             CHUNKED_SIZE_ARG);
+    int rc = -1;
+    if (conn_send_line(c, line) == 0) {
+      rc = cfg->compress ? send_file_z(c, in, UINT64_MAX, cfg->crc)
+                         : send_file_chunks(c, in, cfg->crc);
+    }
     fclose(in);
-    return -1;
+    if (rc != 0 || recv_status_line(c, resp, sizeof(resp)) != 0) {
+      return -1;
+    }
+    print_server_line(resp);
+    return 0;
   }
 
+  char id[64];
+  uint64_t offset = 0;
+  int rc;
+  if (resume_id) {
+    snprintf(id, sizeof(id), "%s", resume_id);
+    snprintf(line, sizeof(line), "upload_status %s", id);
+    struct upload_status us;
+    if ((rc = send_expect_ok(c, line, resp, sizeof(resp))) != 0) {
+      fclose(in);
+      return rc < 0 ? -1 : 0;
+    }
+    if (upload_status_parse(resp, &us) != 0 || us.size != (uint64_t)st.st_size ||
+        upload_prefix_matches(in, &us) != 0) {
+      fprintf(stderr, "upload: %s does not match upload %s\n", local_path, id);
+      fclose(in);
+      return 0;
+    }
+    offset = us.committed;
+  } else {
+    if (cfg->dedup &&
+        (rc = upload_by_hash(c, in, (uint64_t)st.st_size, remote_path, resp, sizeof(resp))) <= 0) {
+      fclose(in);
+      if (rc < 0) {
+        return -1;
+      }
+      printf("Deduplicated: the server already had these %lld bytes\n", (long long)st.st_size);
+      print_server_line(resp);
+      return 0;
+    }
+    snprintf(line, sizeof(line), "upload_open %s %lld", remote_path, (long long)st.st_size);
+    if ((rc = send_expect_ok(c, line, resp, sizeof(resp))) != 0 ||
+        sscanf(resp, "OK %63s", id) != 1) {
+      fclose(in);
+      return rc < 0 ? -1 : 0;
+    }
+    printf("Upload %s started\n", id);
+  }
+
+  uint64_t remaining = (uint64_t)st.st_size - offset;
+  snprintf(line, sizeof(line), "upload_data%s %s %llu %llu", payload_flags(cfg), id,
+           (unsigned long long)offset, (unsigned long long)remaining);
+  if (conn_send_line(c, line) != 0 || fseeko(in, (off_t)offset, SEEK_SET) != 0) {
+    fclose(in);
+    return -1;
+  }
+  if (cfg->compress) {
+    rc = send_file_z(c, in, remaining, cfg->crc);
+    fclose(in);
+    if (rc != 0 || recv_status_line(c, resp, sizeof(resp)) != 0) {
+      return -1;
+    }
+    print_server_line(resp);
+    return 0;
+  }
   char buf[4096];
-  long remaining = size;
+  uint32_t sum = 0;
+  int crc = cfg->crc;
   while (remaining > 0) {
-    size_t n = fread(buf, 1, sizeof(buf), in);
+    size_t n = fread(buf, 1, remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf), in);
     if (n == 0) {
       break;
     }
-    if (send_blob(fd, buf, n) != 0) {
+    if (crc) {
+      sum = crc32c(sum, buf, n);
+    }
+    if (conn_send_blob(c, buf, n) != 0) {
       fclose(in);
       return -1;
     }
-    remaining -= (long)n;
+    remaining -= n;
   }
   fclose(in);
+  if (crc && send_crc_trailer(c, sum) != 0) {
+    return -1;
+  }
 
-  char resp[256];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   print_server_line(resp);
   return 0;
 }
 
-static int handle_download(int fd, const char *remote_path, const char *local_path) {
+/* size payload bytes into out, compressed or not, summed into *crc when crc is set. */
+static int recv_payload(struct conn *c, uint64_t size, FILE *out, uint32_t *crc, int compress,
+                        struct lz_stats *zst) {
+  if (compress) {
+    return zrecv_payload(c, size, out, crc, zst);
+  }
+  char buf[4096];
+  while (size > 0) {
+    size_t chunk = size > sizeof(buf) ? sizeof(buf) : (size_t)size;
+    if (conn_recv_blob(c, buf, chunk) != 0) {
+      return -1;
+    }
+    if (crc) {
+      *crc = crc32c(*crc, buf, chunk);
+    }
+    fwrite(buf, 1, chunk, out);
+    size -= chunk;
+  }
+  return 0;
+}
+
+/* Moves out past a hole: a seek where it can, zeros where it cannot, like a pipe. */
+static void skip_hole(FILE *out, uint64_t len) {
+  static const char zeros[4096];
+  if (fseeko(out, (off_t)len, SEEK_CUR) == 0) {
+    return;
+  }
+  while (len > 0) {
+    size_t chunk = len > sizeof(zeros) ? sizeof(zeros) : (size_t)len;
+    if (fwrite(zeros, 1, chunk, out) != chunk) {
+      return;
+    }
+    len -= chunk;
+  }
+}
+
+/*
+ * A -sparse answer: data extents are written and holes seeked over, which
+ * leaves them unallocated; the file is then cut at its end so a trailing
+ * hole gets its length too. *holes adds up the bytes skipped.
+ */
+static int recv_sparse(struct conn *c, uint64_t size, FILE *out, uint32_t *crc, int compress,
+                       struct lz_stats *zst, uint64_t *holes) {
+  uint64_t got = 0;
+  while (got < size) {
+    unsigned char hdr[SPARSE_HEADER_SIZE];
+    int kind;
+    uint64_t len;
+    if (conn_recv_blob(c, hdr, sizeof(hdr)) != 0 || sparse_header_unpack(hdr, &kind, &len) != 0 ||
+        len == 0 || len > size - got) {
+      return -1;
+    }
+    if (kind == SPARSE_HOLE) {
+      skip_hole(out, len);
+      if (crc) {
+        *crc = crc32c_zeros(*crc, len);
+      }
+      *holes += len;
+    } else if (recv_payload(c, len, out, crc, compress, zst) != 0) {
+      return -1;
+    }
+    got += len;
+  }
+  /* On a pipe ftello fails, and the zeros were written instead. */
+  off_t end = ftello(out);
+  if (end > 0 && (fflush(out) != 0 || ftruncate(fileno(out), end) != 0)) {
+    fprintf(stderr, "download: cannot extend the file to %lld bytes\n", (long long)end);
+  }
+  return 0;
+}
+
+/*
+ * With resume, an existing local file is taken as the start of the remote one.
+ * With crc, the copy's CRC-32C, taken as it arrives, is checked against the
+ * server's for the whole file.
+ */
+static int handle_download(struct conn *c, const char *remote_path, const char *local_path,
+                           int resume, const struct client_config *cfg) {
   char line[2048];
-  snprintf(line, sizeof(line), "download %s", remote_path);
-  if (send_line(fd, line) != 0) {
+  struct stat st;
+  int crc = cfg->crc;
+  char flags[32];
+  snprintf(flags, sizeof(flags), "%s%s", cfg->sparse ? " " SPARSE_FLAG_ARG : "",
+           cfg->compress ? " " Z_FLAG_ARG : "");
+  off_t offset = resume && stat(local_path, &st) == 0 ? st.st_size : 0;
+  if (offset > 0) {
+    snprintf(line, sizeof(line), "read%s -offset=%lld %s", flags, (long long)offset,
+             remote_path);
+  } else {
+    snprintf(line, sizeof(line), "download%s %s", flags, remote_path);
+  }
+  if (conn_send_line(c, line) != 0) {
     return -1;
   }
   char resp[256];
-  if (recv_status_line(fd, resp, sizeof(resp)) != 0) {
+  if (recv_status_line(c, resp, sizeof(resp)) != 0) {
     return -1;
   }
   if (strncmp(resp, "OK", 2) != 0) {
@@ -322,27 +797,190 @@ static int handle_download(int fd, const char *remote_path, const char *local_pa
   }
   long size = 0;
   sscanf(resp, "OK %ld", &size);
-  FILE *out = fopen(local_path, "wb");
+  /* Not "a": holes are seeked over, and appending would ignore the seek. */
+  FILE *out = fopen(local_path, offset > 0 ? "rb+" : "wb");
+  uint32_t sum = 0;
+  if (out && ((crc && offset > 0 && file_crc32c(out, (uint64_t)offset, &sum) != 0) ||
+              fseeko(out, offset, SEEK_SET) != 0)) {
+    fclose(out);
+    out = NULL;
+  }
   if (!out) {
     fprintf(stderr, "download: cannot open %s\n", local_path);
     return -1;
   }
-  char buf[4096];
-  long remaining = size;
-  while (remaining > 0) {
-    size_t chunk = remaining > (long)sizeof(buf) ? sizeof(buf) : (size_t)remaining;
-    if (recv_blob(fd, buf, chunk) != 0) {
-      fclose(out);
-      return -1;
+  struct lz_stats zst = {0};
+  uint64_t holes = 0;
+  uint32_t *sump = crc ? &sum : NULL;
+  int failed = cfg->sparse
+                   ? recv_sparse(c, (uint64_t)size, out, sump, cfg->compress, &zst, &holes) != 0
+                   : recv_payload(c, (uint64_t)size, out, sump, cfg->compress, &zst) != 0;
+  fclose(out);
+  if (failed) {
+    return -1;
+  }
+  if (cfg->compress) {
+    compress_report(&zst);
+  }
+  if (holes > 0) {
+    printf("Sparse: %llu of %ld bytes were holes\n", (unsigned long long)holes, size);
+  }
+  if (crc) {
+    char msg[256];
+    int rc = download_verify(c, remote_path, sum, msg, sizeof(msg));
+    if (rc != 0) {
+      if (rc > 0) {
+        fprintf(stderr, "download: %s: %s\n", local_path, msg);
+      }
+      return rc < 0 ? -1 : 0;
     }
-    fwrite(buf, 1, chunk, out);
-    remaining -= (long)chunk;
   }
-  fclose(out);
   printf("OK\n");
   return 0;
 }
 
+/*
+ * -j N: the upload is opened here, its ranges go up on N connections at once
+ * and only then is it committed, so the file appears whole or not at all.
+ */
+static int handle_upload_parallel(struct client_state *state, const char *local_path,
+                                  const char *remote_path, int jobs) {
+  int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "upload: -j needs a regular file: %s\n", local_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  char line[2048];
+  char resp[256];
+  char id[64];
+  snprintf(line, sizeof(line), "upload_open %s %lld", remote_path, (long long)st.st_size);
+  int rc = send_expect_ok(&state->conn, line, resp, sizeof(resp));
+  if (rc != 0 || sscanf(resp, "OK %63s", id) != 1) {
+    close(fd);
+    return rc < 0 ? -1 : 0;
+  }
+  printf("Upload %s started\n", id);
+  rc = parallel_put(state, fd, id, (uint64_t)st.st_size, jobs);
+  close(fd);
+  if (rc != 0) {
+    /* The ranges that did arrive are of no use to anyone: the server can drop them now. */
+    snprintf(line, sizeof(line), "upload_abort %s", id);
+    if (conn_send_line(&state->conn, line) != 0 ||
+        recv_status_line(&state->conn, resp, sizeof(resp)) != 0) {
+      return -1;
+    }
+    return 0;
+  }
+  snprintf(line, sizeof(line), "upload_commit %s", id);
+  if (conn_send_line(&state->conn, line) != 0 ||
+      recv_status_line(&state->conn, resp, sizeof(resp)) != 0) {
+    return -1;
+  }
+  print_server_line(resp);
+  return 0;
+}
+
+/*
+ * -delta: only what changed goes up, against the server's copy of the file.
+ * Without one there is nothing to compare with and the file goes up whole.
+ */
+static int handle_upload_delta(struct conn *c, const char *local_path, const char *remote_path,
+                               const struct client_config *cfg) {
+  int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "upload: -delta needs a regular file: %s\n", local_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  char resp[256];
+  uint64_t literal = 0;
+  int rc = delta_upload(c, fd, (uint64_t)st.st_size, remote_path, &literal, resp, sizeof(resp));
+  close(fd);
+  if (rc < 0) {
+    return -1;
+  }
+  if (rc > 0) {
+    printf("Delta: %s, sending the whole file\n", resp);
+    return handle_upload(c, local_path, remote_path, NULL, cfg);
+  }
+  printf("Delta: sent %llu of %lld bytes\n", (unsigned long long)literal, (long long)st.st_size);
+  print_server_line(resp);
+  return 0;
+}
+
+/* -j N: the size comes from opening the file, then N ranged reads fill it in. */
+static int handle_download_parallel(struct client_state *state, const char *remote_path,
+                                    const char *local_path, int jobs) {
+  char line[2048];
+  char resp[256];
+  snprintf(line, sizeof(line), "open %s r", remote_path);
+  int rc = send_expect_ok(&state->conn, line, resp, sizeof(resp));
+  int handle = 0;
+  long long size = 0;
+  if (rc != 0 || sscanf(resp, "OK %d %lld", &handle, &size) != 2) {
+    return rc < 0 ? -1 : 0;
+  }
+  snprintf(line, sizeof(line), "close %d", handle);
+  if (send_expect_ok(&state->conn, line, resp, sizeof(resp)) < 0) {
+    return -1;
+  }
+  int fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+    fprintf(stderr, "download: cannot open %s\n", local_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  rc = parallel_get(state, remote_path, fd, (uint64_t)size, jobs);
+  if (close(fd) != 0) {
+    rc = -1;
+  }
+  if (rc == 0 && state->cfg.crc) {
+    /* The ranges arrived out of order: hash the finished copy instead. */
+    FILE *in = fopen(local_path, "rb");
+    uint32_t sum = 0;
+    char msg[256];
+    rc = in && file_crc32c(in, (uint64_t)size, &sum) == 0 ? 0 : -1;
+    if (in) {
+      fclose(in);
+    }
+    if (rc != 0) {
+      fprintf(stderr, "download: cannot read back %s\n", local_path);
+    } else if ((rc = download_verify(&state->conn, remote_path, sum, msg, sizeof(msg))) > 0) {
+      fprintf(stderr, "download: %s: %s\n", local_path, msg);
+    } else if (rc < 0) {
+      return -1;
+    }
+  }
+  if (rc == 0) {
+    printf("OK\n");
+  }
+  return 0;
+}
+
+/* "-j" followed by the number of connections, 1..PARALLEL_MAX_JOBS. */
+static int parse_jobs_opt(const char *opt, int *jobs) {
+  if (!opt || strcmp(opt, "-j") != 0) {
+    return 0;
+  }
+  char *n = strtok(NULL, " ");
+  char *end = NULL;
+  long v = n ? strtol(n, &end, 10) : 0;
+  if (!n || *end != '\0' || v < 1 || v > PARALLEL_MAX_JOBS) {
+    return -1;
+  }
+  *jobs = (int)v;
+  return 1;
+}
+
 void client_loop(struct client_state *state) {
   char line[2048];
   if (isatty(STDIN_FILENO)) {
@@ -353,14 +991,14 @@ void client_loop(struct client_state *state) {
     fd_set rfds;
     FD_ZERO(&rfds);
     FD_SET(STDIN_FILENO, &rfds);
-    FD_SET(state->fd, &rfds);
-    int maxfd = state->fd > STDIN_FILENO ? state->fd : STDIN_FILENO;
+    FD_SET(state->conn.fd, &rfds);
+    int maxfd = state->conn.fd > STDIN_FILENO ? state->conn.fd : STDIN_FILENO;
     if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
       continue;
     }
-    if (FD_ISSET(state->fd, &rfds)) {
+    if (FD_ISSET(state->conn.fd, &rfds)) {
       char notice[1024];
-      int n = recv_line(state->fd, notice, sizeof(notice));
+      int n = conn_recv_line(&state->conn, notice, sizeof(notice));
       if (n <= 0) {
         break;
       }
@@ -369,12 +1007,7 @@ void client_loop(struct client_state *state) {
       continue;
     }
     if (!fgets(line, sizeof(line), stdin)) {
-      if (bg_jobs_pending() > 0) {
-        while (bg_jobs_pending() > 0) {
-          struct timespec req = {.tv_sec = 0, .tv_nsec = 100000000};
-          nanosleep(&req, NULL);
-        }
-      }
+      bg_jobs_wait();
       break;
     }
     size_t len = strlen(line);
@@ -402,7 +1035,7 @@ void client_loop(struct client_state *state) {
         printf("Background jobs running, exit aborted\n");
         continue;
       }
-      handle_simple(state->fd, "exit");
+      handle_simple(&state->conn, "exit");
       break;
     }
 
@@ -416,9 +1049,10 @@ void client_loop(struct client_state *state) {
         printf("usage: login <user>\n");
         continue;
       }
-      if (handle_simple(state->fd, line) == 0) {
+      if (handle_simple(&state->conn, line) == 0) {
         snprintf(state->user, sizeof(state->user), "%s", user);
         state->logged_in = 1;
+        fetch_token(state);
       }
       continue;
     }
@@ -428,68 +1062,104 @@ void client_loop(struct client_state *state) {
         printf("not logged in\n");
         continue;
       }
-      if (handle_simple(state->fd, line) == 0) {
+      if (handle_simple(&state->conn, line) == 0) {
         state->logged_in = 0;
         state->user[0] = '\0';
+        state->token[0] = '\0';
+        conn_pool_clear();
       }
       continue;
     }
 
+    if (strcmp(cmd, "jobs") == 0) {
+      bg_jobs_list(stdout);
+      continue;
+    }
+
+    if (strcmp(cmd, "cancel") == 0) {
+      char *id = strtok(NULL, " ");
+      if (!id) {
+        printf("usage: cancel <job id>\n");
+      } else if (bg_jobs_cancel(atoi(id)) != 0) {
+        printf("no such job\n");
+      }
+      continue;
+    }
+
+    if (strcmp(cmd, "wait") == 0) {
+      bg_jobs_wait();
+      continue;
+    }
+
     if (strcmp(cmd, "upload") == 0) {
       char *opt = strtok(NULL, " ");
-      int background = 0;
-      char *local = opt;
-      char *remote = NULL;
-      if (opt && strcmp(opt, "-b") == 0) {
-        background = 1;
-        local = strtok(NULL, " ");
+      int priority = 0;
+      int background = parse_background_opt(opt, &priority);
+      const char *resume_id = NULL;
+      if (!background && opt && strncmp(opt, "-resume=", 8) == 0) {
+        resume_id = opt + 8;
       }
-      remote = strtok(NULL, " ");
-      if (!local || !remote) {
-        printf("usage: upload [-b] <client path> <server path>\n");
+      int delta = !background && opt && strcmp(opt, "-delta") == 0;
+      int jobs = 0;
+      int parallel = background ? 0 : parse_jobs_opt(opt, &jobs);
+      char *local = background || resume_id || parallel || delta ? strtok(NULL, " ") : opt;
+      char *remote = strtok(NULL, " ");
+      if (background < 0 || parallel < 0 || !local || !remote || (resume_id && !resume_id[0])) {
+        printf("usage: upload [-b[=prio]|-resume=<id>|-j N|-delta] <client path> <server path>\n");
         continue;
       }
-      if (background) {
-        if (bg_start_upload(state, local, remote) != 0) {
+      if (parallel) {
+        handle_upload_parallel(state, local, remote, jobs);
+      } else if (delta) {
+        handle_upload_delta(&state->conn, local, remote, &state->cfg);
+      } else if (background) {
+        int id = bg_start_upload(state, local, remote, priority);
+        if (id < 0) {
           printf("background upload failed\n");
+        } else {
+          printf("[Background] Job %d queued\n", id);
         }
       } else {
-        handle_upload(state->fd, local, remote);
+        handle_upload(&state->conn, local, remote, resume_id, &state->cfg);
       }
       continue;
     }
 
     if (strcmp(cmd, "download") == 0) {
       char *opt = strtok(NULL, " ");
-      int background = 0;
-      char *remote = opt;
-      char *local = NULL;
-      if (opt && strcmp(opt, "-b") == 0) {
-        background = 1;
-        remote = strtok(NULL, " ");
-      }
-      local = strtok(NULL, " ");
-      if (!remote || !local) {
-        printf("usage: download [-b] <server path> <client path>\n");
+      int priority = 0;
+      int background = parse_background_opt(opt, &priority);
+      int resume = !background && opt && strcmp(opt, "-resume") == 0;
+      int jobs = 0;
+      int parallel = background ? 0 : parse_jobs_opt(opt, &jobs);
+      char *remote = background || resume || parallel ? strtok(NULL, " ") : opt;
+      char *local = strtok(NULL, " ");
+      if (background < 0 || parallel < 0 || !remote || !local) {
+        printf("usage: download [-b[=prio]|-resume|-j N] <server path> <client path>\n");
         continue;
       }
-      if (background) {
-        if (bg_start_download(state, remote, local) != 0) {
+      if (parallel) {
+        handle_download_parallel(state, remote, local, jobs);
+      } else if (background) {
+        int id = bg_start_download(state, remote, local, priority);
+        if (id < 0) {
           printf("background download failed\n");
+        } else {
+          printf("[Background] Job %d queued\n", id);
         }
       } else {
-        handle_download(state->fd, remote, local);
+        handle_download(&state->conn, remote, local, resume, &state->cfg);
       }
       continue;
     }
 
-    if (strcmp(cmd, "list") == 0) {
-      handle_list(state->fd, line);
+    if (strcmp(cmd, "list") == 0 || strcmp(cmd, "stats") == 0) {
+      handle_list(&state->conn, line);
       continue;
     }
 
-    if (strcmp(cmd, "read") == 0) {
-      handle_read(state->fd, line);
+    if (strcmp(cmd, "read") == 0 || strcmp(cmd, "pread") == 0) {
+      handle_read(&state->conn, line, state->cfg.compress);
       continue;
     }
 
@@ -503,10 +1173,38 @@ void client_loop(struct client_state *state) {
         printf("usage: write [-offset=n|-o set=n] <path>\n");
         continue;
       }
-      handle_write(state->fd, path, offset);
+      handle_write(&state->conn, path, offset, &state->cfg);
+      continue;
+    }
+
+    if (strcmp(cmd, "readv") == 0) {
+      handle_readv(&state->conn, line);
+      continue;
+    }
+
+    if (strcmp(cmd, "batch") == 0) {
+      char *file = strtok(NULL, " ");
+      if (!file) {
+        printf("usage: batch <file>\n");
+        continue;
+      }
+      handle_batch(&state->conn, file);
+      continue;
+    }
+
+    if (strcmp(cmd, "pwrite") == 0) {
+      char *h_str = strtok(NULL, " ");
+      char *off_str = strtok(NULL, " ");
+      if (!h_str || !off_str) {
+        printf("usage: pwrite <handle> <offset>\n");
+        continue;
+      }
+      char args[128];
+      snprintf(args, sizeof(args), "%s %s", h_str, off_str);
+      send_stdin_payload(&state->conn, "pwrite", args, &state->cfg);
       continue;
     }
 
-    handle_simple(state->fd, line);
+    handle_simple(&state->conn, line);
   }
 }
@@ -0,0 +1,101 @@
+#include "client/compress.h"
+
+#include "common/crc32c.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct zsend {
+  struct conn *c;
+  struct lz_encoder enc;
+  size_t used;
+  int failed;
+  unsigned char raw[LZ_BLOCK_MAX];
+  unsigned char frame[LZ_FRAME_MAX];
+};
+
+struct zsend *zsend_open(struct conn *c) {
+  struct zsend *z = calloc(1, sizeof(*z));
+  if (z) {
+    z->c = c;
+  }
+  return z;
+}
+
+static int zsend_block(struct zsend *z) {
+  size_t n = lz_encode_block(&z->enc, z->raw, z->used, z->frame);
+  z->used = 0;
+  if (!z->failed && conn_send_blob(z->c, z->frame, n) != 0) {
+    z->failed = 1;
+  }
+  return z->failed ? -1 : 0;
+}
+
+int zsend_write(struct zsend *z, const void *data, size_t len) {
+  const unsigned char *p = data;
+  while (len > 0 && !z->failed) {
+    size_t take = LZ_BLOCK_MAX - z->used < len ? LZ_BLOCK_MAX - z->used : len;
+    memcpy(z->raw + z->used, p, take);
+    z->used += take;
+    p += take;
+    len -= take;
+    if (z->used == LZ_BLOCK_MAX) {
+      zsend_block(z);
+    }
+  }
+  return z->failed ? -1 : 0;
+}
+
+int zsend_close(struct zsend *z, struct lz_stats *st) {
+  if (!z) {
+    return -1;
+  }
+  /* The pending bytes, if any, then the end block. */
+  if (z->used > 0) {
+    zsend_block(z);
+  }
+  int rc = zsend_block(z);
+  if (st) {
+    *st = z->enc.stats;
+  }
+  free(z);
+  return rc;
+}
+
+int zrecv_payload(struct conn *c, uint64_t size, FILE *out, uint32_t *crc, struct lz_stats *st) {
+  unsigned char *buf = malloc(LZ_BLOCK_MAX + LZ_BLOCK_MAX);
+  if (!buf) {
+    return -1;
+  }
+  unsigned char *body = buf + LZ_BLOCK_MAX;
+  uint64_t got = 0;
+  int rc = 0;
+  while (rc == 0) {
+    unsigned char hdr[LZ_HEADER_SIZE];
+    uint32_t raw = 0;
+    uint32_t stored = 0;
+    if (conn_recv_blob(c, hdr, sizeof(hdr)) != 0 || lz_header_unpack(hdr, &raw, &stored) != 0 ||
+        raw > size - got || conn_recv_blob(c, body, stored) != 0 ||
+        lz_decode_block(body, stored, buf, raw) != 0) {
+      rc = -1;
+      break;
+    }
+    lz_stats_add(st, raw, stored);
+    if (raw == 0) {
+      rc = got == size ? 0 : -1;
+      break;
+    }
+    if (crc) {
+      *crc = crc32c(*crc, buf, raw);
+    }
+    fwrite(buf, 1, raw, out);
+    got += raw;
+  }
+  free(buf);
+  return rc;
+}
+
+void compress_report(const struct lz_stats *st) {
+  printf("Compressed: %llu bytes as %llu (%.2fx)\n", (unsigned long long)st->raw,
+         (unsigned long long)st->wire, lz_stats_ratio(st));
+}
@@ -1,7 +1,63 @@
 #include "client/config.h"
 
+#include "client/bg_jobs.h"
+#include "client/conn_pool.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Optional trailing settings, each of the form -name=value. */
+static int parse_option(struct client_config *cfg, const char *arg) {
+  const char *eq = strchr(arg, '=');
+  if (arg[0] != '-' || !eq || eq[1] == '\0') {
+    return -1;
+  }
+  char *end = NULL;
+  long value = strtol(eq + 1, &end, 10);
+  if (*end != '\0' || value < 0) {
+    return -1;
+  }
+  size_t name_len = (size_t)(eq - arg);
+  if (name_len == strlen("-proto") && strncmp(arg, "-proto", name_len) == 0) {
+    if (value != 1 && value != 2) {
+      return -1;
+    }
+    cfg->proto = (int)value;
+    return 0;
+  }
+  if (name_len == strlen("-jobs") && strncmp(arg, "-jobs", name_len) == 0 && value > 0) {
+    cfg->max_jobs = (size_t)value;
+    return 0;
+  }
+  if (name_len == strlen("-pool") && strncmp(arg, "-pool", name_len) == 0) {
+    cfg->pool_size = (size_t)value;
+    return 0;
+  }
+  if (name_len == strlen("-crc") && strncmp(arg, "-crc", name_len) == 0 && value <= 1) {
+    cfg->crc = (int)value;
+    return 0;
+  }
+  if (name_len == strlen("-compress") && strncmp(arg, "-compress", name_len) == 0 &&
+      value <= 1) {
+    cfg->compress = (int)value;
+    return 0;
+  }
+  if (name_len == strlen("-sparse") && strncmp(arg, "-sparse", name_len) == 0 && value <= 1) {
+    cfg->sparse = (int)value;
+    return 0;
+  }
+  if (name_len == strlen("-dedup") && strncmp(arg, "-dedup", name_len) == 0 && value <= 1) {
+    cfg->dedup = (int)value;
+    return 0;
+  }
+  if (name_len == strlen("-pool-idle") && strncmp(arg, "-pool-idle", name_len) == 0 &&
+      value <= 86400) {
+    cfg->pool_idle_sec = (int)value;
+    return 0;
+  }
+  return -1;
+}
 
 int client_config_parse(struct client_config *cfg, int argc, char **argv) {
   if (!cfg) {
@@ -9,11 +65,24 @@ int client_config_parse(struct client_config *cfg, int argc, char **argv) {
   }
   snprintf(cfg->ip, sizeof(cfg->ip), "%s", "127.0.0.1");
   cfg->port = 8080;
+  cfg->proto = 1;
+  cfg->max_jobs = BG_JOBS_DEFAULT_RUNNING;
+  cfg->pool_size = CONN_POOL_DEFAULT_SIZE;
+  cfg->pool_idle_sec = CONN_POOL_DEFAULT_IDLE_SEC;
+  cfg->crc = 0;
+  cfg->dedup = 0;
+  cfg->compress = 0;
+  cfg->sparse = 1;
   if (argc >= 2) {
     snprintf(cfg->ip, sizeof(cfg->ip), "%s", argv[1]);
   }
   if (argc >= 3) {
     cfg->port = atoi(argv[2]);
   }
+  for (int i = 3; i < argc; i++) {
+    if (parse_option(cfg, argv[i]) != 0) {
+      return -1;
+    }
+  }
   return 0;
 }
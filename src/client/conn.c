@@ -0,0 +1,268 @@
+#include "client/conn.h"
+
+#include "client/net_client.h"
+#include "common/io.h"
+#include "common/mux.h"
+#include "common/protocol.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int conn_open(struct conn *c, const char *ip, int port, int proto) {
+  c->fd = connect_to_server(ip, port);
+  c->proto = 1;
+  c->data_left = 0;
+  c->mux = NULL;
+  c->stream = 0;
+  if (c->fd < 0) {
+    return -1;
+  }
+  if (proto == 2) {
+    char line[256];
+    if (send_line(c->fd, "hello v2") != 0 || recv_line(c->fd, line, sizeof(line)) <= 0) {
+      conn_close(c);
+      return -1;
+    }
+    /* A server without v2 answers ERR and stays in v1. */
+    if (strcmp(line, "OK v2") != 0) {
+      return 0;
+    }
+    int fd0 = -1;
+    c->mux = mux_create(c->fd, NULL, 0, NULL, NULL, &fd0);
+    if (!c->mux) {
+      conn_close(c);
+      return -1;
+    }
+    mux_start(c->mux);
+    c->fd = fd0;
+    c->proto = 2;
+  }
+  return 0;
+}
+
+/* Opens another stream of a multiplexed connection, e.g. for a background job. */
+int conn_open_stream(const struct conn *parent, struct conn *c) {
+  if (!parent->mux) {
+    return -1;
+  }
+  mux_retain(parent->mux);
+  c->fd = mux_open(parent->mux, &c->stream);
+  if (c->fd < 0) {
+    mux_release(parent->mux);
+    return -1;
+  }
+  c->proto = 2;
+  c->data_left = 0;
+  c->mux = parent->mux;
+  return 0;
+}
+
+void conn_close(struct conn *c) {
+  if (c->mux) {
+    mux_close(c->mux, c->stream);
+    mux_release(c->mux);
+    c->mux = NULL;
+  } else if (c->fd >= 0) {
+    close(c->fd);
+  }
+  c->fd = -1;
+}
+
+static int conn_frame(struct conn *c, struct frame_header *h, const void *payload) {
+  h->stream = c->stream;
+  int fd = mux_begin(c->mux, c->stream, FRAME_HEADER_SIZE + h->len);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = send_frame(fd, h, payload);
+  mux_end(c->mux);
+  return rc;
+}
+
+/* Reads from the stream's pipe and returns the window credit for it. */
+static int conn_read(struct conn *c, void *data, size_t len) {
+  if (read_full(c->fd, data, len) != (ssize_t)len) {
+    return -1;
+  }
+  mux_consumed(c->mux, c->stream, len);
+  return 0;
+}
+
+static int conn_read_header(struct conn *c, struct frame_header *h) {
+  unsigned char buf[FRAME_HEADER_SIZE];
+  if (conn_read(c, buf, sizeof(buf)) != 0) {
+    return -1;
+  }
+  frame_header_unpack(buf, h);
+  return 0;
+}
+
+/* Decimal without leading zeros, so it round-trips through a U64 field. */
+static int parse_canonical_u64(const char *s, uint64_t *out) {
+  size_t len = strlen(s);
+  if (len == 0 || len > 19 || (s[0] == '0' && len > 1) || strspn(s, "0123456789") != len) {
+    return -1;
+  }
+  uint64_t v = 0;
+  for (size_t i = 0; i < len; i++) {
+    v = v * 10 + (uint64_t)(s[i] - '0');
+  }
+  *out = v;
+  return 0;
+}
+
+/*
+ * Encodes a command line as a request frame: the first word picks the
+ * opcode (OP_NONE if unknown, which the server rejects), numeric words become
+ * U64 fields and the rest STR fields. A "#<n>" prefix becomes the frame tag.
+ */
+static int send_command_frame(struct conn *c, const char *line) {
+  char copy[4096];
+  if (snprintf(copy, sizeof(copy), "%s", line) >= (int)sizeof(copy)) {
+    return -1;
+  }
+  struct frame_header h = {0};
+  char *save = NULL;
+  char *tok = strtok_r(copy, " ", &save);
+  if (tok && tok[0] == '#') {
+    uint64_t tag = 0;
+    if (parse_canonical_u64(tok + 1, &tag) != 0 || tag == 0 || tag > UINT32_MAX) {
+      errno = EINVAL;
+      return -1;
+    }
+    h.tag = (uint32_t)tag;
+    tok = strtok_r(NULL, " ", &save);
+  }
+  if (!tok) {
+    errno = EINVAL;
+    return -1;
+  }
+  h.opcode = (uint16_t)frame_opcode(tok);
+  unsigned char payload[4096 + 512];
+  size_t pos = 0;
+  while ((tok = strtok_r(NULL, " ", &save)) != NULL) {
+    uint64_t v = 0;
+    pos = parse_canonical_u64(tok, &v) == 0
+              ? field_put_u64(payload, sizeof(payload), pos, v)
+              : field_put_str(payload, sizeof(payload), pos, tok, strlen(tok));
+    if (pos == 0) {
+      return -1;
+    }
+  }
+  h.len = (uint32_t)pos;
+  return conn_frame(c, &h, payload);
+}
+
+int conn_send_line(struct conn *c, const char *line) {
+  return c->proto == 2 ? send_command_frame(c, line) : send_line(c->fd, line);
+}
+
+int conn_sendf_line(struct conn *c, const char *fmt, ...) {
+  char buf[4096];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= sizeof(buf)) {
+    return -1;
+  }
+  return conn_send_line(c, buf);
+}
+
+static int copy_text(const struct field *f, char *buf, size_t cap, size_t off) {
+  size_t n = f->len < cap - off - 1 ? f->len : cap - off - 1;
+  memcpy(buf + off, f->str, n);
+  buf[off + n] = '\0';
+  return (int)(off + n);
+}
+
+/* Renders the next non-DATA frame as a text line; same contract as recv_line. */
+static int recv_frame_line(struct conn *c, char *buf, size_t cap) {
+  struct frame_header h;
+  unsigned char payload[8192];
+  if (conn_read_header(c, &h) != 0) {
+    return 0;
+  }
+  if (h.opcode == OP_DATA || h.len > sizeof(payload) || conn_read(c, payload, h.len) != 0) {
+    return -1;
+  }
+  size_t pos = 0;
+  struct field f;
+  switch (h.opcode) {
+  case OP_END:
+    return snprintf(buf, cap, "END") >= (int)cap ? -1 : 3;
+  case OP_REPLY: {
+    struct field status;
+    if (field_next(payload, h.len, &pos, &status) != 1 || status.type != FIELD_U64 ||
+        field_next(payload, h.len, &pos, &f) != 1 || f.type != FIELD_STR) {
+      return -1;
+    }
+    int off = h.tag ? snprintf(buf, cap, "#%u ", (unsigned)h.tag) : 0;
+    if (off < 0 || (size_t)off >= cap) {
+      return -1;
+    }
+    return copy_text(&f, buf, cap, (size_t)off);
+  }
+  case OP_ITEM:
+  case OP_NOTICE:
+    if (field_next(payload, h.len, &pos, &f) != 1 || f.type != FIELD_STR) {
+      return -1;
+    }
+    return copy_text(&f, buf, cap, 0);
+  default:
+    return -1;
+  }
+}
+
+int conn_recv_line(struct conn *c, char *buf, size_t cap) {
+  if (!buf || cap == 0) {
+    return -1;
+  }
+  return c->proto == 2 ? recv_frame_line(c, buf, cap) : recv_line(c->fd, buf, cap);
+}
+
+int conn_send_blob(struct conn *c, const void *data, size_t len) {
+  if (c->proto == 1) {
+    return send_blob(c->fd, data, len);
+  }
+  const char *p = (const char *)data;
+  while (len > 0) {
+    size_t chunk = len < FRAME_MAX_PAYLOAD ? len : FRAME_MAX_PAYLOAD;
+    struct frame_header h = {.len = (uint32_t)chunk, .opcode = OP_DATA};
+    if (conn_frame(c, &h, p) != 0) {
+      return -1;
+    }
+    p += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+int conn_recv_blob(struct conn *c, void *data, size_t len) {
+  if (c->proto == 1) {
+    return recv_blob(c->fd, data, len);
+  }
+  char *p = (char *)data;
+  while (len > 0) {
+    if (c->data_left == 0) {
+      struct frame_header h;
+      if (conn_read_header(c, &h) != 0 || h.opcode != OP_DATA) {
+        return -1;
+      }
+      c->data_left = h.len;
+      continue;
+    }
+    size_t take = len < c->data_left ? len : c->data_left;
+    if (conn_read(c, p, take) != 0) {
+      return -1;
+    }
+    p += take;
+    len -= take;
+    c->data_left -= take;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include "client/conn_pool.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct pooled_conn {
+  struct conn conn;
+  char user[64];
+  time_t since;
+};
+
+static struct {
+  pthread_mutex_t mu;
+  struct pooled_conn *slots;
+  size_t size;
+  size_t count;
+  int idle_sec;
+} g_pool = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static time_t now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+void conn_pool_init(size_t size, int idle_sec) {
+  g_pool.slots = size > 0 ? calloc(size, sizeof(*g_pool.slots)) : NULL;
+  g_pool.size = g_pool.slots ? size : 0;
+  g_pool.count = 0;
+  g_pool.idle_sec = idle_sec;
+}
+
+/* An idle connection has nothing to read; anything there, EOF included, means it is unusable. */
+static int conn_is_idle(const struct conn *c) {
+  struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+  return poll(&pfd, 1, 0) == 0;
+}
+
+static void remove_locked(size_t i, struct conn *out) {
+  *out = g_pool.slots[i].conn;
+  g_pool.slots[i] = g_pool.slots[--g_pool.count];
+}
+
+/* Hands out a usable connection of user, dropping stale ones on the way. */
+int conn_pool_get(const char *user, struct conn *c) {
+  time_t now = now_sec();
+  int found = 0;
+  pthread_mutex_lock(&g_pool.mu);
+  for (size_t i = g_pool.count; i-- > 0 && !found;) {
+    struct pooled_conn *p = &g_pool.slots[i];
+    if (now - p->since >= g_pool.idle_sec || !conn_is_idle(&p->conn)) {
+      struct conn stale;
+      remove_locked(i, &stale);
+      conn_close(&stale);
+    } else if (strcmp(p->user, user) == 0) {
+      remove_locked(i, c);
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&g_pool.mu);
+  return found ? 0 : -1;
+}
+
+/* Keeps c for reuse if there is room, otherwise closes it. */
+void conn_pool_put(const char *user, struct conn *c) {
+  int kept = 0;
+  pthread_mutex_lock(&g_pool.mu);
+  if (!c->mux && g_pool.count < g_pool.size && strlen(user) < sizeof(g_pool.slots->user)) {
+    struct pooled_conn *p = &g_pool.slots[g_pool.count++];
+    p->conn = *c;
+    snprintf(p->user, sizeof(p->user), "%s", user);
+    p->since = now_sec();
+    kept = 1;
+  }
+  pthread_mutex_unlock(&g_pool.mu);
+  if (!kept) {
+    conn_close(c);
+  }
+}
+
+void conn_pool_clear(void) {
+  pthread_mutex_lock(&g_pool.mu);
+  while (g_pool.count > 0) {
+    struct conn c;
+    remove_locked(g_pool.count - 1, &c);
+    conn_close(&c);
+  }
+  pthread_mutex_unlock(&g_pool.mu);
+}
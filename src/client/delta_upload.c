@@ -0,0 +1,247 @@
+#include "client/delta_upload.h"
+
+#include "common/crc32c.h"
+#include "common/delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define SIG_BATCH 4096
+#define OUT_BUF (2 * DELTA_LITERAL_MAX)
+
+/* The server's blocks, chained by weak checksum. */
+struct sig_table {
+  uint32_t *weak;
+  uint64_t *strong;
+  int32_t *next;
+  int32_t *head;
+  uint32_t mask;
+  uint32_t count;
+};
+
+/* Instructions are gathered and sent in large pieces rather than one by one. */
+struct emitter {
+  struct conn *c;
+  unsigned char out[OUT_BUF];
+  size_t used;
+  uint32_t copy_index;
+  uint32_t copy_count;
+  uint64_t literal;
+  int failed;
+};
+
+static int recv_reply(struct conn *c, char *resp, size_t cap) {
+  int n;
+  while ((n = conn_recv_line(c, resp, cap)) > 0 && strncmp(resp, "NOTICE ", 7) == 0) {
+  }
+  return n > 0 ? 0 : -1;
+}
+
+static uint32_t bucket(const struct sig_table *t, uint32_t weak) {
+  return (weak * 2654435761u) & t->mask;
+}
+
+static void sig_table_free(struct sig_table *t) {
+  free(t->weak);
+  free(t->strong);
+  free(t->next);
+  free(t->head);
+}
+
+/* Reads count entries; only whole blocks go into the chains. */
+static int sig_table_load(struct conn *c, struct sig_table *t, uint32_t count, int last_short) {
+  uint32_t buckets = 1;
+  while (buckets < 2 * count) {
+    buckets <<= 1;
+  }
+  *t = (struct sig_table){.mask = buckets - 1, .count = count};
+  t->weak = malloc(((size_t)count + 1) * sizeof(*t->weak));
+  t->strong = malloc(((size_t)count + 1) * sizeof(*t->strong));
+  t->next = malloc(((size_t)count + 1) * sizeof(*t->next));
+  t->head = malloc((size_t)buckets * sizeof(*t->head));
+  unsigned char *batch = malloc((size_t)SIG_BATCH * DELTA_SIG_SIZE);
+  int rc = t->weak && t->strong && t->next && t->head && batch ? 0 : -1;
+  if (rc == 0) {
+    memset(t->head, 0xff, (size_t)buckets * sizeof(*t->head));
+  }
+  for (uint32_t i = 0; rc == 0 && i < count; i += SIG_BATCH) {
+    uint32_t n = count - i < SIG_BATCH ? count - i : SIG_BATCH;
+    rc = conn_recv_blob(c, batch, (size_t)n * DELTA_SIG_SIZE);
+    for (uint32_t k = 0; rc == 0 && k < n; k++) {
+      delta_sig_unpack(batch + (size_t)k * DELTA_SIG_SIZE, &t->weak[i + k], &t->strong[i + k]);
+    }
+  }
+  for (uint32_t i = count; rc == 0 && i-- > 0;) {
+    if (last_short && i == count - 1) {
+      continue;
+    }
+    uint32_t b = bucket(t, t->weak[i]);
+    t->next[i] = t->head[b];
+    t->head[b] = (int32_t)i;
+  }
+  free(batch);
+  return rc;
+}
+
+/* A block with this content, preferring want so that copies run on. */
+static int64_t sig_find(const struct sig_table *t, uint32_t weak, const unsigned char *data,
+                        size_t len, uint32_t want) {
+  uint64_t strong = 0;
+  int have_strong = 0;
+  int64_t found = -1;
+  for (int32_t i = t->head[bucket(t, weak)]; i >= 0; i = t->next[i]) {
+    if (t->weak[i] != weak) {
+      continue;
+    }
+    if (!have_strong) {
+      strong = delta_strong(data, len);
+      have_strong = 1;
+    }
+    if (t->strong[i] == strong && (found < 0 || (uint32_t)i == want)) {
+      found = i;
+    }
+  }
+  return found;
+}
+
+static void emit_flush(struct emitter *e) {
+  if (e->used > 0 && !e->failed && conn_send_blob(e->c, e->out, e->used) != 0) {
+    e->failed = 1;
+  }
+  e->used = 0;
+}
+
+static void emit_bytes(struct emitter *e, const void *data, size_t len) {
+  if (e->used + len > sizeof(e->out)) {
+    emit_flush(e);
+  }
+  memcpy(e->out + e->used, data, len);
+  e->used += len;
+}
+
+static void emit_pending_copy(struct emitter *e) {
+  if (e->copy_count > 0) {
+    unsigned char op[DELTA_COPY_SIZE];
+    delta_copy_pack(e->copy_index, e->copy_count, op);
+    emit_bytes(e, op, sizeof(op));
+    e->copy_count = 0;
+  }
+}
+
+static void emit_copy(struct emitter *e, uint32_t index) {
+  if (e->copy_count > 0 && e->copy_index + e->copy_count == index) {
+    e->copy_count++;
+    return;
+  }
+  emit_pending_copy(e);
+  e->copy_index = index;
+  e->copy_count = 1;
+}
+
+static void emit_literal(struct emitter *e, const unsigned char *data, size_t len) {
+  emit_pending_copy(e);
+  e->literal += len;
+  while (len > 0) {
+    size_t n = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+    unsigned char hdr[DELTA_LITERAL_HEADER_SIZE];
+    delta_literal_pack((uint32_t)n, hdr);
+    emit_bytes(e, hdr, sizeof(hdr));
+    emit_bytes(e, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+/* rsync's scan: a window rolls over the file a byte at a time between matches. */
+static void emit_delta(struct emitter *e, const struct sig_table *t, const unsigned char *map,
+                       uint64_t size, uint32_t block, uint64_t base_size) {
+  uint64_t pos = 0;
+  uint64_t lit_start = 0;
+  uint32_t weak = size >= block ? delta_weak(map, block) : 0;
+  while (pos + block <= size && !e->failed) {
+    int64_t match = sig_find(t, weak, map + pos, block, e->copy_index + e->copy_count);
+    if (match >= 0) {
+      emit_literal(e, map + lit_start, (size_t)(pos - lit_start));
+      emit_copy(e, (uint32_t)match);
+      pos += block;
+      lit_start = pos;
+      if (pos + block <= size) {
+        weak = delta_weak(map + pos, block);
+      }
+    } else {
+      if (pos + block < size) {
+        weak = delta_roll(weak, map[pos], map[pos + block], block);
+      }
+      pos++;
+    }
+  }
+  /* The server's short last block can only match the end of the file. */
+  size_t tail = (size_t)(base_size % block);
+  if (tail > 0 && size - pos == tail && t->weak[t->count - 1] == delta_weak(map + pos, tail) &&
+      t->strong[t->count - 1] == delta_strong(map + pos, tail)) {
+    emit_literal(e, map + lit_start, (size_t)(pos - lit_start));
+    emit_copy(e, t->count - 1);
+    lit_start = size;
+  }
+  emit_literal(e, map + lit_start, (size_t)(size - lit_start));
+  emit_pending_copy(e);
+  unsigned char end = DELTA_OP_END;
+  emit_bytes(e, &end, 1);
+  emit_flush(e);
+}
+
+int delta_upload(struct conn *c, int fd, uint64_t size, const char *remote, uint64_t *literal,
+                 char *resp, size_t cap) {
+  *literal = 0;
+  unsigned long long base_size = 0;
+  unsigned long long count = 0;
+  unsigned block = 0;
+  if (conn_sendf_line(c, "signature %s", remote) != 0 || recv_reply(c, resp, cap) != 0) {
+    return -1;
+  }
+  if (strncmp(resp, "OK", 2) != 0) {
+    return 1;
+  }
+  /* Anything else leaves the entries that follow unaccounted for. */
+  if (sscanf(resp, "OK %llu %u %llu", &base_size, &block, &count) != 3 ||
+      block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX || count > DELTA_MAX_BLOCKS ||
+      count != (base_size + block - 1) / block) {
+    return -1;
+  }
+  struct sig_table t;
+  if (sig_table_load(c, &t, (uint32_t)count, base_size % block != 0) != 0) {
+    sig_table_free(&t);
+    return -1;
+  }
+  unsigned char *map = NULL;
+  if (size > 0) {
+    map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      sig_table_free(&t);
+      snprintf(resp, cap, "cannot map local file");
+      return 1;
+    }
+    posix_madvise(map, (size_t)size, POSIX_MADV_SEQUENTIAL);
+  }
+  uint32_t crc = size > 0 ? crc32c(0, map, (size_t)size) : 0;
+  struct emitter *e = malloc(sizeof(*e));
+  int rc = e ? 0 : -1;
+  if (rc == 0 && conn_sendf_line(c, "delta %s %u %llu %08x", remote, block,
+                                 (unsigned long long)size, (unsigned)crc) != 0) {
+    rc = -1;
+  }
+  if (rc == 0) {
+    *e = (struct emitter){.c = c};
+    emit_delta(e, &t, map, size, block, base_size);
+    *literal = e->literal;
+    rc = e->failed || recv_reply(c, resp, cap) != 0 ? -1 : 0;
+  }
+  free(e);
+  if (map) {
+    munmap(map, (size_t)size);
+  }
+  sig_table_free(&t);
+  return rc;
+}
@@ -1,34 +1,46 @@
 #include "client/cli.h"
 #include "client/config.h"
-#include "client/net_client.h"
 #include "client/bg_jobs.h"
+#include "client/conn_pool.h"
 #include "common/log.h"
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 int main(int argc, char **argv) {
   struct client_state state;
-  state.fd = -1;
+  state.conn.fd = -1;
+  state.conn.mux = NULL;
   state.logged_in = 0;
   state.user[0] = '\0';
+  state.token[0] = '\0';
 
   if (client_config_parse(&state.cfg, argc, argv) != 0) {
-    fprintf(stderr, "Usage: %s <ip> <port>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <ip> <port> [-proto=1|2] [-jobs=<n>] [-pool=<conns>]"
+            " [-pool-idle=<sec>] [-crc=0|1] [-dedup=0|1] [-compress=0|1]"
+            " [-sparse=0|1]\n",
+            argv[0]);
     return 1;
   }
 
-  state.fd = connect_to_server(state.cfg.ip, state.cfg.port);
-  if (state.fd < 0) {
+  if (conn_open(&state.conn, state.cfg.ip, state.cfg.port, state.cfg.proto) != 0) {
     perror("connect");
     return 1;
   }
 
-  bg_jobs_init();
+  /* A peer that goes away shows up as a failed write, not a signal. */
+  signal(SIGPIPE, SIG_IGN);
+  bg_jobs_init(state.cfg.max_jobs);
+  conn_pool_init(state.cfg.pool_size, state.cfg.pool_idle_sec);
   log_info("Connected to %s:%d", state.cfg.ip, state.cfg.port);
   client_loop(&state);
 
-  close(state.fd);
+  /* Jobs use the connection's streams and the pool, so they end first. */
+  bg_jobs_cancel_all();
+  bg_jobs_wait();
+  conn_pool_clear();
+  conn_close(&state.conn);
   return 0;
 }
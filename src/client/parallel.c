@@ -0,0 +1,192 @@
+#include "client/parallel.h"
+
+#include "client/bg_jobs.h"
+#include "client/conn.h"
+#include "common/crc32c.h"
+#include "common/protocol.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PARALLEL_BUF (64u << 10)
+
+struct range_job {
+  const struct client_state *state;
+  int fd;
+  const char *name; /* upload id or remote path */
+  int is_put;
+  uint64_t offset;
+  uint64_t len;
+  char reply[256];
+  int rc;
+};
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buf + done, len - done, offset + (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static int put_range(struct range_job *job, struct conn *c) {
+  int crc = job->state->cfg.crc;
+  if (conn_sendf_line(c, "upload_range%s %s %llu %llu", crc ? " " CRC_FLAG_ARG : "", job->name,
+                      (unsigned long long)job->offset, (unsigned long long)job->len) != 0) {
+    return -1;
+  }
+  char buf[PARALLEL_BUF];
+  uint32_t sum = 0;
+  for (uint64_t done = 0; done < job->len;) {
+    size_t n = job->len - done < sizeof(buf) ? (size_t)(job->len - done) : sizeof(buf);
+    if (pread_full(job->fd, buf, n, (off_t)(job->offset + done)) != 0) {
+      return -1;
+    }
+    if (crc) {
+      sum = crc32c(sum, buf, n);
+    }
+    if (conn_send_blob(c, buf, n) != 0) {
+      return -1;
+    }
+    done += n;
+  }
+  if (crc) {
+    unsigned char trailer[CRC_TRAILER_SIZE];
+    crc_trailer_pack(sum, trailer);
+    if (conn_send_blob(c, trailer, sizeof(trailer)) != 0) {
+      return -1;
+    }
+  }
+  if (conn_recv_line(c, job->reply, sizeof(job->reply)) <= 0) {
+    return -1;
+  }
+  return strncmp(job->reply, "OK", 2) == 0 ? 0 : 1;
+}
+
+static int get_range(struct range_job *job, struct conn *c) {
+  if (conn_sendf_line(c, "read -offset=%llu %s %llu", (unsigned long long)job->offset,
+                      job->name, (unsigned long long)job->len) != 0 ||
+      conn_recv_line(c, job->reply, sizeof(job->reply)) <= 0) {
+    return -1;
+  }
+  unsigned long long count = 0;
+  if (sscanf(job->reply, "OK %llu", &count) != 1) {
+    return 1;
+  }
+  char buf[PARALLEL_BUF];
+  for (uint64_t done = 0; done < count;) {
+    size_t n = count - done < sizeof(buf) ? (size_t)(count - done) : sizeof(buf);
+    if (conn_recv_blob(c, buf, n) != 0 ||
+        pwrite_full(job->fd, buf, n, (off_t)(job->offset + done)) != 0) {
+      return -1;
+    }
+    done += n;
+  }
+  if (count != job->len) {
+    /* The file shrank since its size was taken. */
+    snprintf(job->reply, sizeof(job->reply), "short read (%llu bytes)", count);
+    return 1;
+  }
+  return 0;
+}
+
+static void *range_main(void *arg) {
+  struct range_job *job = arg;
+  struct conn c;
+  if (bg_conn_get(job->state, &c) != 0) {
+    snprintf(job->reply, sizeof(job->reply), "no connection");
+    job->rc = -1;
+    return NULL;
+  }
+  job->rc = job->is_put ? put_range(job, &c) : get_range(job, &c);
+  if (job->rc < 0) {
+    snprintf(job->reply, sizeof(job->reply), "connection lost");
+  }
+  /* A range that ended in ERR still left the connection between commands. */
+  bg_conn_put(job->state, &c, job->rc >= 0);
+  return NULL;
+}
+
+static int run_ranges(const struct client_state *state, int fd, const char *name, int is_put,
+                      uint64_t size, int n) {
+  if (n < 1) {
+    n = 1;
+  }
+  if (n > PARALLEL_MAX_JOBS) {
+    n = PARALLEL_MAX_JOBS;
+  }
+  uint64_t max_ranges = (size + PARALLEL_MIN_RANGE - 1) / PARALLEL_MIN_RANGE;
+  if ((uint64_t)n > max_ranges) {
+    n = max_ranges > 0 ? (int)max_ranges : 1;
+  }
+  struct range_job jobs[PARALLEL_MAX_JOBS];
+  pthread_t threads[PARALLEL_MAX_JOBS];
+  int started[PARALLEL_MAX_JOBS] = {0};
+  for (int i = 0; i < n; i++) {
+    uint64_t start = size * (uint64_t)i / (uint64_t)n;
+    uint64_t end = size * (uint64_t)(i + 1) / (uint64_t)n;
+    jobs[i] = (struct range_job){.state = state,
+                                 .fd = fd,
+                                 .name = name,
+                                 .is_put = is_put,
+                                 .offset = start,
+                                 .len = end - start};
+    if (jobs[i].len == 0) {
+      continue;
+    }
+    if (pthread_create(&threads[i], NULL, range_main, &jobs[i]) == 0) {
+      started[i] = 1;
+    } else {
+      /* No thread to spare: move the range from here instead. */
+      range_main(&jobs[i]);
+    }
+  }
+  int rc = 0;
+  for (int i = 0; i < n; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (jobs[i].rc != 0) {
+      fprintf(stderr, "%s: range %llu+%llu failed: %s\n", is_put ? "upload" : "download",
+              (unsigned long long)jobs[i].offset, (unsigned long long)jobs[i].len,
+              jobs[i].reply);
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+int parallel_put(const struct client_state *state, int fd, const char *id, uint64_t size,
+                 int n) {
+  return run_ranges(state, fd, id, 1, size, n);
+}
+
+int parallel_get(const struct client_state *state, const char *remote, int fd, uint64_t size,
+                 int n) {
+  return run_ranges(state, fd, remote, 0, size, n);
+}
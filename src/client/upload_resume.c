@@ -0,0 +1,102 @@
+#include "client/upload_resume.h"
+
+#include "common/crc32c.h"
+#include "common/sha256.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+
+int upload_status_parse(const char *line, struct upload_status *st) {
+  return sscanf(line, "OK %" SCNu64 " %" SCNu64 " %" SCNx32, &st->committed, &st->size,
+                &st->crc) == 3
+             ? 0
+             : -1;
+}
+
+int file_crc32c(FILE *in, uint64_t len, uint32_t *out) {
+  if (fseeko(in, 0, SEEK_SET) != 0) {
+    return -1;
+  }
+  unsigned char buf[65536];
+  uint32_t crc = 0;
+  uint64_t left = len;
+  while (left > 0) {
+    size_t want = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+    size_t n = fread(buf, 1, want, in);
+    if (n == 0) {
+      return -1;
+    }
+    crc = crc32c(crc, buf, n);
+    left -= n;
+  }
+  *out = crc;
+  return 0;
+}
+
+int upload_prefix_matches(FILE *in, const struct upload_status *st) {
+  uint32_t crc = 0;
+  if (file_crc32c(in, st->committed, &crc) != 0) {
+    return -1;
+  }
+  return crc == st->crc ? 0 : -1;
+}
+
+int download_verify(struct conn *c, const char *remote_path, uint32_t crc, char *msg,
+                    size_t cap) {
+  char line[256];
+  if (conn_sendf_line(c, "checksum %s", remote_path) != 0) {
+    return -1;
+  }
+  int n;
+  while ((n = conn_recv_line(c, line, sizeof(line))) > 0 && strncmp(line, "NOTICE ", 7) == 0) {
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  unsigned server_crc = 0;
+  if (sscanf(line, "OK %x", &server_crc) != 1) {
+    snprintf(msg, cap, "%s", line);
+    return 1;
+  }
+  if (server_crc != crc) {
+    snprintf(msg, cap, "checksum mismatch: local %08x, server %08x", (unsigned)crc, server_crc);
+    return 1;
+  }
+  return 0;
+}
+
+int upload_by_hash(struct conn *c, FILE *in, uint64_t size, const char *remote_path, char *resp,
+                   size_t cap) {
+  if (fseeko(in, 0, SEEK_SET) != 0) {
+    return 1;
+  }
+  struct sha256 s;
+  sha256_init(&s);
+  unsigned char buf[65536];
+  uint64_t left = size;
+  while (left > 0) {
+    size_t n = fread(buf, 1, left < sizeof(buf) ? (size_t)left : sizeof(buf), in);
+    if (n == 0) {
+      return 1;
+    }
+    sha256_update(&s, buf, n);
+    left -= n;
+  }
+  unsigned char digest[SHA256_SIZE];
+  char hex[SHA256_HEX_LEN + 1];
+  sha256_final(&s, digest);
+  sha256_hex(digest, hex);
+  if (fseeko(in, 0, SEEK_SET) != 0 ||
+      conn_sendf_line(c, "upload_hash %s %llu %s", remote_path, (unsigned long long)size, hex) !=
+          0) {
+    return -1;
+  }
+  int n;
+  while ((n = conn_recv_line(c, resp, cap)) > 0 && strncmp(resp, "NOTICE ", 7) == 0) {
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  return strncmp(resp, "OK", 2) == 0 ? 0 : 1;
+}
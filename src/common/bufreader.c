@@ -0,0 +1,128 @@
+#include "common/bufreader.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+void bufreader_init(struct bufreader *r, int fd) {
+  r->fd = fd;
+  r->start = 0;
+  r->end = 0;
+}
+
+/* Queues bytes read from the fd elsewhere, ahead of anything read later. */
+int bufreader_preload(struct bufreader *r, const void *data, size_t len) {
+  if (len > sizeof(r->data) - r->end) {
+    return -1;
+  }
+  memcpy(r->data + r->end, data, len);
+  r->end += len;
+  return 0;
+}
+
+size_t bufreader_buffered(const struct bufreader *r) {
+  return r->end - r->start;
+}
+
+int bufreader_has_line(const struct bufreader *r) {
+  return memchr(r->data + r->start, '\n', r->end - r->start) != NULL;
+}
+
+/* Points at the next len buffered bytes without consuming them, or NULL. */
+const void *bufreader_peek(const struct bufreader *r, size_t len) {
+  return r->end - r->start >= len ? r->data + r->start : NULL;
+}
+
+/* Returns bytes added, 0 on EOF, -1 on error. */
+static ssize_t fill(struct bufreader *r) {
+  if (r->start > 0) {
+    memmove(r->data, r->data + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->end == sizeof(r->data)) {
+    return -1;
+  }
+  while (1) {
+    ssize_t n = read(r->fd, r->data + r->end, sizeof(r->data) - r->end);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n > 0) {
+      r->end += (size_t)n;
+    }
+    return n;
+  }
+}
+
+/*
+ * Same contract as read_line: returns the line length without the newline
+ * (0 on EOF), and a line longer than cap - 1 is split across calls.
+ */
+ssize_t bufreader_read_line(struct bufreader *r, char *out, size_t cap) {
+  if (!out || cap == 0) {
+    return -1;
+  }
+  size_t off = 0;
+  while (1) {
+    size_t avail = r->end - r->start;
+    char *nl = memchr(r->data + r->start, '\n', avail);
+    size_t take = nl ? (size_t)(nl - (r->data + r->start)) : avail;
+    if (take > cap - 1 - off) {
+      take = cap - 1 - off;
+      nl = NULL;
+    }
+    memcpy(out + off, r->data + r->start, take);
+    off += take;
+    r->start += take;
+    if (nl) {
+      r->start++;
+      break;
+    }
+    if (off == cap - 1) {
+      break;
+    }
+    ssize_t n = fill(r);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+  out[off] = '\0';
+  return (ssize_t)off;
+}
+
+/* Reads exactly len bytes; a short stream is an error. */
+int bufreader_read(struct bufreader *r, void *out, size_t len) {
+  char *p = (char *)out;
+  while (len > 0) {
+    size_t avail = r->end - r->start;
+    if (avail == 0) {
+      if (len >= sizeof(r->data)) {
+        ssize_t n = read(r->fd, p, len);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        continue;
+      }
+      ssize_t n = fill(r);
+      if (n <= 0) {
+        return -1;
+      }
+      continue;
+    }
+    size_t take = avail < len ? avail : len;
+    memcpy(p, r->data + r->start, take);
+    p += take;
+    r->start += take;
+    len -= take;
+  }
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include "common/crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HW_X86 1
+#elif defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#define CRC32C_HW_ARM 1
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+/* Slicing-by-8: g_table[k][b] is the CRC of byte b followed by k zero bytes. */
+static uint32_t g_table[8][256];
+/* g_x2n[k] is x^(2^k) modulo the polynomial, bit-reflected like the CRC. */
+static uint32_t g_x2n[32];
+static crc32c_fn g_impl;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+static uint64_t load_le64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len >= 8) {
+    uint64_t v = load_le64(p) ^ crc;
+    crc = g_table[7][v & 0xff] ^ g_table[6][(v >> 8) & 0xff] ^ g_table[5][(v >> 16) & 0xff] ^
+          g_table[4][(v >> 24) & 0xff] ^ g_table[3][(v >> 32) & 0xff] ^
+          g_table[2][(v >> 40) & 0xff] ^ g_table[1][(v >> 48) & 0xff] ^ g_table[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = g_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef CRC32C_HW_X86
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p,
+                                                            size_t len) {
+  uint64_t c = crc;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = __builtin_ia32_crc32di(c, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+  }
+  return (uint32_t)c;
+}
+
+static int have_hw(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef CRC32C_HW_ARM
+__attribute__((target("+crc"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p,
+                                                          size_t len) {
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = __builtin_aarch64_crc32cx(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = __builtin_aarch64_crc32cb(crc, *p++);
+  }
+  return crc;
+}
+
+static int have_hw(void) {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+/* a * b modulo the polynomial, both bit-reflected (x^0 is the top bit). */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ 0x82f63b78u : b >> 1;
+  }
+  return p;
+}
+
+/* The CPU's CRC32C instruction where there is one (SSE4.2, ARMv8 CRC), else tables. */
+static void init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+    }
+    g_table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      g_table[k][i] = g_table[0][g_table[k - 1][i] & 0xff] ^ (g_table[k - 1][i] >> 8);
+    }
+  }
+  uint32_t p = 1u << 30;
+  for (int k = 0; k < 32; k++) {
+    g_x2n[k] = p;
+    p = multmodp(p, p);
+  }
+  g_impl = crc32c_sw;
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM)
+  if (have_hw()) {
+    g_impl = crc32c_hw;
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&g_init_once, init);
+  return ~g_impl(~crc, (const unsigned char *)data, len);
+}
+
+/*
+ * A zero byte through the register multiplies it by x^8, so len of them
+ * multiply it by x^(8 len), put together from the powers x^(2^k).
+ */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+  pthread_once(&g_init_once, init);
+  uint32_t reg = ~crc;
+  for (int k = 3; len > 0; k++, len >>= 1) {
+    if (len & 1) {
+      reg = multmodp(g_x2n[k & 31], reg);
+    }
+  }
+  return ~reg;
+}
+
+int crc32c_hardware(void) {
+  pthread_once(&g_init_once, init);
+  return g_impl != crc32c_sw;
+}
@@ -0,0 +1,113 @@
+#include "common/delta.h"
+
+uint32_t delta_block_size(uint64_t size) {
+  uint64_t root = 1;
+  while (root * root < size) {
+    root <<= 1;
+  }
+  if (root < DELTA_BLOCK_MIN) {
+    root = DELTA_BLOCK_MIN;
+  }
+  if (root > DELTA_BLOCK_MAX) {
+    root = DELTA_BLOCK_MAX;
+  }
+  /* Very large files get larger blocks rather than more of them. */
+  while (root < UINT32_MAX / 2 && (size + root - 1) / root > DELTA_MAX_BLOCKS) {
+    root <<= 1;
+  }
+  return (uint32_t)root;
+}
+
+/* rsync's checksum: s1 the byte sum, s2 the sum of the running s1, both mod 2^16. */
+uint32_t delta_weak(const unsigned char *data, size_t len) {
+  uint32_t s1 = 0;
+  uint32_t s2 = 0;
+  for (size_t i = 0; i < len; i++) {
+    s1 += data[i];
+    s2 += s1;
+  }
+  return (s1 & 0xffff) | (s2 << 16);
+}
+
+uint32_t delta_roll(uint32_t weak, unsigned char out, unsigned char in, size_t len) {
+  uint32_t s1 = weak & 0xffff;
+  uint32_t s2 = weak >> 16;
+  s1 = (s1 - out + in) & 0xffff;
+  s2 = (s2 - (uint32_t)len * out + s1) & 0xffff;
+  return s1 | (s2 << 16);
+}
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t load_le64(const unsigned char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = n; i > 0; i--) {
+    v = (v << 8) | p[i - 1];
+  }
+  return v;
+}
+
+/*
+ * Only has to tell apart blocks whose weak checksums collide; the CRC-32C of
+ * the whole file catches anything that gets past both.
+ */
+uint64_t delta_strong(const unsigned char *data, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+  while (len >= 8) {
+    h ^= mix64(load_le64(data, 8));
+    h = ((h << 27) | (h >> 37)) * 0x100000001b3ULL + 0x52dce729ULL;
+    data += 8;
+    len -= 8;
+  }
+  if (len > 0) {
+    h ^= mix64(load_le64(data, len) ^ ((uint64_t)len << 56));
+  }
+  return mix64(h);
+}
+
+static void put_be(unsigned char *p, uint64_t v, size_t n) {
+  for (size_t i = n; i > 0; i--) {
+    p[i - 1] = (unsigned char)v;
+    v >>= 8;
+  }
+}
+
+static uint64_t get_be(const unsigned char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+void delta_sig_pack(uint32_t weak, uint64_t strong, unsigned char out[DELTA_SIG_SIZE]) {
+  put_be(out, weak, 4);
+  put_be(out + 4, strong, 8);
+}
+
+void delta_sig_unpack(const unsigned char in[DELTA_SIG_SIZE], uint32_t *weak, uint64_t *strong) {
+  *weak = (uint32_t)get_be(in, 4);
+  *strong = get_be(in + 4, 8);
+}
+
+void delta_copy_pack(uint32_t index, uint32_t count, unsigned char out[DELTA_COPY_SIZE]) {
+  out[0] = DELTA_OP_COPY;
+  put_be(out + 1, index, 4);
+  put_be(out + 5, count, 4);
+}
+
+void delta_literal_pack(uint32_t len, unsigned char out[DELTA_LITERAL_HEADER_SIZE]) {
+  out[0] = DELTA_OP_LITERAL;
+  put_be(out + 1, len, 4);
+}
+
+uint32_t delta_u32(const unsigned char in[4]) {
+  return (uint32_t)get_be(in, 4);
+}
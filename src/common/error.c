@@ -25,6 +25,8 @@ const char *err_str(enum err_code code) {
       return "UNSUPPORTED";
     case ERR_INTERNAL:
       return "INTERNAL";
+    case ERR_CHECKSUM:
+      return "CHECKSUM";
     default:
       return "UNKNOWN";
   }
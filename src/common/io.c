@@ -39,6 +39,30 @@ ssize_t write_full(int fd, const void *buf, size_t len) {
   return (ssize_t)off;
 }
 
+ssize_t writev_full(int fd, struct iovec *iov, int count) {
+  size_t total = 0;
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += (size_t)n;
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+  return (ssize_t)total;
+}
+
 ssize_t read_line(int fd, char *buf, size_t cap) {
   size_t off = 0;
   while (off + 1 < cap) {
@@ -0,0 +1,239 @@
+#include "common/lz.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+/* As in LZ4: the last literals and no match starting near the end. */
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+/* A block is sent compressed only if that saves at least 1/16 of it. */
+#define MIN_GAIN_SHIFT 4
+/* After this many blocks in a row that did not shrink, skip SKIP_BLOCKS. */
+#define MISSES_BEFORE_SKIP 4
+#define SKIP_BLOCKS 16
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+/* One sequence: lit literals from lit_src, then a match unless mlen is 0. */
+static int emit(unsigned char **opp, const unsigned char *oend, const unsigned char *lit_src,
+                size_t lit, size_t offset, size_t mlen) {
+  unsigned char *op = *opp;
+  size_t need = 1 + lit / 255 + 1 + lit + (mlen ? 2 + mlen / 255 + 1 : 0);
+  if (need > (size_t)(oend - op)) {
+    return -1;
+  }
+  unsigned char *token = op++;
+  *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+  if (lit >= 15) {
+    op = put_length(op, lit - 15);
+  }
+  memcpy(op, lit_src, lit);
+  op += lit;
+  if (mlen) {
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    size_t m = mlen - MIN_MATCH;
+    *token |= (unsigned char)(m >= 15 ? 15 : m);
+    if (m >= 15) {
+      op = put_length(op, m - 15);
+    }
+  }
+  *opp = op;
+  return 0;
+}
+
+size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+  if (len > LZ_BLOCK_MAX) {
+    return 0;
+  }
+  /* Positions + 1, so 0 is an empty slot. */
+  uint32_t table[1u << HASH_BITS];
+  memset(table, 0, sizeof(table));
+  const unsigned char *ip = src;
+  const unsigned char *anchor = src;
+  const unsigned char *iend = src + len;
+  const unsigned char *mflimit = len > MATCH_LIMIT ? iend - MATCH_LIMIT : src;
+  const unsigned char *matchlimit = iend - (len > LAST_LITERALS ? LAST_LITERALS : len);
+  unsigned char *op = dst;
+  const unsigned char *oend = dst + cap;
+  while (ip < mflimit) {
+    uint32_t seq = read32(ip);
+    uint32_t h = hash4(seq);
+    const unsigned char *ref = table[h] ? src + table[h] - 1 : NULL;
+    table[h] = (uint32_t)(ip - src) + 1;
+    if (!ref || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+      /* Long runs without a match are skipped through faster. */
+      ip += 1 + ((size_t)(ip - anchor) >> 6);
+      continue;
+    }
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    size_t mlen = MIN_MATCH;
+    while (ip + mlen + 8 <= matchlimit && read64(ip + mlen) == read64(ref + mlen)) {
+      mlen += 8;
+    }
+    while (ip + mlen < matchlimit && ip[mlen] == ref[mlen]) {
+      mlen++;
+    }
+    if (emit(&op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen) != 0) {
+      return 0;
+    }
+    ip += mlen;
+    anchor = ip;
+    table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src) + 1;
+  }
+  if (emit(&op, oend, anchor, (size_t)(iend - anchor), 0, 0) != 0) {
+    return 0;
+  }
+  return (size_t)(op - dst);
+}
+
+static int get_length(const unsigned char **ipp, const unsigned char *iend, size_t *len) {
+  const unsigned char *ip = *ipp;
+  unsigned char b;
+  do {
+    if (ip >= iend) {
+      return -1;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  *ipp = ip;
+  return 0;
+}
+
+int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t raw) {
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + len;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + raw;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15 && get_length(&ip, iend, &lit) != 0) {
+      return -1;
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) {
+      break;
+    }
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && get_length(&ip, iend, &mlen) != 0) {
+      return -1;
+    }
+    mlen += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op)) {
+      return -1;
+    }
+    const unsigned char *ref = op - offset;
+    if (offset >= mlen) {
+      memcpy(op, ref, mlen);
+    } else {
+      /* Overlapping: a run repeating the last offset bytes. */
+      for (size_t i = 0; i < mlen; i++) {
+        op[i] = ref[i];
+      }
+    }
+    op += mlen;
+  }
+  return op == oend ? 0 : -1;
+}
+
+static void put32(unsigned char *out, uint32_t v) {
+  out[0] = (unsigned char)(v >> 24);
+  out[1] = (unsigned char)(v >> 16);
+  out[2] = (unsigned char)(v >> 8);
+  out[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) |
+         (uint32_t)in[3];
+}
+
+size_t lz_encode_block(struct lz_encoder *e, const void *src, size_t len, unsigned char *out) {
+  size_t stored = len;
+  if (len > 0 && e->skip > 0) {
+    e->skip--;
+  } else if (len > 0) {
+    size_t n = lz_compress(src, len, out + LZ_HEADER_SIZE, len - (len >> MIN_GAIN_SHIFT) - 1);
+    if (n > 0) {
+      stored = n;
+      e->misses = 0;
+    } else if (++e->misses >= MISSES_BEFORE_SKIP) {
+      e->skip = SKIP_BLOCKS;
+      e->misses = 0;
+    }
+  }
+  if (stored == len) {
+    memcpy(out + LZ_HEADER_SIZE, src, len);
+  }
+  put32(out, (uint32_t)len);
+  put32(out + 4, (uint32_t)stored);
+  lz_stats_add(&e->stats, (uint32_t)len, (uint32_t)stored);
+  return LZ_HEADER_SIZE + stored;
+}
+
+int lz_header_unpack(const unsigned char in[LZ_HEADER_SIZE], uint32_t *raw, uint32_t *stored) {
+  *raw = get32(in);
+  *stored = get32(in + 4);
+  return *raw <= LZ_BLOCK_MAX && *stored <= *raw ? 0 : -1;
+}
+
+int lz_decode_block(const unsigned char *body, uint32_t stored, unsigned char *out, uint32_t raw) {
+  if (stored == raw) {
+    memcpy(out, body, raw);
+    return 0;
+  }
+  return lz_decompress(body, stored, out, raw);
+}
+
+void lz_stats_add(struct lz_stats *s, uint32_t raw, uint32_t stored) {
+  s->raw += raw;
+  s->wire += LZ_HEADER_SIZE + stored;
+  if (raw > 0) {
+    s->blocks++;
+    s->stored_blocks += stored == raw;
+  }
+}
+
+double lz_stats_ratio(const struct lz_stats *s) {
+  return s->wire ? (double)s->raw / (double)s->wire : 1.0;
+}
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include "common/mux.h"
+
+#include "common/bufreader.h"
+#include "common/io.h"
+#include "common/protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct mux_stream {
+  uint32_t id;
+  int used;
+  int rfd;
+  int wfd;
+  int fin;
+  size_t window;
+  size_t grant;
+  size_t credit;
+  size_t queued;
+  size_t unacked;
+};
+
+struct mux {
+  int fd;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  pthread_mutex_t wmu;
+  int refs;
+  int started;
+  int dead;
+  uint32_t next_id;
+  uint32_t max_remote_id;
+  /* Ids below max_remote_id the peer opened but has not sent on yet. */
+  uint32_t skipped[MUX_MAX_STREAMS];
+  size_t nskipped;
+  mux_accept_fn accept;
+  void *ctx;
+  /* Credit to grant once the frame being written under wmu is out. */
+  uint32_t grant_stream;
+  size_t grant;
+  struct mux_stream streams[MUX_MAX_STREAMS];
+  struct bufreader in;
+};
+
+static atomic_uint_fast64_t g_streams;
+static atomic_uint_fast64_t g_window_waits;
+static atomic_uint_fast64_t g_refused;
+
+static struct mux_stream *find_locked(struct mux *m, uint32_t id) {
+  for (size_t i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (m->streams[i].used && m->streams[i].id == id) {
+      return &m->streams[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Registers a stream and sizes its window to its pipe; *rfd gets the read
+ * end. The kernel may grant a smaller pipe than asked for, e.g. once the
+ * user is over pipe-user-pages-soft, so the window comes from the size it
+ * reports. The window is half the pipe because the kernel packs pipe pages
+ * only partly when a write does not fit the last page's free space. Returns
+ * NULL if the pipe cannot hold one whole frame.
+ */
+static struct mux_stream *add_locked(struct mux *m, uint32_t id, int *rfd) {
+  struct mux_stream *st = NULL;
+  for (size_t i = 0; i < MUX_MAX_STREAMS && !st; i++) {
+    if (!m->streams[i].used) {
+      st = &m->streams[i];
+    }
+  }
+  int fds[2];
+  if (!st || pipe2(fds, O_CLOEXEC) != 0) {
+    return NULL;
+  }
+  (void)fcntl(fds[1], F_SETPIPE_SZ, 2 * MUX_WINDOW);
+  int size = fcntl(fds[1], F_GETPIPE_SZ);
+  size_t window = size > 0 ? (size_t)size / 2 : 0;
+  if (window < MUX_MIN_WINDOW) {
+    close(fds[0]);
+    close(fds[1]);
+    return NULL;
+  }
+  st->id = id;
+  st->used = 1;
+  st->rfd = fds[0];
+  st->wfd = fds[1];
+  st->fin = 0;
+  st->window = window < MUX_WINDOW ? window : MUX_WINDOW;
+  st->grant = st->window - MUX_MIN_WINDOW;
+  st->credit = MUX_MIN_WINDOW;
+  st->queued = 0;
+  st->unacked = 0;
+  *rfd = fds[0];
+  atomic_fetch_add_explicit(&g_streams, 1, memory_order_relaxed);
+  return st;
+}
+
+/*
+ * Whether a frame for an unknown id opens a stream rather than being a late
+ * one for a closed stream. The peer's threads may send the first frames of
+ * streams out of id order, so ids passed over by a newer one stay openable.
+ */
+static int remote_opens_locked(struct mux *m, uint32_t id) {
+  if (id > m->max_remote_id) {
+    uint32_t skip = m->max_remote_id + 1;
+    if (id - skip > MUX_MAX_STREAMS) {
+      skip = id - MUX_MAX_STREAMS;
+    }
+    for (; skip < id; skip++) {
+      if (m->nskipped == MUX_MAX_STREAMS) {
+        memmove(m->skipped, m->skipped + 1, (MUX_MAX_STREAMS - 1) * sizeof(m->skipped[0]));
+        m->nskipped--;
+      }
+      m->skipped[m->nskipped++] = skip;
+    }
+    m->max_remote_id = id;
+    return 1;
+  }
+  for (size_t i = 0; i < m->nskipped; i++) {
+    if (m->skipped[i] == id) {
+      m->skipped[i] = m->skipped[--m->nskipped];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* WINDOW and FIN are not subject to flow control. The caller holds wmu. */
+static void put_control(struct mux *m, int opcode, uint32_t stream, size_t credit) {
+  unsigned char frame[FRAME_HEADER_SIZE + 16];
+  size_t len = opcode == OP_WINDOW
+                   ? field_put_u64(frame + FRAME_HEADER_SIZE, 16, 0, (uint64_t)credit)
+                   : 0;
+  struct frame_header h = {.len = (uint32_t)len, .opcode = (uint16_t)opcode, .stream = stream};
+  frame_header_pack(&h, frame);
+  write_full(m->fd, frame, FRAME_HEADER_SIZE + len);
+}
+
+static void send_control(struct mux *m, int opcode, uint32_t stream, size_t credit) {
+  pthread_mutex_lock(&m->wmu);
+  put_control(m, opcode, stream, credit);
+  pthread_mutex_unlock(&m->wmu);
+}
+
+/* Returns -1 if the peer broke the protocol and the connection must end. */
+static int route_frame(struct mux *m, const struct frame_header *h, const unsigned char *frame) {
+  size_t n = FRAME_HEADER_SIZE + h->len;
+  pthread_mutex_lock(&m->mu);
+  if (h->opcode == OP_WINDOW) {
+    struct mux_stream *st = find_locked(m, h->stream);
+    size_t pos = 0;
+    struct field f;
+    if (st && field_next(frame + FRAME_HEADER_SIZE, h->len, &pos, &f) == 1 &&
+        f.type == FIELD_U64) {
+      st->credit += (size_t)f.u64;
+      pthread_cond_broadcast(&m->cv);
+    }
+    pthread_mutex_unlock(&m->mu);
+    return 0;
+  }
+  struct mux_stream *st = find_locked(m, h->stream);
+  if (h->opcode == OP_FIN) {
+    if (st) {
+      /* The peer has dropped the stream: it sends and reads nothing more. */
+      if (st->wfd >= 0) {
+        close(st->wfd);
+        st->wfd = -1;
+      }
+      st->fin = 1;
+      pthread_cond_broadcast(&m->cv);
+    }
+    pthread_mutex_unlock(&m->mu);
+    return 0;
+  }
+  int rfd = -1;
+  int accepted = 0;
+  int rejected = 0;
+  size_t grant = 0;
+  if (!st && m->accept && remote_opens_locked(m, h->stream)) {
+    st = add_locked(m, h->stream, &rfd);
+    accepted = st != NULL;
+    rejected = st == NULL;
+    if (st) {
+      grant = st->grant;
+      st->grant = 0;
+    }
+  }
+  if (st && st->queued + n > st->window) {
+    pthread_mutex_unlock(&m->mu);
+    return -1;
+  }
+  /* Within the window this fits in the pipe, so it does not block. */
+  if (st && st->wfd >= 0) {
+    write_full(st->wfd, frame, n);
+    st->queued += n;
+  }
+  pthread_mutex_unlock(&m->mu);
+  if (grant > 0) {
+    send_control(m, OP_WINDOW, h->stream, grant);
+  }
+  if (accepted) {
+    mux_retain(m);
+    if (m->accept(m, h->stream, rfd, m->ctx) != 0) {
+      mux_close(m, h->stream);
+      mux_release(m);
+    }
+  } else if (rejected) {
+    atomic_fetch_add_explicit(&g_refused, 1, memory_order_relaxed);
+    send_control(m, OP_FIN, h->stream, 0);
+  }
+  return 0;
+}
+
+static void *mux_reader(void *arg) {
+  struct mux *m = (struct mux *)arg;
+  pthread_mutex_lock(&m->mu);
+  while (m->started == 0) {
+    pthread_cond_wait(&m->cv, &m->mu);
+  }
+  int run = m->started > 0;
+  pthread_mutex_unlock(&m->mu);
+  unsigned char *frame = run ? malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD) : NULL;
+  while (frame) {
+    struct frame_header h;
+    if (bufreader_read(&m->in, frame, FRAME_HEADER_SIZE) != 0) {
+      break;
+    }
+    frame_header_unpack(frame, &h);
+    if (h.len > FRAME_MAX_PAYLOAD ||
+        (h.len > 0 && bufreader_read(&m->in, frame + FRAME_HEADER_SIZE, h.len) != 0)) {
+      break;
+    }
+    if (route_frame(m, &h, frame) != 0) {
+      break;
+    }
+  }
+  free(frame);
+  pthread_mutex_lock(&m->mu);
+  m->dead = 1;
+  for (size_t i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (m->streams[i].used && m->streams[i].wfd >= 0) {
+      close(m->streams[i].wfd);
+      m->streams[i].wfd = -1;
+    }
+  }
+  pthread_cond_broadcast(&m->cv);
+  pthread_mutex_unlock(&m->mu);
+  mux_release(m);
+  return NULL;
+}
+
+/*
+ * Sets up the mux for fd, which it takes over once started. pending holds
+ * bytes already read from fd past the point of the switch; they are the
+ * first input the reader routes. Stream 0 exists from the start and
+ * *stream0_fd is its read end. accept is NULL on the side that opens streams
+ * itself. Nothing is read or sent until mux_start, so a side that still has
+ * to acknowledge the switch can do so only once nothing is left to fail.
+ */
+struct mux *mux_create(int fd, const void *pending, size_t pending_len, mux_accept_fn accept,
+                       void *ctx, int *stream0_fd) {
+  struct mux *m = calloc(1, sizeof(*m));
+  if (!m) {
+    return NULL;
+  }
+  m->fd = fd;
+  m->refs = 2;
+  m->next_id = 1;
+  m->accept = accept;
+  m->ctx = ctx;
+  pthread_mutex_init(&m->mu, NULL);
+  pthread_cond_init(&m->cv, NULL);
+  pthread_mutex_init(&m->wmu, NULL);
+  bufreader_init(&m->in, fd);
+  pthread_t tid;
+  if (bufreader_preload(&m->in, pending, pending_len) != 0 ||
+      !add_locked(m, 0, stream0_fd)) {
+    m->fd = -1;
+    mux_release(m);
+    mux_release(m);
+    return NULL;
+  }
+  if (pthread_create(&tid, NULL, mux_reader, m) != 0) {
+    m->fd = -1;
+    mux_release(m);
+    mux_release(m);
+    return NULL;
+  }
+  pthread_detach(tid);
+  return m;
+}
+
+/* Lets the reader run and grants the peer the rest of stream 0's window. */
+void mux_start(struct mux *m) {
+  pthread_mutex_lock(&m->mu);
+  m->started = 1;
+  struct mux_stream *st = find_locked(m, 0);
+  size_t grant = st ? st->grant : 0;
+  if (st) {
+    st->grant = 0;
+  }
+  pthread_cond_broadcast(&m->cv);
+  pthread_mutex_unlock(&m->mu);
+  if (grant > 0) {
+    send_control(m, OP_WINDOW, 0, grant);
+  }
+}
+
+/* Drops a mux that was never started; fd stays with the caller. */
+void mux_cancel(struct mux *m) {
+  pthread_mutex_lock(&m->mu);
+  m->fd = -1;
+  m->started = -1;
+  pthread_cond_broadcast(&m->cv);
+  pthread_mutex_unlock(&m->mu);
+  mux_release(m);
+}
+
+/*
+ * Opens a stream from this side; returns its read end and sets *stream. The
+ * peer learns of the stream from its first frame, so the rest of its window
+ * is granted right after that one.
+ */
+int mux_open(struct mux *m, uint32_t *stream) {
+  pthread_mutex_lock(&m->mu);
+  int rfd = -1;
+  struct mux_stream *st = m->dead ? NULL : add_locked(m, m->next_id, &rfd);
+  if (st) {
+    *stream = m->next_id++;
+  }
+  pthread_mutex_unlock(&m->mu);
+  return st ? rfd : -1;
+}
+
+/*
+ * Waits until the stream may send len more bytes, then takes the socket
+ * write lock and returns the socket. The caller writes exactly len bytes of
+ * whole frames and calls mux_end. len is at most MUX_MIN_WINDOW, the credit
+ * every window is sure to reach.
+ */
+int mux_begin(struct mux *m, uint32_t stream, size_t len) {
+  if (len > MUX_MIN_WINDOW) {
+    return -1;
+  }
+  pthread_mutex_lock(&m->mu);
+  struct mux_stream *st = find_locked(m, stream);
+  if (st && st->credit < len && !m->dead) {
+    atomic_fetch_add_explicit(&g_window_waits, 1, memory_order_relaxed);
+  }
+  while (st && !st->fin && st->credit < len && !m->dead) {
+    pthread_cond_wait(&m->cv, &m->mu);
+    st = find_locked(m, stream);
+  }
+  int ok = st && !st->fin && !m->dead;
+  size_t grant = 0;
+  if (ok) {
+    st->credit -= len;
+    grant = st->grant;
+    st->grant = 0;
+  }
+  pthread_mutex_unlock(&m->mu);
+  if (!ok) {
+    return -1;
+  }
+  pthread_mutex_lock(&m->wmu);
+  m->grant_stream = stream;
+  m->grant = grant;
+  return m->fd;
+}
+
+void mux_end(struct mux *m) {
+  if (m->grant > 0) {
+    put_control(m, OP_WINDOW, m->grant_stream, m->grant);
+    m->grant = 0;
+  }
+  pthread_mutex_unlock(&m->wmu);
+}
+
+int mux_send(struct mux *m, uint32_t stream, const void *data, size_t len) {
+  int fd = mux_begin(m, stream, len);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = write_full(fd, data, len) < 0 ? -1 : 0;
+  mux_end(m);
+  return rc;
+}
+
+/* Records len bytes taken off a stream; credit goes back in quarter windows. */
+void mux_consumed(struct mux *m, uint32_t stream, size_t len) {
+  size_t credit = 0;
+  pthread_mutex_lock(&m->mu);
+  struct mux_stream *st = find_locked(m, stream);
+  if (st) {
+    st->queued -= len < st->queued ? len : st->queued;
+    st->unacked += len;
+    if (st->unacked >= st->window / 4) {
+      credit = st->unacked;
+      st->unacked = 0;
+    }
+  }
+  int dead = m->dead;
+  pthread_mutex_unlock(&m->mu);
+  if (credit > 0 && !dead) {
+    send_control(m, OP_WINDOW, stream, credit);
+  }
+}
+
+/*
+ * Drops the stream on this side and tells the peer with FIN. The connection
+ * ends with its last stream: the socket is shut down, so the reader sees EOF.
+ */
+void mux_close(struct mux *m, uint32_t stream) {
+  pthread_mutex_lock(&m->mu);
+  struct mux_stream *st = find_locked(m, stream);
+  int open = 0;
+  if (st) {
+    close(st->rfd);
+    if (st->wfd >= 0) {
+      close(st->wfd);
+    }
+    memset(st, 0, sizeof(*st));
+    pthread_cond_broadcast(&m->cv);
+  }
+  for (size_t i = 0; i < MUX_MAX_STREAMS; i++) {
+    open += m->streams[i].used;
+  }
+  int dead = m->dead;
+  pthread_mutex_unlock(&m->mu);
+  if (st && !dead) {
+    send_control(m, OP_FIN, stream, 0);
+  }
+  if (open == 0) {
+    shutdown(m->fd, SHUT_RDWR);
+  }
+}
+
+void mux_retain(struct mux *m) {
+  pthread_mutex_lock(&m->mu);
+  m->refs++;
+  pthread_mutex_unlock(&m->mu);
+}
+
+void mux_release(struct mux *m) {
+  pthread_mutex_lock(&m->mu);
+  int last = --m->refs == 0;
+  pthread_mutex_unlock(&m->mu);
+  if (!last) {
+    return;
+  }
+  for (size_t i = 0; i < MUX_MAX_STREAMS; i++) {
+    if (m->streams[i].used) {
+      close(m->streams[i].rfd);
+      if (m->streams[i].wfd >= 0) {
+        close(m->streams[i].wfd);
+      }
+    }
+  }
+  if (m->fd >= 0) {
+    close(m->fd);
+  }
+  pthread_mutex_destroy(&m->mu);
+  pthread_cond_destroy(&m->cv);
+  pthread_mutex_destroy(&m->wmu);
+  free(m);
+}
+
+void mux_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "mux.streams %llu\n", (unsigned long long)atomic_load(&g_streams));
+  strbuf_appendf(sb, "mux.window_waits %llu\n", (unsigned long long)atomic_load(&g_window_waits));
+  strbuf_appendf(sb, "mux.refused %llu\n", (unsigned long long)atomic_load(&g_refused));
+}
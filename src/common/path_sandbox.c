@@ -1,93 +1,105 @@
 #include "common/path_sandbox.h"
 
-#include <limits.h>
-#include <stdio.h>
 #include <string.h>
 
-static int normalize_abs_path(const char *in, char *out, size_t cap) {
-  if (!in || in[0] != '/') {
-    return -1;
-  }
-
-  char tmp[PATH_MAX];
-  size_t len = strlen(in);
-  if (len >= sizeof(tmp)) {
-    return -1;
-  }
-  memcpy(tmp, in, len + 1);
-
-  char *segments[PATH_MAX / 2];
-  size_t segs = 0;
-
-  char *save = NULL;
-  for (char *tok = strtok_r(tmp, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
-    if (strcmp(tok, ".") == 0 || strcmp(tok, "") == 0) {
+/*
+ * Appends the segments of input onto out[0..len), collapsing "." and "..".
+ * Segments never pop below floor; doing so means the path escapes and fails.
+ */
+static int append_segments(char *out, size_t len, size_t floor, size_t cap, const char *input,
+                           size_t *out_len) {
+  const char *p = input;
+  while (*p) {
+    while (*p == '/') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    const char *seg = p;
+    while (*p && *p != '/') {
+      p++;
+    }
+    size_t slen = (size_t)(p - seg);
+    if (slen == 1 && seg[0] == '.') {
       continue;
     }
-    if (strcmp(tok, "..") == 0) {
-      if (segs > 0) {
-        segs--;
+    if (slen == 2 && seg[0] == '.' && seg[1] == '.') {
+      if (len <= floor) {
+        return -1;
       }
+      while (len > floor && out[len - 1] != '/') {
+        len--;
+      }
+      len--;
       continue;
     }
-    segments[segs++] = tok;
+    if (len + 1 + slen >= cap) {
+      return -1;
+    }
+    out[len++] = '/';
+    memcpy(out + len, seg, slen);
+    len += slen;
   }
+  *out_len = len;
+  return 0;
+}
 
-  size_t pos = 0;
-  if (cap < 2) {
-    return -1;
-  }
-  out[pos++] = '/';
-  for (size_t i = 0; i < segs; i++) {
-    size_t slen = strlen(segments[i]);
-    if (pos + slen + 1 >= cap) {
+static int finish(char *out, size_t len, size_t cap) {
+  if (len == 0) {
+    if (cap < 2) {
       return -1;
     }
-    memcpy(out + pos, segments[i], slen);
-    pos += slen;
-    if (i + 1 < segs) {
-      out[pos++] = '/';
-    }
+    out[len++] = '/';
   }
-  out[pos] = '\0';
+  out[len] = '\0';
   return 0;
 }
 
-static int normalize_root(const char *root, char *out, size_t cap) {
-  if (!root || root[0] != '/') {
+int path_resolver_init(struct path_resolver *r, const char *root) {
+  if (!r || !root || root[0] != '/') {
+    return -1;
+  }
+  size_t len = 0;
+  if (append_segments(r->root, 0, 0, sizeof(r->root), root, &len) != 0) {
     return -1;
   }
-  return normalize_abs_path(root, out, cap);
+  /* "/" is kept as the empty prefix so joins never produce "//". */
+  r->root_len = len;
+  r->root[len] = '\0';
+  return 0;
 }
 
-int resolve_path_in_root(const char *root, const char *base_abs,
-                         const char *input, char *out, size_t cap) {
-  if (!root || !base_abs || !input || !out) {
+int path_resolve(const struct path_resolver *r, const char *base_abs, size_t base_len,
+                 const char *input, char *out, size_t cap) {
+  if (!r || !base_abs || !input || !out || cap == 0) {
     return -1;
   }
-
-  char merged[PATH_MAX];
+  size_t len;
   if (input[0] == '/') {
-    if (snprintf(merged, sizeof(merged), "%s%s", root, input) >= (int)sizeof(merged)) {
+    len = r->root_len;
+    if (len >= cap) {
       return -1;
     }
+    memcpy(out, r->root, len);
   } else {
-    if (snprintf(merged, sizeof(merged), "%s/%s", base_abs, input) >= (int)sizeof(merged)) {
+    while (base_len > 0 && base_abs[base_len - 1] == '/') {
+      base_len--;
+    }
+    if (base_len < r->root_len || memcmp(base_abs, r->root, r->root_len) != 0 ||
+        (base_len > r->root_len && base_abs[r->root_len] != '/')) {
       return -1;
     }
+    if (base_len >= cap) {
+      return -1;
+    }
+    memcpy(out, base_abs, base_len);
+    len = base_len;
   }
-
-  if (normalize_abs_path(merged, out, cap) != 0) {
-    return -1;
-  }
-  char root_norm[PATH_MAX];
-  if (normalize_root(root, root_norm, sizeof(root_norm)) != 0) {
-    return -1;
-  }
-  if (!path_is_within(root_norm, out)) {
+  if (append_segments(out, len, r->root_len, cap, input, &len) != 0) {
     return -1;
   }
-  return 0;
+  return finish(out, len, cap);
 }
 
 int path_is_within(const char *parent, const char *child) {
@@ -53,3 +53,197 @@ int send_blob(int fd, const void *data, size_t len) {
 int recv_blob(int fd, void *data, size_t len) {
   return read_full(fd, data, len) < 0 ? -1 : 0;
 }
+
+/* Indexed by opcode; these are also the v1 command names. */
+static const char *const g_op_names[OP_COMMAND_COUNT] = {
+    [OP_HELLO] = "hello",
+    [OP_EXIT] = "exit",
+    [OP_CREATE_USER] = "create_user",
+    [OP_LOGIN] = "login",
+    [OP_LOGOUT] = "logout",
+    [OP_WHOAMI] = "whoami",
+    [OP_STATS] = "stats",
+    [OP_CREATE] = "create",
+    [OP_CHMOD] = "chmod",
+    [OP_MOVE] = "move",
+    [OP_DELETE] = "delete",
+    [OP_CD] = "cd",
+    [OP_LIST] = "list",
+    [OP_READ] = "read",
+    [OP_READV] = "readv",
+    [OP_WRITE] = "write",
+    [OP_UPLOAD] = "upload",
+    [OP_DOWNLOAD] = "download",
+    [OP_OPEN] = "open",
+    [OP_PREAD] = "pread",
+    [OP_PWRITE] = "pwrite",
+    [OP_CLOSE] = "close",
+    [OP_TRANSFER_REQUEST] = "transfer_request",
+    [OP_ACCEPT] = "accept",
+    [OP_ACCEPT_ALL] = "accept_all",
+    [OP_REJECT] = "reject",
+    [OP_TOKEN] = "token",
+    [OP_RESUME] = "resume",
+    [OP_WATCH] = "watch",
+    [OP_UNWATCH] = "unwatch",
+    [OP_UPLOAD_OPEN] = "upload_open",
+    [OP_UPLOAD_STATUS] = "upload_status",
+    [OP_UPLOAD_DATA] = "upload_data",
+    [OP_UPLOAD_RANGE] = "upload_range",
+    [OP_UPLOAD_COMMIT] = "upload_commit",
+    [OP_CHECKSUM] = "checksum",
+    [OP_SIGNATURE] = "signature",
+    [OP_DELTA] = "delta",
+    [OP_UPLOAD_HASH] = "upload_hash",
+    [OP_UPLOAD_ABORT] = "upload_abort",
+};
+
+int frame_opcode(const char *name) {
+  for (int op = OP_NONE + 1; op < OP_COMMAND_COUNT; op++) {
+    if (strcmp(g_op_names[op], name) == 0) {
+      return op;
+    }
+  }
+  return OP_NONE;
+}
+
+const char *frame_opname(int opcode) {
+  if (opcode <= OP_NONE || opcode >= OP_COMMAND_COUNT) {
+    return NULL;
+  }
+  return g_op_names[opcode];
+}
+
+static void put_u16(unsigned char *p, uint16_t v) {
+  p[0] = (unsigned char)(v >> 8);
+  p[1] = (unsigned char)v;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void frame_header_pack(const struct frame_header *h, unsigned char out[FRAME_HEADER_SIZE]) {
+  put_u32(out, h->len);
+  put_u16(out + 4, h->opcode);
+  put_u16(out + 6, h->flags);
+  put_u32(out + 8, h->tag);
+  put_u32(out + 12, h->stream);
+}
+
+void frame_header_unpack(const unsigned char in[FRAME_HEADER_SIZE], struct frame_header *h) {
+  h->len = get_u32(in);
+  h->opcode = get_u16(in + 4);
+  h->flags = get_u16(in + 6);
+  h->tag = get_u32(in + 8);
+  h->stream = get_u32(in + 12);
+}
+
+void chunk_header_pack(uint32_t len, unsigned char out[CHUNK_HEADER_SIZE]) {
+  put_u32(out, len);
+}
+
+uint32_t chunk_header_unpack(const unsigned char in[CHUNK_HEADER_SIZE]) {
+  return get_u32(in);
+}
+
+void crc_trailer_pack(uint32_t crc, unsigned char out[CRC_TRAILER_SIZE]) {
+  put_u32(out, crc);
+}
+
+uint32_t crc_trailer_unpack(const unsigned char in[CRC_TRAILER_SIZE]) {
+  return get_u32(in);
+}
+
+void sparse_header_pack(int kind, uint64_t len, unsigned char out[SPARSE_HEADER_SIZE]) {
+  out[0] = (unsigned char)kind;
+  put_u32(out + 1, (uint32_t)(len >> 32));
+  put_u32(out + 5, (uint32_t)len);
+}
+
+int sparse_header_unpack(const unsigned char in[SPARSE_HEADER_SIZE], int *kind, uint64_t *len) {
+  *kind = in[0];
+  *len = ((uint64_t)get_u32(in + 1) << 32) | get_u32(in + 5);
+  return *kind == SPARSE_DATA || *kind == SPARSE_HOLE ? 0 : -1;
+}
+
+/* The field writers return the position after the field, or 0 if it does not fit. */
+size_t field_put_str(unsigned char *out, size_t cap, size_t pos, const char *s, size_t len) {
+  if (len > UINT32_MAX || pos > cap || cap - pos < 5 || cap - pos - 5 < len) {
+    return 0;
+  }
+  out[pos] = FIELD_STR;
+  put_u32(out + pos + 1, (uint32_t)len);
+  memcpy(out + pos + 5, s, len);
+  return pos + 5 + len;
+}
+
+size_t field_put_u64(unsigned char *out, size_t cap, size_t pos, uint64_t v) {
+  if (pos > cap || cap - pos < 13) {
+    return 0;
+  }
+  out[pos] = FIELD_U64;
+  put_u32(out + pos + 1, 8);
+  put_u32(out + pos + 5, (uint32_t)(v >> 32));
+  put_u32(out + pos + 9, (uint32_t)v);
+  return pos + 13;
+}
+
+/*
+ * Decodes the field at *pos and advances past it. Returns 1 for a field,
+ * 0 at the end of the buffer and -1 for a truncated or unknown field.
+ * STR values point into buf and are not NUL-terminated.
+ */
+int field_next(const unsigned char *buf, size_t len, size_t *pos, struct field *out) {
+  if (*pos == len) {
+    return 0;
+  }
+  if (len - *pos < 5) {
+    return -1;
+  }
+  const unsigned char *p = buf + *pos;
+  uint32_t flen = get_u32(p + 1);
+  if (len - *pos - 5 < flen) {
+    return -1;
+  }
+  out->type = p[0];
+  if (out->type == FIELD_U64) {
+    if (flen != 8) {
+      return -1;
+    }
+    out->u64 = ((uint64_t)get_u32(p + 5) << 32) | get_u32(p + 9);
+  } else if (out->type == FIELD_STR) {
+    out->str = (const char *)(p + 5);
+    out->len = flen;
+  } else {
+    return -1;
+  }
+  *pos += 5 + flen;
+  return 1;
+}
+
+int send_frame(int fd, const struct frame_header *h, const void *payload) {
+  unsigned char buf[FRAME_HEADER_SIZE + 4096];
+  frame_header_pack(h, buf);
+  if (h->len <= sizeof(buf) - FRAME_HEADER_SIZE) {
+    if (h->len > 0) {
+      memcpy(buf + FRAME_HEADER_SIZE, payload, h->len);
+    }
+    return write_full(fd, buf, FRAME_HEADER_SIZE + h->len) < 0 ? -1 : 0;
+  }
+  if (write_full(fd, buf, FRAME_HEADER_SIZE) < 0) {
+    return -1;
+  }
+  return write_full(fd, payload, h->len) < 0 ? -1 : 0;
+}
@@ -0,0 +1,192 @@
+#include "common/sha256.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_HW_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*compress_fn)(uint32_t h[8], const unsigned char *p, size_t blocks);
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+static uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void compress_one(uint32_t h[8], const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+           ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    hh = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += hh;
+}
+
+static void compress_sw(uint32_t h[8], const unsigned char *p, size_t blocks) {
+  for (; blocks > 0; blocks--, p += 64) {
+    compress_one(h, p);
+  }
+}
+
+#ifdef SHA256_HW_X86
+/*
+ * The SHA extensions: state kept as ABEF/CDGH, four rounds per pair of
+ * sha256rnds2 and the message schedule in sha256msg1/msg2.
+ */
+__attribute__((target("sha,sse4.1"))) static void compress_hw(uint32_t h[8],
+                                                              const unsigned char *p,
+                                                              size_t blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+  for (; blocks > 0; blocks--, p += 64) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i m[4];
+    for (int i = 0; i < 16; i++) {
+      __m128i *cur = &m[i % 4];
+      __m128i *prev = &m[(i + 3) % 4];
+      __m128i *next = &m[(i + 1) % 4];
+      if (i < 4) {
+        *cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+      }
+      __m128i msg = _mm_add_epi32(*cur, _mm_loadu_si128((const __m128i *)&k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (i >= 3 && i <= 14) {
+        *next = _mm_add_epi32(*next, _mm_alignr_epi8(*cur, *prev, 4));
+        *next = _mm_sha256msg2_epu32(*next, *cur);
+      }
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+      if (i >= 1 && i <= 12) {
+        *prev = _mm_sha256msg1_epu32(*prev, *cur);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+  _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int have_hw(void) {
+  unsigned a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1)) {
+    return 0;
+  }
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA);
+}
+#endif
+
+static compress_fn g_compress;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+/* The CPU's SHA instructions where there are any, else plain C. */
+static void init(void) {
+  g_compress = compress_sw;
+#ifdef SHA256_HW_X86
+  if (have_hw()) {
+    g_compress = compress_hw;
+  }
+#endif
+}
+
+void sha256_init(struct sha256 *s) {
+  pthread_once(&g_init_once, init);
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(s->h, iv, sizeof(iv));
+  s->len = 0;
+  s->used = 0;
+}
+
+void sha256_update(struct sha256 *s, const void *data, size_t len) {
+  const unsigned char *p = data;
+  s->len += len;
+  if (s->used > 0) {
+    size_t take = 64 - s->used < len ? 64 - s->used : len;
+    memcpy(s->buf + s->used, p, take);
+    s->used += take;
+    p += take;
+    len -= take;
+    if (s->used < 64) {
+      return;
+    }
+    g_compress(s->h, s->buf, 1);
+    s->used = 0;
+  }
+  if (len >= 64) {
+    g_compress(s->h, p, len / 64);
+    p += len - len % 64;
+    len %= 64;
+  }
+  memcpy(s->buf, p, len);
+  s->used = len;
+}
+
+void sha256_final(struct sha256 *s, unsigned char out[SHA256_SIZE]) {
+  uint64_t bits = s->len * 8;
+  unsigned char pad[72] = {0x80};
+  size_t pad_len = s->used < 56 ? 56 - s->used : 120 - s->used;
+  for (int i = 0; i < 8; i++) {
+    pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+  }
+  uint64_t len = s->len;
+  sha256_update(s, pad, pad_len + 8);
+  s->len = len;
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = (unsigned char)(s->h[i] >> 24);
+    out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+    out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+    out[4 * i + 3] = (unsigned char)s->h[i];
+  }
+}
+
+void sha256_hex(const unsigned char digest[SHA256_SIZE], char out[SHA256_HEX_LEN + 1]) {
+  for (int i = 0; i < SHA256_SIZE; i++) {
+    snprintf(out + 2 * i, 3, "%02x", digest[i]);
+  }
+}
@@ -0,0 +1,525 @@
+#include "server/attr_cache.h"
+
+#include "common/path_sandbox.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define ATTR_SHARDS 64
+#define ATTR_OWNER_MAX 64
+
+enum meta_state {
+  META_UNKNOWN = 0,
+  META_ABSENT,
+  META_PRESENT
+};
+
+struct attr_entry {
+  struct attr_entry *hnext;
+  struct attr_entry *lru_prev;
+  struct attr_entry *lru_next;
+  uint64_t hash;
+  int has_stat;
+  int watched;
+  uint64_t stat_stamp_ms;
+  struct attr_info info;
+  int meta_state;
+  int perm;
+  char owner[ATTR_OWNER_MAX];
+  size_t path_len;
+  char path[];
+};
+
+/*
+ * Each shard is a fixed-size chained hash sized to its share of the bound,
+ * plus an LRU list (lru.lru_next is the most recent) used for eviction.
+ */
+struct attr_shard {
+  pthread_mutex_t mu;
+  struct attr_entry **buckets;
+  size_t bucket_count;
+  size_t count;
+  size_t cap;
+  struct attr_entry lru;
+};
+
+static struct {
+  struct attr_shard shards[ATTR_SHARDS];
+  int enabled;
+  int watch_fd;
+  pthread_mutex_t watch_mu;
+  char **watch_dirs;
+  size_t watch_cap;
+} g_attr = {
+    .watch_fd = -1,
+    .watch_mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static atomic_uint_fast64_t g_hits;
+static atomic_uint_fast64_t g_misses;
+static atomic_uint_fast64_t g_invalidations;
+static atomic_uint_fast64_t g_evictions;
+static atomic_uint_fast64_t g_entries;
+static atomic_uint_fast64_t g_bytes;
+static atomic_uint_fast64_t g_watches;
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+static uint64_t path_hash(const char *path, size_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)path[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static struct attr_shard *shard_for(uint64_t hash) {
+  return &g_attr.shards[hash & (ATTR_SHARDS - 1)];
+}
+
+static size_t bucket_for(const struct attr_shard *shard, uint64_t hash) {
+  return (size_t)(hash >> 6) & (shard->bucket_count - 1);
+}
+
+static size_t entry_bytes(const struct attr_entry *e) {
+  return sizeof(*e) + e->path_len + 1;
+}
+
+static void lru_unlink(struct attr_entry *e) {
+  e->lru_prev->lru_next = e->lru_next;
+  e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push_front(struct attr_shard *shard, struct attr_entry *e) {
+  e->lru_prev = &shard->lru;
+  e->lru_next = shard->lru.lru_next;
+  shard->lru.lru_next->lru_prev = e;
+  shard->lru.lru_next = e;
+}
+
+static struct attr_entry *find_locked(struct attr_shard *shard, const char *path, size_t len,
+                                      uint64_t hash) {
+  for (struct attr_entry *e = shard->buckets[bucket_for(shard, hash)]; e; e = e->hnext) {
+    if (e->hash == hash && e->path_len == len && memcmp(e->path, path, len) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void remove_locked(struct attr_shard *shard, struct attr_entry *e) {
+  struct attr_entry **pp = &shard->buckets[bucket_for(shard, e->hash)];
+  while (*pp && *pp != e) {
+    pp = &(*pp)->hnext;
+  }
+  if (*pp) {
+    *pp = e->hnext;
+  }
+  lru_unlink(e);
+  shard->count--;
+  atomic_fetch_sub(&g_entries, 1);
+  atomic_fetch_sub(&g_bytes, entry_bytes(e));
+  free(e);
+}
+
+static struct attr_entry *get_locked(struct attr_shard *shard, const char *path, size_t len,
+                                     uint64_t hash) {
+  struct attr_entry *e = find_locked(shard, path, len, hash);
+  if (e) {
+    lru_unlink(e);
+    lru_push_front(shard, e);
+    return e;
+  }
+  e = calloc(1, sizeof(*e) + len + 1);
+  if (!e) {
+    return NULL;
+  }
+  memcpy(e->path, path, len);
+  e->path[len] = '\0';
+  e->path_len = len;
+  e->hash = hash;
+  size_t b = bucket_for(shard, hash);
+  e->hnext = shard->buckets[b];
+  shard->buckets[b] = e;
+  lru_push_front(shard, e);
+  shard->count++;
+  atomic_fetch_add(&g_entries, 1);
+  atomic_fetch_add(&g_bytes, entry_bytes(e));
+  while (shard->count > shard->cap && shard->lru.lru_prev != e) {
+    remove_locked(shard, shard->lru.lru_prev);
+    atomic_fetch_add(&g_evictions, 1);
+  }
+  return e;
+}
+
+static int parent_of(const char *path, char *out, size_t cap) {
+  const char *slash = strrchr(path, '/');
+  if (!slash) {
+    return -1;
+  }
+  size_t len = slash == path ? 1 : (size_t)(slash - path);
+  if (len >= cap) {
+    return -1;
+  }
+  memcpy(out, path, len);
+  out[len] = '\0';
+  return 0;
+}
+
+static void drop_stat(const char *path) {
+  size_t len = strlen(path);
+  uint64_t hash = path_hash(path, len);
+  struct attr_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct attr_entry *e = find_locked(shard, path, len, hash);
+  if (e && e->has_stat) {
+    e->has_stat = 0;
+    atomic_fetch_add(&g_invalidations, 1);
+  }
+  pthread_mutex_unlock(&shard->mu);
+}
+
+static void drop_all_stats(void) {
+  for (size_t i = 0; i < ATTR_SHARDS; i++) {
+    struct attr_shard *shard = &g_attr.shards[i];
+    pthread_mutex_lock(&shard->mu);
+    for (struct attr_entry *e = shard->lru.lru_next; e != &shard->lru; e = e->lru_next) {
+      e->has_stat = 0;
+    }
+    pthread_mutex_unlock(&shard->mu);
+  }
+  atomic_fetch_add(&g_invalidations, 1);
+}
+
+#if defined(__linux__)
+static void watch_forget(int wd) {
+  pthread_mutex_lock(&g_attr.watch_mu);
+  if (wd >= 0 && (size_t)wd < g_attr.watch_cap && g_attr.watch_dirs[wd]) {
+    free(g_attr.watch_dirs[wd]);
+    g_attr.watch_dirs[wd] = NULL;
+    atomic_fetch_sub(&g_watches, 1);
+  }
+  pthread_mutex_unlock(&g_attr.watch_mu);
+}
+
+static int watch_lookup(int wd, char *out, size_t cap) {
+  int rc = -1;
+  pthread_mutex_lock(&g_attr.watch_mu);
+  if (wd >= 0 && (size_t)wd < g_attr.watch_cap && g_attr.watch_dirs[wd]) {
+    rc = snprintf(out, cap, "%s", g_attr.watch_dirs[wd]) < (int)cap ? 0 : -1;
+  }
+  pthread_mutex_unlock(&g_attr.watch_mu);
+  return rc;
+}
+
+/* Watches are per directory; re-adding an inode just returns its old wd. */
+static int watch_dir(const char *dir) {
+  int wd = inotify_add_watch(g_attr.watch_fd, dir,
+                             IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  if (wd < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_attr.watch_mu);
+  if ((size_t)wd >= g_attr.watch_cap) {
+    size_t cap = g_attr.watch_cap ? g_attr.watch_cap : 64;
+    while (cap <= (size_t)wd) {
+      cap *= 2;
+    }
+    char **dirs = realloc(g_attr.watch_dirs, cap * sizeof(*dirs));
+    if (!dirs) {
+      pthread_mutex_unlock(&g_attr.watch_mu);
+      inotify_rm_watch(g_attr.watch_fd, wd);
+      return -1;
+    }
+    memset(dirs + g_attr.watch_cap, 0, (cap - g_attr.watch_cap) * sizeof(*dirs));
+    g_attr.watch_dirs = dirs;
+    g_attr.watch_cap = cap;
+  }
+  if (!g_attr.watch_dirs[wd] || strcmp(g_attr.watch_dirs[wd], dir) != 0) {
+    char *copy = strdup(dir);
+    if (!copy) {
+      pthread_mutex_unlock(&g_attr.watch_mu);
+      return -1;
+    }
+    if (!g_attr.watch_dirs[wd]) {
+      atomic_fetch_add(&g_watches, 1);
+    }
+    free(g_attr.watch_dirs[wd]);
+    g_attr.watch_dirs[wd] = copy;
+  }
+  pthread_mutex_unlock(&g_attr.watch_mu);
+  return 0;
+}
+
+static void *watch_thread(void *arg) {
+  (void)arg;
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char dir[PATH_MAX];
+  char child[PATH_MAX];
+  while (1) {
+    ssize_t n = read(g_attr.watch_fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        drop_all_stats();
+        continue;
+      }
+      if (watch_lookup(ev->wd, dir, sizeof(dir)) != 0) {
+        continue;
+      }
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        attr_cache_invalidate_tree(dir);
+        watch_forget(ev->wd);
+        continue;
+      }
+      if (ev->len == 0 ||
+          snprintf(child, sizeof(child), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, ev->name) >=
+              (int)sizeof(child)) {
+        drop_stat(dir);
+        continue;
+      }
+      if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        attr_cache_invalidate_tree(child);
+      } else {
+        attr_cache_invalidate(child);
+      }
+    }
+  }
+  return NULL;
+}
+
+static int watch_start(void) {
+  g_attr.watch_fd = inotify_init1(IN_CLOEXEC);
+  if (g_attr.watch_fd < 0) {
+    return -1;
+  }
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, watch_thread, NULL) != 0) {
+    close(g_attr.watch_fd);
+    g_attr.watch_fd = -1;
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+#else
+static int watch_dir(const char *dir) {
+  (void)dir;
+  return -1;
+}
+
+static int watch_start(void) {
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+int attr_cache_init(size_t max_entries, int watch) {
+  g_attr.enabled = max_entries > 0;
+  if (!g_attr.enabled) {
+    return 0;
+  }
+  size_t per_shard = (max_entries + ATTR_SHARDS - 1) / ATTR_SHARDS;
+  size_t buckets = 4;
+  while (buckets < per_shard) {
+    buckets *= 2;
+  }
+  for (size_t i = 0; i < ATTR_SHARDS; i++) {
+    struct attr_shard *shard = &g_attr.shards[i];
+    pthread_mutex_init(&shard->mu, NULL);
+    shard->buckets = calloc(buckets, sizeof(*shard->buckets));
+    if (!shard->buckets) {
+      return -1;
+    }
+    shard->bucket_count = buckets;
+    shard->count = 0;
+    shard->cap = per_shard;
+    shard->lru.lru_next = &shard->lru;
+    shard->lru.lru_prev = &shard->lru;
+  }
+  if (watch && watch_start() != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static void fill_info(struct attr_info *out, const struct stat *st) {
+  out->dev = st->st_dev;
+  out->ino = st->st_ino;
+  out->mode = st->st_mode;
+  out->size = st->st_size;
+  out->mtime = st->st_mtim;
+}
+
+int attr_cache_stat(int dirfd, const char *rel, const char *full, struct attr_info *out) {
+  if (!rel || !full || !out) {
+    return -1;
+  }
+  size_t len = strlen(full);
+  uint64_t hash = path_hash(full, len);
+  struct attr_shard *shard = shard_for(hash);
+  if (g_attr.enabled) {
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&shard->mu);
+    struct attr_entry *e = find_locked(shard, full, len, hash);
+    if (e && e->has_stat && (e->watched || now - e->stat_stamp_ms < ATTR_CACHE_STAT_TTL_MS)) {
+      *out = e->info;
+      lru_unlink(e);
+      lru_push_front(shard, e);
+      pthread_mutex_unlock(&shard->mu);
+      atomic_fetch_add(&g_hits, 1);
+      return 0;
+    }
+    pthread_mutex_unlock(&shard->mu);
+    atomic_fetch_add(&g_misses, 1);
+  }
+
+  /* Watch before stat so a change racing with the fill is still reported. */
+  int watched = 0;
+  char parent[PATH_MAX];
+  if (g_attr.enabled && g_attr.watch_fd >= 0 && parent_of(full, parent, sizeof(parent)) == 0) {
+    watched = watch_dir(parent) == 0;
+  }
+  struct stat st;
+  if (fstatat(dirfd, rel, &st, 0) != 0) {
+    return -1;
+  }
+  fill_info(out, &st);
+  if (!g_attr.enabled) {
+    return 0;
+  }
+  pthread_mutex_lock(&shard->mu);
+  struct attr_entry *e = get_locked(shard, full, len, hash);
+  if (e) {
+    e->info = *out;
+    e->has_stat = 1;
+    e->watched = watched;
+    e->stat_stamp_ms = now_ms();
+  }
+  pthread_mutex_unlock(&shard->mu);
+  return 0;
+}
+
+int attr_cache_get_meta(const char *path, char *owner, size_t owner_cap, int *perm) {
+  if (!g_attr.enabled || !path) {
+    return -1;
+  }
+  size_t len = strlen(path);
+  uint64_t hash = path_hash(path, len);
+  struct attr_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct attr_entry *e = find_locked(shard, path, len, hash);
+  int rc = -1;
+  if (e && e->meta_state != META_UNKNOWN) {
+    rc = e->meta_state == META_PRESENT ? 1 : 0;
+    if (rc == 1) {
+      if (owner && owner_cap > 0) {
+        snprintf(owner, owner_cap, "%s", e->owner);
+      }
+      if (perm) {
+        *perm = e->perm;
+      }
+    }
+    lru_unlink(e);
+    lru_push_front(shard, e);
+  }
+  pthread_mutex_unlock(&shard->mu);
+  atomic_fetch_add(rc >= 0 ? &g_hits : &g_misses, 1);
+  return rc;
+}
+
+void attr_cache_put_meta(const char *path, const char *owner, int perm) {
+  if (!g_attr.enabled || !path || (owner && strlen(owner) >= ATTR_OWNER_MAX)) {
+    return;
+  }
+  size_t len = strlen(path);
+  uint64_t hash = path_hash(path, len);
+  struct attr_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct attr_entry *e = get_locked(shard, path, len, hash);
+  if (e) {
+    e->meta_state = owner ? META_PRESENT : META_ABSENT;
+    e->perm = perm;
+    snprintf(e->owner, sizeof(e->owner), "%s", owner ? owner : "");
+  }
+  pthread_mutex_unlock(&shard->mu);
+}
+
+/* Drops the cached stat of path and of its parent, whose mtime moved with it. */
+void attr_cache_invalidate(const char *path) {
+  if (!g_attr.enabled || !path) {
+    return;
+  }
+  drop_stat(path);
+  char parent[PATH_MAX];
+  if (parent_of(path, parent, sizeof(parent)) == 0) {
+    drop_stat(parent);
+  }
+}
+
+/* Removes path and everything below it outright, meta included. */
+void attr_cache_invalidate_tree(const char *path) {
+  if (!g_attr.enabled || !path) {
+    return;
+  }
+  for (size_t i = 0; i < ATTR_SHARDS; i++) {
+    struct attr_shard *shard = &g_attr.shards[i];
+    pthread_mutex_lock(&shard->mu);
+    struct attr_entry *e = shard->lru.lru_next;
+    while (e != &shard->lru) {
+      struct attr_entry *next = e->lru_next;
+      if (path_is_within(path, e->path)) {
+        remove_locked(shard, e);
+      }
+      e = next;
+    }
+    pthread_mutex_unlock(&shard->mu);
+  }
+  atomic_fetch_add(&g_invalidations, 1);
+  char parent[PATH_MAX];
+  if (parent_of(path, parent, sizeof(parent)) == 0) {
+    drop_stat(parent);
+  }
+}
+
+void attr_cache_stats_append(struct strbuf *sb) {
+  uint64_t hits = atomic_load(&g_hits);
+  uint64_t misses = atomic_load(&g_misses);
+  uint64_t lookups = hits + misses;
+  strbuf_appendf(sb, "attr.hits %llu\n", (unsigned long long)hits);
+  strbuf_appendf(sb, "attr.misses %llu\n", (unsigned long long)misses);
+  strbuf_appendf(sb, "attr.hit_rate_pct %llu\n",
+                 (unsigned long long)(lookups ? hits * 100 / lookups : 0));
+  strbuf_appendf(sb, "attr.entries %llu\n", (unsigned long long)atomic_load(&g_entries));
+  strbuf_appendf(sb, "attr.bytes %llu\n", (unsigned long long)atomic_load(&g_bytes));
+  strbuf_appendf(sb, "attr.evictions %llu\n", (unsigned long long)atomic_load(&g_evictions));
+  strbuf_appendf(sb, "attr.invalidations %llu\n",
+                 (unsigned long long)atomic_load(&g_invalidations));
+  strbuf_appendf(sb, "attr.watches %llu\n", (unsigned long long)atomic_load(&g_watches));
+}
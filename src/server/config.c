@@ -1,5 +1,8 @@
 #include "server/config.h"
 
+#include "server/attr_cache.h"
+#include "server/file_cache.h"
+
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +13,48 @@ static void set_defaults(struct server_config *cfg) {
   snprintf(cfg->root, sizeof(cfg->root), "%s", "./server_root");
   snprintf(cfg->ip, sizeof(cfg->ip), "%s", "127.0.0.1");
   cfg->port = 8080;
+  cfg->root_fd = -1;
+  cfg->attr_cache_entries = ATTR_CACHE_DEFAULT_ENTRIES;
+  cfg->file_cache_mb = FILE_CACHE_DEFAULT_MB;
+  cfg->attr_watch = 0;
+  cfg->dedup = 0;
+  cfg->sync = SYNC_DATA;
+}
+
+/* Optional trailing settings, each of the form -name=value. */
+static int parse_option(struct server_config *cfg, const char *arg) {
+  const char *eq = strchr(arg, '=');
+  if (arg[0] != '-' || !eq || eq[1] == '\0') {
+    return -1;
+  }
+  char *end = NULL;
+  long value = strtol(eq + 1, &end, 10);
+  if (*end != '\0' || value < 0) {
+    return -1;
+  }
+  size_t name_len = (size_t)(eq - arg);
+  if (name_len == strlen("-attr-cache") && strncmp(arg, "-attr-cache", name_len) == 0) {
+    cfg->attr_cache_entries = (size_t)value;
+    return 0;
+  }
+  if (name_len == strlen("-file-cache") && strncmp(arg, "-file-cache", name_len) == 0) {
+    cfg->file_cache_mb = (size_t)value;
+    return 0;
+  }
+  if (name_len == strlen("-attr-watch") && strncmp(arg, "-attr-watch", name_len) == 0) {
+    cfg->attr_watch = value != 0;
+    return 0;
+  }
+  if (name_len == strlen("-dedup") && strncmp(arg, "-dedup", name_len) == 0) {
+    cfg->dedup = value != 0;
+    return 0;
+  }
+  if (name_len == strlen("-fsync") && strncmp(arg, "-fsync", name_len) == 0 &&
+      value <= SYNC_FULL) {
+    cfg->sync = (int)value;
+    return 0;
+  }
+  return -1;
 }
 
 int server_config_parse(struct server_config *cfg, int argc, char **argv) {
@@ -26,6 +71,11 @@ int server_config_parse(struct server_config *cfg, int argc, char **argv) {
   if (argc >= 4) {
     cfg->port = atoi(argv[3]);
   }
+  for (int i = 4; i < argc; i++) {
+    if (parse_option(cfg, argv[i]) != 0) {
+      return -1;
+    }
+  }
   if (cfg->root[0] != '/') {
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -36,5 +86,10 @@ int server_config_parse(struct server_config *cfg, int argc, char **argv) {
       }
     }
   }
+  if (path_resolver_init(&cfg->resolver, cfg->root) != 0) {
+    return -1;
+  }
+  snprintf(cfg->root, sizeof(cfg->root), "%s",
+           cfg->resolver.root_len ? cfg->resolver.root : "/");
   return 0;
 }
@@ -0,0 +1,363 @@
+#include "server/dedup.h"
+
+#include "common/sha256.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BLOBS_DIR ".csap_blobs"
+#define INDEX_BUCKETS 4096
+#define HASH_CHUNK (1u << 20)
+#define CLAIM_BUCKETS 4096
+
+struct blob {
+  dev_t dev;
+  ino_t ino;
+  char hex[SHA256_HEX_LEN + 1];
+  struct blob *next;
+};
+
+/* A user who has uploaded content with this hash, and so may link to it by hash alone. */
+struct claim {
+  char user[64];
+  char hex[SHA256_HEX_LEN + 1];
+  struct claim *next;
+};
+
+static int g_enabled;
+static char g_dir[PATH_MAX];
+static unsigned long g_tmp_seq;
+
+/* Ingest, link and unref all run under g_mu, so a blob's link count only
+   drops to one while nobody is about to link it again. */
+static pthread_mutex_t g_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct blob *g_index[INDEX_BUCKETS];
+static struct claim *g_claims[CLAIM_BUCKETS];
+
+static atomic_uint_fast64_t g_ingest_hits;
+static atomic_uint_fast64_t g_hash_hits;
+static atomic_uint_fast64_t g_skipped;
+
+static size_t index_bucket(dev_t dev, ino_t ino) {
+  return (size_t)(((uint64_t)ino * 0x9e3779b97f4a7c15ull) ^ (uint64_t)dev) % INDEX_BUCKETS;
+}
+
+static struct blob *index_find_locked(dev_t dev, ino_t ino) {
+  for (struct blob *b = g_index[index_bucket(dev, ino)]; b; b = b->next) {
+    if (b->dev == dev && b->ino == ino) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static void index_add_locked(const struct stat *st, const char *hex) {
+  if (index_find_locked(st->st_dev, st->st_ino)) {
+    return;
+  }
+  struct blob *b = malloc(sizeof(*b));
+  if (!b) {
+    return;
+  }
+  b->dev = st->st_dev;
+  b->ino = st->st_ino;
+  memcpy(b->hex, hex, sizeof(b->hex));
+  size_t i = index_bucket(st->st_dev, st->st_ino);
+  b->next = g_index[i];
+  g_index[i] = b;
+}
+
+static void index_remove_locked(dev_t dev, ino_t ino) {
+  for (struct blob **p = &g_index[index_bucket(dev, ino)]; *p; p = &(*p)->next) {
+    if ((*p)->dev == dev && (*p)->ino == ino) {
+      struct blob *b = *p;
+      *p = b->next;
+      free(b);
+      return;
+    }
+  }
+}
+
+static size_t claim_bucket(const char *user, const char *hex) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (const char *p = user; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 0x100000001b3ull;
+  }
+  for (const char *p = hex; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 0x100000001b3ull;
+  }
+  return (size_t)(h % CLAIM_BUCKETS);
+}
+
+static int claimed_locked(const char *user, const char *hex) {
+  for (struct claim *c = g_claims[claim_bucket(user, hex)]; c; c = c->next) {
+    if (strcmp(c->user, user) == 0 && strcmp(c->hex, hex) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void claim_locked(const char *user, const char *hex) {
+  if (claimed_locked(user, hex)) {
+    return;
+  }
+  struct claim *c = malloc(sizeof(*c));
+  if (!c) {
+    return;
+  }
+  snprintf(c->user, sizeof(c->user), "%s", user);
+  memcpy(c->hex, hex, sizeof(c->hex));
+  size_t i = claim_bucket(c->user, hex);
+  c->next = g_claims[i];
+  g_claims[i] = c;
+}
+
+static int valid_hex(const char *hex) {
+  if (strlen(hex) != SHA256_HEX_LEN) {
+    return 0;
+  }
+  for (const char *p = hex; *p; p++) {
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int blob_path(const char *hex, char *out, size_t cap) {
+  return snprintf(out, cap, "%s/%s", g_dir, hex) >= (int)cap ? -1 : 0;
+}
+
+static int tmp_path_locked(char *out, size_t cap) {
+  return snprintf(out, cap, "%s/tmp.%ld.%lu", g_dir, (long)getpid(), ++g_tmp_seq) >= (int)cap
+             ? -1
+             : 0;
+}
+
+/* Takes the blob away once the store holds its only link. */
+static void collect_locked(const char *hex) {
+  char path[PATH_MAX];
+  struct stat st;
+  if (blob_path(hex, path, sizeof(path)) == 0 && lstat(path, &st) == 0 && st.st_nlink == 1 &&
+      unlink(path) == 0) {
+    index_remove_locked(st.st_dev, st.st_ino);
+  }
+}
+
+static void sweep_locked(void) {
+  DIR *d = opendir(g_dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (de->d_name[0] == '.' || blob_path(de->d_name, path, sizeof(path)) != 0) {
+      continue;
+    }
+    if (strncmp(de->d_name, "tmp.", 4) == 0) {
+      /* Only left behind by a crash between link and rename. */
+      if (lstat(path, &st) == 0 && st.st_nlink == 1) {
+        unlink(path);
+      }
+      continue;
+    }
+    if (!valid_hex(de->d_name) || lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (st.st_nlink == 1) {
+      if (unlink(path) == 0) {
+        index_remove_locked(st.st_dev, st.st_ino);
+      }
+    } else {
+      index_add_locked(&st, de->d_name);
+    }
+  }
+  closedir(d);
+}
+
+int dedup_init(const char *root, int enabled) {
+  if (snprintf(g_dir, sizeof(g_dir), "%s/%s", root, BLOBS_DIR) >= (int)sizeof(g_dir)) {
+    return -1;
+  }
+  g_enabled = enabled;
+  if (enabled && mkdir(g_dir, 0700) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  /* Even without -dedup, a store left by an earlier run is kept tidy. */
+  pthread_mutex_lock(&g_mu);
+  sweep_locked();
+  pthread_mutex_unlock(&g_mu);
+  return 0;
+}
+
+int dedup_enabled(void) {
+  return g_enabled;
+}
+
+static int hash_file(const char *path, uint64_t size, char hex[SHA256_HEX_LEN + 1]) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != size) {
+    close(fd);
+    return -1;
+  }
+  struct sha256 s;
+  sha256_init(&s);
+  int rc = 0;
+  /* Mapped a piece at a time so the hash never pins the whole file. */
+  for (uint64_t off = 0; rc == 0 && off < size; off += HASH_CHUNK) {
+    size_t len = size - off < HASH_CHUNK ? (size_t)(size - off) : HASH_CHUNK;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, (off_t)off);
+    if (map == MAP_FAILED) {
+      rc = -1;
+      break;
+    }
+    posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+    sha256_update(&s, map, len);
+    munmap(map, len);
+  }
+  close(fd);
+  unsigned char digest[SHA256_SIZE];
+  sha256_final(&s, digest);
+  sha256_hex(digest, hex);
+  return rc;
+}
+
+int dedup_ingest(const char *part, uint64_t size, const char *user) {
+  char hex[SHA256_HEX_LEN + 1];
+  char blob[PATH_MAX];
+  if (!g_enabled || hash_file(part, size, hex) != 0 || blob_path(hex, blob, sizeof(blob)) != 0) {
+    return -1;
+  }
+  int rc = -1;
+  struct stat st;
+  pthread_mutex_lock(&g_mu);
+  if (lstat(blob, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == size) {
+    /* Seen before: the part gives way to another link to the blob. */
+    char tmp[PATH_MAX];
+    if (tmp_path_locked(tmp, sizeof(tmp)) == 0 && link(blob, tmp) == 0) {
+      if (rename(tmp, part) == 0) {
+        index_add_locked(&st, hex);
+        atomic_fetch_add_explicit(&g_ingest_hits, 1, memory_order_relaxed);
+        rc = 0;
+      } else {
+        unlink(tmp);
+      }
+    }
+  } else if (link(part, blob) == 0 && lstat(blob, &st) == 0) {
+    index_add_locked(&st, hex);
+    rc = 0;
+  }
+  if (rc == 0) {
+    claim_locked(user, hex);
+  }
+  pthread_mutex_unlock(&g_mu);
+  return rc;
+}
+
+int dedup_link(const char *user, const char *hex, uint64_t size, char *tmp, size_t cap) {
+  char blob[PATH_MAX];
+  if (!g_enabled || !valid_hex(hex) || blob_path(hex, blob, sizeof(blob)) != 0) {
+    return -1;
+  }
+  int rc = -1;
+  struct stat st;
+  pthread_mutex_lock(&g_mu);
+  if (claimed_locked(user, hex) && lstat(blob, &st) == 0 && S_ISREG(st.st_mode) &&
+      (uint64_t)st.st_size == size && tmp_path_locked(tmp, cap) == 0 && link(blob, tmp) == 0) {
+    index_add_locked(&st, hex);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&g_mu);
+  return rc;
+}
+
+void dedup_note_skipped(uint64_t size) {
+  atomic_fetch_add_explicit(&g_hash_hits, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_skipped, size, memory_order_relaxed);
+}
+
+int dedup_link_copy(const char *src, const char *dst) {
+  struct stat st;
+  if (!g_enabled || stat(src, &st) != 0 || st.st_nlink < 2) {
+    return -1;
+  }
+  int rc = -1;
+  pthread_mutex_lock(&g_mu);
+  struct blob *b = index_find_locked(st.st_dev, st.st_ino);
+  char blob[PATH_MAX];
+  if (b && blob_path(b->hex, blob, sizeof(blob)) == 0 && link(blob, dst) == 0) {
+    rc = 0;
+  }
+  pthread_mutex_unlock(&g_mu);
+  return rc;
+}
+
+void dedup_unref(const struct stat *st) {
+  if (!g_enabled) {
+    return;
+  }
+  pthread_mutex_lock(&g_mu);
+  struct blob *b = index_find_locked(st->st_dev, st->st_ino);
+  if (b) {
+    char hex[SHA256_HEX_LEN + 1];
+    memcpy(hex, b->hex, sizeof(hex));
+    collect_locked(hex);
+  }
+  pthread_mutex_unlock(&g_mu);
+}
+
+void dedup_sweep(void) {
+  if (!g_enabled) {
+    return;
+  }
+  pthread_mutex_lock(&g_mu);
+  sweep_locked();
+  pthread_mutex_unlock(&g_mu);
+}
+
+void dedup_stats_append(struct strbuf *sb) {
+  uint64_t blobs = 0;
+  uint64_t stored = 0;
+  uint64_t logical = 0;
+  pthread_mutex_lock(&g_mu);
+  for (size_t i = 0; i < INDEX_BUCKETS; i++) {
+    for (struct blob *b = g_index[i]; b; b = b->next) {
+      char path[PATH_MAX];
+      struct stat st;
+      if (blob_path(b->hex, path, sizeof(path)) != 0 || lstat(path, &st) != 0 ||
+          st.st_nlink < 2) {
+        continue;
+      }
+      blobs++;
+      stored += (uint64_t)st.st_size;
+      logical += (uint64_t)st.st_size * (uint64_t)(st.st_nlink - 1);
+    }
+  }
+  pthread_mutex_unlock(&g_mu);
+  strbuf_appendf(sb, "dedup.enabled %d\n", g_enabled);
+  strbuf_appendf(sb, "dedup.blobs %llu\n", (unsigned long long)blobs);
+  strbuf_appendf(sb, "dedup.stored_bytes %llu\n", (unsigned long long)stored);
+  strbuf_appendf(sb, "dedup.logical_bytes %llu\n", (unsigned long long)logical);
+  strbuf_appendf(sb, "dedup.saved_bytes %llu\n", (unsigned long long)(logical - stored));
+  strbuf_appendf(sb, "dedup.ratio %.2f\n", stored ? (double)logical / (double)stored : 1.0);
+  strbuf_appendf(sb, "dedup.ingest_hits %llu\n",
+                 (unsigned long long)atomic_load(&g_ingest_hits));
+  strbuf_appendf(sb, "dedup.hash_hits %llu\n", (unsigned long long)atomic_load(&g_hash_hits));
+  strbuf_appendf(sb, "dedup.skipped_bytes %llu\n", (unsigned long long)atomic_load(&g_skipped));
+}
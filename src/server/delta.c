@@ -0,0 +1,119 @@
+#include "server/delta.h"
+
+#include "common/delta.h"
+#include "common/io.h"
+#include "server/fsutil.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SIG_BATCH 4096
+
+static atomic_uint_fast64_t g_signatures;
+static atomic_uint_fast64_t g_applied;
+static atomic_uint_fast64_t g_literal;
+static atomic_uint_fast64_t g_copied;
+
+int delta_send_signature(struct client_session *sess, int fd, uint64_t size, uint32_t block) {
+  unsigned char *buf = malloc(block);
+  unsigned char *sigs = malloc((size_t)SIG_BATCH * DELTA_SIG_SIZE);
+  int rc = buf && sigs ? 0 : -1;
+  size_t batched = 0;
+  for (uint64_t off = 0; rc == 0 && off < size; off += block) {
+    size_t len = size - off < block ? (size_t)(size - off) : block;
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = pread(fd, buf + got, len - got, (off_t)(off + got));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      got += (size_t)n;
+    }
+    /* The size was promised already: a file cut short hashes as zeros. */
+    for (size_t i = got; i < len; i++) {
+      buf[i] = 0;
+    }
+    delta_sig_pack(delta_weak(buf, len), delta_strong(buf, len),
+                   sigs + batched * DELTA_SIG_SIZE);
+    if (++batched == SIG_BATCH || off + len >= size) {
+      rc = session_send_blob(sess, sigs, batched * DELTA_SIG_SIZE);
+      batched = 0;
+    }
+  }
+  free(buf);
+  free(sigs);
+  atomic_fetch_add_explicit(&g_signatures, 1, memory_order_relaxed);
+  return rc;
+}
+
+int delta_apply(struct client_session *sess, int base_fd, uint64_t base_size, uint32_t block,
+                int out_fd, struct delta_result *res) {
+  *res = (struct delta_result){0};
+  uint64_t blocks = (base_size + block - 1) / block;
+  int writing = out_fd >= 0;
+  unsigned char buf[DELTA_LITERAL_MAX];
+  while (1) {
+    unsigned char op;
+    if (session_recv_blob(sess, &op, 1) != 0) {
+      return -1;
+    }
+    if (op == DELTA_OP_END) {
+      break;
+    }
+    unsigned char hdr[DELTA_COPY_SIZE - 1];
+    if (op == DELTA_OP_COPY) {
+      if (session_recv_blob(sess, hdr, 8) != 0) {
+        return -1;
+      }
+      uint64_t index = delta_u32(hdr);
+      uint64_t count = delta_u32(hdr + 4);
+      if (count == 0 || index + count > blocks) {
+        res->bad = 1;
+        writing = 0;
+        continue;
+      }
+      uint64_t off = index * block;
+      uint64_t end = (index + count) * block;
+      size_t len = (size_t)((end < base_size ? end : base_size) - off);
+      if (writing && fsutil_copy_range(base_fd, (off_t)off, out_fd, len) != 0) {
+        res->failed = errno ? errno : EIO;
+        writing = 0;
+      }
+      res->copied += len;
+    } else if (op == DELTA_OP_LITERAL) {
+      if (session_recv_blob(sess, hdr, 4) != 0) {
+        return -1;
+      }
+      uint32_t len = delta_u32(hdr);
+      if (len > DELTA_LITERAL_MAX || session_recv_blob(sess, buf, len) != 0) {
+        return -1;
+      }
+      if (writing && write_full(out_fd, buf, len) < 0) {
+        res->failed = errno;
+        writing = 0;
+      }
+      res->literal += len;
+    } else {
+      /* Nothing tells where an unknown instruction ends. */
+      return -1;
+    }
+  }
+  if (writing) {
+    atomic_fetch_add_explicit(&g_applied, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_literal, res->literal, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_copied, res->copied, memory_order_relaxed);
+  }
+  return 0;
+}
+
+void delta_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "delta.signatures %llu\n", (unsigned long long)atomic_load(&g_signatures));
+  strbuf_appendf(sb, "delta.applied %llu\n", (unsigned long long)atomic_load(&g_applied));
+  strbuf_appendf(sb, "delta.literal_bytes %llu\n", (unsigned long long)atomic_load(&g_literal));
+  strbuf_appendf(sb, "delta.copied_bytes %llu\n", (unsigned long long)atomic_load(&g_copied));
+}
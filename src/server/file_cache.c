@@ -0,0 +1,269 @@
+#include "server/file_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 1024
+
+struct file_cache_entry {
+  struct file_cache_entry *hnext;
+  /* Place on the shard's CLOCK ring. */
+  struct file_cache_entry *prev;
+  struct file_cache_entry *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  /* Sessions sending from it; a removed entry is freed by the last of them. */
+  unsigned refs;
+  int referenced;
+  int removed;
+  unsigned char data[];
+};
+
+struct file_cache_shard {
+  pthread_mutex_t mu;
+  struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+  struct file_cache_entry *hand;
+  size_t count;
+  size_t bytes;
+  size_t cap;
+};
+
+static struct file_cache_shard g_shards[FILE_CACHE_SHARDS];
+static int g_enabled;
+/* Bumped by every invalidation: a fill that saw it move may hold old bytes. */
+static atomic_uint_fast64_t g_generation;
+
+static atomic_uint_fast64_t g_hits;
+static atomic_uint_fast64_t g_misses;
+static atomic_uint_fast64_t g_fills;
+static atomic_uint_fast64_t g_evictions;
+static atomic_uint_fast64_t g_invalidations;
+static atomic_uint_fast64_t g_entries;
+static atomic_uint_fast64_t g_bytes;
+
+static uint64_t inode_hash(dev_t dev, ino_t ino) {
+  return ((uint64_t)ino * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)dev * 0xff51afd7ed558ccdull);
+}
+
+static struct file_cache_shard *shard_for(dev_t dev, ino_t ino) {
+  return &g_shards[inode_hash(dev, ino) % FILE_CACHE_SHARDS];
+}
+
+static size_t bucket_for(dev_t dev, ino_t ino) {
+  return (size_t)(inode_hash(dev, ino) / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS;
+}
+
+static size_t entry_bytes(const struct file_cache_entry *e) {
+  return sizeof(*e) + (size_t)e->size;
+}
+
+int file_cache_init(size_t max_mb) {
+  g_enabled = max_mb > 0;
+  for (size_t i = 0; i < FILE_CACHE_SHARDS; i++) {
+    struct file_cache_shard *shard = &g_shards[i];
+    if (pthread_mutex_init(&shard->mu, NULL) != 0) {
+      return -1;
+    }
+    shard->cap = (max_mb << 20) / FILE_CACHE_SHARDS;
+  }
+  return 0;
+}
+
+static struct file_cache_entry *find_locked(dev_t dev, ino_t ino) {
+  struct file_cache_shard *shard = shard_for(dev, ino);
+  for (struct file_cache_entry *e = shard->buckets[bucket_for(dev, ino)]; e; e = e->hnext) {
+    if (e->dev == dev && e->ino == ino) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void remove_locked(struct file_cache_shard *shard, struct file_cache_entry *e) {
+  struct file_cache_entry **pp = &shard->buckets[bucket_for(e->dev, e->ino)];
+  while (*pp != e) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = e->hnext;
+  if (e->next == e) {
+    shard->hand = NULL;
+  } else {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    if (shard->hand == e) {
+      shard->hand = e->next;
+    }
+  }
+  shard->count--;
+  shard->bytes -= entry_bytes(e);
+  atomic_fetch_sub(&g_entries, 1);
+  atomic_fetch_sub(&g_bytes, entry_bytes(e));
+  e->removed = 1;
+  if (e->refs == 0) {
+    free(e);
+  }
+}
+
+/*
+ * Sweeps the hand until need more bytes fit: entries with their bit set lose
+ * it and stay, held ones are passed over. Two turns of the ring see every
+ * bit cleared, so a shard full of held entries gives up there.
+ */
+static int make_room_locked(struct file_cache_shard *shard, size_t need) {
+  size_t steps = 2 * shard->count;
+  while (shard->bytes + need > shard->cap && shard->hand && steps-- > 0) {
+    struct file_cache_entry *e = shard->hand;
+    shard->hand = e->next;
+    if (e->referenced) {
+      e->referenced = 0;
+    } else if (e->refs == 0) {
+      remove_locked(shard, e);
+      atomic_fetch_add(&g_evictions, 1);
+    }
+  }
+  return shard->bytes + need <= shard->cap ? 0 : -1;
+}
+
+/* New entries go just behind the hand, the last place it will look. */
+static void insert_locked(struct file_cache_shard *shard, struct file_cache_entry *e) {
+  size_t b = bucket_for(e->dev, e->ino);
+  e->hnext = shard->buckets[b];
+  shard->buckets[b] = e;
+  if (!shard->hand) {
+    e->prev = e;
+    e->next = e;
+    shard->hand = e;
+  } else {
+    e->next = shard->hand;
+    e->prev = shard->hand->prev;
+    e->prev->next = e;
+    shard->hand->prev = e;
+  }
+  shard->count++;
+  shard->bytes += entry_bytes(e);
+  atomic_fetch_add(&g_entries, 1);
+  atomic_fetch_add(&g_bytes, entry_bytes(e));
+}
+
+struct file_cache_entry *file_cache_get(const struct attr_info *info) {
+  if (!g_enabled || !S_ISREG(info->mode) || info->size > (off_t)FILE_CACHE_MAX_FILE) {
+    return NULL;
+  }
+  struct file_cache_shard *shard = shard_for(info->dev, info->ino);
+  pthread_mutex_lock(&shard->mu);
+  struct file_cache_entry *e = find_locked(info->dev, info->ino);
+  if (e && (e->size != info->size || e->mtime.tv_sec != info->mtime.tv_sec ||
+            e->mtime.tv_nsec != info->mtime.tv_nsec)) {
+    /* The inode has moved on; what is cached is an older version. */
+    remove_locked(shard, e);
+    e = NULL;
+  }
+  if (e) {
+    e->referenced = 1;
+    e->refs++;
+  }
+  pthread_mutex_unlock(&shard->mu);
+  atomic_fetch_add(e ? &g_hits : &g_misses, 1);
+  return e;
+}
+
+struct file_cache_entry *file_cache_fill(int fd, const struct stat *st) {
+  if (!g_enabled || !S_ISREG(st->st_mode) || st->st_size > (off_t)FILE_CACHE_MAX_FILE) {
+    return NULL;
+  }
+  uint64_t gen = atomic_load(&g_generation);
+  struct file_cache_entry *e = calloc(1, sizeof(*e) + (size_t)st->st_size);
+  if (!e) {
+    return NULL;
+  }
+  size_t got = 0;
+  while (got < (size_t)st->st_size) {
+    ssize_t n = pread(fd, e->data + got, (size_t)st->st_size - got, (off_t)got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(e);
+      return NULL;
+    }
+    got += (size_t)n;
+  }
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime = st->st_mtim;
+  e->refs = 1;
+  struct file_cache_shard *shard = shard_for(e->dev, e->ino);
+  pthread_mutex_lock(&shard->mu);
+  struct file_cache_entry *old = find_locked(e->dev, e->ino);
+  if (old) {
+    remove_locked(shard, old);
+  }
+  int kept = atomic_load(&g_generation) == gen && make_room_locked(shard, entry_bytes(e)) == 0;
+  if (kept) {
+    insert_locked(shard, e);
+  } else {
+    /* Still good for the read that asked for it, which holds the file's lock. */
+    e->removed = 1;
+  }
+  pthread_mutex_unlock(&shard->mu);
+  if (kept) {
+    atomic_fetch_add(&g_fills, 1);
+  }
+  return e;
+}
+
+const unsigned char *file_cache_data(const struct file_cache_entry *e, size_t *len) {
+  *len = (size_t)e->size;
+  return e->data;
+}
+
+void file_cache_release(struct file_cache_entry *e) {
+  struct file_cache_shard *shard = shard_for(e->dev, e->ino);
+  pthread_mutex_lock(&shard->mu);
+  int last = --e->refs == 0 && e->removed;
+  pthread_mutex_unlock(&shard->mu);
+  if (last) {
+    free(e);
+  }
+}
+
+void file_cache_invalidate(dev_t dev, ino_t ino) {
+  if (!g_enabled) {
+    return;
+  }
+  atomic_fetch_add(&g_generation, 1);
+  struct file_cache_shard *shard = shard_for(dev, ino);
+  pthread_mutex_lock(&shard->mu);
+  struct file_cache_entry *e = find_locked(dev, ino);
+  if (e) {
+    remove_locked(shard, e);
+    atomic_fetch_add(&g_invalidations, 1);
+  }
+  pthread_mutex_unlock(&shard->mu);
+}
+
+void file_cache_stats_append(struct strbuf *sb) {
+  uint64_t hits = atomic_load(&g_hits);
+  uint64_t misses = atomic_load(&g_misses);
+  uint64_t lookups = hits + misses;
+  strbuf_appendf(sb, "filecache.hits %llu\n", (unsigned long long)hits);
+  strbuf_appendf(sb, "filecache.misses %llu\n", (unsigned long long)misses);
+  strbuf_appendf(sb, "filecache.hit_rate_pct %llu\n",
+                 (unsigned long long)(lookups ? hits * 100 / lookups : 0));
+  strbuf_appendf(sb, "filecache.fills %llu\n", (unsigned long long)atomic_load(&g_fills));
+  strbuf_appendf(sb, "filecache.entries %llu\n", (unsigned long long)atomic_load(&g_entries));
+  strbuf_appendf(sb, "filecache.bytes %llu\n", (unsigned long long)atomic_load(&g_bytes));
+  strbuf_appendf(sb, "filecache.evictions %llu\n",
+                 (unsigned long long)atomic_load(&g_evictions));
+  strbuf_appendf(sb, "filecache.invalidations %llu\n",
+                 (unsigned long long)atomic_load(&g_invalidations));
+}
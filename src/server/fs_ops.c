@@ -1,23 +1,43 @@
 #include "server/fs_ops.h"
 
+#include "common/crc32c.h"
 #include "common/error.h"
 #include "common/path_sandbox.h"
 #include "common/perm.h"
 #include "common/protocol.h"
 #include "common/io.h"
+#include "common/delta.h"
+#include "server/attr_cache.h"
+#include "server/dedup.h"
+#include "server/delta.h"
+#include "server/file_cache.h"
+#include "server/fsutil.h"
 #include "server/locks.h"
 #include "server/meta.h"
 #include "server/session.h"
+#include "server/uploads.h"
+#include "server/watch.h"
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Gives full an inode of its own; st, taken before, may have been shared with a blob. */
+static int unshare(const char *full, const struct stat *st) {
+  if (fsutil_break_link(full) != 0) {
+    return -1;
+  }
+  dedup_unref(st);
+  return 0;
+}
+
 static int parent_dir(const char *path, char *out, size_t cap) {
   if (!path || !out || cap == 0) {
     return -1;
@@ -43,7 +63,7 @@ static int resolve_for_user(struct client_session *sess, const char *path,
   if (!sess || !path || !out) {
     return -1;
   }
-  if (resolve_path_in_root(sess->cfg->root, sess->cwd, path, out, cap) != 0) {
+  if (path_resolve(&sess->cfg->resolver, sess->cwd, sess->cwd_len, path, out, cap) != 0) {
     return -1;
   }
   if (!allow_root && !path_is_within(sess->home, out)) {
@@ -52,39 +72,111 @@ static int resolve_for_user(struct client_session *sess, const char *path,
   return 0;
 }
 
+/*
+ * A resolved path re-expressed against the deepest directory handle the
+ * session already holds (cwd, then home, then the server root), so the kernel
+ * only walks the components below it. The absolute string is still what
+ * locks and metadata key on.
+ */
+struct at_path {
+  int dirfd;
+  const char *rel;
+};
+
+static const char *rel_under(const char *full, const char *base, size_t base_len) {
+  if (base_len == 0 || strncmp(full, base, base_len) != 0) {
+    return NULL;
+  }
+  if (full[base_len] == '\0') {
+    return ".";
+  }
+  return full[base_len] == '/' ? full + base_len + 1 : NULL;
+}
+
+static void at_path_for(const struct client_session *sess, const char *full,
+                        struct at_path *ap) {
+  const char *rel;
+  if (sess->cwd_fd >= 0 && (rel = rel_under(full, sess->cwd, sess->cwd_len)) != NULL) {
+    ap->dirfd = sess->cwd_fd;
+    ap->rel = rel;
+    return;
+  }
+  if (sess->home_fd >= 0 && (rel = rel_under(full, sess->home, strlen(sess->home))) != NULL) {
+    ap->dirfd = sess->home_fd;
+    ap->rel = rel;
+    return;
+  }
+  const struct path_resolver *r = &sess->cfg->resolver;
+  if (sess->cfg->root_fd >= 0) {
+    if (r->root_len == 0) {
+      ap->dirfd = sess->cfg->root_fd;
+      ap->rel = full[1] ? full + 1 : ".";
+      return;
+    }
+    if ((rel = rel_under(full, r->root, r->root_len)) != NULL) {
+      ap->dirfd = sess->cfg->root_fd;
+      ap->rel = rel;
+      return;
+    }
+  }
+  ap->dirfd = AT_FDCWD;
+  ap->rel = full;
+}
+
+/*
+ * Unshares the file at ap before it is changed or opened for writing: a
+ * shared inode may not even be writable. The link count comes from the
+ * directory, never the cache, since sharing must be exact; the caller holds
+ * the write lock on full.
+ */
+static int unshare_at(const char *full, const struct at_path *ap) {
+  struct stat st;
+  if (fstatat(ap->dirfd, ap->rel, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_nlink <= 1) {
+    return 0;
+  }
+  return unshare(full, &st);
+}
+
 int fs_cmd_create(struct client_session *sess, const char *path, int is_dir, int perm_oct) {
   char full[PATH_MAX];
   if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+    return session_err(sess, ERR_PERM, "path outside home");
   }
 
   if (locks_wrlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   char parent[PATH_MAX];
   if (parent_dir(full, parent, sizeof(parent)) != 0 ||
       meta_check_access(sess->cfg->root, parent, sess->user, 0, 1, 1) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    return session_err(sess, ERR_PERM, "permission denied");
   }
 
   int masked = perm_oct & 0770;
   int rc = 0;
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
   if (is_dir) {
-    if (mkdir(full, (mode_t)masked) != 0) {
-      rc = send_err(sess->fd, ERR_IO, "mkdir failed: %s", strerror(errno));
+    if (mkdirat(ap.dirfd, ap.rel, (mode_t)masked) != 0) {
+      rc = session_err(sess, ERR_IO, "mkdir failed: %s", strerror(errno));
     } else {
       meta_set(sess->cfg->root, full, sess->user, masked);
-      rc = sendf_line(sess->fd, "OK");
+      attr_cache_invalidate(full);
+      watch_notify(full, 1);
+      rc = session_reply(sess, "OK");
     }
   } else {
-    int fd = open(full, O_WRONLY | O_CREAT | O_EXCL, (mode_t)masked);
+    int fd = fsutil_openat_beneath(ap.dirfd, ap.rel, O_WRONLY | O_CREAT | O_EXCL, masked);
     if (fd < 0) {
-      rc = send_err(sess->fd, ERR_IO, "create failed: %s", strerror(errno));
+      rc = session_err(sess, ERR_IO, "create failed: %s", strerror(errno));
     } else {
       close(fd);
       meta_set(sess->cfg->root, full, sess->user, masked);
-      rc = sendf_line(sess->fd, "OK");
+      attr_cache_invalidate(full);
+      watch_notify(full, 1);
+      rc = session_reply(sess, "OK");
     }
   }
   locks_unlock(full);
@@ -94,28 +186,32 @@ int fs_cmd_create(struct client_session *sess, const char *path, int is_dir, int
 int fs_cmd_chmod(struct client_session *sess, const char *path, int perm_oct) {
   char full[PATH_MAX];
   if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+    return session_err(sess, ERR_PERM, "path outside home");
   }
   if (locks_wrlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   char owner[64];
   int current_perm = 0;
   if (meta_get(sess->cfg->root, full, owner, sizeof(owner), &current_perm) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_NOT_FOUND, "metadata missing");
+    return session_err(sess, ERR_NOT_FOUND, "metadata missing");
   }
   if (strcmp(owner, sess->user) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "not owner");
+    return session_err(sess, ERR_PERM, "not owner");
   }
   int masked = perm_oct & 0770;
   int rc = 0;
-  if (chmod(full, (mode_t)masked) != 0) {
-    rc = send_err(sess->fd, ERR_IO, "chmod failed: %s", strerror(errno));
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  if (unshare_at(full, &ap) != 0 || fchmodat(ap.dirfd, ap.rel, (mode_t)masked, 0) != 0) {
+    rc = session_err(sess, ERR_IO, "chmod failed: %s", strerror(errno));
   } else {
     meta_set(sess->cfg->root, full, sess->user, masked);
-    rc = sendf_line(sess->fd, "OK");
+    attr_cache_invalidate(full);
+    watch_notify(full, 0);
+    rc = session_reply(sess, "OK");
   }
   locks_unlock(full);
   return rc;
@@ -126,10 +222,10 @@ int fs_cmd_move(struct client_session *sess, const char *src, const char *dst) {
   char full_dst[PATH_MAX];
   if (resolve_for_user(sess, src, full_src, sizeof(full_src), 0) != 0 ||
       resolve_for_user(sess, dst, full_dst, sizeof(full_dst), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+    return session_err(sess, ERR_PERM, "path outside home");
   }
   if (locks_wrlock_pair(full_src, full_dst) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   char src_parent[PATH_MAX];
   char dst_parent[PATH_MAX];
@@ -138,14 +234,28 @@ int fs_cmd_move(struct client_session *sess, const char *src, const char *dst) {
       meta_check_access(sess->cfg->root, src_parent, sess->user, 0, 1, 1) != 0 ||
       meta_check_access(sess->cfg->root, dst_parent, sess->user, 0, 1, 1) != 0) {
     locks_unlock_pair(full_src, full_dst);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    return session_err(sess, ERR_PERM, "permission denied");
   }
   int rc = 0;
-  if (rename(full_src, full_dst) != 0) {
-    rc = send_err(sess->fd, ERR_IO, "move failed: %s", strerror(errno));
+  struct at_path ap_src;
+  struct at_path ap_dst;
+  at_path_for(sess, full_src, &ap_src);
+  at_path_for(sess, full_dst, &ap_dst);
+  struct stat old;
+  int replaced = fstatat(ap_dst.dirfd, ap_dst.rel, &old, AT_SYMLINK_NOFOLLOW) == 0;
+  if (renameat(ap_src.dirfd, ap_src.rel, ap_dst.dirfd, ap_dst.rel) != 0) {
+    rc = session_err(sess, ERR_IO, "move failed: %s", strerror(errno));
   } else {
+    if (replaced) {
+      dedup_unref(&old);
+      file_cache_invalidate(old.st_dev, old.st_ino);
+    }
     meta_move(sess->cfg->root, full_src, full_dst);
-    rc = sendf_line(sess->fd, "OK");
+    attr_cache_invalidate_tree(full_src);
+    attr_cache_invalidate_tree(full_dst);
+    watch_notify(full_src, 0);
+    watch_notify(full_dst, 1);
+    rc = session_reply(sess, "OK");
   }
   locks_unlock_pair(full_src, full_dst);
   return rc;
@@ -154,23 +264,33 @@ int fs_cmd_move(struct client_session *sess, const char *src, const char *dst) {
 int fs_cmd_delete(struct client_session *sess, const char *path) {
   char full[PATH_MAX];
   if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+    return session_err(sess, ERR_PERM, "path outside home");
   }
   if (locks_wrlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   char parent[PATH_MAX];
   if (parent_dir(full, parent, sizeof(parent)) != 0 ||
       meta_check_access(sess->cfg->root, parent, sess->user, 0, 1, 1) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    return session_err(sess, ERR_PERM, "permission denied");
   }
   int rc = 0;
-  if (unlink(full) != 0) {
-    rc = send_err(sess->fd, ERR_IO, "delete failed: %s", strerror(errno));
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  struct stat st;
+  int had = fstatat(ap.dirfd, ap.rel, &st, AT_SYMLINK_NOFOLLOW) == 0;
+  if (unlinkat(ap.dirfd, ap.rel, 0) != 0) {
+    rc = session_err(sess, ERR_IO, "delete failed: %s", strerror(errno));
   } else {
+    if (had) {
+      dedup_unref(&st);
+      file_cache_invalidate(st.st_dev, st.st_ino);
+    }
     meta_remove(sess->cfg->root, full);
-    rc = sendf_line(sess->fd, "OK");
+    attr_cache_invalidate(full);
+    watch_notify(full, 0);
+    rc = session_reply(sess, "OK");
   }
   locks_unlock(full);
   return rc;
@@ -179,45 +299,58 @@ int fs_cmd_delete(struct client_session *sess, const char *path) {
 int fs_cmd_cd(struct client_session *sess, const char *path) {
   char full[PATH_MAX];
   if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+    return session_err(sess, ERR_PERM, "path outside home");
   }
   if (locks_rdlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   if (meta_check_access(sess->cfg->root, full, sess->user, 0, 0, 1) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    return session_err(sess, ERR_PERM, "permission denied");
   }
-  struct stat st;
-  if (stat(full, &st) != 0 || !S_ISDIR(st.st_mode)) {
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  int dir_fd = fsutil_open_dir(ap.dirfd, ap.rel);
+  if (dir_fd < 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_NOT_FOUND, "not a directory");
+    return session_err(sess, ERR_NOT_FOUND, "not a directory");
   }
+  if (sess->cwd_fd >= 0) {
+    close(sess->cwd_fd);
+  }
+  sess->cwd_fd = dir_fd;
   snprintf(sess->cwd, sizeof(sess->cwd), "%s", full);
+  sess->cwd_len = strlen(sess->cwd);
   locks_unlock(full);
-  return sendf_line(sess->fd, "OK");
+  return session_reply(sess, "OK");
 }
 
 int fs_cmd_list(struct client_session *sess, const char *path) {
   const char *target = path && path[0] ? path : ".";
   char full[PATH_MAX];
   if (resolve_for_user(sess, target, full, sizeof(full), 1) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside root");
+    return session_err(sess, ERR_PERM, "path outside root");
   }
   if (locks_rdlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    return session_err(sess, ERR_IO, "lock failed");
   }
   if (meta_check_access(sess->cfg->root, full, sess->user, 1, 0, 1) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    return session_err(sess, ERR_PERM, "permission denied");
   }
 
-  DIR *dir = opendir(full);
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  int list_fd = fsutil_openat_beneath(ap.dirfd, ap.rel, O_RDONLY | O_DIRECTORY, 0);
+  DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
   if (!dir) {
+    if (list_fd >= 0) {
+      close(list_fd);
+    }
     locks_unlock(full);
-    return send_err(sess->fd, ERR_NOT_FOUND, "list failed: %s", strerror(errno));
+    return session_err(sess, ERR_NOT_FOUND, "list failed: %s", strerror(errno));
   }
-  int rc = sendf_line(sess->fd, "OK");
+  int rc = session_reply(sess, "OK");
   if (rc != 0) {
     locks_unlock(full);
     closedir(dir);
@@ -235,153 +368,1285 @@ int fs_cmd_list(struct client_session *sess, const char *path) {
         (int)sizeof(entry_path)) {
       continue;
     }
-    struct stat st;
-    if (stat(entry_path, &st) != 0) {
+    struct attr_info info;
+    if (attr_cache_stat(dirfd(dir), ent->d_name, entry_path, &info) != 0) {
       continue;
     }
     int meta_perm = 0;
     if (meta_get(sess->cfg->root, entry_path, NULL, 0, &meta_perm) != 0) {
-      meta_perm = (int)(st.st_mode & 0770);
+      meta_perm = (int)(info.mode & 0770);
     }
-    mode_t mode = (mode_t)meta_perm | (S_ISDIR(st.st_mode) ? S_IFDIR : S_IFREG);
+    mode_t mode = (mode_t)meta_perm | (S_ISDIR(info.mode) ? S_IFDIR : S_IFREG);
     perm_to_string(mode, perm, sizeof(perm));
-    sendf_line(sess->fd, "%s %ld %s", perm, (long)st.st_size, ent->d_name);
+    session_line(sess, "%s %ld %s", perm, (long)info.size, ent->d_name);
   }
-  sendf_line(sess->fd, "END");
+  session_end(sess);
   locks_unlock(full);
   closedir(dir);
   return 0;
 }
 
-int fs_cmd_read(struct client_session *sess, const char *path, long offset) {
-  char full[PATH_MAX];
-  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+/*
+ * Resolves path and checks that the session may read it, under a read lock
+ * that is held on success; on failure the error was sent.
+ */
+static int lock_for_read(struct client_session *sess, const char *path, char *full,
+                         size_t cap) {
+  if (resolve_for_user(sess, path, full, cap, 0) != 0) {
+    session_err(sess, ERR_PERM, "path outside home");
+    return -1;
   }
   if (locks_rdlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+    session_err(sess, ERR_IO, "lock failed");
+    return -1;
   }
   if (meta_check_access(sess->cfg->root, full, sess->user, 1, 0, 0) != 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+    session_err(sess, ERR_PERM, "permission denied");
+    return -1;
   }
-  int fd = open(full, O_RDONLY);
+  return 0;
+}
+
+/* Opens a path lock_for_read accepted; on failure the error was sent and the lock dropped. */
+static int open_locked(struct client_session *sess, const char *full, int *out_fd,
+                       struct stat *st) {
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  int fd = fsutil_openat_beneath(ap.dirfd, ap.rel, O_RDONLY, 0);
   if (fd < 0) {
     locks_unlock(full);
-    return send_err(sess->fd, ERR_NOT_FOUND, "open failed: %s", strerror(errno));
+    session_err(sess, ERR_NOT_FOUND, "open failed: %s", strerror(errno));
+    return -1;
   }
-
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
+  if (fstat(fd, st) != 0) {
     close(fd);
     locks_unlock(full);
-    return send_err(sess->fd, ERR_IO, "stat failed: %s", strerror(errno));
+    session_err(sess, ERR_IO, "stat failed: %s", strerror(errno));
+    return -1;
   }
+  *out_fd = fd;
+  return 0;
+}
 
+/*
+ * Resolves and opens path for reading under a read lock. On success the lock
+ * is held and the fd and size are returned; on failure the error was sent.
+ */
+static int open_for_read(struct client_session *sess, const char *path, char *full, size_t cap,
+                         int *out_fd, off_t *out_size) {
+  struct stat st;
+  if (lock_for_read(sess, path, full, cap) != 0 || open_locked(sess, full, out_fd, &st) != 0) {
+    return -1;
+  }
+  *out_size = st.st_size;
+  return 0;
+}
+
+/* Clamps [offset, offset + length) to the file; length < 0 means to EOF. */
+static size_t clamp_range(off_t size, long offset, long length) {
   if (offset < 0) {
     offset = 0;
   }
-  if (lseek(fd, offset, SEEK_SET) < 0) {
-    close(fd);
-    locks_unlock(full);
-    return send_err(sess->fd, ERR_IO, "seek failed: %s", strerror(errno));
+  if (offset >= size) {
+    return 0;
+  }
+  off_t avail = size - offset;
+  if (length >= 0 && (off_t)length < avail) {
+    return (size_t)length;
   }
+  return (size_t)avail;
+}
 
-  off_t remaining = st.st_size - offset;
-  if (remaining < 0) {
-    remaining = 0;
+/* Answers a read from a file_cache entry: the reply line and the bytes in one write. */
+static int send_cached(struct client_session *sess, struct file_cache_entry *e, long offset,
+                       long length) {
+  size_t size;
+  const unsigned char *data = file_cache_data(e, &size);
+  size_t count = clamp_range((off_t)size, offset, length);
+  size_t start = offset < 0 ? 0 : (size_t)offset;
+  int rc = session_reply(sess, "OK %zu", count);
+  if (rc == 0 && count > 0 && sess->payload_sparse) {
+    unsigned char hdr[SPARSE_HEADER_SIZE];
+    sparse_header_pack(SPARSE_DATA, count, hdr);
+    rc = session_send_blob(sess, hdr, sizeof(hdr));
   }
-  if (sendf_line(sess->fd, "OK %ld", (long)remaining) != 0) {
-    close(fd);
+  if (rc == 0 && count > 0) {
+    rc = session_send_bytes(sess, data + start, count);
+  }
+  file_cache_release(e);
+  return rc;
+}
+
+/*
+ * Small files are answered from file_cache when their cached attributes
+ * match an entry, with no open or read; a miss fills the entry on the way.
+ * Compressed reads always go to the file.
+ */
+int fs_cmd_read(struct client_session *sess, const char *path, long offset, long length) {
+  char full[PATH_MAX];
+  if (lock_for_read(sess, path, full, sizeof(full)) != 0) {
+    return 0;
+  }
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  struct attr_info info;
+  struct file_cache_entry *e = NULL;
+  if (!sess->payload_z && attr_cache_stat(ap.dirfd, ap.rel, full, &info) == 0 &&
+      (e = file_cache_get(&info)) != NULL) {
+    int rc = send_cached(sess, e, offset, length);
     locks_unlock(full);
-    return -1;
+    return rc;
   }
+  int fd = -1;
+  struct stat st;
+  if (open_locked(sess, full, &fd, &st) != 0) {
+    return 0;
+  }
+  int rc;
+  if (!sess->payload_z && (e = file_cache_fill(fd, &st)) != NULL) {
+    rc = send_cached(sess, e, offset, length);
+  } else {
+    size_t count = clamp_range(st.st_size, offset, length);
+    off_t start = offset < 0 ? 0 : (off_t)offset;
+    rc = session_reply(sess, "OK %zu", count);
+    if (rc == 0 && count > 0) {
+      rc = sess->payload_sparse ? session_send_sparse(sess, fd, start, count)
+                                : session_send_file(sess, fd, start, count);
+    }
+  }
+  close(fd);
+  locks_unlock(full);
+  return rc;
+}
 
-  char buf[4096];
-  while (remaining > 0) {
-    ssize_t n = read(fd, buf, sizeof(buf));
-    if (n <= 0) {
-      break;
+struct read_range {
+  long offset;
+  long length;
+};
+
+static int parse_ranges(const char *spec, struct read_range *out, size_t cap, size_t *count) {
+  *count = 0;
+  const char *p = spec;
+  while (*p) {
+    char *end = NULL;
+    long off = strtol(p, &end, 10);
+    if (end == p || *end != ':' || off < 0) {
+      return -1;
     }
-    if (send_blob(sess->fd, buf, (size_t)n) != 0) {
-      break;
+    p = end + 1;
+    long len = strtol(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0') || len < 0 || *count >= cap) {
+      return -1;
     }
-    remaining -= n;
+    out[*count].offset = off;
+    out[*count].length = len;
+    (*count)++;
+    p = *end == ',' ? end + 1 : end;
   }
+  return *count > 0 ? 0 : -1;
+}
 
+/*
+ * Several ranges of one file in a single response: "OK <count>", then per
+ * range a "RANGE <offset> <length>" line (length clamped to the file)
+ * followed by exactly that many bytes.
+ */
+int fs_cmd_readv(struct client_session *sess, const char *path, const char *spec) {
+  struct read_range ranges[READV_MAX_RANGES];
+  size_t count = 0;
+  if (parse_ranges(spec, ranges, READV_MAX_RANGES, &count) != 0) {
+    return session_err(sess, ERR_INVALID, "ranges must be off:len[,off:len...] (max %d)",
+                    READV_MAX_RANGES);
+  }
+  char full[PATH_MAX];
+  int fd = -1;
+  off_t size = 0;
+  if (open_for_read(sess, path, full, sizeof(full), &fd, &size) != 0) {
+    return 0;
+  }
+  int rc = session_reply(sess, "OK %zu", count);
+  for (size_t i = 0; rc == 0 && i < count; i++) {
+    size_t n = clamp_range(size, ranges[i].offset, ranges[i].length);
+    rc = session_line(sess, "RANGE %ld %zu", ranges[i].offset, n);
+    if (rc == 0 && n > 0) {
+      rc = session_send_file(sess, fd, (off_t)ranges[i].offset, n);
+    }
+  }
   close(fd);
   locks_unlock(full);
+  return rc;
+}
+
+/*
+ * The file is mapped rather than read, so hashing costs no copy into a
+ * buffer and runs at the speed of crc32c itself.
+ */
+static int crc32c_file(int fd, off_t size, uint32_t *out) {
+  uint32_t crc = 0;
+  if (size > 0) {
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      return -1;
+    }
+    posix_madvise(map, (size_t)size, POSIX_MADV_SEQUENTIAL);
+    crc = crc32c(0, map, (size_t)size);
+    munmap(map, (size_t)size);
+  }
+  *out = crc;
   return 0;
 }
 
-int fs_cmd_write(struct client_session *sess, const char *path, long offset, size_t size) {
+/* "OK <crc32c> <size>" of a file, so a copy can be checked without reading it back. */
+int fs_cmd_checksum(struct client_session *sess, const char *path) {
   char full[PATH_MAX];
-  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+  int fd = -1;
+  off_t size = 0;
+  if (open_for_read(sess, path, full, sizeof(full), &fd, &size) != 0) {
+    return 0;
   }
+  uint32_t crc = 0;
+  int rc = crc32c_file(fd, size, &crc);
+  close(fd);
+  locks_unlock(full);
+  if (rc != 0) {
+    return session_err(sess, ERR_IO, "checksum failed: %s", strerror(errno));
+  }
+  return session_reply(sess, "OK %08x %lld", (unsigned)crc, (long long)size);
+}
 
-  if (locks_wrlock(full) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+/*
+ * "OK <size> <block> <count>" and count signature entries of the file, for a
+ * client about to send a new version of it with delta.
+ */
+int fs_cmd_signature(struct client_session *sess, const char *path) {
+  char full[PATH_MAX];
+  int fd = -1;
+  off_t size = 0;
+  if (open_for_read(sess, path, full, sizeof(full), &fd, &size) != 0) {
+    return 0;
   }
-  struct stat st;
-  int exists = (stat(full, &st) == 0);
-  if (exists) {
-    if (meta_check_access(sess->cfg->root, full, sess->user, 0, 1, 0) != 0) {
-      locks_unlock(full);
-      return send_err(sess->fd, ERR_PERM, "permission denied");
+  uint32_t block = delta_block_size((uint64_t)size);
+  uint64_t count = ((uint64_t)size + block - 1) / block;
+  int rc = session_reply(sess, "OK %lld %u %llu", (long long)size, (unsigned)block,
+                         (unsigned long long)count);
+  if (rc == 0 && count > 0) {
+    rc = delta_send_signature(sess, fd, (uint64_t)size, block);
+  }
+  close(fd);
+  locks_unlock(full);
+  return rc;
+}
+
+/*
+ * The payload of write, upload or pwrite as it arrives: either exactly size
+ * bytes, or chunks until the empty one (FS_PAYLOAD_CHUNKED). Compressed, it
+ * is blocks up to the end block either way, and a sized one must decode to
+ * exactly size bytes.
+ */
+struct payload {
+  size_t left;
+  size_t total;
+  int chunked;
+  int done;
+  /* With a CRC trailer: the CRC of what arrived, and the one sent after it. */
+  int has_crc;
+  int trailer_read;
+  uint32_t crc;
+  uint32_t sent_crc;
+  /* Compressed: what is left of the decoded block. */
+  int z;
+  const unsigned char *block;
+  size_t block_left;
+};
+
+static void payload_init(struct client_session *sess, struct payload *pl, size_t size) {
+  pl->chunked = size == FS_PAYLOAD_CHUNKED;
+  pl->left = pl->chunked ? 0 : size;
+  pl->total = 0;
+  pl->done = 0;
+  pl->has_crc = sess->payload_crc;
+  pl->trailer_read = 0;
+  pl->crc = 0;
+  pl->sent_crc = 0;
+  pl->z = sess->payload_z;
+  pl->block = NULL;
+  pl->block_left = 0;
+}
+
+/* Decodes blocks until one has bytes or the end block arrives. */
+static int payload_fill_block(struct client_session *sess, struct payload *pl) {
+  while (pl->block_left == 0 && !pl->done) {
+    if (session_recv_block(sess, &pl->block, &pl->block_left) != 0) {
+      return -1;
+    }
+    pl->done = pl->block_left == 0;
+    /* Past the announced size, or short of it, nothing says what was meant. */
+    if (!pl->chunked && (pl->block_left > pl->left || (pl->done && pl->left > 0))) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Reads up to cap payload bytes into buf; *n == 0 once the payload is over. */
+static int payload_next(struct client_session *sess, struct payload *pl, void *buf, size_t cap,
+                        size_t *n) {
+  size_t take;
+  if (pl->z) {
+    if (payload_fill_block(sess, pl) != 0) {
+      return -1;
     }
+    take = pl->block_left < cap ? pl->block_left : cap;
+    memcpy(buf, pl->block, take);
+    pl->block += take;
+    pl->block_left -= take;
   } else {
-    char parent[PATH_MAX];
-    if (parent_dir(full, parent, sizeof(parent)) != 0 ||
-        meta_check_access(sess->cfg->root, parent, sess->user, 0, 1, 1) != 0) {
-      locks_unlock(full);
-      return send_err(sess->fd, ERR_PERM, "permission denied");
+    while (pl->left == 0 && pl->chunked && !pl->done) {
+      unsigned char hdr[CHUNK_HEADER_SIZE];
+      if (session_recv_blob(sess, hdr, sizeof(hdr)) != 0) {
+        return -1;
+      }
+      pl->left = chunk_header_unpack(hdr);
+      pl->done = pl->left == 0;
+    }
+    take = pl->left < cap ? pl->left : cap;
+    if (take > 0 && session_recv_blob(sess, buf, take) != 0) {
+      return -1;
+    }
+  }
+  if (take > 0 && pl->has_crc) {
+    pl->crc = crc32c(pl->crc, buf, take);
+  }
+  if (take == 0 && pl->has_crc && !pl->trailer_read) {
+    unsigned char trailer[CRC_TRAILER_SIZE];
+    if (session_recv_blob(sess, trailer, sizeof(trailer)) != 0) {
+      return -1;
+    }
+    pl->sent_crc = crc_trailer_unpack(trailer);
+    pl->trailer_read = 1;
+  }
+  /* Compressed and chunked, blocks alone delimit the payload and left stays 0. */
+  if (!pl->z || !pl->chunked) {
+    pl->left -= take;
+  }
+  pl->total += take;
+  *n = take;
+  return 0;
+}
+
+/* Whether a fully read payload matches its trailer, if it had one. */
+static int payload_intact(const struct payload *pl) {
+  return !pl->has_crc || pl->crc == pl->sent_crc;
+}
+
+static int payload_mismatch(struct client_session *sess, const struct payload *pl) {
+  return session_err(sess, ERR_CHECKSUM, "checksum mismatch: received %08x, sent %08x",
+                     (unsigned)pl->crc, (unsigned)pl->sent_crc);
+}
+
+/* Consumes what is left of a payload so the stream stays in sync. */
+static int payload_discard(struct client_session *sess, struct payload *pl) {
+  char buf[4096];
+  size_t n;
+  do {
+    if (payload_next(sess, pl, buf, sizeof(buf), &n) != 0) {
+      return -1;
     }
+  } while (n > 0);
+  return 0;
+}
+
+/* Refuses a write whose payload is already on its way; err 0 adds no reason. */
+static int refuse_write(struct client_session *sess, struct payload *pl, enum err_code code,
+                        const char *msg, int err) {
+  if (payload_discard(sess, pl) != 0) {
+    return -1;
+  }
+  if (err) {
+    return session_err(sess, code, "%s: %s", msg, strerror(err));
   }
+  return session_err(sess, code, "%s", msg);
+}
+
+/*
+ * Whether the session may write full: the file itself if it exists, else its
+ * directory. Sets *exists; the caller holds the write lock on full.
+ */
+static int may_write(struct client_session *sess, const char *full, const struct at_path *ap,
+                     int *exists) {
+  struct attr_info info;
+  *exists = (attr_cache_stat(ap->dirfd, ap->rel, full, &info) == 0);
+  if (*exists) {
+    return meta_check_access(sess->cfg->root, full, sess->user, 0, 1, 0);
+  }
+  char parent[PATH_MAX];
+  if (parent_dir(full, parent, sizeof(parent)) != 0) {
+    return -1;
+  }
+  return meta_check_access(sess->cfg->root, parent, sess->user, 0, 1, 1);
+}
 
-  int fd = open(full, O_WRONLY | O_CREAT, 0700);
+int fs_cmd_write(struct client_session *sess, const char *path, long offset, size_t size) {
+  struct payload pl;
+  payload_init(sess, &pl, size);
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return refuse_write(sess, &pl, ERR_PERM, "path outside home", 0);
+  }
+
+  if (locks_wrlock(full) != 0) {
+    return refuse_write(sess, &pl, ERR_IO, "lock failed", 0);
+  }
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  int exists = 0;
+  if (may_write(sess, full, &ap, &exists) != 0) {
+    locks_unlock(full);
+    return refuse_write(sess, &pl, ERR_PERM, "permission denied", 0);
+  }
+
+  if (exists && unshare_at(full, &ap) != 0) {
+    int saved = errno;
+    locks_unlock(full);
+    return refuse_write(sess, &pl, ERR_IO, "unshare failed", saved);
+  }
+  int fd = fsutil_openat_beneath(ap.dirfd, ap.rel, O_WRONLY | O_CREAT, 0700);
   if (fd < 0) {
+    int saved = errno;
     locks_unlock(full);
-    return send_err(sess->fd, ERR_IO, "open failed: %s", strerror(errno));
+    return refuse_write(sess, &pl, ERR_IO, "open failed", saved);
   }
   if (offset < 0) {
     offset = 0;
   }
   if (lseek(fd, offset, SEEK_SET) < 0) {
+    int saved = errno;
     close(fd);
     locks_unlock(full);
-    return send_err(sess->fd, ERR_IO, "seek failed: %s", strerror(errno));
+    return refuse_write(sess, &pl, ERR_IO, "seek failed", saved);
   }
 
-  size_t remaining = size;
   char buf[4096];
-  while (remaining > 0) {
-    size_t chunk = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-    if (recv_blob(sess->fd, buf, chunk) != 0) {
+  size_t n;
+  do {
+    if (payload_next(sess, &pl, buf, sizeof(buf), &n) != 0) {
       close(fd);
+      attr_cache_invalidate(full);
       locks_unlock(full);
-      return send_err(sess->fd, ERR_IO, "read from client failed");
+      return session_err(sess, ERR_IO, "read from client failed");
     }
-    if (write_full(fd, buf, chunk) < 0) {
+    if (n > 0 && write_full(fd, buf, n) < 0) {
+      int saved = errno;
       close(fd);
+      attr_cache_invalidate(full);
       locks_unlock(full);
-      return send_err(sess->fd, ERR_IO, "write failed: %s", strerror(errno));
+      return refuse_write(sess, &pl, ERR_IO, "write failed", saved);
     }
-    remaining -= chunk;
-  }
+  } while (n > 0);
 
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    file_cache_invalidate(st.st_dev, st.st_ino);
+  }
   close(fd);
   if (!exists) {
     meta_set(sess->cfg->root, full, sess->user, 0700);
   }
+  attr_cache_invalidate(full);
+  watch_notify(full, !exists);
   locks_unlock(full);
-  return sendf_line(sess->fd, "OK %zu", size);
+  if (!payload_intact(&pl)) {
+    return payload_mismatch(sess, &pl);
+  }
+  return session_reply(sess, "OK %zu", pl.total);
 }
 
+int fs_cmd_upload_open(struct client_session *sess, const char *path, size_t size) {
+  struct upload_record rec = {.size = size};
+  if (resolve_for_user(sess, path, rec.target, sizeof(rec.target), 0) != 0) {
+    return session_err(sess, ERR_PERM, "path outside home");
+  }
+  if (locks_wrlock(rec.target) != 0) {
+    return session_err(sess, ERR_IO, "lock failed");
+  }
+  struct at_path ap;
+  at_path_for(sess, rec.target, &ap);
+  int exists = 0;
+  int allowed = may_write(sess, rec.target, &ap, &exists) == 0;
+  locks_unlock(rec.target);
+  if (!allowed) {
+    return session_err(sess, ERR_PERM, "permission denied");
+  }
+  if (upload_count(sess->user) >= UPLOAD_MAX_PER_USER) {
+    return session_err(sess, ERR_BUSY, "too many open uploads");
+  }
+  snprintf(rec.user, sizeof(rec.user), "%s", sess->user);
+  if (upload_create(&rec) != 0) {
+    return session_err(sess, ERR_IO, "cannot start upload: %s", strerror(errno));
+  }
+  return session_reply(sess, "OK %s", rec.id);
+}
+
+/* Loads an upload of the session's user; anyone else's does not exist for it. */
+static int load_own_upload(struct client_session *sess, const char *id,
+                           struct upload_record *rec) {
+  if (upload_load(id, rec) != 0 || strcmp(rec->user, sess->user) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int fs_cmd_upload_status(struct client_session *sess, const char *id) {
+  struct upload_record rec;
+  if (load_own_upload(sess, id, &rec) != 0) {
+    return session_err(sess, ERR_NOT_FOUND, "no such upload");
+  }
+  return session_reply(sess, "OK %llu %llu %08x", (unsigned long long)rec.committed,
+                       (unsigned long long)rec.size, (unsigned)rec.crc);
+}
+
+/* Syncs what was written past the committed offset and commits it. */
+static int upload_checkpoint(int fd, struct upload_record *rec, uint64_t written,
+                             uint32_t crc) {
+  if (written == rec->committed) {
+    return 0;
+  }
+  if (fdatasync(fd) != 0) {
+    return -1;
+  }
+  rec->committed = written;
+  rec->crc = crc;
+  return upload_save(rec);
+}
+
+/* Makes a rename into full's directory durable. */
+static int sync_parent(const char *full) {
+  char parent[PATH_MAX];
+  if (parent_dir(full, parent, sizeof(parent)) != 0) {
+    return -1;
+  }
+  int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/*
+ * Optionally files from in the dedup store, then renames it onto the target;
+ * a failed ingest still renames.
+ */
+static int place_file(const char *from, const struct at_path *ap, uint64_t size,
+                      const char *user, int ingest) {
+  if (ingest) {
+    dedup_ingest(from, size, user);
+  }
+  return renameat(AT_FDCWD, from, ap->dirfd, ap->rel);
+}
+
+/*
+ * Moves the file at from, size bytes, onto target, checking access as write
+ * does, and replies. A replaced target's mode carries over unless from is
+ * already a link to a blob, which keeps the blob's. With ingest it is filed
+ * in the dedup store first. Sets *moved once from is gone. Under -fsync=2
+ * the directory is synced after.
+ */
+static int commit_file(struct client_session *sess, const char *from, const char *target,
+                       uint64_t size, int ingest, int *moved) {
+  *moved = 0;
+  if (locks_wrlock(target) != 0) {
+    return session_err(sess, ERR_IO, "lock failed");
+  }
+  struct at_path ap;
+  at_path_for(sess, target, &ap);
+  int exists = 0;
+  int rc;
+  struct stat old;
+  struct stat cur;
+  if (may_write(sess, target, &ap, &exists) != 0) {
+    rc = session_err(sess, ERR_PERM, "permission denied");
+  } else if (exists && fstatat(ap.dirfd, ap.rel, &old, AT_SYMLINK_NOFOLLOW) != 0) {
+    rc = session_err(sess, ERR_IO, "commit failed: %s", strerror(errno));
+  } else if (exists && stat(from, &cur) == 0 && cur.st_nlink == 1 &&
+             (cur.st_mode & 07777) != (old.st_mode & 07777) &&
+             chmod(from, old.st_mode & 07777) != 0) {
+    rc = session_err(sess, ERR_IO, "commit failed: %s", strerror(errno));
+  } else if (place_file(from, &ap, size, sess->user, ingest) != 0) {
+    rc = session_err(sess, ERR_IO, "commit failed: %s", strerror(errno));
+  } else {
+    *moved = 1;
+    if (sess->cfg->sync == SYNC_FULL) {
+      sync_parent(target);
+    }
+    if (exists) {
+      dedup_unref(&old);
+      file_cache_invalidate(old.st_dev, old.st_ino);
+    } else {
+      meta_set(sess->cfg->root, target, sess->user, 0700);
+    }
+    attr_cache_invalidate(target);
+    watch_notify(target, !exists);
+    rc = session_reply(sess, "OK %llu", (unsigned long long)size);
+  }
+  locks_unlock(target);
+  return rc;
+}
+
+/* Moves a fully received part onto its target. */
+static int upload_finish(struct client_session *sess, const char *part,
+                         const struct upload_record *rec) {
+  int moved;
+  int rc = commit_file(sess, part, rec->target, rec->committed, dedup_enabled(), &moved);
+  if (moved) {
+    upload_remove(rec->id);
+  }
+  return rc;
+}
+
+/*
+ * Receives a whole file into a staging file and renames it over path, so
+ * readers see the old version until the new one is complete and a failed
+ * upload leaves it as it was. The lock on path is only held to check access
+ * and to commit; the staging file gets path's mode, or 0700 for a new file.
+ */
 int fs_cmd_upload(struct client_session *sess, const char *path, size_t size) {
-  return fs_cmd_write(sess, path, 0, size);
+  struct payload pl;
+  payload_init(sess, &pl, size);
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return refuse_write(sess, &pl, ERR_PERM, "path outside home", 0);
+  }
+  if (locks_wrlock(full) != 0) {
+    return refuse_write(sess, &pl, ERR_IO, "lock failed", 0);
+  }
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  int exists = 0;
+  int allowed = may_write(sess, full, &ap, &exists) == 0;
+  struct stat old;
+  int mode = 0700;
+  if (allowed && exists && fstatat(ap.dirfd, ap.rel, &old, AT_SYMLINK_NOFOLLOW) == 0) {
+    mode = (int)(old.st_mode & 0777);
+  }
+  locks_unlock(full);
+  if (!allowed) {
+    return refuse_write(sess, &pl, ERR_PERM, "permission denied", 0);
+  }
+  char stage[PATH_MAX];
+  int fd = upload_stage_create(pl.chunked ? 0 : size, mode, stage, sizeof(stage));
+  if (fd < 0) {
+    return refuse_write(sess, &pl, ERR_IO, "cannot stage file", errno);
+  }
+
+  char buf[4096];
+  size_t n;
+  int failed = 0;
+  do {
+    if (payload_next(sess, &pl, buf, sizeof(buf), &n) != 0) {
+      close(fd);
+      unlink(stage);
+      return -1;
+    }
+    if (n > 0 && !failed && write_full(fd, buf, n) < 0) {
+      failed = errno ? errno : EIO;
+    }
+  } while (n > 0);
+  if (!failed && sess->cfg->sync != SYNC_NONE && fdatasync(fd) != 0) {
+    failed = errno ? errno : EIO;
+  }
+  close(fd);
+  if (failed || !payload_intact(&pl)) {
+    unlink(stage);
+    return failed ? session_err(sess, ERR_IO, "write failed: %s", strerror(failed))
+                  : payload_mismatch(sess, &pl);
+  }
+  int moved;
+  int rc = commit_file(sess, stage, full, pl.total, dedup_enabled(), &moved);
+  if (!moved) {
+    unlink(stage);
+  }
+  return rc;
+}
+
+/*
+ * Appends to an upload at its committed offset. Bytes are synced and
+ * committed every UPLOAD_CHECKPOINT_BYTES, at the end of the payload and also
+ * when the client goes away mid-payload, so a resume repeats nothing that
+ * reached the disk. The last byte moves the file into place.
+ */
+int fs_cmd_upload_data(struct client_session *sess, const char *id, long offset, size_t len) {
+  struct payload pl;
+  payload_init(sess, &pl, len);
+  char part[PATH_MAX];
+  struct upload_record rec;
+  if (upload_part_path(id, part, sizeof(part)) != 0) {
+    return refuse_write(sess, &pl, ERR_NOT_FOUND, "no such upload", 0);
+  }
+  if (locks_wrlock(part) != 0) {
+    return refuse_write(sess, &pl, ERR_IO, "lock failed", 0);
+  }
+  if (load_own_upload(sess, id, &rec) != 0) {
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_NOT_FOUND, "no such upload", 0);
+  }
+  if (upload_range_covered(id) > 0) {
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_INVALID, "upload has ranges, use upload_commit", 0);
+  }
+  if (offset < 0 || (uint64_t)offset != rec.committed) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "offset must be %llu", (unsigned long long)rec.committed);
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_INVALID, msg, 0);
+  }
+  int fd = open(part, O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, (off_t)rec.committed) != 0 ||
+      lseek(fd, (off_t)rec.committed, SEEK_SET) < 0) {
+    int saved = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_IO, "open failed", saved);
+  }
+
+  uint64_t written = rec.committed;
+  uint32_t crc = rec.crc;
+  const struct upload_record start = rec;
+  char buf[4096];
+  size_t n;
+  int failed = 0;
+  do {
+    if (payload_next(sess, &pl, buf, sizeof(buf), &n) != 0) {
+      upload_checkpoint(fd, &rec, written, crc);
+      close(fd);
+      locks_unlock(part);
+      return -1;
+    }
+    if (n == 0 || failed) {
+      continue;
+    }
+    if (written + n > rec.size) {
+      failed = EFBIG;
+    } else if (write_full(fd, buf, n) < 0) {
+      failed = errno ? errno : EIO;
+    } else {
+      written += n;
+      crc = crc32c(crc, buf, n);
+      if (written - rec.committed >= UPLOAD_CHECKPOINT_BYTES &&
+          upload_checkpoint(fd, &rec, written, crc) != 0) {
+        failed = errno ? errno : EIO;
+      }
+    }
+  } while (n > 0);
+  if (!failed && upload_checkpoint(fd, &rec, written, crc) != 0) {
+    failed = errno ? errno : EIO;
+  }
+  close(fd);
+  int rc;
+  if (!failed && !payload_intact(&pl)) {
+    /* Nothing of a corrupted payload stays committed, checkpoints included. */
+    rec = start;
+    upload_save(&rec);
+    rc = payload_mismatch(sess, &pl);
+  } else if (failed == EFBIG) {
+    rc = session_err(sess, ERR_INVALID, "payload beyond upload size");
+  } else if (failed) {
+    rc = session_err(sess, ERR_IO, "write failed: %s", strerror(failed));
+  } else if (rec.committed == rec.size) {
+    rc = upload_finish(sess, part, &rec);
+  } else {
+    rc = session_reply(sess, "OK %llu", (unsigned long long)rec.committed);
+  }
+  locks_unlock(part);
+  return rc;
+}
+
+/*
+ * One range of a parallel upload, written in place at its offset. Ranges of
+ * the same upload run at once on other connections: each holds the part's
+ * lock shared (so upload_data, which holds it exclusively, stays out) and a
+ * range lock on its own bytes, and is synced before it is acknowledged.
+ */
+int fs_cmd_upload_range(struct client_session *sess, const char *id, long offset, size_t len) {
+  struct payload pl;
+  payload_init(sess, &pl, len);
+  char part[PATH_MAX];
+  struct upload_record rec;
+  if (upload_part_path(id, part, sizeof(part)) != 0 || load_own_upload(sess, id, &rec) != 0) {
+    return refuse_write(sess, &pl, ERR_NOT_FOUND, "no such upload", 0);
+  }
+  if (pl.chunked || len == 0 || offset < 0 || (uint64_t)offset > rec.size ||
+      len > rec.size - (uint64_t)offset) {
+    return refuse_write(sess, &pl, ERR_INVALID, "range outside upload", 0);
+  }
+  uint64_t covered = 0;
+  if (upload_range_add(id, 0, 0, &covered) != 0) {
+    return refuse_write(sess, &pl, ERR_NOT_FOUND, "no such upload", 0);
+  }
+  if (locks_rdlock(part) != 0) {
+    return refuse_write(sess, &pl, ERR_IO, "lock failed", 0);
+  }
+  if (locks_range_lock(part, (uint64_t)offset, len) != 0) {
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_IO, "lock failed", 0);
+  }
+  int fd = open(part, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    int saved = errno;
+    locks_range_unlock(part, (uint64_t)offset, len);
+    locks_unlock(part);
+    return refuse_write(sess, &pl, ERR_IO, "open failed", saved);
+  }
+
+  char buf[UPLOAD_RANGE_BUF];
+  off_t pos = offset;
+  int failed = 0;
+  size_t chunk;
+  do {
+    if (payload_next(sess, &pl, buf, sizeof(buf), &chunk) != 0) {
+      close(fd);
+      locks_range_unlock(part, (uint64_t)offset, len);
+      locks_unlock(part);
+      return -1;
+    }
+    for (size_t done = 0; !failed && done < chunk;) {
+      ssize_t n = pwrite(fd, buf + done, chunk - done, pos + (off_t)done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        failed = errno ? errno : EIO;
+        break;
+      }
+      done += (size_t)n;
+    }
+    pos += (off_t)chunk;
+  } while (chunk > 0);
+  if (!failed && fdatasync(fd) != 0) {
+    failed = errno ? errno : EIO;
+  }
+  close(fd);
+  locks_range_unlock(part, (uint64_t)offset, len);
+  locks_unlock(part);
+  if (failed) {
+    return session_err(sess, ERR_IO, "write failed: %s", strerror(failed));
+  }
+  if (!payload_intact(&pl)) {
+    return payload_mismatch(sess, &pl);
+  }
+  if (upload_range_add(id, (uint64_t)offset, len, &covered) != 0) {
+    /* Committed, aborted or expired while the bytes were on their way. */
+    return session_err(sess, ERR_NOT_FOUND, "no such upload");
+  }
+  return session_reply(sess, "OK %llu", (unsigned long long)covered);
+}
+
+/* Completes a parallel upload once its ranges cover every byte. */
+int fs_cmd_upload_commit(struct client_session *sess, const char *id) {
+  char part[PATH_MAX];
+  struct upload_record rec;
+  if (upload_part_path(id, part, sizeof(part)) != 0) {
+    return session_err(sess, ERR_NOT_FOUND, "no such upload");
+  }
+  if (locks_wrlock(part) != 0) {
+    return session_err(sess, ERR_IO, "lock failed");
+  }
+  int rc;
+  uint64_t covered = 0;
+  if (load_own_upload(sess, id, &rec) != 0) {
+    rc = session_err(sess, ERR_NOT_FOUND, "no such upload");
+  } else if (rec.committed != rec.size && (covered = upload_range_covered(id)) != rec.size) {
+    rc = session_err(sess, ERR_INVALID, "%llu of %llu bytes received",
+                     (unsigned long long)covered, (unsigned long long)rec.size);
+  } else {
+    rec.committed = rec.size;
+    rc = upload_finish(sess, part, &rec);
+  }
+  locks_unlock(part);
+  return rc;
+}
+
+/* Drops an upload that will not be finished, with its part and ranges. */
+int fs_cmd_upload_abort(struct client_session *sess, const char *id) {
+  char part[PATH_MAX];
+  struct upload_record rec;
+  if (upload_part_path(id, part, sizeof(part)) != 0) {
+    return session_err(sess, ERR_NOT_FOUND, "no such upload");
+  }
+  if (locks_wrlock(part) != 0) {
+    return session_err(sess, ERR_IO, "lock failed");
+  }
+  int rc;
+  if (load_own_upload(sess, id, &rec) != 0) {
+    rc = session_err(sess, ERR_NOT_FOUND, "no such upload");
+  } else {
+    upload_remove(id);
+    rc = session_reply(sess, "OK");
+  }
+  locks_unlock(part);
+  return rc;
+}
+
+/* Refuses a delta whose instructions are already on their way. */
+static int refuse_delta(struct client_session *sess, enum err_code code, const char *msg,
+                        int err) {
+  struct delta_result res;
+  if (delta_apply(sess, -1, 0, DELTA_BLOCK_MIN, -1, &res) != 0) {
+    return -1;
+  }
+  if (err) {
+    return session_err(sess, code, "%s: %s", msg, strerror(err));
+  }
+  return session_err(sess, code, "%s", msg);
+}
+
+/*
+ * Rebuilds a file from its current version and the client's instructions.
+ * The new version is put together in an upload part file, read locked
+ * against the old one only while it is copied from, and moves over the old
+ * one only once its size and CRC-32C are those the client announced; until
+ * then readers see the old version whole.
+ */
+int fs_cmd_delta(struct client_session *sess, const char *path, uint32_t block, uint64_t size,
+                 uint32_t crc) {
+  struct upload_record rec = {.size = size};
+  if (block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX) {
+    return refuse_delta(sess, ERR_INVALID, "bad block size", 0);
+  }
+  if (resolve_for_user(sess, path, rec.target, sizeof(rec.target), 0) != 0) {
+    return refuse_delta(sess, ERR_PERM, "path outside home", 0);
+  }
+  if (locks_rdlock(rec.target) != 0) {
+    return refuse_delta(sess, ERR_IO, "lock failed", 0);
+  }
+  struct at_path ap;
+  at_path_for(sess, rec.target, &ap);
+  int exists = 0;
+  if (may_write(sess, rec.target, &ap, &exists) != 0 ||
+      (exists && meta_check_access(sess->cfg->root, rec.target, sess->user, 1, 0, 0) != 0)) {
+    locks_unlock(rec.target);
+    return refuse_delta(sess, ERR_PERM, "permission denied", 0);
+  }
+  int base = exists ? fsutil_openat_beneath(ap.dirfd, ap.rel, O_RDONLY, 0) : -1;
+  struct stat st;
+  if (base < 0 || fstat(base, &st) != 0) {
+    int saved = exists ? errno : ENOENT;
+    if (base >= 0) {
+      close(base);
+    }
+    locks_unlock(rec.target);
+    return refuse_delta(sess, ERR_NOT_FOUND, "open failed", saved);
+  }
+  snprintf(rec.user, sizeof(rec.user), "%s", sess->user);
+  char part[PATH_MAX];
+  int out = -1;
+  if (upload_create(&rec) != 0 || upload_part_path(rec.id, part, sizeof(part)) != 0 ||
+      (out = open(part, O_RDWR | O_CLOEXEC)) < 0) {
+    int saved = errno;
+    close(base);
+    locks_unlock(rec.target);
+    if (rec.id[0]) {
+      upload_remove(rec.id);
+    }
+    return refuse_delta(sess, ERR_IO, "cannot stage file", saved);
+  }
+
+  struct delta_result res;
+  int applied = delta_apply(sess, base, (uint64_t)st.st_size, block, out, &res);
+  close(base);
+  locks_unlock(rec.target);
+  off_t built = applied == 0 ? lseek(out, 0, SEEK_CUR) : -1;
+  uint32_t built_crc = 0;
+  int rc;
+  if (applied != 0) {
+    rc = -1;
+  } else if (res.bad) {
+    rc = session_err(sess, ERR_INVALID, "copy past the end of the file");
+  } else if (res.failed) {
+    rc = session_err(sess, ERR_IO, "write failed: %s", strerror(res.failed));
+  } else if (built < 0 || crc32c_file(out, built, &built_crc) != 0) {
+    rc = session_err(sess, ERR_IO, "checksum failed: %s", strerror(errno));
+  } else if ((uint64_t)built != size || built_crc != crc) {
+    /* Most likely the file changed since the client took its signature. */
+    rc = session_err(sess, ERR_CHECKSUM, "rebuilt %lld bytes with crc %08x, sent %llu and %08x",
+                     (long long)built, (unsigned)built_crc, (unsigned long long)size,
+                     (unsigned)crc);
+  } else if (fdatasync(out) != 0) {
+    rc = session_err(sess, ERR_IO, "sync failed: %s", strerror(errno));
+  } else {
+    close(out);
+    out = -1;
+    rec.committed = size;
+    rc = upload_finish(sess, part, &rec);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+  /* upload_finish has removed the record when the file moved. */
+  upload_remove(rec.id);
+  return rc;
+}
+
+int fs_cmd_upload_hash(struct client_session *sess, const char *path, uint64_t size,
+                       const char *hash) {
+  if (!dedup_enabled()) {
+    return session_err(sess, ERR_UNSUPPORTED, "deduplication is off");
+  }
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return session_err(sess, ERR_PERM, "path outside home");
+  }
+  char tmp[PATH_MAX];
+  if (dedup_link(sess->user, hash, size, tmp, sizeof(tmp)) != 0) {
+    return session_err(sess, ERR_NOT_FOUND, "no such content");
+  }
+  int moved;
+  int rc = commit_file(sess, tmp, full, size, 0, &moved);
+  if (moved) {
+    dedup_note_skipped(size);
+  } else {
+    /* Refused: the blob loses the link it just gained. */
+    struct stat st;
+    int had = stat(tmp, &st) == 0;
+    unlink(tmp);
+    if (had) {
+      dedup_unref(&st);
+    }
+  }
+  return rc;
 }
 
 int fs_cmd_download(struct client_session *sess, const char *path) {
-  return fs_cmd_read(sess, path, 0);
+  return fs_cmd_read(sess, path, 0, -1);
+}
+
+static struct session_handle *find_handle(struct client_session *sess, int id) {
+  if (id <= 0) {
+    return NULL;
+  }
+  for (size_t i = 0; i < SESSION_MAX_HANDLES; i++) {
+    if (sess->handles[i].id == id) {
+      return &sess->handles[i];
+    }
+  }
+  return NULL;
+}
+
+static void release_handle(struct session_handle *h) {
+  close(h->fd);
+  if (h->writable) {
+    attr_cache_invalidate(h->path);
+    watch_notify(h->path, 0);
+  }
+  free(h->path);
+  memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Resolves, checks permissions and opens once; later pread/pwrite calls go
+ * straight to the kept fd at explicit offsets with no lookup or lock. Like a
+ * POSIX fd, a handle keeps the access it was granted until it is closed.
+ */
+int fs_cmd_open(struct client_session *sess, const char *path, const char *mode) {
+  int readable = 0;
+  int writable = 0;
+  if (strcmp(mode, "r") == 0) {
+    readable = 1;
+  } else if (strcmp(mode, "w") == 0) {
+    writable = 1;
+  } else if (strcmp(mode, "rw") == 0) {
+    readable = 1;
+    writable = 1;
+  } else {
+    return session_err(sess, ERR_INVALID, "mode must be r, w or rw");
+  }
+  struct session_handle *slot = NULL;
+  for (size_t i = 0; i < SESSION_MAX_HANDLES && !slot; i++) {
+    if (sess->handles[i].id == 0) {
+      slot = &sess->handles[i];
+    }
+  }
+  if (!slot) {
+    return session_err(sess, ERR_BUSY, "too many open handles");
+  }
+
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return session_err(sess, ERR_PERM, "path outside home");
+  }
+  char *path_copy = strdup(full);
+  if (!path_copy) {
+    return session_err(sess, ERR_INTERNAL, "out of memory");
+  }
+  if ((writable ? locks_wrlock(full) : locks_rdlock(full)) != 0) {
+    free(path_copy);
+    return session_err(sess, ERR_IO, "lock failed");
+  }
+  struct at_path ap;
+  at_path_for(sess, full, &ap);
+  struct attr_info info;
+  int exists = (attr_cache_stat(ap.dirfd, ap.rel, full, &info) == 0);
+  int denied = 0;
+  if (exists) {
+    denied = S_ISDIR(info.mode) ||
+             meta_check_access(sess->cfg->root, full, sess->user, readable, writable, 0) != 0;
+  } else if (!writable) {
+    locks_unlock(full);
+    free(path_copy);
+    return session_err(sess, ERR_NOT_FOUND, "no such file");
+  } else {
+    char parent[PATH_MAX];
+    denied = parent_dir(full, parent, sizeof(parent)) != 0 ||
+             meta_check_access(sess->cfg->root, parent, sess->user, 0, 1, 1) != 0;
+  }
+  if (denied) {
+    locks_unlock(full);
+    free(path_copy);
+    return session_err(sess, ERR_PERM, "permission denied");
+  }
+
+  int flags = O_RDONLY;
+  if (writable) {
+    flags = (readable ? O_RDWR : O_WRONLY) | O_CREAT;
+  }
+  int fd = writable && exists && unshare_at(full, &ap) != 0
+               ? -1
+               : fsutil_openat_beneath(ap.dirfd, ap.rel, flags, 0700);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    int saved = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    locks_unlock(full);
+    free(path_copy);
+    return session_err(sess, ERR_IO, "open failed: %s", strerror(saved));
+  }
+  if (!exists) {
+    meta_set(sess->cfg->root, full, sess->user, 0700);
+    attr_cache_invalidate(full);
+    watch_notify(full, 1);
+  }
+  locks_unlock(full);
+
+  slot->id = ++sess->next_handle_id;
+  slot->fd = fd;
+  slot->readable = readable;
+  slot->writable = writable;
+  slot->path = path_copy;
+  return session_reply(sess, "OK %d %ld", slot->id, (long)st.st_size);
+}
+
+int fs_cmd_pread(struct client_session *sess, int handle, long offset, size_t len) {
+  struct session_handle *h = find_handle(sess, handle);
+  if (!h) {
+    return session_err(sess, ERR_NOT_FOUND, "no such handle");
+  }
+  if (!h->readable) {
+    return session_err(sess, ERR_PERM, "handle not open for reading");
+  }
+  struct stat st;
+  if (offset < 0 || fstat(h->fd, &st) != 0) {
+    return session_err(sess, ERR_INVALID, "bad offset");
+  }
+  size_t count = clamp_range(st.st_size, offset, len > (size_t)LONG_MAX ? -1 : (long)len);
+  if (session_reply(sess, "OK %zu", count) != 0) {
+    return -1;
+  }
+  return count > 0 ? session_send_file(sess, h->fd, (off_t)offset, count) : 0;
+}
+
+int fs_cmd_pwrite(struct client_session *sess, int handle, long offset, size_t len) {
+  struct payload pl;
+  payload_init(sess, &pl, len);
+  struct session_handle *h = find_handle(sess, handle);
+  if (!h) {
+    return refuse_write(sess, &pl, ERR_NOT_FOUND, "no such handle", 0);
+  }
+  if (!h->writable) {
+    return refuse_write(sess, &pl, ERR_PERM, "handle not open for writing", 0);
+  }
+  if (offset < 0) {
+    return refuse_write(sess, &pl, ERR_INVALID, "bad offset", 0);
+  }
+  char buf[4096];
+  off_t pos = offset;
+  int failed = 0;
+  size_t chunk;
+  do {
+    if (payload_next(sess, &pl, buf, sizeof(buf), &chunk) != 0) {
+      return -1;
+    }
+    for (size_t done = 0; !failed && done < chunk;) {
+      ssize_t n = pwrite(h->fd, buf + done, chunk - done, pos + (off_t)done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        failed = errno ? errno : EIO;
+        break;
+      }
+      done += (size_t)n;
+    }
+    pos += (off_t)chunk;
+  } while (chunk > 0);
+  struct stat st;
+  if (fstat(h->fd, &st) == 0) {
+    file_cache_invalidate(st.st_dev, st.st_ino);
+  }
+  attr_cache_invalidate(h->path);
+  if (failed) {
+    return session_err(sess, ERR_IO, "write failed: %s", strerror(failed));
+  }
+  if (!payload_intact(&pl)) {
+    return payload_mismatch(sess, &pl);
+  }
+  return session_reply(sess, "OK %zu", pl.total);
+}
+
+int fs_cmd_close(struct client_session *sess, int handle) {
+  struct session_handle *h = find_handle(sess, handle);
+  if (!h) {
+    return session_err(sess, ERR_NOT_FOUND, "no such handle");
+  }
+  release_handle(h);
+  return session_reply(sess, "OK");
+}
+
+int fs_cmd_watch(struct client_session *sess, const char *path) {
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return session_err(sess, ERR_PERM, "path outside home");
+  }
+  if (watch_add(&sess->mailbox, full, path) != 0) {
+    return session_err(sess, ERR_BUSY, "too many watches");
+  }
+  return session_reply(sess, "OK");
+}
+
+/* Notices already queued for the path go out before the reply, none after. */
+int fs_cmd_unwatch(struct client_session *sess, const char *path) {
+  char full[PATH_MAX];
+  if (resolve_for_user(sess, path, full, sizeof(full), 0) != 0) {
+    return session_err(sess, ERR_PERM, "path outside home");
+  }
+  if (watch_remove(&sess->mailbox, full) != 0) {
+    return session_err(sess, ERR_NOT_FOUND, "not watched");
+  }
+  if (session_drain_notices(sess) != 0) {
+    return -1;
+  }
+  return session_reply(sess, "OK");
+}
+
+void fs_close_handles(struct client_session *sess) {
+  for (size_t i = 0; i < SESSION_MAX_HANDLES; i++) {
+    if (sess->handles[i].id != 0) {
+      release_handle(&sess->handles[i]);
+    }
+  }
 }
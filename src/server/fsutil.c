@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "server/fsutil.h"
+
+#include "common/io.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#if defined(SYS_openat2)
+#include <linux/openat2.h>
+#endif
+#endif
+
+static atomic_uint_fast64_t g_clone_counts[3];
+static atomic_uint g_tmp_seq;
+static atomic_int g_openat2_missing;
+static atomic_uint_fast64_t g_holes;
+static atomic_uint_fast64_t g_hole_bytes;
+
+/*
+ * Opens rel beneath dirfd. Where the kernel has openat2 the walk is confined
+ * with RESOLVE_BENEATH, so neither ".." nor a symlink can leave dirfd; older
+ * kernels fall back to plain openat on an already-normalized rel.
+ */
+int fsutil_openat_beneath(int dirfd, const char *rel, int flags, int mode) {
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+  if (dirfd != AT_FDCWD && !atomic_load_explicit(&g_openat2_missing, memory_order_relaxed)) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = (unsigned long long)(flags | O_CLOEXEC);
+    how.mode = (flags & (O_CREAT | O_TMPFILE)) ? (unsigned long long)mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    long fd = syscall(SYS_openat2, dirfd, rel, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+      return (int)fd;
+    }
+    atomic_store_explicit(&g_openat2_missing, 1, memory_order_relaxed);
+  }
+#endif
+  return openat(dirfd, rel, flags | O_CLOEXEC, (mode_t)mode);
+}
+
+int fsutil_open_dir(int dirfd, const char *rel) {
+  return fsutil_openat_beneath(dirfd, rel, O_PATH | O_DIRECTORY, 0);
+}
+
+/*
+ * Sends len bytes of fd starting at off, with sendfile where available so the
+ * data never passes through user space. A file shorter than announced is zero
+ * padded, so a length already promised to the peer always holds.
+ */
+int fsutil_send_range(int sock, int fd, off_t off, size_t len) {
+#if defined(__linux__)
+  while (len > 0) {
+    size_t want = len > (size_t)1 << 30 ? (size_t)1 << 30 : len;
+    ssize_t n = sendfile(sock, fd, &off, want);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      break;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    len -= (size_t)n;
+  }
+#endif
+  char buf[4096];
+  while (len > 0) {
+    size_t chunk = len > sizeof(buf) ? sizeof(buf) : len;
+    ssize_t n = pread(fd, buf, chunk, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      memset(buf, 0, chunk);
+      n = (ssize_t)chunk;
+    }
+    if (write_full(sock, buf, (size_t)n) < 0) {
+      return -1;
+    }
+    off += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/*
+ * Appends len bytes of in_fd from off at out_fd's position, with
+ * copy_file_range where available so the kernel (or the filesystem, by
+ * sharing extents) does the copy. Fails if in_fd ends first.
+ */
+int fsutil_copy_range(int in_fd, off_t off, int out_fd, size_t len) {
+#if defined(__linux__)
+  while (len > 0) {
+    ssize_t n = copy_file_range(in_fd, &off, out_fd, NULL, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP)) {
+      break;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    len -= (size_t)n;
+  }
+#endif
+  char buf[65536];
+  while (len > 0) {
+    size_t chunk = len > sizeof(buf) ? sizeof(buf) : len;
+    ssize_t n = pread(in_fd, buf, chunk, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || write_full(out_fd, buf, (size_t)n) < 0) {
+      return -1;
+    }
+    off += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+void fsutil_extent(int fd, off_t off, off_t end, int *hole, off_t *len) {
+  *hole = 0;
+  *len = end - off;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t data = lseek(fd, off, SEEK_DATA);
+  if (data < 0 && errno == ENXIO) {
+    /* No data from off on: the rest is a hole. */
+    *hole = 1;
+  } else if (data > off) {
+    *hole = 1;
+    *len = (data < end ? data : end) - off;
+  } else if (data == off) {
+    off_t next = lseek(fd, off, SEEK_HOLE);
+    if (next > off && next < end) {
+      *len = next - off;
+    }
+  }
+  if (*hole) {
+    atomic_fetch_add_explicit(&g_holes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_hole_bytes, (uint64_t)*len, memory_order_relaxed);
+  }
+#else
+  (void)fd;
+#endif
+}
+
+/* Copies the data extents only; holes stay holes, and ftruncate sets the size. */
+int fsutil_copy_file(const char *src, const char *dst) {
+  int in_fd = open(src, O_RDONLY);
+  if (in_fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  int out_fd = fstat(in_fd, &st) == 0 ? open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0700) : -1;
+  if (out_fd < 0) {
+    close(in_fd);
+    return -1;
+  }
+  int rc = 0;
+  off_t off = 0;
+  while (rc == 0 && off < st.st_size) {
+    int hole;
+    off_t len;
+    fsutil_extent(in_fd, off, st.st_size, &hole, &len);
+    if (!hole && (lseek(out_fd, off, SEEK_SET) < 0 ||
+                  fsutil_copy_range(in_fd, off, out_fd, (size_t)len) != 0)) {
+      rc = -1;
+    }
+    off += len;
+  }
+  if (rc == 0 && ftruncate(out_fd, st.st_size) != 0) {
+    rc = -1;
+  }
+  close(in_fd);
+  if (close(out_fd) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+static int reflink_file(const char *src, const char *dst) {
+#if defined(__linux__) && defined(FICLONE)
+  int in_fd = open(src, O_RDONLY);
+  if (in_fd < 0) {
+    return -1;
+  }
+  int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0700);
+  if (out_fd < 0) {
+    close(in_fd);
+    return -1;
+  }
+  int rc = ioctl(out_fd, FICLONE, in_fd);
+  close(in_fd);
+  close(out_fd);
+  if (rc != 0) {
+    unlink(dst);
+    return -1;
+  }
+  return 0;
+#else
+  (void)src;
+  (void)dst;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+static int tmp_sibling(const char *path, char *out, size_t cap) {
+  unsigned seq = atomic_fetch_add(&g_tmp_seq, 1);
+  if (snprintf(out, cap, "%s.csap-tmp-%ld-%u", path, (long)getpid(), seq) >= (int)cap) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Materializes dst from src and atomically replaces whatever dst was.
+ * Tries a reflink first (independent inode, shared extents), then a hardlink
+ * when the caller allows sharing the inode, and finally a byte copy.
+ * Returns the fsutil_clone_kind used, or -1.
+ */
+int fsutil_clone_file(const char *src, const char *dst, int allow_hardlink) {
+  if (!src || !dst) {
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (tmp_sibling(dst, tmp, sizeof(tmp)) != 0) {
+    return -1;
+  }
+  int kind;
+  if (reflink_file(src, tmp) == 0) {
+    kind = FSUTIL_CLONE_REFLINK;
+  } else if (allow_hardlink && link(src, tmp) == 0) {
+    kind = FSUTIL_CLONE_HARDLINK;
+  } else if (fsutil_copy_file(src, tmp) == 0) {
+    kind = FSUTIL_CLONE_COPY;
+  } else {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    return -1;
+  }
+  if (rename(tmp, dst) != 0) {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    return -1;
+  }
+  atomic_fetch_add(&g_clone_counts[kind], 1);
+  return kind;
+}
+
+/*
+ * Reserves len bytes of blocks for fd without changing its size, so a file
+ * written front to back gets few, large extents and a full disk shows up
+ * before the first byte. Where the filesystem cannot, writes allocate as usual.
+ */
+int fsutil_preallocate(int fd, off_t len) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  if (len <= 0) {
+    return 0;
+  }
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len) == 0) {
+    return 0;
+  }
+  return errno == EOPNOTSUPP || errno == ENOSYS ? 0 : -1;
+#else
+  (void)fd;
+  (void)len;
+  return 0;
+#endif
+}
+
+/* Gives a hardlinked file its own inode before it is modified in place. */
+int fsutil_break_link(const char *path) {
+  struct stat st;
+  if (!path || stat(path, &st) != 0) {
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_nlink <= 1) {
+    return 0;
+  }
+  if (fsutil_clone_file(path, path, 0) < 0) {
+    return -1;
+  }
+  return chmod(path, (st.st_mode & 0777) | S_IRUSR | S_IWUSR);
+}
+
+int fsutil_remove_tree(const char *path) {
+  struct stat st;
+  if (!path || lstat(path, &st) != 0) {
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return unlink(path);
+  }
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+  int rc = 0;
+  struct dirent *ent;
+  char child[PATH_MAX];
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(child, sizeof(child), "%s/%s", path, ent->d_name) >= (int)sizeof(child) ||
+        fsutil_remove_tree(child) != 0) {
+      rc = -1;
+    }
+  }
+  closedir(dir);
+  if (rmdir(path) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+int fsutil_mkdir_p(const char *path, int mode) {
+  if (!path || !path[0]) {
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s", path) >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  for (char *p = tmp + 1; *p; p++) {
+    if (*p != '/') {
+      continue;
+    }
+    *p = '\0';
+    if (mkdir(tmp, (mode_t)mode) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    *p = '/';
+  }
+  if (mkdir(tmp, (mode_t)mode) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  return 0;
+}
+
+void fsutil_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "clone.reflinks %llu\n",
+                 (unsigned long long)atomic_load(&g_clone_counts[FSUTIL_CLONE_REFLINK]));
+  strbuf_appendf(sb, "clone.hardlinks %llu\n",
+                 (unsigned long long)atomic_load(&g_clone_counts[FSUTIL_CLONE_HARDLINK]));
+  strbuf_appendf(sb, "clone.copies %llu\n",
+                 (unsigned long long)atomic_load(&g_clone_counts[FSUTIL_CLONE_COPY]));
+  strbuf_appendf(sb, "sparse.holes %llu\n", (unsigned long long)atomic_load(&g_holes));
+  strbuf_appendf(sb, "sparse.hole_bytes %llu\n", (unsigned long long)atomic_load(&g_hole_bytes));
+}
@@ -1,12 +1,22 @@
 #include "server/locks.h"
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+struct held_range {
+  uint64_t offset;
+  uint64_t len;
+  struct held_range *next;
+};
+
 struct lock_entry {
   char *path;
   pthread_rwlock_t lock;
+  /* Byte ranges held with locks_range_lock, guarded by g_mu. */
+  struct held_range *ranges;
+  pthread_cond_t ranges_cv;
   struct lock_entry *next;
 };
 
@@ -34,7 +44,8 @@ static struct lock_entry *lock_entry_get(const char *path) {
     cur = calloc(1, sizeof(*cur));
     if (cur) {
       cur->path = strdup(path);
-      if (!cur->path || pthread_rwlock_init(&cur->lock, NULL) != 0) {
+      if (!cur->path || pthread_rwlock_init(&cur->lock, NULL) != 0 ||
+          pthread_cond_init(&cur->ranges_cv, NULL) != 0) {
         free(cur->path);
         free(cur);
         cur = NULL;
@@ -127,3 +138,63 @@ void locks_unlock_pair(const char *path1, const char *path2) {
   locks_unlock(second);
   locks_unlock(first);
 }
+
+static int ranges_overlap(const struct held_range *r, uint64_t offset, uint64_t len) {
+  return offset < r->offset + r->len && r->offset < offset + len;
+}
+
+/*
+ * Exclusive lock on [offset, offset + len) of path, for writers that put
+ * disjoint parts of one file in place at once. It is independent of the
+ * path's rwlock: callers hold that shared so whole-file writers stay out.
+ */
+int locks_range_lock(const char *path, uint64_t offset, uint64_t len) {
+  if (!path || len == 0) {
+    return -1;
+  }
+  struct held_range *held = malloc(sizeof(*held));
+  if (!held) {
+    return -1;
+  }
+  struct lock_entry *entry = lock_entry_get(path);
+  if (!entry) {
+    free(held);
+    return -1;
+  }
+  held->offset = offset;
+  held->len = len;
+  pthread_mutex_lock(&g_mu);
+  for (;;) {
+    const struct held_range *r = entry->ranges;
+    while (r && !ranges_overlap(r, offset, len)) {
+      r = r->next;
+    }
+    if (!r) {
+      break;
+    }
+    pthread_cond_wait(&entry->ranges_cv, &g_mu);
+  }
+  held->next = entry->ranges;
+  entry->ranges = held;
+  pthread_mutex_unlock(&g_mu);
+  return 0;
+}
+
+void locks_range_unlock(const char *path, uint64_t offset, uint64_t len) {
+  if (!path) {
+    return;
+  }
+  pthread_mutex_lock(&g_mu);
+  struct lock_entry *entry = lock_entry_find(path);
+  struct held_range **pp = entry ? &entry->ranges : NULL;
+  while (pp && *pp && ((*pp)->offset != offset || (*pp)->len != len)) {
+    pp = &(*pp)->next;
+  }
+  if (pp && *pp) {
+    struct held_range *held = *pp;
+    *pp = held->next;
+    free(held);
+    pthread_cond_broadcast(&entry->ranges_cv);
+  }
+  pthread_mutex_unlock(&g_mu);
+}
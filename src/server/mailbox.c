@@ -0,0 +1,206 @@
+#include "server/mailbox.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static atomic_uint_fast64_t g_enqueued;
+static atomic_uint_fast64_t g_delivered;
+static atomic_uint_fast64_t g_dropped;
+static atomic_uint_fast64_t g_latency_sum_ns;
+static atomic_uint_fast64_t g_latency_max_ns;
+static atomic_uint_fast64_t g_depth_max;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void atomic_max(atomic_uint_fast64_t *dst, uint64_t val) {
+  uint_fast64_t cur = atomic_load_explicit(dst, memory_order_relaxed);
+  while (cur < val &&
+         !atomic_compare_exchange_weak_explicit(dst, &cur, val, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+int mailbox_init(struct mailbox *mb, size_t cap) {
+  if (!mb) {
+    return -1;
+  }
+  size_t n = 2;
+  while (n < cap) {
+    n <<= 1;
+  }
+  memset(mb, 0, sizeof(*mb));
+  mb->efd = -1;
+  mb->slots = calloc(n, sizeof(*mb->slots));
+  if (!mb->slots) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    atomic_init(&mb->slots[i].seq, i);
+  }
+  mb->mask = n - 1;
+  atomic_init(&mb->head, 0);
+  atomic_init(&mb->tail, 0);
+  mb->efd = eventfd(0, EFD_NONBLOCK);
+  if (mb->efd < 0) {
+    free(mb->slots);
+    mb->slots = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static char *mailbox_take(struct mailbox *mb, uint64_t *enq_ns) {
+  size_t pos = atomic_load_explicit(&mb->tail, memory_order_relaxed);
+  struct mailbox_slot *slot = &mb->slots[pos & mb->mask];
+  size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq != pos + 1) {
+    return NULL;
+  }
+  char *msg = slot->msg;
+  if (enq_ns) {
+    *enq_ns = slot->enq_ns;
+  }
+  slot->msg = NULL;
+  atomic_store_explicit(&slot->seq, pos + mb->mask + 1, memory_order_release);
+  atomic_store_explicit(&mb->tail, pos + 1, memory_order_relaxed);
+  return msg;
+}
+
+void mailbox_destroy(struct mailbox *mb) {
+  if (!mb || !mb->slots) {
+    return;
+  }
+  char *msg;
+  while ((msg = mailbox_take(mb, NULL)) != NULL) {
+    free(msg);
+  }
+  free(mb->slots);
+  mb->slots = NULL;
+  if (mb->efd >= 0) {
+    close(mb->efd);
+    mb->efd = -1;
+  }
+}
+
+static int mailbox_wake(struct mailbox *mb) {
+  uint64_t one = 1;
+  if (write(mb->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    return -1;
+  }
+  return 0;
+}
+
+int mailbox_post(struct mailbox *mb, const char *line) {
+  if (!mb || !mb->slots || !line) {
+    return -1;
+  }
+  char *copy = strdup(line);
+  if (!copy) {
+    return -1;
+  }
+  size_t pos = atomic_load_explicit(&mb->head, memory_order_relaxed);
+  struct mailbox_slot *slot;
+  while (1) {
+    slot = &mb->slots[pos & mb->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&mb->head, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      free(copy);
+      atomic_fetch_add_explicit(&mb->dropped, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&g_dropped, 1, memory_order_relaxed);
+      mailbox_wake(mb);
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&mb->head, memory_order_relaxed);
+    }
+  }
+
+  slot->msg = copy;
+  slot->enq_ns = now_ns();
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+  size_t depth = pos + 1 - atomic_load_explicit(&mb->tail, memory_order_relaxed);
+  atomic_max(&g_depth_max, depth);
+  atomic_fetch_add_explicit(&mb->enqueued, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_enqueued, 1, memory_order_relaxed);
+  return mailbox_wake(mb);
+}
+
+int mailbox_postf(struct mailbox *mb, const char *fmt, ...) {
+  char buf[4096];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= sizeof(buf)) {
+    return -1;
+  }
+  return mailbox_post(mb, buf);
+}
+
+int mailbox_wait_fd(const struct mailbox *mb) {
+  return mb ? mb->efd : -1;
+}
+
+int mailbox_drain(struct mailbox *mb, mailbox_emit_fn emit, void *ctx) {
+  if (!mb || !mb->slots) {
+    return -1;
+  }
+  uint64_t ticks;
+  if (read(mb->efd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) {
+    return -1;
+  }
+  int rc = 0;
+  uint64_t enq_ns = 0;
+  char *msg;
+  while ((msg = mailbox_take(mb, &enq_ns)) != NULL) {
+    if (rc == 0 && emit(ctx, msg) != 0) {
+      rc = -1;
+    }
+    free(msg);
+    if (rc == 0) {
+      uint64_t lat = now_ns() - enq_ns;
+      atomic_fetch_add_explicit(&g_latency_sum_ns, lat, memory_order_relaxed);
+      atomic_max(&g_latency_max_ns, lat);
+      atomic_fetch_add_explicit(&mb->delivered, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&g_delivered, 1, memory_order_relaxed);
+    }
+  }
+  uint64_t dropped = atomic_load_explicit(&mb->dropped, memory_order_relaxed);
+  if (rc == 0 && dropped != mb->dropped_reported) {
+    char line[64];
+    snprintf(line, sizeof(line), "NOTICE DROPPED %llu",
+             (unsigned long long)(dropped - mb->dropped_reported));
+    rc = emit(ctx, line);
+    mb->dropped_reported = dropped;
+  }
+  return rc;
+}
+
+void mailbox_stats_append(struct strbuf *sb) {
+  uint64_t delivered = atomic_load(&g_delivered);
+  uint64_t lat_sum = atomic_load(&g_latency_sum_ns);
+  strbuf_appendf(sb, "mailbox.enqueued %llu\n", (unsigned long long)atomic_load(&g_enqueued));
+  strbuf_appendf(sb, "mailbox.delivered %llu\n", (unsigned long long)delivered);
+  strbuf_appendf(sb, "mailbox.dropped %llu\n", (unsigned long long)atomic_load(&g_dropped));
+  strbuf_appendf(sb, "mailbox.depth_max %llu\n", (unsigned long long)atomic_load(&g_depth_max));
+  strbuf_appendf(sb, "mailbox.latency_avg_us %llu\n",
+                 (unsigned long long)(delivered ? lat_sum / delivered / 1000 : 0));
+  strbuf_appendf(sb, "mailbox.latency_max_us %llu\n",
+                 (unsigned long long)(atomic_load(&g_latency_max_ns) / 1000));
+}
@@ -1,12 +1,18 @@
+#include "server/attr_cache.h"
 #include "server/config.h"
+#include "server/dedup.h"
+#include "server/file_cache.h"
+#include "server/fsutil.h"
 #include "server/net_server.h"
 #include "server/session.h"
 #include "server/signals.h"
 #include "server/locks.h"
 #include "server/transfer.h"
+#include "server/uploads.h"
 #include "server/users.h"
 #include "common/log.h"
 
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -21,7 +27,12 @@ struct thread_args {
 static void *client_thread(void *arg) {
   struct thread_args *args = (struct thread_args *)arg;
   struct client_session sess;
-  session_init(&sess, args->fd, args->cfg);
+  if (session_init(&sess, args->fd, args->cfg) != 0) {
+    perror("session");
+    close(args->fd);
+    free(args);
+    return NULL;
+  }
   session_run(&sess);
   session_close(&sess);
   free(args);
@@ -31,20 +42,44 @@ static void *client_thread(void *arg) {
 int main(int argc, char **argv) {
   struct server_config cfg;
   if (server_config_parse(&cfg, argc, argv) != 0) {
-    fprintf(stderr, "Usage: %s <root> <ip> <port>\n", argv[0]);
+    fprintf(stderr,
+            "Usage: %s <root> <ip> <port> [-attr-cache=<entries>] [-attr-watch=0|1] "
+            "[-file-cache=<MiB>] [-dedup=0|1] [-fsync=0|1|2]\n",
+            argv[0]);
     return 1;
   }
 
   server_setup_signals();
+  if (attr_cache_init(cfg.attr_cache_entries, cfg.attr_watch) != 0) {
+    perror("attr cache");
+    return 1;
+  }
+  if (file_cache_init(cfg.file_cache_mb) != 0) {
+    perror("file cache");
+    return 1;
+  }
   if (users_init(cfg.root) != 0) {
     perror("init root");
     return 1;
   }
+  cfg.root_fd = fsutil_open_dir(AT_FDCWD, cfg.root);
+  if (cfg.root_fd < 0) {
+    perror("open root");
+    return 1;
+  }
   if (locks_init() != 0) {
     perror("locks_init");
     return 1;
   }
-  transfer_init();
+  transfer_init(cfg.root);
+  if (uploads_init(cfg.root) != 0) {
+    perror("uploads_init");
+    return 1;
+  }
+  if (dedup_init(cfg.root, cfg.dedup) != 0) {
+    perror("dedup_init");
+    return 1;
+  }
 
   int listen_fd = server_listen(&cfg);
   if (listen_fd < 0) {
@@ -1,6 +1,7 @@
 #include "server/meta.h"
 
 #include "common/path_sandbox.h"
+#include "server/attr_cache.h"
 
 #include <errno.h>
 #include <limits.h>
@@ -194,6 +195,10 @@ int meta_get(const char *root, const char *path, char *owner, size_t owner_cap,
   if (!path || !perm) {
     return -1;
   }
+  int cached = attr_cache_get_meta(path, owner, owner_cap, perm);
+  if (cached >= 0) {
+    return cached ? 0 : -1;
+  }
   pthread_mutex_lock(&g_meta_mu);
   struct meta_entry *entries = NULL;
   size_t count = 0;
@@ -203,6 +208,7 @@ int meta_get(const char *root, const char *path, char *owner, size_t owner_cap,
   }
   int idx = find_entry(entries, count, path);
   if (idx < 0) {
+    attr_cache_put_meta(path, NULL, 0);
     free_entries(entries, count);
     pthread_mutex_unlock(&g_meta_mu);
     return -1;
@@ -211,6 +217,7 @@ int meta_get(const char *root, const char *path, char *owner, size_t owner_cap,
     snprintf(owner, owner_cap, "%s", entries[idx].owner);
   }
   *perm = entries[idx].perm & 0770;
+  attr_cache_put_meta(path, entries[idx].owner, *perm);
   free_entries(entries, count);
   pthread_mutex_unlock(&g_meta_mu);
   return 0;
@@ -256,6 +263,9 @@ int meta_set(const char *root, const char *path, const char *owner, int perm) {
   }
 
   int rc = save_entries(root, entries, count);
+  if (rc == 0) {
+    attr_cache_put_meta(path, owner, perm & 0770);
+  }
   free_entries(entries, count);
   pthread_mutex_unlock(&g_meta_mu);
   return rc;
@@ -280,6 +290,9 @@ int meta_remove(const char *root, const char *path) {
     count--;
   }
   int rc = save_entries(root, entries, count);
+  if (rc == 0) {
+    attr_cache_put_meta(path, NULL, 0);
+  }
   free_entries(entries, count);
   pthread_mutex_unlock(&g_meta_mu);
   return rc;
@@ -321,6 +334,8 @@ int meta_move(const char *root, const char *old_path, const char *new_path) {
     }
   }
   int rc = save_entries(root, entries, count);
+  attr_cache_invalidate_tree(old_path);
+  attr_cache_invalidate_tree(new_path);
   free_entries(entries, count);
   pthread_mutex_unlock(&g_meta_mu);
   return rc;
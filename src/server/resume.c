@@ -0,0 +1,143 @@
+#include "server/resume.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+struct resume_entry {
+  char token[RESUME_TOKEN_LEN + 1];
+  char user[64];
+  int home_fd;
+  time_t expires;
+};
+
+static struct {
+  pthread_mutex_t mu;
+  struct resume_entry entries[RESUME_MAX_TOKENS];
+} g_resume = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static atomic_uint_fast64_t g_issued;
+static atomic_uint_fast64_t g_claims;
+static atomic_uint_fast64_t g_rejects;
+
+static time_t now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Compares in time independent of where the first difference is. */
+static int token_equal(const char *a, const char *b) {
+  unsigned char diff = 0;
+  for (size_t i = 0; i < RESUME_TOKEN_LEN; i++) {
+    diff |= (unsigned char)(a[i] ^ b[i]);
+  }
+  return diff == 0;
+}
+
+static void drop_locked(struct resume_entry *e) {
+  close(e->home_fd);
+  memset(e, 0, sizeof(*e));
+}
+
+int resume_issue(const char *user, int home_fd, char *token, size_t cap) {
+  unsigned char raw[RESUME_TOKEN_LEN / 2];
+  if (cap <= RESUME_TOKEN_LEN || strlen(user) >= sizeof(((struct resume_entry *)0)->user) ||
+      getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) {
+    return -1;
+  }
+  int fd = fcntl(home_fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(raw); i++) {
+    snprintf(token + 2 * i, 3, "%02x", raw[i]);
+  }
+  time_t now = now_sec();
+  pthread_mutex_lock(&g_resume.mu);
+  struct resume_entry *slot = NULL;
+  struct resume_entry *oldest = NULL;
+  for (size_t i = 0; i < RESUME_MAX_TOKENS; i++) {
+    struct resume_entry *e = &g_resume.entries[i];
+    if (e->token[0] && e->expires <= now) {
+      drop_locked(e);
+    }
+    if (!e->token[0]) {
+      slot = slot ? slot : e;
+    } else if (!oldest || e->expires < oldest->expires) {
+      oldest = e;
+    }
+  }
+  if (!slot) {
+    slot = oldest;
+    drop_locked(slot);
+  }
+  snprintf(slot->token, sizeof(slot->token), "%s", token);
+  snprintf(slot->user, sizeof(slot->user), "%s", user);
+  slot->home_fd = fd;
+  slot->expires = now + RESUME_TTL_SEC;
+  pthread_mutex_unlock(&g_resume.mu);
+  atomic_fetch_add_explicit(&g_issued, 1, memory_order_relaxed);
+  return 0;
+}
+
+/* On success *home_fd is a new descriptor for the user's home. */
+int resume_claim(const char *token, char *user, size_t user_cap, int *home_fd) {
+  if (strlen(token) != RESUME_TOKEN_LEN) {
+    atomic_fetch_add_explicit(&g_rejects, 1, memory_order_relaxed);
+    return -1;
+  }
+  time_t now = now_sec();
+  int rc = -1;
+  pthread_mutex_lock(&g_resume.mu);
+  for (size_t i = 0; i < RESUME_MAX_TOKENS; i++) {
+    struct resume_entry *e = &g_resume.entries[i];
+    if (!e->token[0] || !token_equal(e->token, token)) {
+      continue;
+    }
+    if (e->expires <= now) {
+      drop_locked(e);
+      break;
+    }
+    *home_fd = fcntl(e->home_fd, F_DUPFD_CLOEXEC, 0);
+    if (*home_fd >= 0 && snprintf(user, user_cap, "%s", e->user) < (int)user_cap) {
+      e->expires = now + RESUME_TTL_SEC;
+      rc = 0;
+    } else if (*home_fd >= 0) {
+      close(*home_fd);
+    }
+    break;
+  }
+  pthread_mutex_unlock(&g_resume.mu);
+  atomic_fetch_add_explicit(rc == 0 ? &g_claims : &g_rejects, 1, memory_order_relaxed);
+  return rc;
+}
+
+void resume_revoke(const char *token) {
+  if (strlen(token) != RESUME_TOKEN_LEN) {
+    return;
+  }
+  pthread_mutex_lock(&g_resume.mu);
+  for (size_t i = 0; i < RESUME_MAX_TOKENS; i++) {
+    struct resume_entry *e = &g_resume.entries[i];
+    if (e->token[0] && token_equal(e->token, token)) {
+      drop_locked(e);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_resume.mu);
+}
+
+void resume_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "resume.issued %llu\n", (unsigned long long)atomic_load(&g_issued));
+  strbuf_appendf(sb, "resume.claims %llu\n", (unsigned long long)atomic_load(&g_claims));
+  strbuf_appendf(sb, "resume.rejects %llu\n", (unsigned long long)atomic_load(&g_rejects));
+}
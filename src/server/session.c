@@ -1,51 +1,102 @@
 #include "server/session.h"
 
+#include "common/crc32c.h"
 #include "common/error.h"
+#include "common/io.h"
+#include "common/lz.h"
+#include "common/mux.h"
 #include "common/perm.h"
 #include "common/protocol.h"
+#include "common/strbuf.h"
+#include "server/attr_cache.h"
+#include "server/dedup.h"
+#include "server/delta.h"
+#include "server/file_cache.h"
 #include "server/fs_ops.h"
+#include "server/fsutil.h"
+#include "server/resume.h"
 #include "server/transfer.h"
+#include "server/uploads.h"
 #include "server/users.h"
+#include "server/watch.h"
 #include "server/meta.h"
 
 #include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-static long parse_offset(const char *arg) {
-  if (!arg) {
-    return 0;
+#define CMD_MAX_ARGS 16
+#define SESSION_FRAME_DATA_MAX (SESSION_OUT_CAP - FRAME_HEADER_SIZE)
+
+/* Compressed payload bytes before and after compression, both directions. */
+static atomic_uint_fast64_t g_z_out_raw;
+static atomic_uint_fast64_t g_z_out_wire;
+static atomic_uint_fast64_t g_z_in_raw;
+static atomic_uint_fast64_t g_z_in_wire;
+static atomic_uint_fast64_t g_z_stored;
+
+/*
+ * A decoded command: argv[0] is the command name. v1 arguments are the
+ * space-separated words of the line; v2 arguments are the request's fields,
+ * with U64 fields also kept as numbers so they need no parsing.
+ */
+struct cmd_args {
+  int argc;
+  const char *argv[CMD_MAX_ARGS];
+  int has_num[CMD_MAX_ARGS];
+  uint64_t num[CMD_MAX_ARGS];
+};
+
+static const char *cmd_arg(const struct cmd_args *a, int i) {
+  return i < a->argc ? a->argv[i] : NULL;
+}
+
+static int cmd_arg_long(const struct cmd_args *a, int i, long *out) {
+  if (i >= a->argc) {
+    return -1;
   }
-  const char *prefix = "-offset=";
-  size_t len = strlen(prefix);
-  if (strncmp(arg, prefix, len) != 0) {
+  if (a->has_num[i]) {
+    if (a->num[i] > LONG_MAX) {
+      return -1;
+    }
+    *out = (long)a->num[i];
     return 0;
   }
-  return strtol(arg + len, NULL, 10);
-}
-
-static int parse_offset_tokens(char *arg1, char *arg2, char **out_path, long *out_offset) {
-  if (!out_path || !out_offset) {
+  char *end = NULL;
+  errno = 0;
+  long v = strtol(a->argv[i], &end, 10);
+  if (end == a->argv[i] || *end != '\0' || errno != 0) {
     return -1;
   }
+  *out = v;
+  return 0;
+}
+
+/* Consumes an optional "-offset=N" or "-o set=N" at *i. */
+static void parse_offset_args(const struct cmd_args *a, int *i, long *out_offset) {
+  const char *arg1 = cmd_arg(a, *i);
+  const char *arg2 = cmd_arg(a, *i + 1);
   *out_offset = 0;
-  *out_path = arg1;
   if (arg1 && strncmp(arg1, "-offset=", 8) == 0) {
-    *out_offset = parse_offset(arg1);
-    *out_path = arg2;
-    return 0;
-  }
-  if (arg1 && arg2 && strcmp(arg1, "-o") == 0 && strncmp(arg2, "set=", 4) == 0) {
+    *out_offset = strtol(arg1 + 8, NULL, 10);
+    *i += 1;
+  } else if (arg1 && arg2 && strcmp(arg1, "-o") == 0 && strncmp(arg2, "set=", 4) == 0) {
     *out_offset = strtol(arg2 + 4, NULL, 10);
-    *out_path = strtok(NULL, " ");
+    *i += 2;
   }
-  return 0;
 }
 
-void session_init(struct client_session *sess, int fd, const struct server_config *cfg) {
+/* -1 if the session's mailbox cannot be set up; the caller then drops the connection. */
+int session_init(struct client_session *sess, int fd, const struct server_config *cfg) {
   memset(sess, 0, sizeof(*sess));
   sess->fd = fd;
   sess->cfg = cfg;
@@ -53,317 +104,1193 @@ void session_init(struct client_session *sess, int fd, const struct server_confi
   sess->user[0] = '\0';
   sess->home[0] = '\0';
   sess->cwd[0] = '\0';
+  sess->home_fd = -1;
+  sess->cwd_fd = -1;
+  sess->proto = 1;
+  bufreader_init(&sess->in, fd);
+  return mailbox_init(&sess->mailbox, MAILBOX_DEFAULT_CAP);
 }
 
-void session_close(struct client_session *sess) {
-  if (sess->logged_in) {
-    users_unregister_active(sess->fd);
+int session_flush(struct client_session *sess) {
+  if (sess->out_len == 0) {
+    return 0;
   }
-  close(sess->fd);
+  int rc = sess->mux ? mux_send(sess->mux, sess->stream, sess->out, sess->out_len)
+                     : (write_full(sess->fd, sess->out, sess->out_len) < 0 ? -1 : 0);
+  sess->out_len = 0;
+  return rc;
 }
 
-static int require_login(struct client_session *sess) {
-  if (!sess->logged_in) {
-    return send_err(sess->fd, ERR_PERM, "login required");
+static int session_write(struct client_session *sess, const void *data, size_t len) {
+  if (len > sizeof(sess->out) - sess->out_len && session_flush(sess) != 0) {
+    return -1;
+  }
+  if (len >= sizeof(sess->out)) {
+    return write_full(sess->fd, data, len) < 0 ? -1 : 0;
   }
+  memcpy(sess->out + sess->out_len, data, len);
+  sess->out_len += len;
   return 0;
 }
 
-void session_run(struct client_session *sess) {
-  char line[4096];
-  while (1) {
-    int n = recv_line(sess->fd, line, sizeof(line));
-    if (n <= 0) {
-      break;
-    }
+/*
+ * Frames are only ever flushed whole, since other streams may write to the
+ * socket between two flushes; len is at most SESSION_FRAME_DATA_MAX.
+ */
+static int session_frame(struct client_session *sess, int opcode, uint16_t flags,
+                         const void *payload, size_t len) {
+  struct frame_header h = {.len = (uint32_t)len,
+                           .opcode = (uint16_t)opcode,
+                           .flags = flags,
+                           .tag = opcode == OP_NOTICE ? 0 : sess->frame_tag,
+                           .stream = sess->stream};
+  if (FRAME_HEADER_SIZE + len > sizeof(sess->out) - sess->out_len && session_flush(sess) != 0) {
+    return -1;
+  }
+  frame_header_pack(&h, (unsigned char *)sess->out + sess->out_len);
+  if (len > 0) {
+    memcpy(sess->out + sess->out_len + FRAME_HEADER_SIZE, payload, len);
+  }
+  sess->out_len += FRAME_HEADER_SIZE + len;
+  return 0;
+}
 
-    char *cmd = strtok(line, " ");
-    if (!cmd) {
-      send_err(sess->fd, ERR_INVALID, "empty command");
-      continue;
-    }
+/* A status (REPLY) or continuation (ITEM) line; code is 0 for non-errors. */
+static int session_vline(struct client_session *sess, int status, enum err_code code,
+                         const char *fmt, va_list ap) {
+  char buf[4096];
+  int off = 0;
+  if (sess->proto == 1 && status && sess->tag[0]) {
+    off = snprintf(buf, sizeof(buf), "#%s ", sess->tag);
+  }
+  int n = vsnprintf(buf + off, sizeof(buf) - (size_t)off, fmt, ap);
+  if (n < 0 || (size_t)(off + n) >= sizeof(buf) - 1) {
+    return -1;
+  }
+  n += off;
+  if (sess->proto == 1) {
+    buf[n++] = '\n';
+    return session_write(sess, buf, (size_t)n);
+  }
+  unsigned char payload[sizeof(buf) + 32];
+  size_t pos = 0;
+  if (status) {
+    pos = field_put_u64(payload, sizeof(payload), pos, (uint64_t)code);
+    pos = field_put_str(payload, sizeof(payload), pos, buf, (size_t)n);
+    return session_frame(sess, OP_REPLY, code ? FRAME_F_ERROR : 0, payload, pos);
+  }
+  pos = field_put_str(payload, sizeof(payload), pos, buf, (size_t)n);
+  return session_frame(sess, OP_ITEM, 0, payload, pos);
+}
 
-    if (strcmp(cmd, "exit") == 0) {
-      sendf_line(sess->fd, "OK");
-      exit(0);
-    }
+int session_reply(struct client_session *sess, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int rc = session_vline(sess, 1, ERR_OK, fmt, ap);
+  va_end(ap);
+  return rc;
+}
 
-    if (strcmp(cmd, "create_user") == 0) {
-      char *user = strtok(NULL, " ");
-      char *perm_str = strtok(NULL, " ");
-      mode_t perm = 0;
-      if (!user || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
-        send_err(sess->fd, ERR_INVALID, "usage: create_user <name> <perm>");
-        continue;
-      }
-      if (users_create(sess->cfg->root, user, perm) != 0) {
-        send_err(sess->fd, ERR_IO, "user create failed: %s", strerror(errno));
-        continue;
-      }
-      sendf_line(sess->fd, "OK");
-      continue;
-    }
+int session_line(struct client_session *sess, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int rc = session_vline(sess, 0, ERR_OK, fmt, ap);
+  va_end(ap);
+  return rc;
+}
 
-    if (strcmp(cmd, "login") == 0) {
-      if (sess->logged_in) {
-        send_err(sess->fd, ERR_PERM, "already logged in");
-        continue;
-      }
-      char *user = strtok(NULL, " ");
-      if (!user) {
-        send_err(sess->fd, ERR_INVALID, "usage: login <name>");
-        continue;
-      }
-      char home[PATH_MAX];
-      if (users_get_home(sess->cfg->root, user, home, sizeof(home)) != 0) {
-        send_err(sess->fd, ERR_INVALID, "invalid user");
-        continue;
-      }
-      struct stat st;
-      if (stat(home, &st) != 0 || !S_ISDIR(st.st_mode)) {
-        send_err(sess->fd, ERR_NOT_FOUND, "user home not found");
-        continue;
-      }
-      int meta_perm = 0;
-      if (meta_get(sess->cfg->root, home, NULL, 0, &meta_perm) != 0) {
-        meta_set(sess->cfg->root, home, user, (int)(st.st_mode & 0770));
-      }
-      snprintf(sess->user, sizeof(sess->user), "%s", user);
-      snprintf(sess->home, sizeof(sess->home), "%s", home);
-      snprintf(sess->cwd, sizeof(sess->cwd), "%s", home);
-      sess->logged_in = 1;
-      users_register_active(user, sess->fd);
-      sendf_line(sess->fd, "OK");
-      continue;
-    }
+static int session_status(struct client_session *sess, enum err_code code, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int rc = session_vline(sess, 1, code, fmt, ap);
+  va_end(ap);
+  return rc;
+}
 
-    if (strcmp(cmd, "logout") == 0) {
-      if (!sess->logged_in) {
-        send_err(sess->fd, ERR_PERM, "not logged in");
-        continue;
-      }
-      users_unregister_active(sess->fd);
-      sess->logged_in = 0;
-      sess->user[0] = '\0';
-      sess->home[0] = '\0';
-      sess->cwd[0] = '\0';
-      sendf_line(sess->fd, "OK");
-      continue;
-    }
+int session_err(struct client_session *sess, enum err_code code, const char *fmt, ...) {
+  char msg[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  return session_status(sess, code, "ERR %d %s %s", code, err_str(code), msg);
+}
 
-    if (strcmp(cmd, "whoami") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      sendf_line(sess->fd, "OK %s", sess->user);
-      continue;
-    }
+int session_end(struct client_session *sess) {
+  if (sess->proto == 1) {
+    return session_write(sess, "END\n", 4);
+  }
+  return session_frame(sess, OP_END, 0, NULL, 0);
+}
 
-    if (strcmp(cmd, "create") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *arg1 = strtok(NULL, " ");
-      char *arg2 = strtok(NULL, " ");
-      int is_dir = 0;
-      char *path = arg1;
-      char *perm_str = arg2;
-      if (arg1 && strcmp(arg1, "-d") == 0) {
-        is_dir = 1;
-        path = strtok(NULL, " ");
-        perm_str = strtok(NULL, " ");
-      }
-      mode_t perm = 0;
-      if (!path || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
-        send_err(sess->fd, ERR_INVALID, "usage: create [-d] <path> <perm>");
-        continue;
-      }
-      fs_cmd_create(sess, path, is_dir, perm);
-      continue;
+int session_send_blob(struct client_session *sess, const void *data, size_t len) {
+  if (sess->proto == 1) {
+    return session_write(sess, data, len);
+  }
+  const char *p = (const char *)data;
+  while (len > 0) {
+    size_t chunk = len < SESSION_FRAME_DATA_MAX ? len : SESSION_FRAME_DATA_MAX;
+    if (session_frame(sess, OP_DATA, 0, p, chunk) != 0) {
+      return -1;
     }
+    p += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
 
-    if (strcmp(cmd, "chmod") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *path = strtok(NULL, " ");
-      char *perm_str = strtok(NULL, " ");
-      mode_t perm = 0;
-      if (!path || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
-        send_err(sess->fd, ERR_INVALID, "usage: chmod <path> <perm>");
-        continue;
-      }
-      fs_cmd_chmod(sess, path, perm);
-      continue;
-    }
+static int session_zbuf(struct client_session *sess) {
+  if (!sess->zbuf) {
+    sess->zbuf = malloc(LZ_BLOCK_MAX + LZ_FRAME_MAX);
+  }
+  return sess->zbuf ? 0 : -1;
+}
 
-    if (strcmp(cmd, "move") == 0) {
-      if (require_login(sess) != 0) {
+/* A block at a time: read, compressed and on its way before the next is read. */
+static int send_file_z(struct client_session *sess, int fd, off_t off, size_t len) {
+  if (session_zbuf(sess) != 0) {
+    return -1;
+  }
+  unsigned char *raw = sess->zbuf;
+  unsigned char *frame = sess->zbuf + LZ_BLOCK_MAX;
+  struct lz_encoder enc = {0};
+  int rc = 0;
+  while (rc == 0) {
+    size_t want = len < LZ_BLOCK_MAX ? len : LZ_BLOCK_MAX;
+    size_t got = 0;
+    while (got < want) {
+      ssize_t n = pread(fd, raw + got, want - got, off + (off_t)got);
+      if (n < 0 && errno == EINTR) {
         continue;
       }
-      char *src = strtok(NULL, " ");
-      char *dst = strtok(NULL, " ");
-      if (!src || !dst) {
-        send_err(sess->fd, ERR_INVALID, "usage: move <src> <dst>");
-        continue;
+      if (n <= 0) {
+        break;
       }
-      fs_cmd_move(sess, src, dst);
-      continue;
+      got += (size_t)n;
     }
-
-    if (strcmp(cmd, "delete") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *path = strtok(NULL, " ");
-      if (!path) {
-        send_err(sess->fd, ERR_INVALID, "usage: delete <path>");
-        continue;
-      }
-      fs_cmd_delete(sess, path);
-      continue;
+    /* The length was promised already: a file cut short reads as zeros. */
+    memset(raw + got, 0, want - got);
+    rc = session_send_blob(sess, frame, lz_encode_block(&enc, raw, want, frame));
+    if (want == 0) {
+      break;
     }
+    off += (off_t)want;
+    len -= want;
+  }
+  atomic_fetch_add_explicit(&g_z_out_raw, enc.stats.raw, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_z_out_wire, enc.stats.wire, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_z_stored, enc.stats.stored_blocks, memory_order_relaxed);
+  return rc;
+}
 
-    if (strcmp(cmd, "cd") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *path = strtok(NULL, " ");
-      if (!path) {
-        send_err(sess->fd, ERR_INVALID, "usage: cd <path>");
-        continue;
-      }
-      fs_cmd_cd(sess, path);
-      continue;
+/*
+ * File bytes go to the socket by sendfile. In v2 each DATA frame is written
+ * under the connection's write lock, so other streams interleave between
+ * frames rather than waiting for the whole file.
+ */
+int session_send_file(struct client_session *sess, int fd, off_t off, size_t len) {
+  if (sess->payload_z) {
+    return send_file_z(sess, fd, off, len);
+  }
+  if (session_flush(sess) != 0) {
+    return -1;
+  }
+  if (!sess->mux) {
+    return len > 0 ? fsutil_send_range(sess->fd, fd, off, len) : 0;
+  }
+  while (len > 0) {
+    size_t chunk = len < FRAME_MAX_PAYLOAD ? len : FRAME_MAX_PAYLOAD;
+    struct frame_header h = {.len = (uint32_t)chunk,
+                             .opcode = OP_DATA,
+                             .tag = sess->frame_tag,
+                             .stream = sess->stream};
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    frame_header_pack(&h, hdr);
+    int sock = mux_begin(sess->mux, sess->stream, sizeof(hdr) + chunk);
+    if (sock < 0) {
+      return -1;
     }
-
-    if (strcmp(cmd, "list") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *path = strtok(NULL, " ");
-      fs_cmd_list(sess, path);
-      continue;
+    int rc = write_full(sock, hdr, sizeof(hdr)) < 0 ? -1 : fsutil_send_range(sock, fd, off, chunk);
+    mux_end(sess->mux);
+    if (rc != 0) {
+      return -1;
     }
+    off += (off_t)chunk;
+    len -= chunk;
+  }
+  return 0;
+}
 
-    if (strcmp(cmd, "read") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *arg1 = strtok(NULL, " ");
-      char *arg2 = strtok(NULL, " ");
-      long offset = 0;
-      char *path = NULL;
-      parse_offset_tokens(arg1, arg2, &path, &offset);
-      if (!path) {
-        send_err(sess->fd, ERR_INVALID, "usage: read [-offset=n|-o set=n] <path>");
-        continue;
-      }
-      fs_cmd_read(sess, path, offset);
-      continue;
-    }
+int session_send_bytes(struct client_session *sess, const void *data, size_t len) {
+  if (sess->proto != 1) {
+    return session_send_blob(sess, data, len);
+  }
+  struct iovec iov[2] = {{.iov_base = sess->out, .iov_len = sess->out_len},
+                         {.iov_base = (void *)data, .iov_len = len}};
+  sess->out_len = 0;
+  return writev_full(sess->fd, iov, 2) < 0 ? -1 : 0;
+}
 
-    if (strcmp(cmd, "write") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *arg1 = strtok(NULL, " ");
-      char *arg2 = strtok(NULL, " ");
-      long offset = 0;
-      char *path = NULL;
-      char *size_str = NULL;
-      if (arg1 && arg2 && strcmp(arg1, "-o") == 0 && strncmp(arg2, "set=", 4) == 0) {
-        offset = strtol(arg2 + 4, NULL, 10);
-        path = strtok(NULL, " ");
-        size_str = strtok(NULL, " ");
-      } else if (arg1 && strncmp(arg1, "-offset=", 8) == 0) {
-        offset = parse_offset(arg1);
-        path = arg2;
-        size_str = strtok(NULL, " ");
-      } else {
-        path = arg1;
-        size_str = arg2;
-      }
-      if (!path || !size_str) {
-        send_err(sess->fd, ERR_INVALID, "usage: write [-offset=n|-o set=n] <path> <size>");
-        continue;
-      }
-      size_t size = (size_t)strtoul(size_str, NULL, 10);
-      fs_cmd_write(sess, path, offset, size);
-      continue;
+int session_send_sparse(struct client_session *sess, int fd, off_t off, size_t len) {
+  off_t end = off + (off_t)len;
+  while (off < end) {
+    int hole;
+    off_t n;
+    fsutil_extent(fd, off, end, &hole, &n);
+    unsigned char hdr[SPARSE_HEADER_SIZE];
+    sparse_header_pack(hole ? SPARSE_HOLE : SPARSE_DATA, (uint64_t)n, hdr);
+    if (session_send_blob(sess, hdr, sizeof(hdr)) != 0 ||
+        (!hole && session_send_file(sess, fd, off, (size_t)n) != 0)) {
+      return -1;
     }
+    off += n;
+  }
+  return 0;
+}
 
-    if (strcmp(cmd, "upload") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
+/* Blocking input; flushes first so the peer has every reply it may await. */
+static int session_read_in(struct client_session *sess, void *data, size_t len) {
+  if (bufreader_buffered(&sess->in) < len && session_flush(sess) != 0) {
+    return -1;
+  }
+  if (bufreader_read(&sess->in, data, len) != 0) {
+    return -1;
+  }
+  if (sess->mux) {
+    mux_consumed(sess->mux, sess->stream, len);
+  }
+  return 0;
+}
+
+int session_recv_blob(struct client_session *sess, void *data, size_t len) {
+  if (sess->proto == 1) {
+    return session_read_in(sess, data, len);
+  }
+  char *p = (char *)data;
+  while (len > 0) {
+    if (sess->data_left == 0) {
+      unsigned char hdr[FRAME_HEADER_SIZE];
+      struct frame_header h;
+      if (session_read_in(sess, hdr, sizeof(hdr)) != 0) {
+        return -1;
       }
-      char *path = strtok(NULL, " ");
-      char *size_str = strtok(NULL, " ");
-      if (!path || !size_str) {
-        send_err(sess->fd, ERR_INVALID, "usage: upload <path> <size>");
-        continue;
+      frame_header_unpack(hdr, &h);
+      if (h.opcode != OP_DATA) {
+        return -1;
       }
-      size_t size = (size_t)strtoul(size_str, NULL, 10);
-      fs_cmd_upload(sess, path, size);
+      sess->data_left = h.len;
       continue;
     }
+    size_t take = len < sess->data_left ? len : sess->data_left;
+    if (session_read_in(sess, p, take) != 0) {
+      return -1;
+    }
+    p += take;
+    len -= take;
+    sess->data_left -= take;
+  }
+  return 0;
+}
 
-    if (strcmp(cmd, "download") == 0) {
-      if (require_login(sess) != 0) {
+int session_recv_block(struct client_session *sess, const unsigned char **data, size_t *len) {
+  unsigned char hdr[LZ_HEADER_SIZE];
+  uint32_t raw = 0;
+  uint32_t stored = 0;
+  if (session_zbuf(sess) != 0 || session_recv_blob(sess, hdr, sizeof(hdr)) != 0 ||
+      lz_header_unpack(hdr, &raw, &stored) != 0) {
+    return -1;
+  }
+  unsigned char *body = sess->zbuf + LZ_BLOCK_MAX;
+  if (session_recv_blob(sess, body, stored) != 0 ||
+      lz_decode_block(body, stored, sess->zbuf, raw) != 0) {
+    return -1;
+  }
+  atomic_fetch_add_explicit(&g_z_in_raw, raw, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_z_in_wire, LZ_HEADER_SIZE + stored, memory_order_relaxed);
+  if (raw > 0 && stored == raw) {
+    atomic_fetch_add_explicit(&g_z_stored, 1, memory_order_relaxed);
+  }
+  *data = sess->zbuf;
+  *len = raw;
+  return 0;
+}
+
+static int session_notice(void *ctx, const char *line) {
+  struct client_session *sess = (struct client_session *)ctx;
+  if (sess->proto == 1) {
+    return session_line(sess, "%s", line);
+  }
+  unsigned char payload[4096 + 8];
+  size_t pos = field_put_str(payload, sizeof(payload), 0, line, strlen(line));
+  return pos ? session_frame(sess, OP_NOTICE, 0, payload, pos) : -1;
+}
+
+int session_drain_notices(struct client_session *sess) {
+  return mailbox_drain(&sess->mailbox, session_notice, sess);
+}
+
+static void *stream_thread(void *arg) {
+  struct client_session *sess = (struct client_session *)arg;
+  session_run(sess);
+  session_close(sess);
+  free(sess);
+  return NULL;
+}
+
+/*
+ * A stream opened by the client is served like a connection of its own: a
+ * fresh session, already in v2, on a worker thread of its own.
+ */
+static int session_accept_stream(struct mux *m, uint32_t stream, int rfd, void *ctx) {
+  struct client_session *sess = malloc(sizeof(*sess));
+  if (!sess) {
+    return -1;
+  }
+  if (session_init(sess, rfd, (const struct server_config *)ctx) != 0) {
+    free(sess);
+    return -1;
+  }
+  sess->fd = -1;
+  sess->proto = 2;
+  sess->mux = m;
+  sess->stream = stream;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, stream_thread, sess) != 0) {
+    mailbox_destroy(&sess->mailbox);
+    free(sess);
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+static void session_close_dirs(struct client_session *sess) {
+  if (sess->cwd_fd >= 0) {
+    close(sess->cwd_fd);
+  }
+  if (sess->home_fd >= 0) {
+    close(sess->home_fd);
+  }
+  sess->home_fd = -1;
+  sess->cwd_fd = -1;
+}
+
+void session_close(struct client_session *sess) {
+  if (sess->logged_in) {
+    users_unregister_active(sess->user, &sess->mailbox);
+  }
+  watch_remove_all(&sess->mailbox);
+  fs_close_handles(sess);
+  session_close_dirs(sess);
+  mailbox_destroy(&sess->mailbox);
+  free(sess->zbuf);
+  if (sess->mux) {
+    mux_close(sess->mux, sess->stream);
+    mux_release(sess->mux);
+  } else {
+    close(sess->fd);
+  }
+}
+
+/* Whether a whole command is already buffered and can run without a read. */
+static int session_has_command(const struct client_session *sess) {
+  if (sess->proto == 1) {
+    return bufreader_has_line(&sess->in);
+  }
+  const unsigned char *hdr = bufreader_peek(&sess->in, FRAME_HEADER_SIZE);
+  if (!hdr) {
+    return 0;
+  }
+  struct frame_header h;
+  frame_header_unpack(hdr, &h);
+  return bufreader_peek(&sess->in, FRAME_HEADER_SIZE + (size_t)h.len) != NULL;
+}
+
+/*
+ * Waits for the next command while flushing queued notices. Only this thread
+ * writes to the socket, so notices land between responses, never inside one.
+ * A command already pipelined in the input buffer runs without a poll, and
+ * replies are flushed only when the buffer runs dry.
+ */
+static int session_wait_command(struct client_session *sess) {
+  if (session_has_command(sess)) {
+    return 0;
+  }
+  if (session_flush(sess) != 0) {
+    return -1;
+  }
+  while (1) {
+    struct pollfd pfds[2];
+    pfds[0].fd = sess->in.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = mailbox_wait_fd(&sess->mailbox);
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) {
         continue;
       }
-      char *path = strtok(NULL, " ");
-      if (!path) {
-        send_err(sess->fd, ERR_INVALID, "usage: download <path>");
-        continue;
+      return -1;
+    }
+    if (pfds[1].revents & POLLIN) {
+      if (session_drain_notices(sess) != 0 ||
+          session_flush(sess) != 0) {
+        return -1;
       }
-      fs_cmd_download(sess, path);
-      continue;
     }
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      return 0;
+    }
+  }
+}
 
-    if (strcmp(cmd, "transfer_request") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *file = strtok(NULL, " ");
-      char *dest_user = strtok(NULL, " ");
-      if (!file || !dest_user) {
-        send_err(sess->fd, ERR_INVALID, "usage: transfer_request <file> <dest_user>");
-        continue;
-      }
-      transfer_request_create(sess, file, dest_user);
-      continue;
+static void append_compress_stats(struct strbuf *sb) {
+  uint64_t out_raw = atomic_load(&g_z_out_raw);
+  uint64_t out_wire = atomic_load(&g_z_out_wire);
+  uint64_t in_raw = atomic_load(&g_z_in_raw);
+  uint64_t in_wire = atomic_load(&g_z_in_wire);
+  strbuf_appendf(sb, "compress.sent_raw_bytes %llu\n", (unsigned long long)out_raw);
+  strbuf_appendf(sb, "compress.sent_wire_bytes %llu\n", (unsigned long long)out_wire);
+  strbuf_appendf(sb, "compress.received_raw_bytes %llu\n", (unsigned long long)in_raw);
+  strbuf_appendf(sb, "compress.received_wire_bytes %llu\n", (unsigned long long)in_wire);
+  strbuf_appendf(sb, "compress.stored_blocks %llu\n",
+                 (unsigned long long)atomic_load(&g_z_stored));
+  strbuf_appendf(sb, "compress.ratio %.2f\n",
+                 out_wire + in_wire ? (double)(out_raw + in_raw) / (double)(out_wire + in_wire)
+                                    : 1.0);
+}
+
+static int send_stats(struct client_session *sess) {
+  struct strbuf sb;
+  strbuf_init(&sb);
+  mailbox_stats_append(&sb);
+  fsutil_stats_append(&sb);
+  mux_stats_append(&sb);
+  resume_stats_append(&sb);
+  watch_stats_append(&sb);
+  uploads_stats_append(&sb);
+  delta_stats_append(&sb);
+  dedup_stats_append(&sb);
+  attr_cache_stats_append(&sb);
+  file_cache_stats_append(&sb);
+  strbuf_appendf(&sb, "crc32c.hardware %d\n", crc32c_hardware());
+  append_compress_stats(&sb);
+  int rc = session_reply(sess, "OK");
+  char *save = NULL;
+  for (char *line = sb.len > 0 ? strtok_r(sb.data, "\n", &save) : NULL; rc == 0 && line;
+       line = strtok_r(NULL, "\n", &save)) {
+    rc = session_line(sess, "%s", line);
+  }
+  if (rc == 0) {
+    rc = session_end(sess);
+  }
+  strbuf_free(&sb);
+  return rc;
+}
+
+static int require_login(struct client_session *sess) {
+  if (!sess->logged_in) {
+    return session_err(sess, ERR_PERM, "login required");
+  }
+  return 0;
+}
+
+static void cmd_hello(struct client_session *sess, const struct cmd_args *a) {
+  const char *version = cmd_arg(a, 1);
+  if (!version || (strcmp(version, "v1") != 0 && strcmp(version, "v2") != 0)) {
+    session_err(sess, ERR_UNSUPPORTED, "usage: hello <v1|v2>");
+    return;
+  }
+  int proto = version[1] - '0';
+  if (proto == sess->proto) {
+    session_reply(sess, "OK %s", version);
+    return;
+  }
+  if (sess->proto == 2) {
+    session_err(sess, ERR_UNSUPPORTED, "cannot leave v2");
+    return;
+  }
+  /* Set up before the ack, so a failure can still be answered in v1. */
+  size_t pending = bufreader_buffered(&sess->in);
+  int fd0 = -1;
+  struct mux *m = mux_create(sess->fd, bufreader_peek(&sess->in, pending), pending,
+                             session_accept_stream, (void *)sess->cfg, &fd0);
+  if (!m) {
+    session_err(sess, ERR_BUSY, "cannot set up v2");
+    return;
+  }
+  /* Acknowledged in the old protocol; everything after is in the new one. */
+  session_reply(sess, "OK %s", version);
+  if (session_flush(sess) != 0) {
+    mux_cancel(m);
+    return;
+  }
+  mux_start(m);
+  bufreader_init(&sess->in, fd0);
+  sess->proto = 2;
+  sess->mux = m;
+  sess->stream = 0;
+}
+
+static void cmd_exit(struct client_session *sess, const struct cmd_args *a) {
+  (void)a;
+  session_reply(sess, "OK");
+  session_flush(sess);
+  exit(0);
+}
+
+static void cmd_create_user(struct client_session *sess, const struct cmd_args *a) {
+  const char *user = cmd_arg(a, 1);
+  const char *perm_str = cmd_arg(a, 2);
+  mode_t perm = 0;
+  if (!user || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
+    session_err(sess, ERR_INVALID, "usage: create_user <name> <perm>");
+    return;
+  }
+  if (users_create(sess->cfg->root, user, perm) != 0) {
+    session_err(sess, ERR_IO, "user create failed: %s", strerror(errno));
+    return;
+  }
+  session_reply(sess, "OK");
+}
+
+/* Completes a login or resume; takes over home_fd and replies. */
+static void session_attach(struct client_session *sess, const char *user, const char *home,
+                           int home_fd, int interactive) {
+  int cwd_fd = fcntl(home_fd, F_DUPFD_CLOEXEC, 0);
+  if (cwd_fd < 0) {
+    close(home_fd);
+    session_err(sess, ERR_IO, "login failed: %s", strerror(errno));
+    return;
+  }
+  snprintf(sess->user, sizeof(sess->user), "%s", user);
+  snprintf(sess->home, sizeof(sess->home), "%s", home);
+  snprintf(sess->cwd, sizeof(sess->cwd), "%s", home);
+  sess->cwd_len = strlen(sess->cwd);
+  sess->home_fd = home_fd;
+  sess->cwd_fd = cwd_fd;
+  sess->logged_in = 1;
+  sess->interactive = interactive;
+  users_register_active(user, &sess->mailbox, sess->interactive);
+  session_reply(sess, "OK");
+}
+
+static void cmd_login(struct client_session *sess, const struct cmd_args *a) {
+  if (sess->logged_in) {
+    session_err(sess, ERR_PERM, "already logged in");
+    return;
+  }
+  const char *user = cmd_arg(a, 1);
+  const char *mode = cmd_arg(a, 2);
+  if (!user || (mode && strcmp(mode, "-b") != 0)) {
+    session_err(sess, ERR_INVALID, "usage: login <name> [-b]");
+    return;
+  }
+  char home[PATH_MAX];
+  if (users_get_home(sess->cfg->root, user, home, sizeof(home)) != 0) {
+    session_err(sess, ERR_INVALID, "invalid user");
+    return;
+  }
+  int home_fd = fsutil_open_dir(sess->cfg->root_fd, user);
+  struct stat st;
+  if (home_fd < 0 || fstat(home_fd, &st) != 0) {
+    if (home_fd >= 0) {
+      close(home_fd);
     }
+    session_err(sess, ERR_NOT_FOUND, "user home not found");
+    return;
+  }
+  int meta_perm = 0;
+  if (meta_get(sess->cfg->root, home, NULL, 0, &meta_perm) != 0) {
+    meta_set(sess->cfg->root, home, user, (int)(st.st_mode & 0770));
+  }
+  session_attach(sess, user, home, home_fd, mode == NULL);
+}
 
-    if (strcmp(cmd, "accept") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *dir = strtok(NULL, " ");
-      char *id_str = strtok(NULL, " ");
-      if (!dir || !id_str) {
-        send_err(sess->fd, ERR_INVALID, "usage: accept <dir> <id>");
-        continue;
-      }
-      int id = atoi(id_str);
-      transfer_accept(sess, dir, id);
-      continue;
+static void cmd_token(struct client_session *sess, const struct cmd_args *a) {
+  (void)a;
+  if (!sess->resume_token[0] &&
+      resume_issue(sess->user, sess->home_fd, sess->resume_token,
+                   sizeof(sess->resume_token)) != 0) {
+    sess->resume_token[0] = '\0';
+    session_err(sess, ERR_INTERNAL, "token failed");
+    return;
+  }
+  session_reply(sess, "OK %s", sess->resume_token);
+}
+
+/* Same result as login, minus the home lookup and metadata check. */
+static void cmd_resume(struct client_session *sess, const struct cmd_args *a) {
+  if (sess->logged_in) {
+    session_err(sess, ERR_PERM, "already logged in");
+    return;
+  }
+  const char *token = cmd_arg(a, 1);
+  const char *mode = cmd_arg(a, 2);
+  if (!token || (mode && strcmp(mode, "-b") != 0)) {
+    session_err(sess, ERR_INVALID, "usage: resume <token> [-b]");
+    return;
+  }
+  char user[64];
+  char home[PATH_MAX];
+  int home_fd = -1;
+  if (resume_claim(token, user, sizeof(user), &home_fd) != 0) {
+    session_err(sess, ERR_PERM, "invalid or expired token");
+    return;
+  }
+  if (users_get_home(sess->cfg->root, user, home, sizeof(home)) != 0) {
+    close(home_fd);
+    session_err(sess, ERR_INVALID, "invalid user");
+    return;
+  }
+  session_attach(sess, user, home, home_fd, mode == NULL);
+}
+
+static void cmd_logout(struct client_session *sess, const struct cmd_args *a) {
+  (void)a;
+  if (!sess->logged_in) {
+    session_err(sess, ERR_PERM, "not logged in");
+    return;
+  }
+  users_unregister_active(sess->user, &sess->mailbox);
+  if (sess->resume_token[0]) {
+    resume_revoke(sess->resume_token);
+    sess->resume_token[0] = '\0';
+  }
+  watch_remove_all(&sess->mailbox);
+  sess->logged_in = 0;
+  sess->user[0] = '\0';
+  sess->home[0] = '\0';
+  sess->cwd[0] = '\0';
+  sess->cwd_len = 0;
+  fs_close_handles(sess);
+  session_close_dirs(sess);
+  session_reply(sess, "OK");
+}
+
+static void cmd_stats(struct client_session *sess, const struct cmd_args *a) {
+  (void)a;
+  send_stats(sess);
+}
+
+static void cmd_whoami(struct client_session *sess, const struct cmd_args *a) {
+  (void)a;
+  session_reply(sess, "OK %s", sess->user);
+}
+
+static void cmd_create(struct client_session *sess, const struct cmd_args *a) {
+  int i = 1;
+  int is_dir = 0;
+  if (cmd_arg(a, i) && strcmp(cmd_arg(a, i), "-d") == 0) {
+    is_dir = 1;
+    i++;
+  }
+  const char *path = cmd_arg(a, i);
+  const char *perm_str = cmd_arg(a, i + 1);
+  mode_t perm = 0;
+  if (!path || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
+    session_err(sess, ERR_INVALID, "usage: create [-d] <path> <perm>");
+    return;
+  }
+  fs_cmd_create(sess, path, is_dir, perm);
+}
+
+static void cmd_chmod(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  const char *perm_str = cmd_arg(a, 2);
+  mode_t perm = 0;
+  if (!path || !perm_str || parse_octal_perm(perm_str, &perm) != 0) {
+    session_err(sess, ERR_INVALID, "usage: chmod <path> <perm>");
+    return;
+  }
+  fs_cmd_chmod(sess, path, perm);
+}
+
+static void cmd_move(struct client_session *sess, const struct cmd_args *a) {
+  const char *src = cmd_arg(a, 1);
+  const char *dst = cmd_arg(a, 2);
+  if (!src || !dst) {
+    session_err(sess, ERR_INVALID, "usage: move <src> <dst>");
+    return;
+  }
+  fs_cmd_move(sess, src, dst);
+}
+
+static void cmd_delete(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: delete <path>");
+    return;
+  }
+  fs_cmd_delete(sess, path);
+}
+
+static void cmd_cd(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: cd <path>");
+    return;
+  }
+  fs_cmd_cd(sess, path);
+}
+
+static void cmd_list(struct client_session *sess, const struct cmd_args *a) {
+  fs_cmd_list(sess, cmd_arg(a, 1));
+}
+
+static void cmd_read(struct client_session *sess, const struct cmd_args *a) {
+  int i = 1;
+  long offset = 0;
+  parse_offset_args(a, &i, &offset);
+  const char *path = cmd_arg(a, i);
+  long length = -1;
+  if (!path || (cmd_arg(a, i + 1) && (cmd_arg_long(a, i + 1, &length) != 0 || length < 0))) {
+    session_err(sess, ERR_INVALID, "usage: read [-offset=n|-o set=n] <path> [length]");
+    return;
+  }
+  fs_cmd_read(sess, path, offset, length);
+}
+
+static void cmd_readv(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  const char *spec = cmd_arg(a, 2);
+  if (!path || !spec) {
+    session_err(sess, ERR_INVALID, "usage: readv <path> <off>:<len>[,<off>:<len>...]");
+    return;
+  }
+  fs_cmd_readv(sess, path, spec);
+}
+
+/* A payload size: a byte count, or "chunked" for a payload sent in chunks. */
+static int cmd_arg_size(const struct cmd_args *a, int i, size_t *size) {
+  const char *arg = cmd_arg(a, i);
+  long n = 0;
+  if (arg && strcmp(arg, CHUNKED_SIZE_ARG) == 0) {
+    *size = FS_PAYLOAD_CHUNKED;
+    return 0;
+  }
+  if (cmd_arg_long(a, i, &n) != 0 || n < 0) {
+    return -1;
+  }
+  *size = (size_t)n;
+  return 0;
+}
+
+static void cmd_write(struct client_session *sess, const struct cmd_args *a) {
+  int i = 1;
+  long offset = 0;
+  parse_offset_args(a, &i, &offset);
+  const char *path = cmd_arg(a, i);
+  size_t size = 0;
+  if (!path || cmd_arg_size(a, i + 1, &size) != 0) {
+    session_err(sess, ERR_INVALID, "usage: write [-offset=n|-o set=n] <path> <size|chunked>");
+    return;
+  }
+  fs_cmd_write(sess, path, offset, size);
+}
+
+static void cmd_upload(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  size_t size = 0;
+  if (!path || cmd_arg_size(a, 2, &size) != 0) {
+    session_err(sess, ERR_INVALID, "usage: upload <path> <size|chunked>");
+    return;
+  }
+  fs_cmd_upload(sess, path, size);
+}
+
+static void cmd_upload_open(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  long size = 0;
+  if (!path || cmd_arg_long(a, 2, &size) != 0 || size < 0) {
+    session_err(sess, ERR_INVALID, "usage: upload_open <path> <size>");
+    return;
+  }
+  fs_cmd_upload_open(sess, path, (size_t)size);
+}
+
+static void cmd_upload_status(struct client_session *sess, const struct cmd_args *a) {
+  const char *id = cmd_arg(a, 1);
+  if (!id) {
+    session_err(sess, ERR_INVALID, "usage: upload_status <id>");
+    return;
+  }
+  fs_cmd_upload_status(sess, id);
+}
+
+static void cmd_upload_data(struct client_session *sess, const struct cmd_args *a) {
+  const char *id = cmd_arg(a, 1);
+  long offset = 0;
+  size_t len = 0;
+  if (!id || cmd_arg_long(a, 2, &offset) != 0 || cmd_arg_size(a, 3, &len) != 0) {
+    session_err(sess, ERR_INVALID, "usage: upload_data <id> <offset> <length|chunked>");
+    return;
+  }
+  fs_cmd_upload_data(sess, id, offset, len);
+}
+
+static void cmd_upload_range(struct client_session *sess, const struct cmd_args *a) {
+  const char *id = cmd_arg(a, 1);
+  long offset = 0;
+  size_t len = 0;
+  if (!id || cmd_arg_long(a, 2, &offset) != 0 || cmd_arg_size(a, 3, &len) != 0) {
+    session_err(sess, ERR_INVALID, "usage: upload_range <id> <offset> <length>");
+    return;
+  }
+  fs_cmd_upload_range(sess, id, offset, len);
+}
+
+static void cmd_checksum(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: checksum <path>");
+    return;
+  }
+  fs_cmd_checksum(sess, path);
+}
+
+static void cmd_signature(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: signature <path>");
+    return;
+  }
+  fs_cmd_signature(sess, path);
+}
+
+static void cmd_delta(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  const char *crc_arg = cmd_arg(a, 4);
+  long block = 0;
+  long size = 0;
+  char *end = NULL;
+  unsigned long crc = crc_arg ? strtoul(crc_arg, &end, 16) : 0;
+  if (!path || cmd_arg_long(a, 2, &block) != 0 || cmd_arg_long(a, 3, &size) != 0 ||
+      block <= 0 || block > UINT32_MAX || size < 0 || !crc_arg || end == crc_arg ||
+      *end != '\0' || crc > UINT32_MAX) {
+    session_err(sess, ERR_INVALID, "usage: delta <path> <block> <size> <crc32c>");
+    return;
+  }
+  fs_cmd_delta(sess, path, (uint32_t)block, (uint64_t)size, (uint32_t)crc);
+}
+
+static void cmd_upload_hash(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  const char *hash = cmd_arg(a, 3);
+  long size = 0;
+  if (!path || cmd_arg_long(a, 2, &size) != 0 || size < 0 || !hash) {
+    session_err(sess, ERR_INVALID, "usage: upload_hash <path> <size> <sha256>");
+    return;
+  }
+  fs_cmd_upload_hash(sess, path, (uint64_t)size, hash);
+}
+
+static void cmd_upload_commit(struct client_session *sess, const struct cmd_args *a) {
+  const char *id = cmd_arg(a, 1);
+  if (!id) {
+    session_err(sess, ERR_INVALID, "usage: upload_commit <id>");
+    return;
+  }
+  fs_cmd_upload_commit(sess, id);
+}
+
+static void cmd_upload_abort(struct client_session *sess, const struct cmd_args *a) {
+  const char *id = cmd_arg(a, 1);
+  if (!id) {
+    session_err(sess, ERR_INVALID, "usage: upload_abort <id>");
+    return;
+  }
+  fs_cmd_upload_abort(sess, id);
+}
+
+static void cmd_download(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: download <path>");
+    return;
+  }
+  fs_cmd_download(sess, path);
+}
+
+static void cmd_open(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  const char *mode = cmd_arg(a, 2);
+  if (!path || !mode) {
+    session_err(sess, ERR_INVALID, "usage: open <path> <r|w|rw>");
+    return;
+  }
+  fs_cmd_open(sess, path, mode);
+}
+
+static void cmd_pread_pwrite(struct client_session *sess, const struct cmd_args *a) {
+  long handle = 0;
+  long offset = 0;
+  size_t len = 0;
+  int is_read = strcmp(a->argv[0], "pread") == 0;
+  if (cmd_arg_long(a, 1, &handle) != 0 || cmd_arg_long(a, 2, &offset) != 0 ||
+      cmd_arg_size(a, 3, &len) != 0 || (is_read && len == FS_PAYLOAD_CHUNKED)) {
+    session_err(sess, ERR_INVALID, "usage: %s <handle> <offset> <length>", a->argv[0]);
+    return;
+  }
+  if (is_read) {
+    fs_cmd_pread(sess, (int)handle, offset, len);
+  } else {
+    fs_cmd_pwrite(sess, (int)handle, offset, len);
+  }
+}
+
+static void cmd_close(struct client_session *sess, const struct cmd_args *a) {
+  long handle = 0;
+  if (cmd_arg_long(a, 1, &handle) != 0) {
+    session_err(sess, ERR_INVALID, "usage: close <handle>");
+    return;
+  }
+  fs_cmd_close(sess, (int)handle);
+}
+
+static void cmd_transfer_request(struct client_session *sess, const struct cmd_args *a) {
+  const char *files = cmd_arg(a, 1);
+  const char *dest_users = cmd_arg(a, 2);
+  if (!files || !dest_users) {
+    session_err(sess, ERR_INVALID,
+                "usage: transfer_request <file>[,<file>...] <dest_user>[,<dest_user>...]");
+    return;
+  }
+  transfer_request_create(sess, files, dest_users);
+}
+
+static void cmd_accept_all(struct client_session *sess, const struct cmd_args *a) {
+  const char *dir = cmd_arg(a, 1);
+  if (!dir) {
+    session_err(sess, ERR_INVALID, "usage: accept_all <dir>");
+    return;
+  }
+  transfer_accept_all(sess, dir);
+}
+
+static void cmd_accept(struct client_session *sess, const struct cmd_args *a) {
+  const char *dir = cmd_arg(a, 1);
+  long id = 0;
+  if (!dir || cmd_arg_long(a, 2, &id) != 0) {
+    session_err(sess, ERR_INVALID, "usage: accept <dir> <id>");
+    return;
+  }
+  transfer_accept(sess, dir, (int)id);
+}
+
+static void cmd_reject(struct client_session *sess, const struct cmd_args *a) {
+  long id = 0;
+  if (cmd_arg_long(a, 1, &id) != 0) {
+    session_err(sess, ERR_INVALID, "usage: reject <id>");
+    return;
+  }
+  transfer_reject(sess, (int)id);
+}
+
+static void cmd_watch(struct client_session *sess, const struct cmd_args *a) {
+  const char *path = cmd_arg(a, 1);
+  if (!path) {
+    session_err(sess, ERR_INVALID, "usage: %s <path>", a->argv[0]);
+    return;
+  }
+  if (strcmp(a->argv[0], "watch") == 0) {
+    fs_cmd_watch(sess, path);
+  } else {
+    fs_cmd_unwatch(sess, path);
+  }
+}
+
+struct command {
+  void (*run)(struct client_session *sess, const struct cmd_args *a);
+  int need_login;
+};
+
+/* Indexed by opcode, so v1 names and v2 opcodes reach the same handler. */
+static const struct command g_commands[OP_COMMAND_COUNT] = {
+    [OP_HELLO] = {cmd_hello, 0},
+    [OP_EXIT] = {cmd_exit, 0},
+    [OP_CREATE_USER] = {cmd_create_user, 0},
+    [OP_LOGIN] = {cmd_login, 0},
+    [OP_LOGOUT] = {cmd_logout, 0},
+    [OP_WHOAMI] = {cmd_whoami, 1},
+    [OP_STATS] = {cmd_stats, 0},
+    [OP_CREATE] = {cmd_create, 1},
+    [OP_CHMOD] = {cmd_chmod, 1},
+    [OP_MOVE] = {cmd_move, 1},
+    [OP_DELETE] = {cmd_delete, 1},
+    [OP_CD] = {cmd_cd, 1},
+    [OP_LIST] = {cmd_list, 1},
+    [OP_READ] = {cmd_read, 1},
+    [OP_READV] = {cmd_readv, 1},
+    [OP_WRITE] = {cmd_write, 1},
+    [OP_UPLOAD] = {cmd_upload, 1},
+    [OP_DOWNLOAD] = {cmd_download, 1},
+    [OP_OPEN] = {cmd_open, 1},
+    [OP_PREAD] = {cmd_pread_pwrite, 1},
+    [OP_PWRITE] = {cmd_pread_pwrite, 1},
+    [OP_CLOSE] = {cmd_close, 1},
+    [OP_TRANSFER_REQUEST] = {cmd_transfer_request, 1},
+    [OP_ACCEPT] = {cmd_accept, 1},
+    [OP_ACCEPT_ALL] = {cmd_accept_all, 1},
+    [OP_REJECT] = {cmd_reject, 1},
+    [OP_TOKEN] = {cmd_token, 1},
+    [OP_RESUME] = {cmd_resume, 0},
+    [OP_WATCH] = {cmd_watch, 1},
+    [OP_UNWATCH] = {cmd_watch, 1},
+    [OP_UPLOAD_OPEN] = {cmd_upload_open, 1},
+    [OP_UPLOAD_STATUS] = {cmd_upload_status, 1},
+    [OP_UPLOAD_DATA] = {cmd_upload_data, 1},
+    [OP_UPLOAD_RANGE] = {cmd_upload_range, 1},
+    [OP_UPLOAD_COMMIT] = {cmd_upload_commit, 1},
+    [OP_CHECKSUM] = {cmd_checksum, 1},
+    [OP_SIGNATURE] = {cmd_signature, 1},
+    [OP_DELTA] = {cmd_delta, 1},
+    [OP_UPLOAD_HASH] = {cmd_upload_hash, 1},
+    [OP_UPLOAD_ABORT] = {cmd_upload_abort, 1},
+};
+
+static void dispatch(struct client_session *sess, int opcode, const struct cmd_args *a) {
+  const struct command *c =
+      opcode > OP_NONE && opcode < OP_COMMAND_COUNT ? &g_commands[opcode] : NULL;
+  if (!c || !c->run) {
+    session_err(sess, ERR_UNSUPPORTED, "unknown command");
+    return;
+  }
+  if (c->need_login && require_login(sess) != 0) {
+    return;
+  }
+  c->run(sess, a);
+}
+
+/*
+ * Reads one v1 command line into a. Returns 1 to dispatch, 0 if the line was
+ * answered already (bad tag, empty), -1 when the connection is done.
+ */
+static int read_text_command(struct client_session *sess, char *line, size_t cap,
+                             struct cmd_args *a, int *opcode) {
+  ssize_t n = bufreader_read_line(&sess->in, line, cap);
+  if (n <= 0) {
+    return -1;
+  }
+  char *cmd_start = line;
+  if (line[0] == '#') {
+    size_t tag_len = strcspn(line + 1, " ");
+    if (tag_len == 0 || tag_len > SESSION_TAG_MAX) {
+      session_err(sess, ERR_INVALID, "bad tag");
+      return 0;
     }
+    memcpy(sess->tag, line + 1, tag_len);
+    sess->tag[tag_len] = '\0';
+    cmd_start = line + 1 + tag_len;
+  }
+  char *save = NULL;
+  for (char *tok = strtok_r(cmd_start, " ", &save); tok && a->argc < CMD_MAX_ARGS;
+       tok = strtok_r(NULL, " ", &save)) {
+    a->argv[a->argc++] = tok;
+  }
+  if (a->argc == 0) {
+    session_err(sess, ERR_INVALID, "empty command");
+    return 0;
+  }
+  *opcode = frame_opcode(a->argv[0]);
+  return 1;
+}
 
-    if (strcmp(cmd, "reject") == 0) {
-      if (require_login(sess) != 0) {
-        continue;
-      }
-      char *id_str = strtok(NULL, " ");
-      if (!id_str) {
-        send_err(sess->fd, ERR_INVALID, "usage: reject <id>");
-        continue;
-      }
-      int id = atoi(id_str);
-      transfer_reject(sess, id);
-      continue;
+/*
+ * Reads one v2 request frame into a; strings are copied NUL-terminated into
+ * buf. Same return values as read_text_command.
+ */
+static int read_frame_command(struct client_session *sess, char *buf, size_t cap,
+                              struct cmd_args *a, int *opcode) {
+  unsigned char hdr[FRAME_HEADER_SIZE];
+  struct frame_header h;
+  if (session_read_in(sess, hdr, sizeof(hdr)) != 0) {
+    return -1;
+  }
+  frame_header_unpack(hdr, &h);
+  sess->frame_tag = h.tag;
+  if (h.len > FRAME_MAX_PAYLOAD) {
+    return -1;
+  }
+  unsigned char payload[FRAME_MAX_PAYLOAD];
+  if (h.len > 0 && session_read_in(sess, payload, h.len) != 0) {
+    return -1;
+  }
+  a->argv[a->argc++] = frame_opname(h.opcode) ? frame_opname(h.opcode) : "?";
+  size_t pos = 0;
+  size_t used = 0;
+  struct field f;
+  int rc;
+  while ((rc = field_next(payload, h.len, &pos, &f)) == 1) {
+    if (a->argc == CMD_MAX_ARGS) {
+      break;
+    }
+    char *s = buf + used;
+    if (f.type == FIELD_U64) {
+      a->has_num[a->argc] = 1;
+      a->num[a->argc] = f.u64;
+      used += (size_t)snprintf(s, cap - used, "%llu", (unsigned long long)f.u64) + 1;
+    } else if (memchr(f.str, '\0', f.len) == NULL) {
+      memcpy(s, f.str, f.len);
+      s[f.len] = '\0';
+      used += f.len + 1;
+    } else {
+      rc = -1;
+      break;
     }
+    a->argv[a->argc++] = s;
+  }
+  if (rc < 0) {
+    session_err(sess, ERR_INVALID, "malformed fields");
+    return 0;
+  }
+  *opcode = h.opcode;
+  return 1;
+}
 
-    send_err(sess->fd, ERR_UNSUPPORTED, "unknown command");
+/* Removes flag if it follows the command name; 1 if it was there. */
+static int take_flag(struct cmd_args *a, const char *flag) {
+  if (a->argc < 2 || strcmp(a->argv[1], flag) != 0) {
+    return 0;
+  }
+  for (int i = 1; i + 1 < a->argc; i++) {
+    a->argv[i] = a->argv[i + 1];
+    a->has_num[i] = a->has_num[i + 1];
+    a->num[i] = a->num[i + 1];
+  }
+  a->argc--;
+  return 1;
+}
+
+void session_run(struct client_session *sess) {
+  char line[4096];
+  char strings[FRAME_MAX_PAYLOAD + CMD_MAX_ARGS * 24];
+  while (1) {
+    if (session_wait_command(sess) != 0) {
+      break;
+    }
+    struct cmd_args args;
+    memset(&args, 0, sizeof(args));
+    sess->tag[0] = '\0';
+    sess->frame_tag = 0;
+    int opcode = OP_NONE;
+    int rc = sess->proto == 1
+                 ? read_text_command(sess, line, sizeof(line), &args, &opcode)
+                 : read_frame_command(sess, strings, sizeof(strings), &args, &opcode);
+    if (rc < 0) {
+      break;
+    }
+    sess->payload_crc = 0;
+    sess->payload_z = 0;
+    sess->payload_sparse = 0;
+    /* Once per flag, so they may come in any order. */
+    for (int i = 0; rc > 0 && i < 3; i++) {
+      sess->payload_crc |= take_flag(&args, CRC_FLAG_ARG);
+      sess->payload_z |= take_flag(&args, Z_FLAG_ARG);
+      sess->payload_sparse |= take_flag(&args, SPARSE_FLAG_ARG);
+    }
+    if (rc > 0) {
+      dispatch(sess, opcode, &args);
+    }
   }
+  session_flush(sess);
 }
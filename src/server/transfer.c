@@ -3,77 +3,120 @@
 #include "common/error.h"
 #include "common/path_sandbox.h"
 #include "common/protocol.h"
+#include "server/attr_cache.h"
+#include "server/dedup.h"
+#include "server/fsutil.h"
 #include "server/locks.h"
 #include "server/meta.h"
 #include "server/session.h"
 #include "server/users.h"
+#include "server/watch.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #define MAX_TRANSFERS 128
+#define MAX_TRANSFER_ENTRIES 4096
+#define MAX_TRANSFER_RECIPIENTS 64
+#define MAX_TRANSFER_SOURCES 16
+#define STAGING_DIR ".csap_staging"
 
+enum recipient_state {
+  RECIPIENT_PENDING = 0,
+  RECIPIENT_ACCEPTING = 1,
+  RECIPIENT_DONE = 2
+};
+
+struct transfer_entry {
+  char *rel;
+  int is_dir;
+  int perm;
+};
+
+struct transfer_recipient {
+  char name[64];
+  int state;
+};
+
+/*
+ * One request fans out to several recipients. Files are staged once under
+ * <root>/.csap_staging/<id> and every accept materializes from that copy;
+ * the staging tree goes away when the last recipient accepts or rejects.
+ */
 struct transfer_request {
   int id;
   char from_user[64];
-  char to_user[64];
-  char file_path[PATH_MAX];
+  char label[PATH_MAX];
+  char stage_dir[PATH_MAX];
+  struct transfer_entry *entries;
+  size_t entry_count;
+  struct transfer_recipient *recipients;
+  size_t recipient_count;
+  size_t pending;
+  struct transfer_request *next;
 };
 
 static struct {
-  struct transfer_request reqs[MAX_TRANSFERS];
+  struct transfer_request *head;
   size_t count;
   int next_id;
+  char root[PATH_MAX];
   pthread_mutex_t mu;
 } g_transfers = {
+    .head = NULL,
     .count = 0,
     .next_id = 1,
     .mu = PTHREAD_MUTEX_INITIALIZER,
 };
 
-int transfer_init(void) {
+static int staging_root(char *out, size_t cap) {
+  if (snprintf(out, cap, "%s/%s", g_transfers.root, STAGING_DIR) >= (int)cap) {
+    return -1;
+  }
   return 0;
 }
 
-static int copy_file(const char *src, const char *dst) {
-  int in_fd = open(src, O_RDONLY);
-  if (in_fd < 0) {
+int transfer_init(const char *root) {
+  if (!root) {
     return -1;
   }
-  int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0700);
-  if (out_fd < 0) {
-    close(in_fd);
+  snprintf(g_transfers.root, sizeof(g_transfers.root), "%s", root);
+  char stage[PATH_MAX];
+  if (staging_root(stage, sizeof(stage)) != 0) {
     return -1;
   }
-
-  char buf[4096];
-  while (1) {
-    ssize_t n = read(in_fd, buf, sizeof(buf));
-    if (n == 0) {
-      break;
-    }
-    if (n < 0) {
-      close(in_fd);
-      close(out_fd);
-      return -1;
-    }
-    if (write(out_fd, buf, (size_t)n) != n) {
-      close(in_fd);
-      close(out_fd);
-      return -1;
-    }
+  struct stat st;
+  if (stat(stage, &st) == 0) {
+    fsutil_remove_tree(stage);
   }
-  close(in_fd);
-  close(out_fd);
   return 0;
 }
 
+static void request_free(struct transfer_request *req) {
+  if (!req) {
+    return;
+  }
+  if (req->stage_dir[0]) {
+    fsutil_remove_tree(req->stage_dir);
+    /* Staged blob links are gone: their blobs may be unreferenced now. */
+    dedup_sweep();
+  }
+  for (size_t i = 0; i < req->entry_count; i++) {
+    free(req->entries[i].rel);
+  }
+  free(req->entries);
+  free(req->recipients);
+  free(req);
+}
+
 static int lock_src_dest(const char *src, const char *dst) {
   if (!src || !dst) {
     return -1;
@@ -127,162 +170,513 @@ static void unlock_src_dest(const char *src, const char *dst) {
   locks_unlock(first);
 }
 
-static int add_request_locked(const struct transfer_request *req) {
-  if (g_transfers.count >= MAX_TRANSFERS) {
+static struct transfer_request *find_request_locked(int id) {
+  for (struct transfer_request *cur = g_transfers.head; cur; cur = cur->next) {
+    if (cur->id == id) {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+static void unlink_request_locked(struct transfer_request *req) {
+  for (struct transfer_request **pp = &g_transfers.head; *pp; pp = &(*pp)->next) {
+    if (*pp == req) {
+      *pp = req->next;
+      g_transfers.count--;
+      return;
+    }
+  }
+}
+
+/* Gives back the slot taken for a request that never got listed. */
+static void release_slot(struct transfer_request *req) {
+  pthread_mutex_lock(&g_transfers.mu);
+  g_transfers.count--;
+  pthread_mutex_unlock(&g_transfers.mu);
+  request_free(req);
+}
+
+static struct transfer_recipient *find_recipient(struct transfer_request *req, const char *user) {
+  for (size_t i = 0; i < req->recipient_count; i++) {
+    if (strcmp(req->recipients[i].name, user) == 0) {
+      return &req->recipients[i];
+    }
+  }
+  return NULL;
+}
+
+/* Marks a recipient finished; frees the request once nobody is left. */
+static void finish_recipient(struct transfer_request *req, struct transfer_recipient *rcpt) {
+  pthread_mutex_lock(&g_transfers.mu);
+  rcpt->state = RECIPIENT_DONE;
+  req->pending--;
+  int last = (req->pending == 0);
+  if (last) {
+    unlink_request_locked(req);
+  }
+  pthread_mutex_unlock(&g_transfers.mu);
+  if (last) {
+    request_free(req);
+  }
+}
+
+static int add_entry(struct transfer_request *req, const char *rel, int is_dir, int perm) {
+  if (req->entry_count >= MAX_TRANSFER_ENTRIES) {
     return -1;
   }
-  g_transfers.reqs[g_transfers.count++] = *req;
+  for (size_t i = 0; i < req->entry_count; i++) {
+    if (strcmp(req->entries[i].rel, rel) == 0) {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+  struct transfer_entry *next = realloc(req->entries, (req->entry_count + 1) * sizeof(*next));
+  if (!next) {
+    return -1;
+  }
+  req->entries = next;
+  req->entries[req->entry_count].rel = strdup(rel);
+  if (!req->entries[req->entry_count].rel) {
+    return -1;
+  }
+  req->entries[req->entry_count].is_dir = is_dir;
+  req->entries[req->entry_count].perm = perm;
+  req->entry_count++;
   return 0;
 }
 
-static int find_request_locked(int id) {
-  for (size_t i = 0; i < g_transfers.count; i++) {
-    if (g_transfers.reqs[i].id == id) {
-      return (int)i;
+/*
+ * Checks access on src and stages it (recursively for directories) into
+ * req->stage_dir/rel. Returns an err_code.
+ */
+static enum err_code stage_source(struct client_session *sess, struct transfer_request *req,
+                                  const char *src, const char *rel) {
+  if (locks_rdlock(src) != 0) {
+    return ERR_IO;
+  }
+  struct attr_info info;
+  if (attr_cache_stat(AT_FDCWD, src, src, &info) != 0) {
+    locks_unlock(src);
+    return ERR_NOT_FOUND;
+  }
+  int is_dir = S_ISDIR(info.mode);
+  if (!is_dir && !S_ISREG(info.mode)) {
+    locks_unlock(src);
+    return ERR_INVALID;
+  }
+  if (meta_check_access(sess->cfg->root, src, sess->user, 1, 0, is_dir) != 0) {
+    locks_unlock(src);
+    return ERR_PERM;
+  }
+  int perm = is_dir ? 0770 : 0700;
+  if (meta_get(sess->cfg->root, src, NULL, 0, &perm) != 0) {
+    perm = is_dir ? 0770 : 0700;
+  }
+  if (add_entry(req, rel, is_dir, perm) != 0) {
+    locks_unlock(src);
+    return errno == EEXIST ? ERR_EXISTS : ERR_BUSY;
+  }
+
+  char staged[PATH_MAX];
+  if (snprintf(staged, sizeof(staged), "%s/%s", req->stage_dir, rel) >= (int)sizeof(staged)) {
+    locks_unlock(src);
+    return ERR_INVALID;
+  }
+  if (!is_dir) {
+    /*
+     * Stored content is staged as one more link to its blob. Either way the
+     * staged inode stays owner-writable: recipients are linked to it and the
+     * last of them is left holding it alone. Writes unshare it until then.
+     */
+    int rc = dedup_link_copy(src, staged);
+    if (rc != 0) {
+      rc = fsutil_clone_file(src, staged, 0);
+      if (rc >= 0) {
+        chmod(staged, S_IRUSR | S_IWUSR);
+      }
     }
+    locks_unlock(src);
+    return rc >= 0 ? ERR_OK : ERR_IO;
+  }
+
+  if (mkdir(staged, 0700) != 0) {
+    locks_unlock(src);
+    return ERR_IO;
   }
-  return -1;
+  DIR *dir = opendir(src);
+  if (!dir) {
+    locks_unlock(src);
+    return ERR_IO;
+  }
+  char **names = NULL;
+  size_t name_count = 0;
+  struct dirent *ent;
+  enum err_code code = ERR_OK;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    char **next = realloc(names, (name_count + 1) * sizeof(*next));
+    if (!next) {
+      code = ERR_INTERNAL;
+      break;
+    }
+    names = next;
+    names[name_count] = strdup(ent->d_name);
+    if (!names[name_count]) {
+      code = ERR_INTERNAL;
+      break;
+    }
+    name_count++;
+  }
+  closedir(dir);
+  locks_unlock(src);
+
+  char child_src[PATH_MAX];
+  char child_rel[PATH_MAX];
+  for (size_t i = 0; i < name_count; i++) {
+    if (code == ERR_OK) {
+      if (snprintf(child_src, sizeof(child_src), "%s/%s", src, names[i]) >=
+              (int)sizeof(child_src) ||
+          snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, names[i]) >=
+              (int)sizeof(child_rel)) {
+        code = ERR_INVALID;
+      } else {
+        code = stage_source(sess, req, child_src, child_rel);
+      }
+    }
+    free(names[i]);
+  }
+  free(names);
+  return code;
 }
 
-static void remove_request_locked(size_t idx) {
-  if (idx >= g_transfers.count) {
-    return;
+static char *next_item(char **cursor) {
+  char *item = *cursor;
+  while (item && *item == ',') {
+    item++;
+  }
+  if (!item || !*item) {
+    return NULL;
+  }
+  char *comma = strchr(item, ',');
+  if (comma) {
+    *comma = '\0';
+    *cursor = comma + 1;
+  } else {
+    *cursor = item + strlen(item);
   }
-  g_transfers.reqs[idx] = g_transfers.reqs[g_transfers.count - 1];
-  g_transfers.count--;
+  return item;
 }
 
-int transfer_request_create(struct client_session *sess, const char *file, const char *dest_user) {
-  if (!sess || !file || !dest_user) {
-    return send_err(sess->fd, ERR_INVALID, "missing args");
+int transfer_request_create(struct client_session *sess, const char *files, const char *dest_users) {
+  if (!sess || !files || !dest_users) {
+    return session_err(sess, ERR_INVALID, "missing args");
   }
 
-  char full_src[PATH_MAX];
-  if (resolve_path_in_root(sess->cfg->root, sess->cwd, file, full_src, sizeof(full_src)) != 0 ||
-      !path_is_within(sess->home, full_src)) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
+  struct transfer_request *req = calloc(1, sizeof(*req));
+  if (!req) {
+    return session_err(sess, ERR_INTERNAL, "out of memory");
   }
-  if (locks_rdlock(full_src) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+  snprintf(req->from_user, sizeof(req->from_user), "%s", sess->user);
+  snprintf(req->label, sizeof(req->label), "%s", files);
+
+  char users_buf[4096];
+  snprintf(users_buf, sizeof(users_buf), "%s", dest_users);
+  char *cursor = users_buf;
+  for (char *user = next_item(&cursor); user; user = next_item(&cursor)) {
+    if (find_recipient(req, user)) {
+      continue;
+    }
+    if (!users_exists(user)) {
+      request_free(req);
+      return session_err(sess, ERR_NOT_FOUND, "unknown user %s", user);
+    }
+    if (req->recipient_count >= MAX_TRANSFER_RECIPIENTS) {
+      request_free(req);
+      return session_err(sess, ERR_BUSY, "too many recipients");
+    }
+    struct transfer_recipient *next =
+        realloc(req->recipients, (req->recipient_count + 1) * sizeof(*next));
+    if (!next) {
+      request_free(req);
+      return session_err(sess, ERR_INTERNAL, "out of memory");
+    }
+    req->recipients = next;
+    memset(&req->recipients[req->recipient_count], 0, sizeof(*next));
+    snprintf(req->recipients[req->recipient_count].name, sizeof(next->name), "%s", user);
+    req->recipient_count++;
   }
-  if (meta_check_access(sess->cfg->root, full_src, sess->user, 1, 0, 0) != 0) {
-    locks_unlock(full_src);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+  if (req->recipient_count == 0) {
+    request_free(req);
+    return session_err(sess, ERR_INVALID, "no recipients");
   }
-  locks_unlock(full_src);
 
-  int dest_fd = users_get_active_fd(dest_user);
-  if (dest_fd < 0) {
-    sendf_line(sess->fd, "WAITING");
-    if (users_wait_for_active(dest_user, &dest_fd) != 0) {
-      return send_err(sess->fd, ERR_INTERNAL, "wait failed");
+  char files_buf[4096];
+  snprintf(files_buf, sizeof(files_buf), "%s", files);
+  char sources[MAX_TRANSFER_SOURCES][PATH_MAX];
+  size_t source_count = 0;
+  cursor = files_buf;
+  for (char *file = next_item(&cursor); file; file = next_item(&cursor)) {
+    if (source_count >= MAX_TRANSFER_SOURCES) {
+      request_free(req);
+      return session_err(sess, ERR_BUSY, "too many files");
+    }
+    if (path_resolve(&sess->cfg->resolver, sess->cwd, sess->cwd_len, file,
+                     sources[source_count], sizeof(sources[0])) != 0 ||
+        !path_is_within(sess->home, sources[source_count]) ||
+        strcmp(sources[source_count], sess->home) == 0) {
+      request_free(req);
+      return session_err(sess, ERR_PERM, "path outside home");
     }
+    source_count++;
+  }
+  if (source_count == 0) {
+    request_free(req);
+    return session_err(sess, ERR_INVALID, "no files");
   }
 
-  struct transfer_request req;
-  memset(&req, 0, sizeof(req));
+  int waiting_sent = 0;
+  for (size_t i = 0; i < req->recipient_count; i++) {
+    if (users_is_active(req->recipients[i].name)) {
+      continue;
+    }
+    if (!waiting_sent) {
+      session_reply(sess, "WAITING");
+      session_flush(sess);
+      waiting_sent = 1;
+    }
+    if (users_wait_for_active(req->recipients[i].name) != 0) {
+      request_free(req);
+      return session_err(sess, ERR_INTERNAL, "wait failed");
+    }
+  }
+
+  /* The slot is taken now, before staging, so concurrent requests cannot overrun the cap. */
   pthread_mutex_lock(&g_transfers.mu);
-  req.id = g_transfers.next_id++;
-  snprintf(req.from_user, sizeof(req.from_user), "%s", sess->user);
-  snprintf(req.to_user, sizeof(req.to_user), "%s", dest_user);
-  snprintf(req.file_path, sizeof(req.file_path), "%s", full_src);
-  if (add_request_locked(&req) != 0) {
+  if (g_transfers.count >= MAX_TRANSFERS) {
     pthread_mutex_unlock(&g_transfers.mu);
-    return send_err(sess->fd, ERR_BUSY, "too many requests");
+    request_free(req);
+    return session_err(sess, ERR_BUSY, "too many requests");
   }
+  g_transfers.count++;
+  req->id = g_transfers.next_id++;
   pthread_mutex_unlock(&g_transfers.mu);
 
-  sendf_line(dest_fd, "NOTICE TRANSFER %d %s %s", req.id, req.from_user, file);
-  return sendf_line(sess->fd, "OK %d", req.id);
-}
+  char stage[PATH_MAX];
+  if (staging_root(stage, sizeof(stage)) != 0 ||
+      snprintf(req->stage_dir, sizeof(req->stage_dir), "%s/%d", stage, req->id) >=
+          (int)sizeof(req->stage_dir) ||
+      fsutil_mkdir_p(req->stage_dir, 0700) != 0) {
+    int saved = errno;
+    req->stage_dir[0] = '\0';
+    release_slot(req);
+    return session_err(sess, ERR_IO, "staging failed: %s", strerror(saved));
+  }
 
-int transfer_accept(struct client_session *sess, const char *dir, int id) {
-  if (!sess || !dir) {
-    return send_err(sess->fd, ERR_INVALID, "missing args");
+  for (size_t i = 0; i < source_count; i++) {
+    const char *slash = strrchr(sources[i], '/');
+    enum err_code code = stage_source(sess, req, sources[i], slash ? slash + 1 : sources[i]);
+    if (code != ERR_OK) {
+      release_slot(req);
+      return session_err(sess, code, "cannot stage %s", sources[i] + strlen(sess->home));
+    }
+  }
+
+  pthread_mutex_lock(&g_transfers.mu);
+  req->pending = req->recipient_count;
+  req->next = g_transfers.head;
+  g_transfers.head = req;
+  int id = req->id;
+  for (size_t i = 0; i < req->recipient_count; i++) {
+    users_notify(req->recipients[i].name, "NOTICE TRANSFER %d %s %s", id, req->from_user,
+                 req->label);
   }
+  pthread_mutex_unlock(&g_transfers.mu);
+
+  return session_reply(sess, "OK %d", id);
+}
 
+/*
+ * Claims the request for the session's user: the recipient moves to
+ * ACCEPTING so the request (and its staged files) stays alive until
+ * finish_recipient is called.
+ */
+static enum err_code claim_request(struct client_session *sess, int id,
+                                   struct transfer_request **out_req,
+                                   struct transfer_recipient **out_rcpt) {
   pthread_mutex_lock(&g_transfers.mu);
-  int idx = find_request_locked(id);
-  if (idx < 0) {
+  struct transfer_request *req = find_request_locked(id);
+  if (!req) {
     pthread_mutex_unlock(&g_transfers.mu);
-    return send_err(sess->fd, ERR_NOT_FOUND, "invalid id");
+    return ERR_NOT_FOUND;
   }
-  struct transfer_request req = g_transfers.reqs[idx];
-  if (strcmp(req.to_user, sess->user) != 0) {
+  struct transfer_recipient *rcpt = find_recipient(req, sess->user);
+  if (!rcpt || rcpt->state != RECIPIENT_PENDING) {
     pthread_mutex_unlock(&g_transfers.mu);
-    return send_err(sess->fd, ERR_PERM, "not recipient");
+    return rcpt ? ERR_NOT_FOUND : ERR_PERM;
   }
-  remove_request_locked((size_t)idx);
+  rcpt->state = RECIPIENT_ACCEPTING;
   pthread_mutex_unlock(&g_transfers.mu);
+  *out_req = req;
+  *out_rcpt = rcpt;
+  return ERR_OK;
+}
 
-  char dest_dir[PATH_MAX];
-  if (resolve_path_in_root(sess->cfg->root, sess->cwd, dir, dest_dir, sizeof(dest_dir)) != 0 ||
-      !path_is_within(sess->home, dest_dir)) {
-    return send_err(sess->fd, ERR_PERM, "path outside home");
-  }
-  if (locks_rdlock(dest_dir) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+static enum err_code materialize(struct client_session *sess, const struct transfer_request *req,
+                                 const char *dest_dir, char *out_dest, size_t out_cap) {
+  char staged[PATH_MAX];
+  char dest[PATH_MAX];
+  for (size_t i = 0; i < req->entry_count; i++) {
+    const struct transfer_entry *e = &req->entries[i];
+    if (snprintf(staged, sizeof(staged), "%s/%s", req->stage_dir, e->rel) >= (int)sizeof(staged) ||
+        snprintf(dest, sizeof(dest), "%s/%s", dest_dir, e->rel) >= (int)sizeof(dest)) {
+      return ERR_INVALID;
+    }
+    if (i == 0) {
+      snprintf(out_dest, out_cap, "%s", req->entry_count == 1 ? dest : dest_dir);
+    }
+    if (e->is_dir) {
+      if (locks_wrlock(dest) != 0) {
+        return ERR_IO;
+      }
+      int ok = mkdir(dest, (mode_t)(e->perm & 0770)) == 0 || errno == EEXIST;
+      if (ok) {
+        meta_set(sess->cfg->root, dest, sess->user, e->perm);
+        attr_cache_invalidate(dest);
+        watch_notify(dest, 1);
+      }
+      locks_unlock(dest);
+      if (!ok) {
+        return ERR_IO;
+      }
+      continue;
+    }
+    if (lock_src_dest(staged, dest) != 0) {
+      return ERR_IO;
+    }
+    int rc = fsutil_clone_file(staged, dest, 1);
+    struct stat st;
+    if (rc >= 0 && stat(dest, &st) == 0 && (st.st_mode & S_IWUSR) == 0) {
+      /* A blob staged from a read-only file: the recipient must be able to write it. */
+      chmod(dest, (st.st_mode & 0777) | S_IRUSR | S_IWUSR);
+    }
+    if (rc >= 0) {
+      meta_set(sess->cfg->root, dest, sess->user, e->perm);
+      attr_cache_invalidate(dest);
+      watch_notify(dest, 1);
+    }
+    unlock_src_dest(staged, dest);
+    if (rc < 0) {
+      return ERR_IO;
+    }
   }
-  if (meta_check_access(sess->cfg->root, dest_dir, sess->user, 0, 1, 1) != 0) {
-    locks_unlock(dest_dir);
-    return send_err(sess->fd, ERR_PERM, "permission denied");
+  return ERR_OK;
+}
+
+static enum err_code accept_one(struct client_session *sess, const char *dest_dir, int id) {
+  struct transfer_request *req = NULL;
+  struct transfer_recipient *rcpt = NULL;
+  enum err_code code = claim_request(sess, id, &req, &rcpt);
+  if (code != ERR_OK) {
+    return code;
+  }
+  char dest[PATH_MAX];
+  code = materialize(sess, req, dest_dir, dest, sizeof(dest));
+  if (code == ERR_OK) {
+    users_notify(req->from_user, "NOTICE TRANSFER_ACCEPTED %d %s %s", req->id, dest, sess->user);
+  }
+  finish_recipient(req, rcpt);
+  return code;
+}
+
+static enum err_code check_dest_dir(struct client_session *sess, const char *dir, char *out,
+                                    size_t cap) {
+  if (path_resolve(&sess->cfg->resolver, sess->cwd, sess->cwd_len, dir, out, cap) != 0 ||
+      !path_is_within(sess->home, out)) {
+    return ERR_PERM;
+  }
+  if (locks_rdlock(out) != 0) {
+    return ERR_IO;
+  }
+  int rc = meta_check_access(sess->cfg->root, out, sess->user, 0, 1, 1);
+  locks_unlock(out);
+  return rc == 0 ? ERR_OK : ERR_PERM;
+}
+
+int transfer_accept(struct client_session *sess, const char *dir, int id) {
+  if (!sess || !dir) {
+    return session_err(sess, ERR_INVALID, "missing args");
   }
-  locks_unlock(dest_dir);
 
-  char base_name[PATH_MAX];
-  const char *slash = strrchr(req.file_path, '/');
-  snprintf(base_name, sizeof(base_name), "%s", slash ? slash + 1 : req.file_path);
+  char dest_dir[PATH_MAX];
+  enum err_code code = check_dest_dir(sess, dir, dest_dir, sizeof(dest_dir));
+  if (code != ERR_OK) {
+    return session_err(sess, code, code == ERR_PERM ? "permission denied" : "lock failed");
+  }
+  code = accept_one(sess, dest_dir, id);
+  switch (code) {
+    case ERR_OK:
+      return session_reply(sess, "OK");
+    case ERR_NOT_FOUND:
+      return session_err(sess, code, "invalid id");
+    case ERR_PERM:
+      return session_err(sess, code, "not recipient");
+    default:
+      return session_err(sess, code, "copy failed: %s", strerror(errno));
+  }
+}
 
-  char dest_path[PATH_MAX];
-  if (snprintf(dest_path, sizeof(dest_path), "%s/%s", dest_dir, base_name) >=
-      (int)sizeof(dest_path)) {
-    return send_err(sess->fd, ERR_INVALID, "path too long");
+int transfer_accept_all(struct client_session *sess, const char *dir) {
+  if (!sess || !dir) {
+    return session_err(sess, ERR_INVALID, "missing args");
   }
 
-  if (lock_src_dest(req.file_path, dest_path) != 0) {
-    return send_err(sess->fd, ERR_IO, "lock failed");
+  char dest_dir[PATH_MAX];
+  enum err_code code = check_dest_dir(sess, dir, dest_dir, sizeof(dest_dir));
+  if (code != ERR_OK) {
+    return session_err(sess, code, code == ERR_PERM ? "permission denied" : "lock failed");
   }
-  int copy_rc = copy_file(req.file_path, dest_path);
-  if (copy_rc == 0) {
-    int src_perm = 0700;
-    if (meta_get(sess->cfg->root, req.file_path, NULL, 0, &src_perm) != 0) {
-      src_perm = 0700;
+
+  int ids[MAX_TRANSFERS];
+  size_t count = 0;
+  pthread_mutex_lock(&g_transfers.mu);
+  for (struct transfer_request *cur = g_transfers.head; cur && count < MAX_TRANSFERS;
+       cur = cur->next) {
+    struct transfer_recipient *rcpt = find_recipient(cur, sess->user);
+    if (rcpt && rcpt->state == RECIPIENT_PENDING) {
+      ids[count++] = cur->id;
     }
-    meta_set(sess->cfg->root, dest_path, sess->user, src_perm);
-  }
-  unlock_src_dest(req.file_path, dest_path);
-  if (copy_rc != 0) {
-    return send_err(sess->fd, ERR_IO, "copy failed: %s", strerror(errno));
   }
+  pthread_mutex_unlock(&g_transfers.mu);
 
-  int sender_fd = users_get_active_fd(req.from_user);
-  if (sender_fd >= 0) {
-    sendf_line(sender_fd, "NOTICE TRANSFER_ACCEPTED %d %s", req.id, dest_path);
+  size_t accepted = 0;
+  size_t failed = 0;
+  for (size_t i = count; i > 0; i--) {
+    if (accept_one(sess, dest_dir, ids[i - 1]) == ERR_OK) {
+      accepted++;
+    } else {
+      failed++;
+    }
   }
-  return sendf_line(sess->fd, "OK");
+  return session_reply(sess, "OK %zu %zu", accepted, failed);
 }
 
 int transfer_reject(struct client_session *sess, int id) {
   if (!sess) {
     return -1;
   }
-  pthread_mutex_lock(&g_transfers.mu);
-  int idx = find_request_locked(id);
-  if (idx < 0) {
-    pthread_mutex_unlock(&g_transfers.mu);
-    return send_err(sess->fd, ERR_NOT_FOUND, "invalid id");
-  }
-  struct transfer_request req = g_transfers.reqs[idx];
-  if (strcmp(req.to_user, sess->user) != 0) {
-    pthread_mutex_unlock(&g_transfers.mu);
-    return send_err(sess->fd, ERR_PERM, "not recipient");
+  struct transfer_request *req = NULL;
+  struct transfer_recipient *rcpt = NULL;
+  enum err_code code = claim_request(sess, id, &req, &rcpt);
+  if (code != ERR_OK) {
+    return session_err(sess, code, code == ERR_PERM ? "not recipient" : "invalid id");
   }
-  remove_request_locked((size_t)idx);
-  pthread_mutex_unlock(&g_transfers.mu);
+  char from_user[64];
+  snprintf(from_user, sizeof(from_user), "%s", req->from_user);
+  finish_recipient(req, rcpt);
 
-  int sender_fd = users_get_active_fd(req.from_user);
-  if (sender_fd >= 0) {
-    sendf_line(sender_fd, "NOTICE TRANSFER_REJECTED %d", req.id);
-  }
-  return sendf_line(sess->fd, "OK");
+  users_notify(from_user, "NOTICE TRANSFER_REJECTED %d %s", id, sess->user);
+  return session_reply(sess, "OK");
 }
@@ -0,0 +1,425 @@
+#include "server/uploads.h"
+
+#include "server/fsutil.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UPLOADS_DIR ".csap_uploads"
+#define STAGE_PREFIX "stage."
+
+static char g_dir[PATH_MAX];
+
+static atomic_uint_fast64_t g_started;
+static atomic_uint_fast64_t g_checkpoints;
+static atomic_uint_fast64_t g_ranges;
+static atomic_uint_fast64_t g_staged;
+static atomic_uint_fast64_t g_preallocated;
+static atomic_uint_fast64_t g_expired;
+static _Atomic time_t g_last_sweep;
+
+struct span {
+  uint64_t start;
+  uint64_t end;
+};
+
+/* Received ranges of one upload, sorted, disjoint and not adjacent. */
+struct range_set {
+  char id[UPLOAD_ID_LEN + 1];
+  struct span *spans;
+  size_t count;
+  size_t cap;
+  uint64_t covered;
+  struct range_set *next;
+};
+
+/*
+ * One set per record that has had a range, dropped with the record by
+ * upload_remove under the same lock, so a late range cannot bring one back.
+ */
+static struct {
+  pthread_mutex_t mu;
+  struct range_set *head;
+} g_ranged = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Ids are generated here, but resumes bring them from the wire. */
+static int valid_id(const char *id) {
+  if (strlen(id) != UPLOAD_ID_LEN) {
+    return 0;
+  }
+  for (const char *p = id; *p; p++) {
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int record_path(const char *id, const char *suffix, char *out, size_t cap) {
+  if (!valid_id(id) || snprintf(out, cap, "%s/%s%s", g_dir, id, suffix) >= (int)cap) {
+    return -1;
+  }
+  return 0;
+}
+
+int upload_part_path(const char *id, char *out, size_t cap) {
+  return record_path(id, ".part", out, cap);
+}
+
+/* Whether name is <id><suffix>; the id goes to id. */
+static int entry_id(const char *name, const char *suffix, char id[UPLOAD_ID_LEN + 1]) {
+  if (strlen(name) != UPLOAD_ID_LEN + strlen(suffix) || strcmp(name + UPLOAD_ID_LEN, suffix) != 0) {
+    return 0;
+  }
+  memcpy(id, name, UPLOAD_ID_LEN);
+  id[UPLOAD_ID_LEN] = '\0';
+  return valid_id(id);
+}
+
+/*
+ * Removes the uploads whose record and part have both gone UPLOAD_TTL_SEC
+ * without a change: a slow upload_data touches the part long before it
+ * checkpoints the record.
+ */
+static void sweep_expired(time_t now, int stages) {
+  DIR *d = opendir(g_dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    char id[UPLOAD_ID_LEN + 1];
+    struct stat st;
+    if (stages && strncmp(de->d_name, STAGE_PREFIX, strlen(STAGE_PREFIX)) == 0) {
+      /* A staging file outlives its upload only through a crash. */
+      unlinkat(dirfd(d), de->d_name, 0);
+      continue;
+    }
+    if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        now - st.st_mtime < UPLOAD_TTL_SEC) {
+      continue;
+    }
+    if (entry_id(de->d_name, ".info", id)) {
+      char part[UPLOAD_ID_LEN + sizeof(".part")];
+      snprintf(part, sizeof(part), "%s.part", id);
+      if (fstatat(dirfd(d), part, &st, 0) == 0 && now - st.st_mtime < UPLOAD_TTL_SEC) {
+        continue;
+      }
+      upload_remove(id);
+      atomic_fetch_add_explicit(&g_expired, 1, memory_order_relaxed);
+    } else if (entry_id(de->d_name, ".part", id)) {
+      /* A part without its record is left by a crash inside upload_create. */
+      char info[UPLOAD_ID_LEN + sizeof(".info")];
+      snprintf(info, sizeof(info), "%s.info", id);
+      if (faccessat(dirfd(d), info, F_OK, 0) != 0) {
+        unlinkat(dirfd(d), de->d_name, 0);
+      }
+    }
+  }
+  closedir(d);
+}
+
+int uploads_init(const char *root) {
+  if (snprintf(g_dir, sizeof(g_dir), "%s/%s", root, UPLOADS_DIR) >= (int)sizeof(g_dir)) {
+    return -1;
+  }
+  if (mkdir(g_dir, 0700) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  time_t now = time(NULL);
+  atomic_store(&g_last_sweep, now);
+  sweep_expired(now, 1);
+  return 0;
+}
+
+static int sync_dir(void) {
+  int fd = open(g_dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/* Replaces the record through a synced temporary so a crash leaves old or new. */
+int upload_save(const struct upload_record *rec) {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  if (record_path(rec->id, ".info", path, sizeof(path)) != 0 ||
+      record_path(rec->id, ".info.tmp", tmp, sizeof(tmp)) != 0) {
+    return -1;
+  }
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    return -1;
+  }
+  int ok = fprintf(f, "%s %" PRIu64 " %" PRIu64 " %08" PRIx32 " %s\n", rec->user, rec->size,
+                   rec->committed, rec->crc, rec->target) > 0;
+  ok = fflush(f) == 0 && ok && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&g_checkpoints, 1, memory_order_relaxed);
+  return sync_dir();
+}
+
+int upload_create(struct upload_record *rec) {
+  time_t now = time(NULL);
+  time_t last = atomic_load(&g_last_sweep);
+  if (now - last >= UPLOAD_SWEEP_SEC &&
+      atomic_compare_exchange_strong(&g_last_sweep, &last, now)) {
+    sweep_expired(now, 0);
+  }
+  unsigned char raw[UPLOAD_ID_LEN / 2];
+  if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) {
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(raw); i++) {
+    snprintf(rec->id + 2 * i, 3, "%02x", raw[i]);
+  }
+  char part[PATH_MAX];
+  if (upload_part_path(rec->id, part, sizeof(part)) != 0) {
+    return -1;
+  }
+  int fd = open(part, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  close(fd);
+  rec->committed = 0;
+  rec->crc = 0;
+  if (upload_save(rec) != 0) {
+    unlink(part);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&g_started, 1, memory_order_relaxed);
+  return 0;
+}
+
+int upload_stage_create(uint64_t size, int mode, char *out, size_t cap) {
+  unsigned char raw[UPLOAD_ID_LEN / 2];
+  if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) {
+    return -1;
+  }
+  char id[UPLOAD_ID_LEN + 1];
+  for (size_t i = 0; i < sizeof(raw); i++) {
+    snprintf(id + 2 * i, 3, "%02x", raw[i]);
+  }
+  if (snprintf(out, cap, "%s/%s%s", g_dir, STAGE_PREFIX, id) >= (int)cap) {
+    return -1;
+  }
+  int fd = open(out, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  /* Set on the file itself: the mode it is created with passes through the umask. */
+  if (fchmod(fd, (mode_t)mode) != 0 || fsutil_preallocate(fd, (off_t)size) != 0) {
+    int saved = errno;
+    close(fd);
+    unlink(out);
+    errno = saved;
+    return -1;
+  }
+  atomic_fetch_add_explicit(&g_staged, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_preallocated, size, memory_order_relaxed);
+  return fd;
+}
+
+int upload_load(const char *id, struct upload_record *rec) {
+  char path[PATH_MAX];
+  if (record_path(id, ".info", path, sizeof(path)) != 0) {
+    return -1;
+  }
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  char line[PATH_MAX + 128];
+  int ok = fgets(line, sizeof(line), f) != NULL;
+  fclose(f);
+  int target_at = 0;
+  if (!ok || sscanf(line, "%63s %" SCNu64 " %" SCNu64 " %" SCNx32 " %n", rec->user, &rec->size,
+                    &rec->committed, &rec->crc, &target_at) != 4 ||
+      target_at == 0) {
+    return -1;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if (snprintf(rec->target, sizeof(rec->target), "%s", line + target_at) >=
+      (int)sizeof(rec->target)) {
+    return -1;
+  }
+  snprintf(rec->id, sizeof(rec->id), "%s", id);
+  return 0;
+}
+
+static struct range_set *range_set_find_locked(const char *id) {
+  for (struct range_set *set = g_ranged.head; set; set = set->next) {
+    if (strcmp(set->id, id) == 0) {
+      return set;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * id's set, made on its first range, but only while its record exists. The
+ * record is touched each time, so an upload still sending ranges never
+ * expires.
+ */
+static struct range_set *range_set_open_locked(const char *id) {
+  char info[PATH_MAX];
+  if (record_path(id, ".info", info, sizeof(info)) != 0 ||
+      utimensat(AT_FDCWD, info, NULL, 0) != 0) {
+    return NULL;
+  }
+  struct range_set *set = range_set_find_locked(id);
+  if (set) {
+    return set;
+  }
+  set = calloc(1, sizeof(*set));
+  if (!set) {
+    return NULL;
+  }
+  snprintf(set->id, sizeof(set->id), "%s", id);
+  set->next = g_ranged.head;
+  g_ranged.head = set;
+  return set;
+}
+
+/* Merges [start, end) in, joining every span it overlaps or touches. */
+static int range_set_add(struct range_set *set, uint64_t start, uint64_t end) {
+  size_t lo = 0;
+  while (lo < set->count && set->spans[lo].end < start) {
+    lo++;
+  }
+  size_t hi = lo;
+  while (hi < set->count && set->spans[hi].start <= end) {
+    if (set->spans[hi].start < start) {
+      start = set->spans[hi].start;
+    }
+    if (set->spans[hi].end > end) {
+      end = set->spans[hi].end;
+    }
+    set->covered -= set->spans[hi].end - set->spans[hi].start;
+    hi++;
+  }
+  if (hi == lo) {
+    if (set->count == set->cap) {
+      size_t cap = set->cap ? set->cap * 2 : 8;
+      struct span *spans = realloc(set->spans, cap * sizeof(*spans));
+      if (!spans) {
+        return -1;
+      }
+      set->spans = spans;
+      set->cap = cap;
+    }
+    memmove(&set->spans[lo + 1], &set->spans[lo], (set->count - lo) * sizeof(*set->spans));
+    set->count++;
+  } else if (hi > lo + 1) {
+    memmove(&set->spans[lo + 1], &set->spans[hi], (set->count - hi) * sizeof(*set->spans));
+    set->count -= hi - lo - 1;
+  }
+  set->spans[lo] = (struct span){start, end};
+  set->covered += end - start;
+  return 0;
+}
+
+int upload_range_add(const char *id, uint64_t offset, uint64_t len, uint64_t *covered) {
+  if (!valid_id(id)) {
+    return -1;
+  }
+  int rc = -1;
+  pthread_mutex_lock(&g_ranged.mu);
+  struct range_set *set = range_set_open_locked(id);
+  if (set && (len == 0 || range_set_add(set, offset, offset + len) == 0)) {
+    *covered = set->covered;
+    rc = 0;
+  }
+  pthread_mutex_unlock(&g_ranged.mu);
+  if (rc == 0 && len > 0) {
+    atomic_fetch_add_explicit(&g_ranges, 1, memory_order_relaxed);
+  }
+  return rc;
+}
+
+uint64_t upload_range_covered(const char *id) {
+  uint64_t covered = 0;
+  pthread_mutex_lock(&g_ranged.mu);
+  struct range_set *set = valid_id(id) ? range_set_find_locked(id) : NULL;
+  if (set) {
+    covered = set->covered;
+  }
+  pthread_mutex_unlock(&g_ranged.mu);
+  return covered;
+}
+
+static void range_set_forget_locked(const char *id) {
+  for (struct range_set **pp = &g_ranged.head; *pp; pp = &(*pp)->next) {
+    if (strcmp((*pp)->id, id) == 0) {
+      struct range_set *set = *pp;
+      *pp = set->next;
+      free(set->spans);
+      free(set);
+      return;
+    }
+  }
+}
+
+void upload_remove(const char *id) {
+  char path[PATH_MAX];
+  pthread_mutex_lock(&g_ranged.mu);
+  if (record_path(id, ".info", path, sizeof(path)) == 0) {
+    unlink(path);
+  }
+  range_set_forget_locked(id);
+  pthread_mutex_unlock(&g_ranged.mu);
+  if (upload_part_path(id, path, sizeof(path)) == 0) {
+    unlink(path);
+  }
+}
+
+size_t upload_count(const char *user) {
+  size_t count = 0;
+  DIR *d = opendir(g_dir);
+  if (!d) {
+    return 0;
+  }
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    char id[UPLOAD_ID_LEN + 1];
+    struct upload_record rec;
+    if (entry_id(de->d_name, ".info", id) && upload_load(id, &rec) == 0 &&
+        strcmp(rec.user, user) == 0) {
+      count++;
+    }
+  }
+  closedir(d);
+  return count;
+}
+
+void uploads_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "uploads.started %llu\n", (unsigned long long)atomic_load(&g_started));
+  strbuf_appendf(sb, "uploads.checkpoints %llu\n",
+                 (unsigned long long)atomic_load(&g_checkpoints));
+  strbuf_appendf(sb, "uploads.ranges %llu\n", (unsigned long long)atomic_load(&g_ranges));
+  strbuf_appendf(sb, "uploads.staged %llu\n", (unsigned long long)atomic_load(&g_staged));
+  strbuf_appendf(sb, "uploads.preallocated_bytes %llu\n",
+                 (unsigned long long)atomic_load(&g_preallocated));
+  strbuf_appendf(sb, "uploads.expired %llu\n", (unsigned long long)atomic_load(&g_expired));
+}
@@ -1,45 +1,250 @@
 #include "server/users.h"
 
+#include "common/io.h"
 #include "common/perm.h"
+#include "server/mailbox.h"
 #include "server/meta.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define MAX_USERS 128
+#define USER_SHARDS 64
+#define USER_SHARD_INITIAL_BUCKETS 16
+#define USERS_FILE ".csap_users"
 
-static struct {
-  struct user_entry entries[MAX_USERS];
-  size_t count;
-  pthread_mutex_t mu;
+struct user_session {
+  struct mailbox *mb;
+  int interactive;
+  struct user_session *next;
+};
+
+struct user_entry {
+  char name[64];
+  int registered;
+  struct user_session *sessions;
+  size_t interactive_count;
   pthread_cond_t cv;
+  uint64_t hash;
+  struct user_entry *next;
+};
+
+/*
+ * Users hash into independently locked shards; each shard is a chained hash
+ * table that doubles when its load factor passes 1. Waiters sleep on their
+ * own user's condvar, so a login only wakes the sessions waiting for it.
+ * A user may hold any number of live sessions; notices fan out to the
+ * interactive ones only, background transfer connections never see them.
+ */
+struct user_shard {
+  pthread_mutex_t mu;
+  struct user_entry **buckets;
+  size_t bucket_count;
+  size_t count;
+};
+
+static struct {
+  struct user_shard shards[USER_SHARDS];
+  char root[PATH_MAX];
+  pthread_mutex_t file_mu;
 } g_users = {
-    .count = 0,
-    .mu = PTHREAD_MUTEX_INITIALIZER,
-    .cv = PTHREAD_COND_INITIALIZER,
+    .file_mu = PTHREAD_MUTEX_INITIALIZER,
 };
 
-int users_init(const char *root) {
-  if (mkdir(root, 0700) != 0 && errno != EEXIST) {
+static uint64_t name_hash(const char *name) {
+  uint64_t h = 1469598103934665603ull;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    h ^= *p;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static struct user_shard *shard_for(uint64_t hash) {
+  return &g_users.shards[hash & (USER_SHARDS - 1)];
+}
+
+static size_t bucket_for(const struct user_shard *shard, uint64_t hash) {
+  return (size_t)(hash >> 6) & (shard->bucket_count - 1);
+}
+
+static struct user_entry *find_user_locked(struct user_shard *shard, const char *name,
+                                           uint64_t hash) {
+  for (struct user_entry *e = shard->buckets[bucket_for(shard, hash)]; e; e = e->next) {
+    if (e->hash == hash && strcmp(e->name, name) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void shard_grow_locked(struct user_shard *shard) {
+  size_t new_count = shard->bucket_count * 2;
+  struct user_entry **buckets = calloc(new_count, sizeof(*buckets));
+  if (!buckets) {
+    return;
+  }
+  for (size_t i = 0; i < shard->bucket_count; i++) {
+    struct user_entry *e = shard->buckets[i];
+    while (e) {
+      struct user_entry *next = e->next;
+      size_t b = (size_t)(e->hash >> 6) & (new_count - 1);
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->bucket_count = new_count;
+}
+
+static struct user_entry *get_user_locked(struct user_shard *shard, const char *name,
+                                          uint64_t hash) {
+  struct user_entry *e = find_user_locked(shard, name, hash);
+  if (e) {
+    return e;
+  }
+  if (strlen(name) >= sizeof(e->name)) {
+    return NULL;
+  }
+  e = calloc(1, sizeof(*e));
+  if (!e) {
+    return NULL;
+  }
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  e->hash = hash;
+  pthread_cond_init(&e->cv, NULL);
+  if (shard->count >= shard->bucket_count) {
+    shard_grow_locked(shard);
+  }
+  size_t b = bucket_for(shard, hash);
+  e->next = shard->buckets[b];
+  shard->buckets[b] = e;
+  shard->count++;
+  return e;
+}
+
+static int users_file_path(char *out, size_t cap) {
+  if (snprintf(out, cap, "%s/%s", g_users.root, USERS_FILE) >= (int)cap) {
     return -1;
   }
-  if (meta_init(root) != 0) {
+  return 0;
+}
+
+static int registry_add(const char *name) {
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = get_user_locked(shard, name, hash);
+  int added = e && !e->registered;
+  if (added) {
+    e->registered = 1;
+  }
+  pthread_mutex_unlock(&shard->mu);
+  return e ? added : -1;
+}
+
+static int load_users_file(void) {
+  char path[PATH_MAX];
+  if (users_file_path(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  FILE *f = fopen(path, "r");
+  if (!f) {
     return -1;
   }
+  char name[128];
+  while (fgets(name, sizeof(name), f)) {
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '\n') {
+      name[--len] = '\0';
+    }
+    if (len > 0) {
+      registry_add(name);
+    }
+  }
+  fclose(f);
   return 0;
 }
 
-static int find_user_locked(const char *name) {
-  for (size_t i = 0; i < g_users.count; i++) {
-    if (strcmp(g_users.entries[i].name, name) == 0) {
-      return (int)i;
+static int append_users_file(const char *name) {
+  char path[PATH_MAX];
+  if (users_file_path(path, sizeof(path)) != 0) {
+    return -1;
+  }
+  char line[128];
+  int n = snprintf(line, sizeof(line), "%s\n", name);
+  if (n < 0 || (size_t)n >= sizeof(line)) {
+    return -1;
+  }
+  pthread_mutex_lock(&g_users.file_mu);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  int rc = -1;
+  if (fd >= 0) {
+    rc = write_full(fd, line, (size_t)n) < 0 ? -1 : 0;
+    close(fd);
+  }
+  pthread_mutex_unlock(&g_users.file_mu);
+  return rc;
+}
+
+/* Rebuilds the registry from user homes when no users file exists yet. */
+static int scan_root(void) {
+  DIR *dir = opendir(g_users.root);
+  if (!dir) {
+    return -1;
+  }
+  struct dirent *ent;
+  char home[PATH_MAX];
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.' ||
+        snprintf(home, sizeof(home), "%s/%s", g_users.root, ent->d_name) >= (int)sizeof(home)) {
+      continue;
+    }
+    struct stat st;
+    if (stat(home, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    if (registry_add(ent->d_name) == 1) {
+      append_users_file(ent->d_name);
     }
   }
-  return -1;
+  closedir(dir);
+  return 0;
+}
+
+int users_init(const char *root) {
+  if (mkdir(root, 0700) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  if (meta_init(root) != 0) {
+    return -1;
+  }
+  snprintf(g_users.root, sizeof(g_users.root), "%s", root);
+  for (size_t i = 0; i < USER_SHARDS; i++) {
+    struct user_shard *shard = &g_users.shards[i];
+    pthread_mutex_init(&shard->mu, NULL);
+    shard->buckets = calloc(USER_SHARD_INITIAL_BUCKETS, sizeof(*shard->buckets));
+    if (!shard->buckets) {
+      return -1;
+    }
+    shard->bucket_count = USER_SHARD_INITIAL_BUCKETS;
+    shard->count = 0;
+  }
+  if (load_users_file() != 0) {
+    return scan_root();
+  }
+  return 0;
 }
 
 int users_create(const char *root, const char *name, int perm_oct) {
@@ -47,7 +252,8 @@ int users_create(const char *root, const char *name, int perm_oct) {
     return -1;
   }
   char path[PATH_MAX];
-  if (snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path)) {
+  if (users_get_home(root, name, path, sizeof(path)) != 0) {
+    errno = EINVAL;
     return -1;
   }
   int masked = perm_oct & 0770;
@@ -61,15 +267,13 @@ int users_create(const char *root, const char *name, int perm_oct) {
     return -1;
   }
 
-  pthread_mutex_lock(&g_users.mu);
-  int idx = find_user_locked(name);
-  if (idx < 0 && g_users.count < MAX_USERS) {
-    struct user_entry *e = &g_users.entries[g_users.count++];
-    snprintf(e->name, sizeof(e->name), "%s", name);
-    snprintf(e->home, sizeof(e->home), "%s", path);
-    e->active_fd = -1;
+  int added = registry_add(name);
+  if (added < 0) {
+    return -1;
+  }
+  if (added) {
+    append_users_file(name);
   }
-  pthread_mutex_unlock(&g_users.mu);
   return 0;
 }
 
@@ -77,72 +281,131 @@ int users_get_home(const char *root, const char *name, char *out, size_t cap) {
   if (!root || !name || !out) {
     return -1;
   }
+  if (!name[0] || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return -1;
+  }
   if (snprintf(out, cap, "%s/%s", root, name) >= (int)cap) {
     return -1;
   }
   return 0;
 }
 
-int users_register_active(const char *name, int fd) {
-  pthread_mutex_lock(&g_users.mu);
-  int idx = find_user_locked(name);
-  if (idx < 0) {
-    if (g_users.count >= MAX_USERS) {
-      pthread_mutex_unlock(&g_users.mu);
-      return -1;
-    }
-    idx = (int)g_users.count++;
-    snprintf(g_users.entries[idx].name, sizeof(g_users.entries[idx].name), "%s", name);
-    g_users.entries[idx].home[0] = '\0';
+int users_exists(const char *name) {
+  if (!name) {
+    return 0;
+  }
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = find_user_locked(shard, name, hash);
+  int exists = e && e->registered;
+  pthread_mutex_unlock(&shard->mu);
+  return exists;
+}
+
+int users_register_active(const char *name, struct mailbox *mb, int interactive) {
+  struct user_session *us = calloc(1, sizeof(*us));
+  if (!us) {
+    return -1;
+  }
+  us->mb = mb;
+  us->interactive = interactive;
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = get_user_locked(shard, name, hash);
+  if (!e) {
+    pthread_mutex_unlock(&shard->mu);
+    free(us);
+    return -1;
+  }
+  us->next = e->sessions;
+  e->sessions = us;
+  if (interactive) {
+    e->interactive_count++;
+    pthread_cond_broadcast(&e->cv);
   }
-  g_users.entries[idx].active_fd = fd;
-  pthread_cond_broadcast(&g_users.cv);
-  pthread_mutex_unlock(&g_users.mu);
+  pthread_mutex_unlock(&shard->mu);
   return 0;
 }
 
-void users_unregister_active(int fd) {
-  pthread_mutex_lock(&g_users.mu);
-  for (size_t i = 0; i < g_users.count; i++) {
-    if (g_users.entries[i].active_fd == fd) {
-      g_users.entries[i].active_fd = -1;
-      break;
+void users_unregister_active(const char *name, struct mailbox *mb) {
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = find_user_locked(shard, name, hash);
+  struct user_session *found = NULL;
+  if (e) {
+    for (struct user_session **pp = &e->sessions; *pp; pp = &(*pp)->next) {
+      if ((*pp)->mb == mb) {
+        found = *pp;
+        *pp = found->next;
+        if (found->interactive) {
+          e->interactive_count--;
+        }
+        break;
+      }
     }
   }
-  pthread_mutex_unlock(&g_users.mu);
+  pthread_mutex_unlock(&shard->mu);
+  free(found);
 }
 
-int users_get_active_fd(const char *name) {
-  pthread_mutex_lock(&g_users.mu);
-  int idx = find_user_locked(name);
-  int fd = -1;
-  if (idx >= 0) {
-    fd = g_users.entries[idx].active_fd;
-  }
-  pthread_mutex_unlock(&g_users.mu);
-  return fd;
+int users_is_active(const char *name) {
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = find_user_locked(shard, name, hash);
+  int active = e && e->interactive_count > 0;
+  pthread_mutex_unlock(&shard->mu);
+  return active;
 }
 
-int users_wait_for_active(const char *name, int *out_fd) {
-  if (!name || !out_fd) {
+int users_wait_for_active(const char *name) {
+  if (!name) {
     return -1;
   }
-  pthread_mutex_lock(&g_users.mu);
-  int idx = find_user_locked(name);
-  if (idx < 0) {
-    if (g_users.count >= MAX_USERS) {
-      pthread_mutex_unlock(&g_users.mu);
-      return -1;
-    }
-    idx = (int)g_users.count++;
-    snprintf(g_users.entries[idx].name, sizeof(g_users.entries[idx].name), "%s", name);
-    g_users.entries[idx].home[0] = '\0';
-    g_users.entries[idx].active_fd = -1;
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = get_user_locked(shard, name, hash);
+  if (!e) {
+    pthread_mutex_unlock(&shard->mu);
+    return -1;
   }
-  while (g_users.entries[idx].active_fd < 0) {
-    pthread_cond_wait(&g_users.cv, &g_users.mu);
+  while (e->interactive_count == 0) {
+    pthread_cond_wait(&e->cv, &shard->mu);
   }
-  *out_fd = g_users.entries[idx].active_fd;
-  pthread_mutex_unlock(&g_users.mu);
+  pthread_mutex_unlock(&shard->mu);
   return 0;
 }
+
+/*
+ * Posts into every interactive session's mailbox while the shard lock pins
+ * them. Returns the number of sessions reached, or -1 if none was.
+ */
+int users_notify(const char *name, const char *fmt, ...) {
+  if (!name || !fmt) {
+    return -1;
+  }
+  char line[4096];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= sizeof(line)) {
+    return -1;
+  }
+  uint64_t hash = name_hash(name);
+  struct user_shard *shard = shard_for(hash);
+  pthread_mutex_lock(&shard->mu);
+  struct user_entry *e = find_user_locked(shard, name, hash);
+  int reached = 0;
+  for (struct user_session *us = e ? e->sessions : NULL; us; us = us->next) {
+    if (us->interactive && mailbox_post(us->mb, line) == 0) {
+      reached++;
+    }
+  }
+  pthread_mutex_unlock(&shard->mu);
+  return reached > 0 ? reached : -1;
+}
@@ -0,0 +1,137 @@
+#include "server/watch.h"
+
+#include "server/mailbox.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct watch_entry {
+  struct mailbox *mb;
+  char *full;
+  char *arg;
+  struct watch_entry *next;
+};
+
+/*
+ * One list for the whole server: watches are few and short-lived, and a
+ * mutation with nobody watching only reads g_active.
+ */
+static struct {
+  pthread_mutex_t mu;
+  struct watch_entry *head;
+} g_watch = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static atomic_size_t g_active;
+static atomic_uint_fast64_t g_added;
+static atomic_uint_fast64_t g_notified;
+
+static void free_entry(struct watch_entry *e) {
+  free(e->full);
+  free(e->arg);
+  free(e);
+}
+
+int watch_add(struct mailbox *mb, const char *full, const char *arg) {
+  struct watch_entry *e = calloc(1, sizeof(*e));
+  if (!e || !(e->full = strdup(full)) || !(e->arg = strdup(arg))) {
+    if (e) {
+      free_entry(e);
+    }
+    return -1;
+  }
+  e->mb = mb;
+  size_t mine = 0;
+  pthread_mutex_lock(&g_watch.mu);
+  for (struct watch_entry *w = g_watch.head; w; w = w->next) {
+    if (w->mb != mb) {
+      continue;
+    }
+    if (strcmp(w->full, full) == 0) {
+      /* Already watched: only the spelling in future notices changes. */
+      char *tmp = w->arg;
+      w->arg = e->arg;
+      e->arg = tmp;
+      pthread_mutex_unlock(&g_watch.mu);
+      free_entry(e);
+      return 0;
+    }
+    mine++;
+  }
+  if (mine >= WATCH_MAX_PER_SESSION) {
+    pthread_mutex_unlock(&g_watch.mu);
+    free_entry(e);
+    return -1;
+  }
+  e->next = g_watch.head;
+  g_watch.head = e;
+  atomic_fetch_add(&g_active, 1);
+  pthread_mutex_unlock(&g_watch.mu);
+  atomic_fetch_add_explicit(&g_added, 1, memory_order_relaxed);
+  return 0;
+}
+
+/* Unlinks the watches of mb on full, or all of them when full is NULL. */
+static int remove_matching(struct mailbox *mb, const char *full) {
+  int removed = 0;
+  pthread_mutex_lock(&g_watch.mu);
+  for (struct watch_entry **pp = &g_watch.head; *pp;) {
+    struct watch_entry *w = *pp;
+    if (w->mb == mb && (!full || strcmp(w->full, full) == 0)) {
+      *pp = w->next;
+      free_entry(w);
+      atomic_fetch_sub(&g_active, 1);
+      removed++;
+    } else {
+      pp = &w->next;
+    }
+  }
+  pthread_mutex_unlock(&g_watch.mu);
+  return removed;
+}
+
+int watch_remove(struct mailbox *mb, const char *full) {
+  return remove_matching(mb, full) > 0 ? 0 : -1;
+}
+
+/* Must run before mb is destroyed: notify posts to it under the lock. */
+void watch_remove_all(struct mailbox *mb) {
+  if (atomic_load(&g_active) > 0) {
+    remove_matching(mb, NULL);
+  }
+}
+
+void watch_notify(const char *full, int created) {
+  if (atomic_load(&g_active) == 0) {
+    return;
+  }
+  const char *event = created ? "CREATED" : "CHANGED";
+  const char *slash = strrchr(full, '/');
+  size_t parent_len = slash ? (size_t)(slash - full) : 0;
+  const char *name = slash ? slash + 1 : full;
+  pthread_mutex_lock(&g_watch.mu);
+  for (struct watch_entry *w = g_watch.head; w; w = w->next) {
+    int rc = -1;
+    if (strcmp(w->full, full) == 0) {
+      rc = mailbox_postf(w->mb, "NOTICE %s %s", event, w->arg);
+    } else if (slash && strncmp(w->full, full, parent_len) == 0 &&
+               (w->full[parent_len] == '\0' || (parent_len == 0 && strcmp(w->full, "/") == 0))) {
+      size_t arg_len = strlen(w->arg);
+      const char *sep = arg_len > 0 && w->arg[arg_len - 1] == '/' ? "" : "/";
+      rc = mailbox_postf(w->mb, "NOTICE %s %s%s%s", event, w->arg, sep, name);
+    }
+    if (rc == 0) {
+      atomic_fetch_add_explicit(&g_notified, 1, memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&g_watch.mu);
+}
+
+void watch_stats_append(struct strbuf *sb) {
+  strbuf_appendf(sb, "watch.active %llu\n", (unsigned long long)atomic_load(&g_active));
+  strbuf_appendf(sb, "watch.added %llu\n", (unsigned long long)atomic_load(&g_added));
+  strbuf_appendf(sb, "watch.notified %llu\n", (unsigned long long)atomic_load(&g_notified));
+}
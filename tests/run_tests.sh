@@ -20,10 +20,12 @@ ROOT="$(mktemp -d /tmp/csap_root.XXXXXX)"
 SERVER_LOG="$ROOT/server.log"
 
 cleanup() {
-  if [[ -n "${SERVER_PID:-}" ]]; then
-    kill "$SERVER_PID" >/dev/null 2>&1 || true
-    wait "$SERVER_PID" >/dev/null 2>&1 || true
-  fi
+  for pid in "${SERVER_PID:-}" "${NR_PID:-}" "${EXP_PID:-}"; do
+    if [[ -n "$pid" ]]; then
+      kill "$pid" >/dev/null 2>&1 || true
+      wait "$pid" >/dev/null 2>&1 || true
+    fi
+  done
 }
 trap cleanup EXIT
 
@@ -31,7 +33,7 @@ pushd "$ROOT_DIR" >/dev/null
 make >/dev/null
 popd >/dev/null
 
-"$ROOT_DIR/Server" "$ROOT" 127.0.0.1 "$PORT" >"$SERVER_LOG" 2>&1 &
+"$ROOT_DIR/Server" "$ROOT" 127.0.0.1 "$PORT" -attr-watch=1 -dedup=1 >"$SERVER_LOG" 2>&1 &
 SERVER_PID=$!
 sleep 0.3
 
@@ -81,6 +83,63 @@ printf "login alice\nread /../etc/passwd\n" | \
   "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_sandbox.log" 2>&1
 expect_in "$ROOT/alice_sandbox.log" "ERR .* PERM"
 
+printf "login alice\ncreate -d nest 0770\ncd nest\ncreate -d inner 0770\ncd inner\ncreate deep.txt 0660\nwrite deep.txt\nnested data\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_nested_write.log" 2>&1
+printf "login alice\ncd nest/inner\ncd /alice\nread nest/inner/deep.txt\nmove nest/inner/deep.txt nest/moved.txt\ncd nest\nlist\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_nested.log" 2>&1
+expect_in "$ROOT/alice_nested.log" "nested data"
+expect_in "$ROOT/alice_nested.log" "moved.txt"
+expect_file "$ROOT/alice/nest/moved.txt"
+
+printf "login alice\nlist nest\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_attr_before.log" 2>&1
+printf "external change\n" >>"$ROOT/alice/nest/moved.txt"
+sleep 0.2
+printf "login alice\nlist nest\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_attr_after.log" 2>&1
+expect_in "$ROOT/alice_attr_before.log" " 12 moved.txt"
+expect_in "$ROOT/alice_attr_after.log" " 28 moved.txt"
+
+printf "login alice\nopen handle.txt rw\npwrite 1 0\nrandom access\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_handle_write.log" 2>&1
+expect_in "$ROOT/alice_handle_write.log" "OK 1 0"
+expect_in "$ROOT/alice_handle_write.log" "OK 14"
+printf "login alice\nopen handle.txt r\npread 1 7 6\nclose 1\npread 1 0 1\nopen missing.txt r\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_handle_read.log" 2>&1
+expect_in "$ROOT/alice_handle_read.log" "OK 1 14"
+expect_in "$ROOT/alice_handle_read.log" "access"
+expect_in "$ROOT/alice_handle_read.log" "ERR .* no such handle"
+expect_in "$ROOT/alice_handle_read.log" "ERR .* no such file"
+
+printf "login alice\nread -offset=2 handle.txt 4\nreadv handle.txt 0:6,7:6,100:4\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_ranges.log" 2>&1
+expect_in "$ROOT/alice_ranges.log" "ndom"
+expect_in "$ROOT/alice_ranges.log" "> OK 3$"
+expect_in "$ROOT/alice_ranges.log" "^RANGE 7 6"
+expect_in "$ROOT/alice_ranges.log" "^access"
+expect_in "$ROOT/alice_ranges.log" "^RANGE 100 0"
+
+printf "create batch_a.txt 0660\ncreate -d batch_dir 0770\nchmod batch_a.txt 0600\nmove batch_a.txt batch_dir/batch_b.txt\nlist batch_dir\nread batch_dir/batch_b.txt\ndelete missing.txt\n" \
+  >"$ROOT/batch.txt"
+printf "login alice\n#t1 cd .\nbatch %s\n" "$ROOT/batch.txt" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_batch.log" 2>&1
+expect_in "$ROOT/alice_batch.log" "#t1 OK"
+expect_in "$ROOT/alice_batch.log" "batch_b.txt"
+expect_in "$ROOT/alice_batch.log" "^ERR .* delete failed"
+if rg -q "out of order" "$ROOT/alice_batch.log"; then
+  echo "Batch replies out of order"
+  exit 1
+fi
+
+printf "login alice\n#9 whoami\nlist batch_dir\nread -offset=2 handle.txt 4\nreadv handle.txt 7:6\nbogus\nwrite v2.txt\nframed\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto=2 >"$ROOT/alice_v2.log" 2>&1
+expect_in "$ROOT/alice_v2.log" "#9 OK alice"
+expect_in "$ROOT/alice_v2.log" "batch_b.txt"
+expect_in "$ROOT/alice_v2.log" "ndom"
+expect_in "$ROOT/alice_v2.log" "^access"
+expect_in "$ROOT/alice_v2.log" "ERR 7 .* unknown command"
+expect_in "$ROOT/alice/v2.txt" "^framed"
+
 {
   printf "login alice\nupload -b %s bg_up.txt\ndownload -b bg_up.txt %s\n" "$LOCAL_FILE" "$ROOT/bg_down.txt"
   sleep 4
@@ -88,6 +147,286 @@ expect_in "$ROOT/alice_sandbox.log" "ERR .* PERM"
 expect_in "$ROOT/alice_bg.log" "\\[Background\\] Command: upload bg_up.txt $LOCAL_FILE concluded"
 expect_in "$ROOT/alice_bg.log" "\\[Background\\] Command: download bg_up.txt $ROOT/bg_down.txt concluded"
 
+head -c 1048576 /dev/urandom >"$ROOT/bg_big.bin"
+{
+  printf "login alice\nupload -b %s bg_big.bin\ndownload -b bg_big.bin %s\n" "$ROOT/bg_big.bin" "$ROOT/bg_big_down.bin"
+  sleep 2
+  printf "whoami\n"
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto=2 >"$ROOT/alice_bg_v2.log" 2>&1
+expect_in "$ROOT/alice_bg_v2.log" "\\[Background\\] Command: upload bg_big.bin $ROOT/bg_big.bin concluded"
+expect_in "$ROOT/alice_bg_v2.log" "\\[Background\\] Command: download bg_big.bin $ROOT/bg_big_down.bin concluded"
+expect_in "$ROOT/alice_bg_v2.log" "OK alice"
+if ! cmp -s "$ROOT/bg_big.bin" "$ROOT/bg_big_down.bin"; then
+  echo "Multiplexed background download differs"
+  exit 1
+fi
+
+{
+  printf "login alice\nwrite streamed.bin\n"
+  cat "$ROOT/bg_big.bin"
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_stream.log" 2>&1
+expect_in "$ROOT/alice_stream.log" "OK 1048576"
+mkfifo "$ROOT/upload.fifo"
+cat "$ROOT/bg_big.bin" >"$ROOT/upload.fifo" &
+printf "login alice\nupload %s fifo.bin\n" "$ROOT/upload.fifo" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto=2 >"$ROOT/alice_fifo.log" 2>&1
+expect_in "$ROOT/alice_fifo.log" "OK 1048576"
+for f in streamed.bin fifo.bin; do
+  if ! cmp -s "$ROOT/bg_big.bin" "$ROOT/alice/$f"; then
+    echo "Chunked $f differs"
+    exit 1
+  fi
+done
+
+# Drop the connection a third of the way into an upload, then resume it.
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\n" >&3
+read -r REPLY <&3
+printf "upload_open resumed.bin 1048576\n" >&3
+read -r REPLY <&3
+UPLOAD_ID="${REPLY#OK }"
+printf "upload_data %s 0 1048576\n" "$UPLOAD_ID" >&3
+head -c 350000 "$ROOT/bg_big.bin" >&3
+exec 3>&-
+sleep 0.3
+head -c 1000 "$ROOT/bg_big.bin" >"$ROOT/resumed_down.bin"
+printf "login alice\nupload_status %s\nupload -resume=%s %s resumed.bin\ndownload -resume resumed.bin %s\n" \
+  "$UPLOAD_ID" "$UPLOAD_ID" "$ROOT/bg_big.bin" "$ROOT/resumed_down.bin" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_resume_upload.log" 2>&1
+expect_in "$ROOT/alice_resume_upload.log" "> OK [1-9][0-9]* 1048576 [0-9a-f]{8}"
+expect_in "$ROOT/alice_resume_upload.log" "> OK 1048576"
+for f in "$ROOT/alice/resumed.bin" "$ROOT/resumed_down.bin"; do
+  if ! cmp -s "$ROOT/bg_big.bin" "$f"; then
+    echo "Resumed $f differs"
+    exit 1
+  fi
+done
+printf "login alice\nupload %s fresh.txt\n" "$LOCAL_FILE" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_upload_id.log" 2>&1
+expect_in "$ROOT/alice_upload_id.log" "Upload [0-9a-f]{16} started"
+
+head -c 3145728 /dev/urandom >"$ROOT/par.bin"
+for n in 1 2; do
+  printf "login alice\nupload -j 3 %s par%s.bin\ndownload -j 4 par%s.bin %s\n" \
+    "$ROOT/par.bin" "$n" "$n" "$ROOT/par_down$n.bin" | \
+    "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" >"$ROOT/alice_parallel$n.log" 2>&1
+  expect_in "$ROOT/alice_parallel$n.log" "OK 3145728"
+  for f in "$ROOT/alice/par$n.bin" "$ROOT/par_down$n.bin"; do
+    if ! cmp -s "$ROOT/par.bin" "$f"; then
+      echo "Parallel transfer $f differs"
+      exit 1
+    fi
+  done
+done
+
+# An aborted parallel upload is gone: its part, and any range sent late.
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\nupload_open aborted.bin 8\n" >&3
+read -r REPLY <&3
+read -r REPLY <&3
+ABORT_ID="${REPLY#OK }"
+ABORT_ID="${ABORT_ID%$'\r'}"
+printf "upload_range %s 0 4\nabcdupload_abort %s\nupload_range %s 4 4\nefgh" \
+  "$ABORT_ID" "$ABORT_ID" "$ABORT_ID" >&3
+for i in 1 2 3; do
+  read -r REPLY <&3
+  printf "%s\n" "$REPLY" >>"$ROOT/alice_abort.log"
+done
+exec 3>&-
+expect_in "$ROOT/alice_abort.log" "^OK 4"
+expect_in "$ROOT/alice_abort.log" "^OK"
+expect_in "$ROOT/alice_abort.log" "^ERR 2 NOT_FOUND"
+if compgen -G "$ROOT/.csap_uploads/$ABORT_ID.*" >/dev/null || [[ -e "$ROOT/alice/aborted.bin" ]]; then
+  echo "Aborted upload left files behind"
+  exit 1
+fi
+
+for n in 1 2; do
+  printf "login alice\nupload %s crc%s.bin\nupload -j 3 %s crcj%s.bin\ndownload -j 2 crcj%s.bin %s\n" \
+    "$ROOT/bg_big.bin" "$n" "$ROOT/par.bin" "$n" "$n" "$ROOT/crc_down$n.bin" | \
+    "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" -crc=1 >"$ROOT/alice_crc$n.log" 2>&1
+  expect_in "$ROOT/alice_crc$n.log" "OK 1048576"
+  for f in "$ROOT/alice/crc$n.bin:$ROOT/bg_big.bin" "$ROOT/crc_down$n.bin:$ROOT/par.bin"; do
+    if ! cmp -s "${f#*:}" "${f%%:*}"; then
+      echo "Checksummed ${f%%:*} differs"
+      exit 1
+    fi
+  done
+done
+
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\nwrite -crc crc_bad.txt 9\n123456789ABCD" >&3
+printf "write -crc crc_ok.txt 9\n123456789\xe3\x06\x92\x83checksum crc_ok.txt\n" >&3
+for i in 1 2 3 4; do
+  read -r REPLY <&3
+  printf "%s\n" "$REPLY"
+done >"$ROOT/alice_crc_raw.log"
+exec 3>&-
+expect_in "$ROOT/alice_crc_raw.log" "^ERR 9 CHECKSUM checksum mismatch"
+expect_in "$ROOT/alice_crc_raw.log" "^OK e3069283 9"
+
+# A shorter upload replaces the file whole; one cut off leaves it as it was.
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\nupload staged.txt 11\nlonger text" >&3
+printf "upload staged.txt 5\nshort" >&3
+for i in 1 2 3; do
+  read -r REPLY <&3
+  printf "%s\n" "$REPLY"
+done >"$ROOT/alice_staged.log"
+printf "upload staged.txt 100\npartial" >&3
+exec 3>&-
+sleep 0.3
+expect_in "$ROOT/alice_staged.log" "^OK 5"
+if [ "$(cat "$ROOT/alice/staged.txt")" != "short" ] ||
+  compgen -G "$ROOT/.csap_uploads/stage.*" >/dev/null; then
+  echo "Staged upload did not replace the file atomically"
+  exit 1
+fi
+
+# Change a few bytes and grow the file, then send only the difference.
+cp "$ROOT/par.bin" "$ROOT/delta.bin"
+printf 'patched' | dd of="$ROOT/delta.bin" bs=1 seek=1500000 conv=notrunc 2>/dev/null
+printf 'appended' >>"$ROOT/delta.bin"
+for n in 1 2; do
+  printf "login alice\nupload -delta %s delta%s.bin\nupload -delta %s delta%s.bin\n" \
+    "$ROOT/par.bin" "$n" "$ROOT/delta.bin" "$n" | \
+    "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" >"$ROOT/alice_delta$n.log" 2>&1
+  expect_in "$ROOT/alice_delta$n.log" "sending the whole file"
+  expect_in "$ROOT/alice_delta$n.log" "Delta: sent [0-9]{1,5} of 3145736 bytes"
+  if ! cmp -s "$ROOT/delta.bin" "$ROOT/alice/delta$n.bin"; then
+    echo "Delta upload $n differs"
+    exit 1
+  fi
+done
+
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\ndelta delta1.bin 1024 3 00000000\nL\0\0\0\003abcE" >&3
+for i in 1 2; do
+  read -r REPLY <&3
+  printf "%s\n" "$REPLY"
+done >"$ROOT/alice_delta_raw.log"
+exec 3>&-
+expect_in "$ROOT/alice_delta_raw.log" "^ERR 9 CHECKSUM rebuilt 3 bytes"
+if ! cmp -s "$ROOT/delta.bin" "$ROOT/alice/delta1.bin"; then
+  echo "Failed delta replaced the file"
+  exit 1
+fi
+
+for i in $(seq 1 2000); do
+  printf "%05d,2026-10-19,upload,alice,ok\n" "$i"
+done >"$ROOT/z.csv"
+for n in 1 2; do
+  printf "login alice\nupload %s z%s.csv\ndownload z%s.csv %s\nread -offset=6 z%s.csv 10\n" \
+    "$ROOT/z.csv" "$n" "$n" "$ROOT/z_down$n.csv" "$n" | \
+    "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" -compress=1 -crc=1 >"$ROOT/alice_z$n.log" 2>&1
+  expect_in "$ROOT/alice_z$n.log" "Compressed: 66000 bytes as [0-9]{4,5} \\([3-9]\\.[0-9]{2}x\\)"
+  expect_in "$ROOT/alice_z$n.log" "2026-10-19"
+  if ! cmp -s "$ROOT/z.csv" "$ROOT/alice/z$n.csv" || ! cmp -s "$ROOT/z.csv" "$ROOT/z_down$n.csv"; then
+    echo "Compressed transfer $n differs"
+    exit 1
+  fi
+done
+
+# Two bytes of data 8 MiB apart: downloads send the hole as a length only.
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf "login alice\nwrite sparse.img 1\nswrite -offset=8388608 sparse.img 1\ne" >&3
+for i in 1 2 3; do
+  read -r REPLY <&3
+done
+exec 3>&-
+for n in 1 2; do
+  printf "login alice\ndownload sparse.img %s\n" "$ROOT/sparse_down$n.img" | \
+    "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" -crc=1 >"$ROOT/alice_sparse$n.log" 2>&1
+  expect_in "$ROOT/alice_sparse$n.log" "Sparse: [0-9]{7} of 8388609 bytes were holes"
+  if ! cmp -s "$ROOT/alice/sparse.img" "$ROOT/sparse_down$n.img" ||
+    [ "$(stat -c %b "$ROOT/sparse_down$n.img")" -ge 1024 ]; then
+    echo "Sparse download $n differs or is fully allocated"
+    exit 1
+  fi
+done
+
+# Small files are served from memory; writing one drops what was cached.
+printf "login alice\ncreate hot.txt 0660\nwrite hot.txt\nfirst version\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >/dev/null 2>&1
+printf "login alice\nread hot.txt\nread hot.txt\nread hot.txt\nwrite hot.txt\nsecond version\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_hot.log" 2>&1
+expect_in "$ROOT/alice_hot.log" "first version"
+printf "login alice\nread hot.txt\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_hot2.log" 2>&1
+expect_in "$ROOT/alice_hot2.log" "second version"
+
+# Only alice has uploaded par.bin: bob is refused its hash and sends it whole.
+PAR_HASH="$(sha256sum "$ROOT/par.bin" | cut -d' ' -f1)"
+printf "login bob\nupload_hash stolen.bin 3145728 %s\n" "$PAR_HASH" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/bob_hash.log" 2>&1
+expect_in "$ROOT/bob_hash.log" "ERR 2 NOT_FOUND"
+if [[ -e "$ROOT/bob/stolen.bin" ]]; then
+  echo "upload_hash linked content bob never uploaded"
+  exit 1
+fi
+printf "only bob has this\n" >"$ROOT/dup_new.txt"
+printf "login bob\nupload %s dup.bin\nupload %s dup_new.txt\n" "$ROOT/par.bin" "$ROOT/dup_new.txt" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -dedup=1 >"$ROOT/bob_dedup.log" 2>&1
+if rg -q "Deduplicated" "$ROOT/bob_dedup.log"; then
+  echo "bob skipped sending content only alice uploaded"
+  exit 1
+fi
+printf "login alice\nupload %s dup_a.bin\n" "$ROOT/par.bin" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -dedup=1 >"$ROOT/alice_dedup.log" 2>&1
+expect_in "$ROOT/alice_dedup.log" "Deduplicated: the server already had these 3145728 bytes"
+expect_in "$ROOT/bob_dedup.log" "Upload [0-9a-f]{16} started"
+if ! cmp -s "$ROOT/par.bin" "$ROOT/bob/dup.bin" ||
+  [ "$(stat -c %i "$ROOT/bob/dup.bin")" != "$(stat -c %i "$ROOT/alice/par1.bin")" ] ||
+  [ "$(stat -c %i "$ROOT/alice/dup_a.bin")" != "$(stat -c %i "$ROOT/alice/par1.bin")" ]; then
+  echo "Deduplicated upload is not the stored copy"
+  exit 1
+fi
+printf "login bob\nwrite -offset=0 dup.bin\nabc\n\n\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/bob_dedup_write.log" 2>&1
+if cmp -s "$ROOT/par.bin" "$ROOT/bob/dup.bin" || ! cmp -s "$ROOT/par.bin" "$ROOT/alice/par1.bin"; then
+  echo "Write to a deduplicated file reached the other copies"
+  exit 1
+fi
+
+printf "login alice\nupload -b %s q1.bin\nupload -b %s q2.bin\ncancel 2\nwait\njobs\n" \
+  "$ROOT/bg_big.bin" "$ROOT/bg_big.bin" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -jobs=1 >"$ROOT/alice_jobs.log" 2>&1
+expect_in "$ROOT/alice_jobs.log" "Job 2 queued"
+expect_in "$ROOT/alice_jobs.log" "(^|> )1 done upload .* 1048576/1048576$"
+expect_in "$ROOT/alice_jobs.log" "^2 cancelled upload"
+if [ -e "$ROOT/alice/q2.bin" ]; then
+  echo "Cancelled job ran"
+  exit 1
+fi
+
+{
+  for cmd in "login alice" "watch later.txt" "watch ." "download -b later.txt $ROOT/later_down.txt"; do
+    printf "%s\n" "$cmd"
+    sleep 0.2
+  done
+  sleep 1
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_watch.log" 2>&1 &
+WATCH_PID=$!
+sleep 1.2
+printf "login alice\nwrite later.txt\nready\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_later.log" 2>&1
+wait "$WATCH_PID"
+expect_in "$ROOT/alice_watch.log" "NOTICE CREATED later.txt$"
+expect_in "$ROOT/alice_watch.log" "NOTICE CREATED \\./later.txt$"
+expect_in "$ROOT/alice_watch.log" "\\[Background\\] Command: download later.txt $ROOT/later_down.txt concluded"
+expect_in "$ROOT/later_down.txt" "^ready"
+
+printf "login alice\ntoken\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_token.log" 2>&1
+expect_in "$ROOT/alice_token.log" "OK [0-9a-f]{32}$"
+TOKEN=$(sed -n 's/.*OK \([0-9a-f]\{32\}\)$/\1/p' "$ROOT/alice_token.log" | head -n 1)
+printf "resume %s\nwhoami\n" "$TOKEN" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_resume.log" 2>&1
+expect_in "$ROOT/alice_resume.log" "OK alice"
+printf "resume 0123456789abcdef0123456789abcdef\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/bad_resume.log" 2>&1
+expect_in "$ROOT/bad_resume.log" "ERR .* invalid or expired token"
+
 {
   printf "login bob\n"
   sleep 0.3
@@ -106,4 +445,133 @@ expect_in "$ROOT/bob_transfer.log" "NOTICE TRANSFER 1 alice"
 expect_in "$ROOT/bob_transfer.log" "^> OK"
 expect_in "$ROOT/alice_transfer.log" "OK 1"
 
+{
+  printf "login bob\n"
+  sleep 0.6
+  printf "accept_all .\nlist\n"
+  sleep 0.3
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/bob_multi.log" 2>&1 &
+BOB_PID=$!
+
+{
+  printf "login alice\ncreate -d pack 0770\ncreate pack/a.txt 0660\n"
+  printf "transfer_request uploaded.txt,bg_up.txt,pack bob\n"
+  sleep 0.3
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_multi.log" 2>&1
+wait "$BOB_PID"
+
+expect_in "$ROOT/alice_multi.log" "OK 2"
+expect_in "$ROOT/bob_multi.log" "NOTICE TRANSFER 2 alice uploaded.txt,bg_up.txt,pack"
+expect_in "$ROOT/bob_multi.log" "OK [1-9] 0"
+expect_in "$ROOT/bob_multi.log" "bg_up.txt"
+expect_file "$ROOT/bob/pack/a.txt"
+
+FANOUT_PIDS=()
+for n in 1 2; do
+  {
+    printf "login bob\n"
+    sleep 0.8
+  } | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" -proto="$n" >"$ROOT/bob_fanout_$n.log" 2>&1 &
+  FANOUT_PIDS+=($!)
+done
+{
+  printf "login bob -b\n"
+  sleep 0.8
+} | "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/bob_fanout_bg.log" 2>&1 &
+FANOUT_PIDS+=($!)
+sleep 0.3
+printf "login alice\ntransfer_request uploaded.txt bob\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/alice_fanout.log" 2>&1
+wait "${FANOUT_PIDS[@]}"
+expect_in "$ROOT/bob_fanout_1.log" "NOTICE TRANSFER 3 alice uploaded.txt"
+expect_in "$ROOT/bob_fanout_2.log" "NOTICE TRANSFER 3 alice uploaded.txt"
+if rg -q "NOTICE" "$ROOT/bob_fanout_bg.log"; then
+  echo "Background session received a notice"
+  exit 1
+fi
+
+# Without root, an accepted file whose staging is gone must still be writable.
+NR_ROOT="$(mktemp -d /tmp/csap_root.XXXXXX)"
+NR_PORT="$((PORT + 1))"
+cp "$ROOT_DIR/Server" "$NR_ROOT/Server"
+NR_RUN=()
+if [[ "$(id -u)" == 0 ]]; then
+  chown nobody "$NR_ROOT"
+  NR_RUN=(setpriv --reuid=nobody --regid=nogroup --clear-groups)
+fi
+"${NR_RUN[@]}" "$NR_ROOT/Server" "$NR_ROOT/data" 127.0.0.1 "$NR_PORT" >"$NR_ROOT/server.log" 2>&1 &
+NR_PID=$!
+sleep 0.3
+printf "create_user alice 0770\ncreate_user bob 0770\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$NR_PORT" >/dev/null 2>&1
+printf "login alice\nwrite f.txt\nfrom alice\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$NR_PORT" >/dev/null 2>&1
+{
+  printf "login bob\n"
+  sleep 0.3
+  printf "accept . 1\n"
+  sleep 0.3
+} | "$ROOT_DIR/Client" 127.0.0.1 "$NR_PORT" >/dev/null 2>&1 &
+BOB_PID=$!
+printf "login alice\ntransfer_request f.txt bob\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$NR_PORT" >/dev/null 2>&1
+wait "$BOB_PID"
+printf "login bob\nwrite f.txt\nfrom bob\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$NR_PORT" >"$ROOT/bob_nonroot.log" 2>&1
+expect_in "$ROOT/bob_nonroot.log" "^> OK [0-9]"
+expect_in "$NR_ROOT/data/bob/f.txt" "from bob"
+kill "$NR_PID" >/dev/null 2>&1 || true
+wait "$NR_PID" >/dev/null 2>&1 || true
+NR_PID=""
+rm -rf "$NR_ROOT"
+
+# An upload left alone for over a day is gone after the next start.
+EXP_ROOT="$(mktemp -d /tmp/csap_root.XXXXXX)"
+EXP_PORT="$((PORT + 2))"
+"$ROOT_DIR/Server" "$EXP_ROOT" 127.0.0.1 "$EXP_PORT" >/dev/null 2>&1 &
+EXP_PID=$!
+sleep 0.3
+printf "create_user carol 0770\nlogin carol\nupload_open old.bin 100\nupload_open new.bin 100\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$EXP_PORT" >"$ROOT/carol_expire.log" 2>&1
+OLD_ID="$(sed -n 's/^> OK \([0-9a-f]\{16\}\)$/\1/p' "$ROOT/carol_expire.log" | head -n 1)"
+kill "$EXP_PID" >/dev/null 2>&1 || true
+wait "$EXP_PID" >/dev/null 2>&1 || true
+touch -d "2 days ago" "$EXP_ROOT/.csap_uploads/$OLD_ID.info" "$EXP_ROOT/.csap_uploads/$OLD_ID.part"
+"$ROOT_DIR/Server" "$EXP_ROOT" 127.0.0.1 "$EXP_PORT" >/dev/null 2>&1 &
+EXP_PID=$!
+sleep 0.3
+if [[ -z "$OLD_ID" ]] || compgen -G "$EXP_ROOT/.csap_uploads/$OLD_ID.*" >/dev/null ||
+  [[ "$(compgen -G "$EXP_ROOT/.csap_uploads/*.info" | wc -l)" != 1 ]]; then
+  echo "Abandoned upload was not swept, or a live one was"
+  exit 1
+fi
+kill "$EXP_PID" >/dev/null 2>&1 || true
+wait "$EXP_PID" >/dev/null 2>&1 || true
+EXP_PID=""
+rm -rf "$EXP_ROOT"
+
+printf "stats\n" | \
+  "$ROOT_DIR/Client" 127.0.0.1 "$PORT" >"$ROOT/stats.log" 2>&1
+expect_in "$ROOT/stats.log" "mailbox.delivered [1-9]"
+expect_in "$ROOT/stats.log" "mailbox.dropped 0"
+expect_in "$ROOT/stats.log" "attr.hits [1-9]"
+expect_in "$ROOT/stats.log" "attr.watches [1-9]"
+expect_in "$ROOT/stats.log" "filecache.hits [1-9]"
+expect_in "$ROOT/stats.log" "filecache.invalidations [1-9]"
+expect_in "$ROOT/stats.log" "mux.streams [1-9]"
+expect_in "$ROOT/stats.log" "resume.claims [1-9]"
+expect_in "$ROOT/stats.log" "watch.notified [1-9]"
+expect_in "$ROOT/stats.log" "uploads.checkpoints [1-9]"
+expect_in "$ROOT/stats.log" "uploads.ranges [1-9]"
+expect_in "$ROOT/stats.log" "uploads.staged [1-9]"
+expect_in "$ROOT/stats.log" "sparse.hole_bytes [1-9]"
+expect_in "$ROOT/stats.log" "crc32c.hardware [01]"
+expect_in "$ROOT/stats.log" "delta.applied [1-9]"
+expect_in "$ROOT/stats.log" "dedup.saved_bytes [1-9]"
+expect_in "$ROOT/stats.log" "compress.received_raw_bytes [1-9]"
+expect_in "$ROOT/stats.log" "compress.ratio [2-9]"
+expect_in "$ROOT/stats.log" "dedup.skipped_bytes 3145728"
+expect_in "$ROOT/.csap_users" "^alice$"
+expect_in "$ROOT/.csap_users" "^bob$"
+
 echo "All tests passed."